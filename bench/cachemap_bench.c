@@ -0,0 +1,112 @@
+#include <assert.h>
+#include <glib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cachemap.h"
+#include "znutil.h"
+
+/* Measures cache map hit throughput as worker threads are added. Runs once with a single
+ * shard (equivalent to one global map lock) and once with CACHEMAP_SHARDS shards. */
+
+#define NR_ZONES 64
+#define NR_KEYS (1u << 20)
+#define OPS_PER_THREAD (1u << 21)
+#define MAX_THREADS 128
+
+struct bench_thread {
+    struct zn_cachemap *map;
+    uint32_t seed;
+    uint64_t hits;
+};
+
+static gpointer
+hit_worker(gpointer user_data) {
+    struct bench_thread *bt = user_data;
+    uint32_t x = bt->seed;
+
+    for (uint32_t i = 0; i < OPS_PER_THREAD; i++) {
+        // xorshift32
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        uint32_t id = x % NR_KEYS;
+
+        struct zone_map_result res = zn_cachemap_find(bt->map, id);
+        assert(res.type == RESULT_LOC);
+        g_atomic_int_dec_and_test(&bt->map->active_readers[res.location.zone]);
+        bt->hits++;
+    }
+
+    return NULL;
+}
+
+static void
+populate(struct zn_cachemap *map) {
+    for (uint32_t id = 0; id < NR_KEYS; id++) {
+        struct zone_map_result res = zn_cachemap_find(map, id);
+        assert(res.type == RESULT_COND);
+        (void) res;
+        struct zn_pair location = {
+            .zone = id % NR_ZONES, .chunk_offset = id / NR_ZONES, .nr_chunks = 1, .id = id,
+            .in_use = true};
+        zn_cachemap_insert(map, id, location);
+    }
+}
+
+static double
+run(struct zn_cachemap *map, uint32_t nr_threads) {
+    struct bench_thread bt[MAX_THREADS];
+    GThread *threads[MAX_THREADS];
+
+    struct timespec start_time, end_time;
+    TIME_NOW(&start_time);
+    for (uint32_t t = 0; t < nr_threads; t++) {
+        bt[t] = (struct bench_thread) {.map = map, .seed = 2463534242u + (t * 7919u), .hits = 0};
+        threads[t] = g_thread_new("cachemap-bench", hit_worker, &bt[t]);
+    }
+
+    uint64_t hits = 0;
+    for (uint32_t t = 0; t < nr_threads; t++) {
+        g_thread_join(threads[t]);
+        hits += bt[t].hits;
+    }
+    TIME_NOW(&end_time);
+
+    return hits / TIME_DIFFERENCE_SEC(start_time, end_time);
+}
+
+int
+main(int argc, char **argv) {
+    uint32_t max_threads = argc > 1 ? strtoul(argv[1], NULL, 10) : g_get_num_processors();
+    if (max_threads == 0 || max_threads > MAX_THREADS) {
+        max_threads = MAX_THREADS;
+    }
+
+    uint32_t shard_configs[] = {1, CACHEMAP_SHARDS};
+    gint *active_readers = calloc(NR_ZONES, sizeof(gint));
+    assert(active_readers);
+
+    printf("SHARDS,THREADS,HITS_PER_SEC,SPEEDUP\n");
+    for (uint32_t c = 0; c < G_N_ELEMENTS(shard_configs); c++) {
+        struct zn_cachemap map;
+        zn_cachemap_init(&map, NR_ZONES, active_readers, shard_configs[c]);
+        populate(&map);
+
+        double base = 0;
+        for (uint32_t t = 1; t <= max_threads; t *= 2) {
+            double rate = run(&map, t);
+            if (t == 1) {
+                base = rate;
+            }
+            printf("%u,%u,%.0f,%.2f\n", shard_configs[c], t, rate, rate / base);
+            fflush(stdout);
+        }
+
+        zn_cachemap_destroy(&map);
+    }
+
+    free(active_readers);
+    return 0;
+}
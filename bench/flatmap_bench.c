@@ -0,0 +1,118 @@
+#include <assert.h>
+#include <glib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "flatmap.h"
+#include "znbackend.h"
+#include "znutil.h"
+
+/* Compares lookup latency and resident memory of the flat index against the previous
+ * cache map layout: a GHashTable keyed by data ID pointing at separately allocated,
+ * 64-byte aligned entries. Pass the number of keys as the first argument. */
+
+#define DEFAULT_KEYS (1u << 22)
+#define LOOKUPS (1u << 24)
+
+/** The cache map entry layout that the flat index replaces */
+struct ghash_entry {
+    struct zn_pair location;
+    GCond write_finished;
+    int type;
+} __attribute__((aligned(64)));
+
+static uint64_t
+resident_bytes(void) {
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp == NULL) {
+        return 0;
+    }
+    unsigned long size = 0;
+    unsigned long resident = 0;
+    if (fscanf(fp, "%lu %lu", &size, &resident) != 2) {
+        resident = 0;
+    }
+    fclose(fp);
+    return (uint64_t) resident * sysconf(_SC_PAGESIZE);
+}
+
+static inline uint32_t
+next_key(uint32_t *x, uint32_t nr_keys) {
+    // xorshift32
+    *x ^= *x << 13;
+    *x ^= *x >> 17;
+    *x ^= *x << 5;
+    return *x % nr_keys;
+}
+
+static void
+bench_ghash(uint32_t nr_keys) {
+    uint64_t rss_before = resident_bytes();
+
+    GHashTable *table = g_hash_table_new(g_direct_hash, g_direct_equal);
+    for (uint32_t id = 0; id < nr_keys; id++) {
+        struct ghash_entry *entry = g_new0(struct ghash_entry, 1);
+        entry->location = (struct zn_pair) {.zone = id % 1024, .chunk_offset = id / 1024, .nr_chunks = 1};
+        g_hash_table_insert(table, GUINT_TO_POINTER(id), entry);
+    }
+    uint64_t rss_after = resident_bytes();
+
+    struct timespec start_time, end_time;
+    uint32_t x = 2463534242u;
+    uint64_t checksum = 0;
+    TIME_NOW(&start_time);
+    for (uint32_t i = 0; i < LOOKUPS; i++) {
+        struct ghash_entry *entry = g_hash_table_lookup(table, GUINT_TO_POINTER(next_key(&x, nr_keys)));
+        checksum += entry->location.chunk_offset;
+    }
+    TIME_NOW(&end_time);
+
+    printf("ghashtable,%u,%.1f,%.1f,%" G_GUINT64_FORMAT "\n", nr_keys,
+           (TIME_DIFFERENCE_NSEC(start_time, end_time)) / LOOKUPS,
+           (double) (rss_after - rss_before) / nr_keys, checksum);
+}
+
+static void
+bench_flatmap(uint32_t nr_keys) {
+    uint64_t rss_before = resident_bytes();
+
+    struct zn_flatmap map;
+    zn_flatmap_init(&map, 1024);
+    for (uint32_t id = 0; id < nr_keys; id++) {
+        bool inserted = false;
+        zn_flatmap_insert(&map, id, ((uint64_t) (id % 1024) << 32) | (id / 1024), &inserted);
+    }
+    zn_flatmap_reclaim(&map);
+    uint64_t rss_after = resident_bytes();
+
+    struct timespec start_time, end_time;
+    uint32_t x = 2463534242u;
+    uint64_t checksum = 0;
+    TIME_NOW(&start_time);
+    for (uint32_t i = 0; i < LOOKUPS; i++) {
+        uint64_t *value = zn_flatmap_find(&map, next_key(&x, nr_keys));
+        checksum += (uint32_t) *value;
+    }
+    TIME_NOW(&end_time);
+
+    printf("flatmap,%u,%.1f,%.1f,%" G_GUINT64_FORMAT "\n", nr_keys,
+           (TIME_DIFFERENCE_NSEC(start_time, end_time)) / LOOKUPS,
+           (double) (rss_after - rss_before) / nr_keys, checksum);
+
+    zn_flatmap_destroy(&map);
+}
+
+int
+main(int argc, char **argv) {
+    uint32_t nr_keys = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_KEYS;
+    assert(nr_keys > 0);
+
+    printf("INDEX,KEYS,LOOKUP_NS,RSS_BYTES_PER_KEY,CHECKSUM\n");
+    // Flat index first, so the GHashTable run cannot reuse memory it freed
+    bench_flatmap(nr_keys);
+    bench_ghash(nr_keys);
+
+    return 0;
+}
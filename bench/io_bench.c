@@ -0,0 +1,237 @@
+#define _GNU_SOURCE // O_DIRECT
+#include <assert.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <linux/fs.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "znbuf.h"
+#include "zncache.h"
+#include "znio.h"
+#include "znutil.h"
+
+/* Compares the psync and io_uring engines on a real device. Each thread fills its own zone
+ * sequentially, then all threads read random chunks back. Reports IOPS and mean latency per
+ * engine. Zones 0..THREADS-1 are overwritten, so only run it against a scratch device such
+ * as nullblk:
+ *
+ *   io_bench <DEVICE> [CHUNK_SZ] [THREADS]
+ *
+ * Without a device it exits with 77, which meson reports as a skipped benchmark. */
+
+#define DEFAULT_CHUNK_SZ 65536
+#define DEFAULT_THREADS 4
+#define MAX_THREADS 64
+#define MAX_CHUNKS_PER_THREAD 1024
+#define READS_PER_THREAD 4096
+
+struct bench_config {
+    struct zn_io io;
+    struct zn_buffer_pool buffers; /**< Registered with `io` */
+    bool zoned;
+    int fd;
+    size_t chunk_sz;
+    uint64_t zone_size;
+    uint32_t chunks_per_thread;
+    uint32_t nr_threads;
+};
+
+struct bench_thread {
+    struct bench_config *cfg;
+    uint32_t tid;
+    uint64_t ops;
+    double total_ns;
+    bool registered; /**< The engine registers the buffers */
+    int failures;
+};
+
+static unsigned char *
+thread_buffer(struct bench_thread *bt) {
+    bt->registered = bt->cfg->io.regions != NULL;
+    return zn_buffer_get(&bt->cfg->buffers);
+}
+
+static void
+release_buffer(struct bench_thread *bt, unsigned char *buffer) {
+    // The thread's ring goes when it exits, before the device is closed
+    zn_buffer_put(&bt->cfg->buffers, buffer);
+}
+
+static void
+register_slab(void *io, void *base, size_t len) {
+    zn_io_register_region(io, base, len);
+}
+
+static gpointer
+write_worker(gpointer user_data) {
+    struct bench_thread *bt = user_data;
+    struct bench_config *cfg = bt->cfg;
+    unsigned char *buffer = thread_buffer(bt);
+    memset(buffer, (int) bt->tid, cfg->chunk_sz);
+
+    for (uint32_t c = 0; c < cfg->chunks_per_thread; c++) {
+        struct timespec start_time, end_time;
+        TIME_NOW(&start_time);
+        if (zn_io_write(&cfg->io, buffer, cfg->chunk_sz,
+                        CHUNK_POINTER(cfg->zone_size, cfg->chunk_sz, c, bt->tid)) != 0) {
+            bt->failures++;
+            break;
+        }
+        TIME_NOW(&end_time);
+        bt->total_ns += TIME_DIFFERENCE_NSEC(start_time, end_time);
+        bt->ops++;
+    }
+
+    release_buffer(bt, buffer);
+    return NULL;
+}
+
+static gpointer
+read_worker(gpointer user_data) {
+    struct bench_thread *bt = user_data;
+    struct bench_config *cfg = bt->cfg;
+    unsigned char *buffer = thread_buffer(bt);
+    uint32_t x = 2463534242u + bt->tid;
+
+    for (uint32_t i = 0; i < READS_PER_THREAD; i++) {
+        // xorshift32
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        uint32_t zone = x % cfg->nr_threads;
+        uint32_t chunk = (x / cfg->nr_threads) % cfg->chunks_per_thread;
+
+        struct timespec start_time, end_time;
+        TIME_NOW(&start_time);
+        if (zn_io_read(&cfg->io, buffer, cfg->chunk_sz,
+                       CHUNK_POINTER(cfg->zone_size, cfg->chunk_sz, chunk, zone)) != 0 ||
+            buffer[0] != (unsigned char) zone) {
+            bt->failures++;
+            break;
+        }
+        TIME_NOW(&end_time);
+        bt->total_ns += TIME_DIFFERENCE_NSEC(start_time, end_time);
+        bt->ops++;
+    }
+
+    release_buffer(bt, buffer);
+    return NULL;
+}
+
+static int
+run(struct bench_config *cfg, const char *op, GThreadFunc worker) {
+    struct bench_thread bt[MAX_THREADS];
+    GThread *threads[MAX_THREADS];
+
+    struct timespec start_time, end_time;
+    TIME_NOW(&start_time);
+    for (uint32_t t = 0; t < cfg->nr_threads; t++) {
+        bt[t] = (struct bench_thread) {.cfg = cfg, .tid = t};
+        threads[t] = g_thread_new("io", worker, &bt[t]);
+    }
+    uint64_t ops = 0;
+    double total_ns = 0;
+    int failures = 0;
+    bool registered = true;
+    for (uint32_t t = 0; t < cfg->nr_threads; t++) {
+        g_thread_join(threads[t]);
+        ops += bt[t].ops;
+        total_ns += bt[t].total_ns;
+        failures += bt[t].failures;
+        registered = registered && bt[t].registered;
+    }
+    TIME_NOW(&end_time);
+    double elapsed = TIME_DIFFERENCE_NSEC(start_time, end_time);
+
+    printf("%s,%s,%u,%zu,%.0f,%.1f,%s\n", zn_io_engine_name(cfg->io.engine), op, cfg->nr_threads,
+           cfg->chunk_sz, ops / (elapsed / 1e9), ops > 0 ? (total_ns / ops) / 1000 : 0.0,
+           registered ? "yes" : "no");
+    return failures;
+}
+
+static int
+reset_zones(struct bench_config *cfg) {
+    if (!cfg->zoned) {
+        return 0;
+    }
+    return zbd_reset_zones(cfg->fd, 0, cfg->zone_size * cfg->nr_threads);
+}
+
+int
+main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <DEVICE> [CHUNK_SZ] [THREADS]\n", argv[0]);
+        return 77;
+    }
+
+    struct bench_config cfg = {0};
+    char *device = argv[1];
+    cfg.chunk_sz = argc > 2 ? strtoul(argv[2], NULL, 10) : DEFAULT_CHUNK_SZ;
+    cfg.nr_threads = argc > 3 ? strtoul(argv[3], NULL, 10) : DEFAULT_THREADS;
+    assert(cfg.nr_threads > 0 && cfg.nr_threads <= MAX_THREADS);
+    assert(cfg.chunk_sz % ZN_DIRECT_ALIGNMENT == 0);
+
+    uint64_t zone_capacity = 0;
+    uint32_t nr_zones = 0;
+    cfg.zoned = zbd_device_is_zoned(device);
+    if (cfg.zoned) {
+        struct zbd_info info = {0};
+        cfg.fd = zbd_open(device, O_RDWR | O_DIRECT | O_SYNC, &info);
+        if (cfg.fd < 0 || zone_cap(cfg.fd, &zone_capacity) != 0) {
+            fprintf(stderr, "Couldn't open zoned device %s\n", device);
+            return 1;
+        }
+        cfg.zone_size = info.zone_size;
+        nr_zones = info.nr_zones;
+    } else {
+        cfg.fd = open(device, O_RDWR | O_DIRECT | O_SYNC);
+        uint64_t size = 0;
+        if (cfg.fd < 0 || ioctl(cfg.fd, BLKGETSIZE64, &size) == -1) {
+            fprintf(stderr, "Couldn't open block device %s\n", device);
+            return 1;
+        }
+        cfg.zone_size = BLOCK_ZONE_CAPACITY;
+        zone_capacity = BLOCK_ZONE_CAPACITY;
+        nr_zones = size / BLOCK_ZONE_CAPACITY;
+    }
+    if (nr_zones < cfg.nr_threads || zone_capacity < cfg.chunk_sz) {
+        fprintf(stderr, "Device is too small for %u threads\n", cfg.nr_threads);
+        return 1;
+    }
+    cfg.chunks_per_thread = MIN(MAX_CHUNKS_PER_THREAD, zone_capacity / cfg.chunk_sz);
+    size_t io_size = MAX_IO == 0 ? cfg.chunk_sz : MAX_IO;
+
+    printf("ENGINE,OP,THREADS,CHUNK_SZ,IOPS,AVG_LAT_US,REGISTERED_BUFFERS\n");
+    int failures = 0;
+    enum zn_io_engine engines[] = {ZN_IO_ENGINE_PSYNC, ZN_IO_ENGINE_URING};
+    for (uint32_t e = 0; e < G_N_ELEMENTS(engines); e++) {
+        zn_io_init(&cfg.io, engines[e], cfg.fd, io_size, cfg.zoned);
+        if (cfg.io.engine != engines[e]) {
+            zn_io_destroy(&cfg.io);
+            continue;
+        }
+        if (reset_zones(&cfg) != 0) {
+            fprintf(stderr, "Couldn't reset zones\n");
+            return 1;
+        }
+        zn_buffer_pool_init(&cfg.buffers, cfg.chunk_sz, false);
+        zn_buffer_pool_watch_slabs(&cfg.buffers, register_slab, &cfg.io);
+        failures += run(&cfg, "write", write_worker);
+        failures += run(&cfg, "read", read_worker);
+        zn_buffer_pool_destroy(&cfg.buffers);
+        zn_io_destroy(&cfg.io);
+    }
+
+    reset_zones(&cfg);
+    if (cfg.zoned) {
+        zbd_close(cfg.fd);
+    } else {
+        close(cfg.fd);
+    }
+    return failures;
+}
@@ -0,0 +1,222 @@
+#include <assert.h>
+#include <glib.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "eviction_policy.h"
+#include "flatmap.h"
+#include "zncache.h"
+#include "znutil.h"
+
+/* Compares the hit ratio of the zone eviction policies on the same gets. The cache is simulated
+ * with the zone state manager and no device: every miss writes one chunk and reports it to the
+ * policy like zn_cache_write_miss() does, and zones are evicted with the water marks of the
+ * eviction thread. Hits are counted once the cache first evicts.
+ *
+ * Without arguments the gets follow Zipfian distributions of several skews. Pass a workload
+ * file of 32-bit IDs and the number of gets to read from it, like `zncache -w`, to replay it
+ * instead. */
+
+#define ZONE_CHUNKS 256
+#define CHUNK_SIZE 4096
+#define NR_KEYS (1u << 16)
+#define NR_GETS (1u << 20)
+
+static const double skews[] = {0.6, 0.9, 1.2};
+static const uint32_t zone_configs[] = {16, 32, 64};
+static const enum zn_evict_policy_type policies[] = {ZN_EVICT_ZONE, ZN_EVICT_PROMOTE_ZONE,
+                                                     ZN_EVICT_S3FIFO_ZONE};
+static const char *policy_names[] = {
+    [ZN_EVICT_ZONE] = "ZONE", [ZN_EVICT_PROMOTE_ZONE] = "PROMOTE_ZONE",
+    [ZN_EVICT_S3FIFO_ZONE] = "S3FIFO_ZONE"};
+
+struct sim_result {
+    uint64_t hits;
+    uint64_t gets;
+    uint64_t resets;
+};
+
+/** Simulated cache, only what the zone policies and the zone state manager use is set */
+struct sim_cache {
+    struct zn_cache cache;
+    struct zn_flatmap index; /**< ID → (zone << 32) | chunk of the cached IDs */
+    uint32_t *zone_ids;      /**< The ID written to each chunk */
+    struct sim_result result;
+    bool warm;
+};
+
+static void
+evict_zones(struct sim_cache *sim, uint32_t nr_zones) {
+    for (uint32_t i = 0; i < nr_zones; i++) {
+        int zone = sim->cache.eviction_policy.do_evict(sim->cache.eviction_policy.data);
+        if (zone == -1) {
+            break;
+        }
+        for (uint32_t c = 0; c < ZONE_CHUNKS; c++) {
+            zn_flatmap_erase(&sim->index, sim->zone_ids[(uint64_t) zone * ZONE_CHUNKS + c]);
+        }
+        zn_flatmap_reclaim(&sim->index);
+        int ret = zsm_evict(&sim->cache.zone_state, zone);
+        assert(ret == 0);
+        (void) ret;
+        sim->result.resets++;
+        sim->warm = true;
+    }
+}
+
+static void
+get(struct sim_cache *sim, uint32_t id) {
+    struct zn_cache *cache = &sim->cache;
+    sim->result.gets += sim->warm;
+
+    uint64_t *packed = zn_flatmap_find(&sim->index, id);
+    if (packed != NULL) {
+        struct zn_pair location = {.zone = (uint32_t) (*packed >> 32),
+                                   .chunk_offset = (uint32_t) *packed, .nr_chunks = 1, .id = id,
+                                   .in_use = true};
+        cache->eviction_policy.update_policy(cache->eviction_policy.data, location, ZN_READ);
+        sim->result.hits += sim->warm;
+        return;
+    }
+
+    struct zn_pair location;
+    enum zsm_get_active_zone_error ret;
+    while ((ret = zsm_get_active_zone(&cache->zone_state, &location)) ==
+           ZSM_GET_ACTIVE_ZONE_EVICT) {
+        evict_zones(sim, EVICT_LOW_THRESH_ZONES);
+    }
+    assert(ret == ZSM_GET_ACTIVE_ZONE_SUCCESS);
+    location.id = id;
+
+    zsm_wait_write_turn(&cache->zone_state, &location);
+    zsm_pass_write_turn(&cache->zone_state, &location);
+    sim->zone_ids[(uint64_t) location.zone * ZONE_CHUNKS + location.chunk_offset] = id;
+    bool inserted;
+    zn_flatmap_insert(&sim->index, id, ((uint64_t) location.zone << 32) | location.chunk_offset,
+                      &inserted);
+    assert(inserted);
+    (void) inserted;
+    cache->eviction_policy.update_policy(cache->eviction_policy.data, location, ZN_WRITE);
+    zsm_return_active_zone(&cache->zone_state, &location);
+
+    // The eviction thread's water marks
+    uint32_t free_zones = zsm_get_num_free_zones(&cache->zone_state);
+    if (free_zones <= EVICT_HIGH_THRESH_ZONES && free_zones < EVICT_LOW_THRESH_ZONES) {
+        evict_zones(sim, EVICT_LOW_THRESH_ZONES - free_zones);
+    }
+}
+
+static struct sim_result
+simulate(const uint32_t *gets, uint64_t nr_gets, uint32_t nr_zones,
+         enum zn_evict_policy_type type) {
+    struct sim_cache *sim = g_new0(struct sim_cache, 1);
+    sim->cache.nr_zones = nr_zones;
+    sim->cache.max_zone_chunks = ZONE_CHUNKS;
+    sim->cache.chunk_sz = CHUNK_SIZE;
+    sim->cache.zone_cap = ZONE_CHUNKS * CHUNK_SIZE;
+    zsm_init(&sim->cache.zone_state, nr_zones, -1, sim->cache.zone_cap, sim->cache.zone_cap,
+             CHUNK_SIZE, 1, ZE_BACKEND_BLOCK);
+    zn_evict_policy_init(&sim->cache.eviction_policy, type, &sim->cache);
+    zn_flatmap_init(&sim->index, nr_zones * ZONE_CHUNKS);
+    sim->zone_ids = g_new(uint32_t, (uint64_t) nr_zones * ZONE_CHUNKS);
+
+    for (uint64_t i = 0; i < nr_gets; i++) {
+        get(sim, gets[i]);
+    }
+
+    struct sim_result result = sim->result;
+    zn_flatmap_destroy(&sim->index);
+    g_free(sim->zone_ids);
+    g_free(sim);
+    return result;
+}
+
+/** @brief `nr_gets` IDs below NR_KEYS, ID k drawn with a probability proportional to 1/(k+1)^skew */
+static uint32_t *
+zipf_gets(double skew, uint64_t nr_gets) {
+    double *cdf = g_new(double, NR_KEYS);
+    double sum = 0;
+    for (uint32_t k = 0; k < NR_KEYS; k++) {
+        sum += 1.0 / pow(k + 1, skew);
+        cdf[k] = sum;
+    }
+
+    uint32_t *gets = g_new(uint32_t, nr_gets);
+    uint64_t x = 88172645463325252ull;
+    for (uint64_t i = 0; i < nr_gets; i++) {
+        // xorshift64
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        double u = (double) (x >> 11) / (double) (1ull << 53) * sum;
+        uint32_t lo = 0;
+        uint32_t hi = NR_KEYS - 1;
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            if (cdf[mid] < u) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        gets[i] = lo;
+    }
+    g_free(cdf);
+    return gets;
+}
+
+static uint32_t *
+read_gets(const char *path, uint64_t nr_gets) {
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        perror("Couldn't open workload file");
+        exit(EXIT_FAILURE);
+    }
+    uint32_t *gets = g_new(uint32_t, nr_gets);
+    if (fread(gets, sizeof(uint32_t), nr_gets, fp) != nr_gets) {
+        fprintf(stderr, "Couldn't read %lu gets from '%s'\n", nr_gets, path);
+        exit(EXIT_FAILURE);
+    }
+    fclose(fp);
+    return gets;
+}
+
+static void
+run(const char *workload, const uint32_t *gets, uint64_t nr_gets) {
+    for (uint32_t z = 0; z < G_N_ELEMENTS(zone_configs); z++) {
+        for (uint32_t p = 0; p < G_N_ELEMENTS(policies); p++) {
+            struct sim_result r = simulate(gets, nr_gets, zone_configs[z], policies[p]);
+            printf("%s,%u,%s,%.4f,%lu\n", workload, zone_configs[z], policy_names[policies[p]],
+                   r.gets ? (double) r.hits / r.gets : 0.0, r.resets);
+            fflush(stdout);
+        }
+    }
+}
+
+int
+main(int argc, char **argv) {
+    if (argc == 2 || argc > 3) {
+        fprintf(stderr, "Usage: %s [WORKLOAD_FILE ITERATIONS]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    printf("WORKLOAD,ZONES,POLICY,HIT_RATIO,ZONE_RESETS\n");
+    if (argc == 3) {
+        uint64_t nr_gets = strtoull(argv[2], NULL, 10);
+        uint32_t *gets = read_gets(argv[1], nr_gets);
+        run(argv[1], gets, nr_gets);
+        g_free(gets);
+        return 0;
+    }
+
+    for (uint32_t s = 0; s < G_N_ELEMENTS(skews); s++) {
+        char workload[32];
+        snprintf(workload, sizeof(workload), "zipf-%.1f", skews[s]);
+        uint32_t *gets = zipf_gets(skews[s], NR_GETS);
+        run(workload, gets, NR_GETS);
+        g_free(gets);
+    }
+    return 0;
+}
@@ -1,26 +1,144 @@
 #pragma once
 
+#include "flatmap.h"
 #include "znbackend.h"
+#include "znbuf.h"
 #include "glib.h"
 #include <stdint.h>
 
+/** Upper bound on the number of shards a cachemap can be split into */
+#define ZN_CACHEMAP_MAX_SHARDS 1024
+
+/** Upper bound on the number of zones, limited by the bits available in an entry */
+#define ZN_CACHEMAP_MAX_ZONES (1u << 16)
+
+/** Upper bound on the chunks of one object, limited by the bits available in an entry */
+#define ZN_CACHEMAP_MAX_EXTENT_CHUNKS (1u << 10)
+
+/** Upper bound on the chunks of one zone, limited by the bits available in an entry */
+#define ZN_CACHEMAP_MAX_ZONE_CHUNKS (1u << 20)
+
+/** Upper bound on threads using the lock-free hit path at once, others always lock */
+#define ZN_CACHEMAP_MAX_OPTIMISTIC_READERS 1024
+
+/**
+ * @struct zn_inflight
+ *
+ * @brief Copy of the data fetched by the writer of an entry, shared with the threads that
+ * waited for that write so they do not read it back from the disk.
+ */
+struct zn_inflight {
+    gint refcount;       /**< Waiters that have not taken their copy yet, plus one held by the
+                              map while the data is pending */
+    size_t size;         /**< Size of `data` in bytes */
+    unsigned char *data; /**< ZN_DIRECT_ALIGNMENT aligned buffer from the map's pool, handed to
+                              the last waiter */
+};
+
+/**
+ * @struct zn_cachemap_waiter
+ *
+ * @brief Wait slot for threads that look up an ID while another thread is writing it.
+ * Taken from the shard's pool by the first waiter (or by zn_cachemap_publish_pending()) and
+ * attached to the in-flight entry, returned by the last waiter to leave once the write is
+ * done. Entries without waiters or pending data carry no wait state.
+ */
+struct zn_cachemap_waiter {
+    GCond cond;          /**< Broadcast when the write completes or fails */
+    uint32_t nr_waiters; /**< Threads sleeping on `cond` */
+    uint32_t next_free;  /**< Next slot on the shard's free list */
+    bool done;           /**< Set by the writer, waiters leave once it is true */
+    struct zn_inflight *inflight; /**< Data published by the writer, or NULL */
+    struct zn_inflight *pending;  /**< Data served until the write completes, see
+                                       zn_cachemap_publish_pending() */
+};
+
+/**
+ * @struct zn_cachemap_shard
+ *
+ * @brief One hash partition of the cache map. Every data ID belongs to exactly one shard,
+ * and all state for that ID (its entry and its waiters) is protected by the shard lock.
+ *
+ * An entry is a single packed word stored inline in the flat index, so a key costs one
+ * index slot. Entries are erased when they become empty, and entries left stale by zone
+ * evictions are swept whenever the index has doubled in size since the last sweep.
+ *
+ * Hits do not take the lock. They read the entry optimistically and validate it against
+ * `seq`, which writers make odd while they invalidate or move a location.
+ */
+struct zn_cachemap_shard {
+    GMutex lock;                /**< Protects everything in this shard, waiters sleep on it */
+    gint seq;                   /**< Sequence counter, odd while a location is being changed */
+    struct zn_flatmap zone_map; /**< Data ID → packed location, generation and entry type */
+    uint32_t sweep_at;          /**< Index size at which stale entries are next swept */
+    struct zn_cachemap_waiter **waiter_blocks; /**< Waiter pool, fixed-size blocks that never move */
+    uint32_t nr_waiter_blocks;  /**< Number of blocks in the waiter pool */
+    uint32_t free_waiters;      /**< Head of the waiter free list, 0 if empty */
+} __attribute__((aligned(64)));
+
 /**
  * @struct zn_cachemap
  *
  * @brief A map for finding where data is stored on the disk based on the data ID.
- * Keeps track of two things:
- *  1. Data ID → (Zone ID, chunk pointer)
- *  2. Zone ID → Data ID
+ * Keeps track of Data ID → (Zone ID, chunk pointer, zone generation).
+ *
+ * Each zone has a generation number that is bumped when the zone is evicted. Entries
+ * record the generation of their zone at insert time, and an entry whose generation is
+ * no longer current is treated as a miss, so evicting a zone never visits its entries.
+ *
+ * The map is split into `nr_shards` partitions by data ID so that lookups for different
+ * IDs do not contend on a single lock.
  */
 struct zn_cachemap {
-    GMutex cache_map_mutex;
-    GHashTable *zone_map;
-    GHashTable **data_map;  /**< Zone ID → GHashTable (chunk -> Data ID) */
+    struct zn_cachemap_shard *shards; /**< Array of `nr_shards` shards */
+    uint32_t nr_shards;               /**< Number of shards, fixed at init */
+    uint32_t nr_zones;                /**< Number of zones on the disk */
+    gint *zone_generation;  /**< Zone ID → generation, bumped each time the zone is evicted */
     gint *active_readers;   /**< Non-owning reference to the number of currently active readers per zone. */
+    struct zn_buffer_pool *buffers; /**< Non-owning pool for copies handed to waiters, NULL to
+                                         use posix_memalign() and free() */
 };
 
+/**
+ * @struct zn_cachemap_stats
+ * @brief Memory used by the cache map, see zn_cachemap_get_stats()
+ */
+struct zn_cachemap_stats {
+    uint64_t nr_keys;     /**< Entries pointing at data currently on disk */
+    uint64_t nr_entries;  /**< All entries, including in-flight writes and stale entries */
+    size_t index_bytes;   /**< Bytes held by the shard indexes */
+    size_t waiter_bytes;  /**< Bytes held by the waiter pools */
+    size_t total_bytes;   /**< All bytes held by the cache map */
+};
+
+/**
+ * @brief Initialize the cache map
+ *
+ * @param map Cache map to initialize
+ * @param num_zones Number of zones on the disk, at most ZN_CACHEMAP_MAX_ZONES
+ * @param active_readers_arr Per-zone reader counts, owned by the caller
+ * @param nr_shards Number of lock partitions, between 1 and ZN_CACHEMAP_MAX_SHARDS
+ */
+void
+zn_cachemap_init(struct zn_cachemap *map, const int num_zones, gint *active_readers_arr,
+                 const uint32_t nr_shards);
+
+/**
+ * @brief Free all memory owned by the cache map
+ *
+ * @param map Cache map to destroy, no other thread may be using it
+ */
+void
+zn_cachemap_destroy(struct zn_cachemap *map);
+
+/**
+ * @brief Collect memory usage of the cache map. Locks each shard in turn.
+ *
+ * @param map Cache map to measure
+ * @param[out] stats Filled with the current usage
+ */
 void
-zn_cachemap_init(struct zn_cachemap *map, const int num_zones, gint *active_readers_arr);
+zn_cachemap_get_stats(struct zn_cachemap *map, struct zn_cachemap_stats *stats);
 
 /**
  * @struct zone_map_result
@@ -28,16 +146,22 @@ zn_cachemap_init(struct zn_cachemap *map, const int num_zones, gint *active_read
  * This is a type with two possible values:
  * 1. It contains a zn_pair, which represents the location on disk
      where the data can be found
- * 2. It contains a condition variable, which new threads will wait on
-        as this thread is tasked with writing the data to disk. The
-        thread should signal once it is finished.
+ * 2. RESULT_COND, meaning this thread is tasked with writing the data to
+        disk. Other threads looking up the ID wait on a condition
+        variable from the shard's waiter pool until the thread calls
+        zn_cachemap_insert or zn_cachemap_fail.
+ 3. RESULT_DATA, meaning this thread waited for another thread's write
+        and was handed a copy of that thread's buffer in `data`, which
+        the caller must release to the map's buffer pool (or free if it
+        has none). No reader count is held.
  */
 struct zone_map_result {
     struct zn_pair location; ///< If it is finished
-    GCond write_finished; ///< If there is a write ongoing
+    unsigned char *data;     ///< RESULT_DATA only, owned by the caller
+    size_t size;             ///< RESULT_DATA only, bytes of object data in `data`
 
-    enum { RESULT_LOC = 0, RESULT_COND = 1, RESULT_EMPTY = 2 } type;
-} __attribute__((aligned(64)));
+    enum { RESULT_LOC = 0, RESULT_COND = 1, RESULT_EMPTY = 2, RESULT_DATA = 3 } type;
+};
 
 /** @brief Finds the data in the zone if it exists, otherwise returns additional information for
     writing to a zone
@@ -49,10 +173,19 @@ struct zone_map_result {
  *	- When a reader requests to read, we need to increment the active
  *       reader count on behalf of them
  *
+ * Hits are served without the shard lock: the entry is read optimistically, the reader
+ * count is incremented, and the shard sequence counter is rechecked. If a writer changed
+ * the shard in between, the count is dropped and the lookup is retried. Misses and
+ * in-flight writes go through the shard lock.
+ *
  * This function should sleep on a condition variable when it finds it
  *      in the cache (indicating that a thread is currently writing the
  *      data to disk). When it is woken up, it should try again to see
  *      if the data exists in the cache map.
+ *
+ * If the writer inserted with zn_cachemap_insert_data, woken threads
+ *      return RESULT_DATA with their own copy of the written data
+ *      instead, and do not need to read it from the disk.
  */
 struct zone_map_result
 zn_cachemap_find(struct zn_cachemap *map, const uint32_t data_id);
@@ -65,32 +198,88 @@ zn_cachemap_find(struct zn_cachemap *map, const uint32_t data_id);
  * @return void
  *
  * Implementation notes:
- * - Additionally inserts the mapping into the Zone ID → Data ID map
- * - We could abstract away the cond variable logic from the thread
- *     here by signalling when the thread calls this function.
+ * - The entry is stamped with the current generation of `location.zone`, so this must
+ *     be called before the zone is handed back to the zone state manager, while it
+ *     cannot be evicted.
+ * - If the entry already points at a location (the data was relocated by GC),
+ *     it is overwritten.
  */
 void
 zn_cachemap_insert(struct zn_cachemap *map, const uint32_t data_id, struct zn_pair location);
 
-/** @brief Clears all entries of a zone in the mapping. Called by eviction threads.
- * @param zone the zone
-   to clear
+/** @brief Inserts a new mapping like zn_cachemap_insert, and hands the written data to the
+ * threads waiting for it.
+ *
+ * @param data_id id of the data to be inserted
+ * @param location the location on disk where the data lives
+ * @param data the buffer that was written, still owned by the caller. If threads are
+ *     waiting for the ID it is copied once into a shared zn_inflight.
+ * @param size size of `data` in bytes
+ * @return void
+ */
+void
+zn_cachemap_insert_data(struct zn_cachemap *map, const uint32_t data_id, struct zn_pair location,
+                        const unsigned char *data, size_t size);
+
+/** @brief Serve lookups of an in-flight ID from `data` while it is written in the background
+ *
+ * Threads that look up the ID, including ones already waiting for it, get RESULT_DATA with
+ * their own copy instead of sleeping until the write completes.
+ *
+ * @param data_id id the caller got RESULT_COND for
+ * @param data buffer from the map's pool (or posix_memalign() if it has none), owned by the
+ *     map from here on. It stays valid until the caller inserts or fails the ID.
+ * @param size size of `data` in bytes
+ * @return void
+ */
+void
+zn_cachemap_publish_pending(struct zn_cachemap *map, const uint32_t data_id, unsigned char *data,
+                            size_t size);
+
+/** @brief Clears a single chunk in the mapping. Called by eviction threads.
+ * @param location the chunk to clear, `location->id` must be the data ID stored there
  * @return void
- * Implementation notes:
- *   - Additionally clears the Zone ID → Data ID map
  */
 void
 zn_cachemap_clear_chunk(struct zn_cachemap *map, struct zn_pair *location);
 
+/** @brief Clears the entry of `location->id` if it still points at `location`
+ * @param location the extent to clear, unlike zn_cachemap_clear_chunk() the ID may have
+ *     been evicted or written elsewhere since
+ * @return true if the entry was cleared
+ */
+bool
+zn_cachemap_clear_extent(struct zn_cachemap *map, const struct zn_pair *location);
+
 /** @brief Clears all entries of a zone in the mapping. Called by eviction threads.
  * @param zone the zone
    to clear
  * @return void
  * Implementation notes:
- *   - Additionally clears the Zone ID → Data ID map
+ *   - O(1): bumps the zone generation, which makes every entry in the zone stale.
+ *       Stale entries are reclaimed by the next lookup of their data ID.
+ *   - Entries only store the low bits of the generation, so every 2^15 evictions of a
+ *       zone its stale entries are erased from all shards before the bump, under the
+ *       shard locks. Otherwise takes no locks.
+ *   - The caller must still wait for the zone's active readers to drain before resetting it.
  */
 void
 zn_cachemap_clear_zone(struct zn_cachemap *map, uint32_t zone);
 
 void
 zn_cachemap_fail(struct zn_cachemap *map, const uint32_t id);
+
+/** @brief Erases an in-flight ID like zn_cachemap_fail, and hands the data to the threads
+ * waiting for it, so that they return it instead of taking over the write.
+ *
+ * Used when the data is kept outside the device, e.g. by the DRAM tier.
+ *
+ * @param id id the caller got RESULT_COND for
+ * @param data the fetched data, still owned by the caller. If threads are waiting for the
+ *     ID it is copied once into a shared zn_inflight.
+ * @param size size of `data` in bytes
+ * @return void
+ */
+void
+zn_cachemap_fail_data(struct zn_cachemap *map, const uint32_t id, const unsigned char *data,
+                      size_t size);
@@ -0,0 +1,206 @@
+#ifndef ZN_DRAM_TIER_H
+#define ZN_DRAM_TIER_H
+
+#include <glib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "flatmap.h"
+#include "znbuf.h"
+
+/*
+ * Bounded DRAM tier in front of the device, keyed by data ID and managed with S3-FIFO.
+ *
+ * New entries go to a small FIFO. Entries hit while in it move to the main FIFO when they
+ * reach its tail, the others leave and are remembered in a ghost FIFO of IDs, so that an ID
+ * seen again soon goes straight to the main FIFO. The main FIFO gives entries that were hit
+ * another pass before they leave.
+ *
+ * Entries take a buffer of the size class of their object, and the tier is bounded by the bytes
+ * of those buffers. An insert makes room for its entry, which can take more than one victim.
+ * An entry that leaves is handed to the caller as a victim and stays readable until the
+ * caller releases it, so the device tier can take it over without a window where the ID is
+ * in neither tier.
+ */
+
+/** Lock partitions at most */
+#define ZN_DRAM_TIER_SHARDS 16
+
+/** Entries of the expected size per lock partition at least, so small tiers keep a useful
+ * small FIFO */
+#define ZN_DRAM_TIER_MIN_SHARD_ENTRIES 64
+
+/** Share of a shard's bytes kept in the small FIFO */
+#define ZN_DRAM_TIER_SMALL_PERCENT 10
+
+/** Hits counted per entry, extra hits do not buy more passes through the main FIFO */
+#define ZN_DRAM_TIER_MAX_FREQ 3
+
+enum zn_dram_queue {
+    ZN_DRAM_QUEUE_SMALL = 0,
+    ZN_DRAM_QUEUE_MAIN = 1,
+    ZN_DRAM_QUEUE_LEAVING = 2, /**< Handed out as a victim, still readable */
+};
+
+/**
+ * @struct zn_dram_entry
+ * @brief An object held in DRAM
+ */
+struct zn_dram_entry {
+    uint32_t id;
+    uint8_t freq;              /**< Hits since it entered its queue, capped */
+    uint8_t queue;             /**< enum zn_dram_queue */
+    gint readers;              /**< Threads copying `data` outside the shard lock */
+    size_t len;                /**< Bytes of object data in `data` */
+    size_t size;               /**< Bytes of `data`, what the entry takes of the capacity */
+    unsigned char *data;       /**< Buffer from the tier's buffer pool */
+    struct zn_dram_entry *prev; /**< Towards the head of its FIFO */
+    struct zn_dram_entry *next; /**< Towards the tail of its FIFO, or the next victim of the
+                                     same insert once it is leaving */
+};
+
+/**
+ * @struct zn_dram_fifo
+ * @brief Entries in insertion order, inserted at the head and evicted from the tail
+ */
+struct zn_dram_fifo {
+    struct zn_dram_entry *head;
+    struct zn_dram_entry *tail;
+    uint32_t length;
+    uint64_t bytes;              /**< Sum of the `size` of its entries */
+};
+
+/**
+ * @struct zn_dram_shard
+ * @brief One partition of the tier, every ID belongs to exactly one
+ */
+struct zn_dram_shard {
+    GMutex lock;                 /**< Protects everything in the shard */
+    struct zn_flatmap index;     /**< Data ID → entry pointer, including leaving entries */
+    struct zn_flatmap ghosts;    /**< Data ID → position in `ghost_ring` */
+    uint32_t *ghost_ring;        /**< IDs that recently left the small FIFO, oldest overwritten */
+    uint32_t ghost_capacity;
+    uint64_t ghost_next;         /**< Position of the next ghost, counts up forever */
+    struct zn_dram_fifo small;
+    struct zn_dram_fifo main;
+    uint64_t capacity;           /**< Bytes of entries in both FIFOs at most */
+    uint64_t small_capacity;     /**< Bytes the small FIFO holds before it is evicted from */
+    uint64_t hits;
+    uint64_t lookups;
+    uint64_t evictions;
+} __attribute__((aligned(64)));
+
+/**
+ * @struct zn_dram_tier
+ * @brief The DRAM tier of a cache
+ */
+struct zn_dram_tier {
+    struct zn_buffer_pool *buffers; /**< Non-owning, provides the object copies */
+    size_t entry_sz;                /**< Expected bytes of an entry */
+    uint32_t nr_shards;             /**< 0 when the tier is disabled */
+    struct zn_dram_shard *shards;
+};
+
+/**
+ * @struct zn_dram_victim
+ * @brief An entry that left the tier, see zn_dram_tier_insert()
+ */
+struct zn_dram_victim {
+    uint32_t id;
+    unsigned char *data;          /**< Readable until zn_dram_tier_release() */
+    size_t len;                   /**< Bytes of object data in `data` */
+    struct zn_dram_entry *entry;  /**< Links the other victims of the insert */
+};
+
+/**
+ * @struct zn_dram_tier_stats
+ * @brief Counters summed over the shards, see zn_dram_tier_get_stats()
+ */
+struct zn_dram_tier_stats {
+    uint64_t nr_entries;  /**< Entries held now */
+    uint64_t hits;        /**< Lookups served from DRAM */
+    uint64_t lookups;     /**< All lookups */
+    uint64_t evictions;   /**< Entries handed out as victims */
+};
+
+/**
+ * @brief Set up the DRAM tier
+ *
+ * @param tier Tier to initialize
+ * @param capacity Bytes of buffers held at most, the tier is disabled below one of the
+ *                 pool's largest buffers
+ * @param entry_sz Expected bytes of an entry, sizes the lock partitions and the ghost FIFO
+ * @param buffers Pool for the copies, owned by the caller. Each entry takes a buffer of the
+ *                class of its object.
+ */
+void
+zn_dram_tier_init(struct zn_dram_tier *tier, uint64_t capacity, size_t entry_sz,
+                  struct zn_buffer_pool *buffers);
+
+/**
+ * @brief Free every entry. No victims may be outstanding.
+ */
+void
+zn_dram_tier_destroy(struct zn_dram_tier *tier);
+
+/**
+ * @brief Whether the cache has a DRAM tier
+ */
+static inline bool
+zn_dram_tier_enabled(const struct zn_dram_tier *tier) {
+    return tier->nr_shards != 0;
+}
+
+/**
+ * @brief Copy an object out of the tier
+ *
+ * @param tier DRAM tier
+ * @param id Data ID to look up
+ * @param dst Buffer to copy into
+ * @param max_len Bytes `dst` holds, a longer object is not copied
+ * @param[out] len Set to the bytes of object data on a hit, copied if at most `max_len`
+ * @return true on a hit
+ */
+bool
+zn_dram_tier_get(struct zn_dram_tier *tier, uint32_t id, unsigned char *dst, size_t max_len,
+                 size_t *len);
+
+/**
+ * @brief Add a copy of an object, making room if the shard is full
+ *
+ * Nothing happens if the ID is already held.
+ *
+ * @param tier DRAM tier
+ * @param id Data ID of the object
+ * @param data Object data, copied
+ * @param len Bytes of object data, at most the pool's buffer size
+ * @param[out] victim Set to the first entry that left to make room
+ * @return true if `victim` was set, it has to be passed to zn_dram_tier_release() until that
+ *         returns false
+ */
+bool
+zn_dram_tier_insert(struct zn_dram_tier *tier, uint32_t id, const unsigned char *data,
+                    size_t len, struct zn_dram_victim *victim);
+
+/**
+ * @brief Drop a victim once the device tier has taken it over
+ *
+ * @param tier DRAM tier
+ * @param[in,out] victim Victim from zn_dram_tier_insert(), set to the next victim of the same
+ *                       insert if there is one
+ * @return true if `victim` was set to another victim, which has to be released in turn
+ */
+bool
+zn_dram_tier_release(struct zn_dram_tier *tier, struct zn_dram_victim *victim);
+
+/**
+ * @brief Counters of the tier. Locks each shard in turn.
+ *
+ * @param tier DRAM tier
+ * @param[out] stats Filled in with the current counters
+ */
+void
+zn_dram_tier_get_stats(struct zn_dram_tier *tier, struct zn_dram_tier_stats *stats);
+
+#endif // ZN_DRAM_TIER_H
@@ -1,7 +1,9 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
 
+#include "readbuffer.h"
 #include "znbackend.h"
 
 // Forward declare zn_cache to avoid cyclic dependency
@@ -23,9 +25,11 @@ enum zn_io_type {
  * @brief Defines eviction policies
  */
 enum zn_evict_policy_type {
-    ZN_EVICT_ZONE = 0,         /**< Zone granularity eviction. */
+    ZN_EVICT_ZONE = 0,         /**< Zone granularity eviction, FIFO. */
     ZN_EVICT_PROMOTE_ZONE = 1, /**< Zone granularity eviction with promotion. */
     ZN_EVICT_CHUNK = 2,        /**< Chunk granularity eviction. */
+    ZN_EVICT_CHUNK_CLOCK = 3,  /**< Chunk granularity eviction, CLOCK (second chance) instead of LRU. */
+    ZN_EVICT_S3FIFO_ZONE = 4,  /**< Zone granularity eviction, S3-FIFO with zones on probation. */
 };
 
 /** Policy specific data */
@@ -58,3 +62,10 @@ zn_evict_policy_init(struct zn_evict_policy *policy, enum zn_evict_policy_type t
  */
 size_t
 zn_evict_policy_get_cache_size(struct zn_evict_policy *policy);
+
+/** @brief Get the hit counts of the policy's read buffer
+    @returns false if the policy does not buffer hits
+ */
+bool
+zn_evict_policy_get_read_buffer_stats(struct zn_evict_policy *policy,
+                                      struct zn_read_buffer_stats *stats);
@@ -5,30 +5,63 @@
 #include "glib.h"
 
 #include "cachemap.h"
+#include "readbuffer.h"
 #include "zone_state_manager.h"
 
 #include <stdint.h>
 
+/** Slot index that ends the LRU list */
+#define ZN_CHUNK_LRU_NONE UINT32_MAX
+
+/**
+ * @struct eviction_policy_chunk_slot
+ * @brief Record of one chunk on the device. The slot of an object's first chunk tracks the
+ * object and links it into the LRU list by slot index, so promoting and evicting an object
+ * neither allocates nor hashes.
+ */
+struct eviction_policy_chunk_slot {
+    struct zn_pair pair; /**< Object or extent starting at this chunk, while `pair.in_use` */
+    uint32_t lru_prev;   /**< Next less recently used object, ZN_CHUNK_LRU_NONE at the head
+                              and for slots outside the list */
+    uint32_t lru_next;   /**< Next more recently used object, ZN_CHUNK_LRU_NONE at the tail
+                              and for slots outside the list */
+    uint8_t referenced;  /**< Hit since the clock hand last passed, ZN_EVICT_CHUNK_CLOCK only.
+                              Set by readers without the policy lock. */
+};
+
 struct eviction_policy_chunk_zone {
     uint32_t zone_id;
-    struct zn_pair *chunks; /**< Pool of chunks, backing for lru */
-    uint32_t chunks_in_use;
+    struct eviction_policy_chunk_slot *chunks; /**< The zone's part of `slots`. An object is
+                                                    tracked in the slot of its first chunk, each
+                                                    further extent of an object in the slot of
+                                                    the extent's first chunk. */
+    uint32_t chunks_in_use; /**< Chunks held by objects in the zone */
     bool filled;
     struct zn_minheap_entry * pqueue_entry; /**< Entry in invalid_pqueue */
 };
 
 struct zn_policy_chunk {
-    // Tail is the end of the queue, head is the least recently used
-    GQueue lru_queue;             /**< Least Recently Used (LRU) queue of chunks for eviction. */
-    GHashTable *chunk_to_lru_map; /**< Hash table mapping chunks to locations in the LRU queue. */
-    GMutex policy_mutex;          /**< LRU lock */
+    // Tail is the end of the list, head is the least recently used. With `clock`, hits don't
+    // move objects, so the list is in write order and only tells which slots hold objects.
+    struct eviction_policy_chunk_slot *slots; /**< Slot of every chunk, zone after zone, slot
+                                                   index = zone * max_zone_chunks + chunk */
+    uint32_t lru_head;   /**< Slot of the least recently used object, or ZN_CHUNK_LRU_NONE */
+    uint32_t lru_tail;   /**< Slot of the most recently used object, or ZN_CHUNK_LRU_NONE */
+    uint32_t nr_objects; /**< Objects in the LRU list */
+    uint32_t nr_slots;
+    bool clock;          /**< Evict with a clock hand over the slots, see ZN_EVICT_CHUNK_CLOCK */
+    uint32_t clock_hand; /**< Slot the clock looks at next */
+    GMutex policy_mutex; /**< LRU lock */
+    struct zn_read_buffer read_buffer; /**< Hits not applied to the LRU list yet */
 
     struct zn_minheap * invalid_pqueue; /**< Priority queue keeping track of invalid zones */
 
     struct eviction_policy_chunk_zone *zone_pool; /**< Pool of zones, backing for lru */
 
     struct zn_cache *cache; /**< Shared pointer to cache (not owned by policy) */
-    uint32_t total_chunks;   /**< Number of chunks on disk */
+    uint64_t total_bytes;    /**< Bytes of chunks on disk */
+    uint64_t used_bytes;     /**< Bytes held by the objects in the LRU list, with all of
+                                  their extents */
 
     unsigned char *chunk_buf; /**< Buffer for use during GC */
 };
@@ -39,6 +72,12 @@ void
 zn_policy_chunk_update(policy_data_t policy, struct zn_pair location,
                              enum zn_io_type io_type);
 
+/** @brief Updates the chunk CLOCK policy, hits only set the reference bit of their chunk
+ */
+void
+zn_policy_chunk_clock_update(policy_data_t policy, struct zn_pair location,
+                             enum zn_io_type io_type);
+
 /** @brief Gets a chunk to evict.
     @returns the 0 on evict, 1 if no evict.
  */
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "eviction_policy.h"
+
+#include <stdint.h>
+
+/*
+ * FIFO at zone granularity.
+ *
+ * The zone state manager already queues zones in the order they are closed, see
+ * zsm_pop_full_zone(), so the policy keeps no state of its own: hits and writes are not
+ * recorded, and the oldest closed zone is evicted.
+ */
+
+struct zn_policy_fifo {
+    struct zn_cache *cache; /**< Shared pointer to cache (not owned by policy) */
+};
+
+/** @brief Updates the FIFO policy, which has nothing to update
+ */
+void
+zn_policy_fifo_update(policy_data_t policy, struct zn_pair location, enum zn_io_type io_type);
+
+/** @brief Gets a zone to evict.
+    @returns the oldest full zone, -1 if there are no full zones.
+ */
+int
+zn_policy_fifo_get_zone_to_evict(policy_data_t policy);
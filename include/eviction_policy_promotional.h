@@ -2,6 +2,7 @@
 
 #include "eviction_policy.h"
 #include "glib.h"
+#include "readbuffer.h"
 
 #include <stdint.h>
 
@@ -10,10 +11,9 @@ struct zn_policy_promotional {
     GQueue lru_queue;            /**< Least Recently Used (LRU) queue for zone eviction. */
     GHashTable *zone_to_lru_map; /**< Hash table mapping zones to locations in the LRU queue. */
     GMutex policy_mutex;         /**< LRU lock */
+    struct zn_read_buffer read_buffer; /**< Hits not applied to the LRU yet */
 
     struct zn_cache *cache; /**< Shared pointer to cache (not owned by policy) */
-
-    uint32_t zone_max_chunks; /**< Number of chunks in a zone */
 };
 
 /** @brief Updates the promotional LRU policy
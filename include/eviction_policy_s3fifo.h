@@ -0,0 +1,75 @@
+#pragma once
+
+#include "eviction_policy.h"
+#include "flatmap.h"
+#include "glib.h"
+
+#include <stdint.h>
+
+/*
+ * S3-FIFO at zone granularity.
+ *
+ * Zones are only written sequentially, so objects cannot be moved between queues one by one.
+ * A zone that fills up enters the small FIFO instead, on probation. When it reaches the head
+ * of the small FIFO, it moves to the main FIFO if enough of its objects were hit since it was
+ * written. Otherwise it is evicted and the IDs of its objects are remembered in a ghost FIFO.
+ * Objects missed again while they are ghosts are rewritten like any miss, and a zone filled
+ * mostly with them goes straight to the main FIFO. The main FIFO gives zones with enough hit
+ * objects another pass before they are evicted.
+ *
+ * Hits set a bit per object without taking the policy lock.
+ */
+
+/** Share of the zones kept in the small FIFO */
+#define ZN_S3FIFO_SMALL_PERCENT 10
+
+/** Share of a zone's objects that must be hit for the zone to move to, or stay in, main */
+#define ZN_S3FIFO_HIT_PERCENT 10
+
+/**
+ * @struct eviction_policy_s3fifo_object
+ * @brief An object written to a zone
+ */
+struct eviction_policy_s3fifo_object {
+    uint32_t id;
+    uint32_t chunk_offset;
+};
+
+struct eviction_policy_s3fifo_zone {
+    GArray *objects;          /**< struct eviction_policy_s3fifo_object, in write order */
+    uint8_t *hit;             /**< Per chunk, set when the object starting there is hit. Set by
+                                   readers without the policy lock. */
+    uint32_t nr_ghosts;       /**< Objects written that were ghosts */
+};
+
+struct zn_policy_s3fifo {
+    // Heads are the oldest zones
+    GQueue small;                /**< Zones on probation */
+    GQueue main;                 /**< Zones that were hit on probation, or filled with ghosts */
+    uint32_t small_zones;        /**< Zones the small FIFO holds before it is evicted from */
+    struct eviction_policy_s3fifo_zone *zones;
+
+    struct zn_flatmap ghosts;    /**< Data ID → position in `ghost_ring` */
+    uint32_t *ghost_ring;        /**< IDs evicted from the small FIFO, oldest overwritten */
+    uint32_t ghost_capacity;
+    uint64_t ghost_next;         /**< Position of the next ghost, counts up forever */
+
+    uint64_t nr_promoted;        /**< Zones moved from small to main */
+    uint64_t nr_ghost_admitted;  /**< Zones that went straight to main */
+    uint64_t nr_reinserted;      /**< Passes given to main zones */
+
+    GMutex policy_mutex;         /**< Protects everything above */
+    struct zn_cache *cache;      /**< Shared pointer to cache (not owned by policy) */
+};
+
+/** @brief Updates the S3-FIFO policy
+ */
+void
+zn_policy_s3fifo_update(policy_data_t policy, struct zn_pair location,
+                        enum zn_io_type io_type);
+
+/** @brief Gets a zone to evict.
+    @returns the zone to evict, -1 if there are no full zones.
+ */
+int
+zn_policy_s3fifo_get_zone_to_evict(policy_data_t policy);
@@ -0,0 +1,172 @@
+#ifndef ZN_EXTENT_MAP_H
+#define ZN_EXTENT_MAP_H
+
+#include <glib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "cachemap.h"
+#include "flatmap.h"
+#include "znbackend.h"
+
+/*
+ * Extents of objects too large for one extent of the cache map.
+ *
+ * Such an object is written as several extents, each in its own zone. The cache map holds the
+ * first extent (the head) like any other object, and this map holds the full list. An object
+ * without a list, or whose list does not start at its head, is a single extent.
+ *
+ * Evicting a zone drops every list with an extent in it, together with its head in the cache
+ * map, so an object is either readable as a whole or a miss. Readers take a reader count on
+ * the zone of every extent while they hold the map lock, so a zone whose lists were dropped
+ * cannot be reset under them.
+ */
+
+/** Most extents of one object */
+#define ZN_EXTENT_MAP_MAX_EXTENTS 8
+
+/**
+ * @struct zn_extent_list
+ * @brief The extents of one object, in the order of its data
+ */
+struct zn_extent_list {
+    uint32_t nr_extents;
+    struct zn_pair extents[ZN_EXTENT_MAP_MAX_EXTENTS]; /**< `extents[0]` is the head */
+};
+
+/**
+ * @struct zn_extent_map
+ * @brief Data ID → extent list, for objects of more than one extent
+ */
+struct zn_extent_map {
+    GMutex lock;              /**< Protects everything below */
+    struct zn_flatmap index;  /**< Data ID → struct zn_extent_list pointer */
+    GArray **zone_ids;        /**< IDs listed with an extent in each zone, possibly dropped since */
+    uint32_t nr_zones;
+    gint *active_readers;     /**< Non-owning, reader counts per zone shared with the cache map */
+    uint64_t nr_inserted;     /**< Lists inserted */
+    uint64_t nr_dropped;      /**< Lists dropped with an evicted zone */
+};
+
+/**
+ * @brief Whether the object of `list` has an extent at the start of `location`
+ */
+static inline bool
+zn_extent_list_contains(const struct zn_extent_list *list, const struct zn_pair *location) {
+    for (uint32_t i = 0; i < list->nr_extents; i++) {
+        if (list->extents[i].zone == location->zone &&
+            list->extents[i].chunk_offset == location->chunk_offset) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Chunks of all extents of `list`
+ */
+static inline uint64_t
+zn_extent_list_chunks(const struct zn_extent_list *list) {
+    uint64_t chunks = 0;
+    for (uint32_t i = 0; i < list->nr_extents; i++) {
+        chunks += list->extents[i].nr_chunks;
+    }
+    return chunks;
+}
+
+/**
+ * @brief Initialize an empty map
+ *
+ * @param map Map to initialize
+ * @param nr_zones Zones of the device
+ * @param active_readers Per-zone reader counts, owned by the caller
+ */
+void
+zn_extent_map_init(struct zn_extent_map *map, uint32_t nr_zones, gint *active_readers);
+
+/**
+ * @brief Free the lists and the index. No other thread may use the map.
+ */
+void
+zn_extent_map_destroy(struct zn_extent_map *map);
+
+/**
+ * @brief Add the list of a written object, replacing any list of its ID
+ *
+ * Call before the head is inserted into the cache map, and before the zones of the extents
+ * are returned to the zone state manager.
+ *
+ * @param map Extent map
+ * @param list Extents of the object, at least two, `extents[i].id` is the data ID
+ */
+void
+zn_extent_map_insert(struct zn_extent_map *map, const struct zn_extent_list *list);
+
+/**
+ * @brief Copy the list of the object whose head the cache map returned, and take a reader
+ * count on the zone of every extent after the head
+ *
+ * The caller holds the head's reader count from zn_cachemap_find(), and drops the others with
+ * zn_extent_map_release().
+ *
+ * @param map Extent map
+ * @param head Location from zn_cachemap_find()
+ * @param[out] list Set to the object's extents when found
+ * @return true if the object has a list starting at `head`
+ */
+bool
+zn_extent_map_acquire(struct zn_extent_map *map, const struct zn_pair *head,
+                      struct zn_extent_list *list);
+
+/**
+ * @brief Drop the reader counts taken by zn_extent_map_acquire()
+ *
+ * Evictions that do not wait for readers may reset the zone of an extent while it is read.
+ * They drop the list first, so data read while the list stayed in the map is whole.
+ *
+ * @return true if the object still has the same list
+ */
+bool
+zn_extent_map_release(struct zn_extent_map *map, const struct zn_extent_list *list);
+
+/**
+ * @brief Copy the list of the object with an extent at `location`, without taking reader counts
+ *
+ * @param map Extent map
+ * @param location Any extent, `location->id` is the data ID
+ * @param[out] list Set to the object's extents when found
+ * @return true if `location` is an extent of a listed object
+ */
+bool
+zn_extent_map_get(struct zn_extent_map *map, const struct zn_pair *location,
+                  struct zn_extent_list *list);
+
+/**
+ * @brief zn_extent_map_get(), and remove the list
+ *
+ * The head stays in the cache map, the caller clears it.
+ */
+bool
+zn_extent_map_remove(struct zn_extent_map *map, const struct zn_pair *location,
+                     struct zn_extent_list *list);
+
+/**
+ * @brief Drop the lists with an extent in `zone`, and their heads from the cache map
+ *
+ * Call after the zone's generation was bumped and before waiting for its readers to drain.
+ *
+ * @param map Extent map
+ * @param cache_map Cache map holding the heads
+ * @param zone Zone being evicted
+ * @return Number of lists dropped
+ */
+uint32_t
+zn_extent_map_clear_zone(struct zn_extent_map *map, struct zn_cachemap *cache_map, uint32_t zone);
+
+/**
+ * @brief Number of lists in the map
+ */
+uint32_t
+zn_extent_map_size(struct zn_extent_map *map);
+
+#endif // ZN_EXTENT_MAP_H
@@ -0,0 +1,181 @@
+#ifndef ZN_FLATMAP_H
+#define ZN_FLATMAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Open-addressing hash index from a uint32_t key to an inline uint64_t value.
+ *
+ * Slots are grouped into fixed-width groups, each with one control byte per slot. A control
+ * byte is either EMPTY, DELETED, or the low 7 bits of the key hash. A lookup compares a whole
+ * group of control bytes at once (SSE2, or AVX2 when available) and only touches the slots
+ * whose byte matches, so a hit normally costs one control load and one slot load.
+ *
+ * All modifications need external locking. zn_flatmap_find_concurrent() may run alongside
+ * a writer: a rehash publishes a new table instead of rebuilding in place, and the old
+ * table is kept on a retired list until the owner calls zn_flatmap_reclaim() once no
+ * concurrent reader can still be using it.
+ */
+
+#if defined(__AVX2__)
+#    define ZN_FLATMAP_GROUP_WIDTH 32
+#else
+#    define ZN_FLATMAP_GROUP_WIDTH 16
+#endif
+
+/**
+ * @struct zn_flatmap_slot
+ * @brief A key and its value, stored inline in the table.
+ */
+struct zn_flatmap_slot {
+    uint64_t value; /**< Opaque value owned by the caller */
+    uint32_t key;   /**< Key, only meaningful when the control byte is full */
+};
+
+/**
+ * @struct zn_flatmap_table
+ * @brief One generation of the table storage, replaced as a whole on rehash.
+ */
+struct zn_flatmap_table {
+    int8_t *ctrl;                  /**< One control byte per slot */
+    struct zn_flatmap_slot *slots; /**< Slot storage, `capacity` entries */
+    uint32_t capacity;             /**< Number of slots, a power of two >= group width */
+    struct zn_flatmap_table *next_retired; /**< Next table on the retired list */
+};
+
+/**
+ * @struct zn_flatmap
+ * @brief Flat hash index. Not thread-safe, callers provide their own locking.
+ */
+struct zn_flatmap {
+    struct zn_flatmap_table *table;   /**< Current table, published atomically */
+    struct zn_flatmap_table *retired; /**< Tables replaced by a rehash and not yet freed */
+    uint32_t capacity;                /**< Number of slots in the current table */
+    uint32_t size;                    /**< Number of full slots */
+    uint32_t tombstones;              /**< Number of DELETED slots */
+};
+
+/**
+ * @brief Initializes an empty map
+ *
+ * @param map Map to initialize
+ * @param capacity Minimum number of slots to allocate up front
+ */
+void
+zn_flatmap_init(struct zn_flatmap *map, uint32_t capacity);
+
+/**
+ * @brief Frees the table storage
+ *
+ * @param map Map to destroy
+ */
+void
+zn_flatmap_destroy(struct zn_flatmap *map);
+
+/**
+ * @brief Looks up a key
+ *
+ * @param map Map to search
+ * @param key Key to find
+ * @return Pointer to the inline value, or NULL if not present. The pointer is invalidated
+ *         by the next insert or erase.
+ */
+uint64_t *
+zn_flatmap_find(struct zn_flatmap *map, uint32_t key);
+
+/**
+ * @brief Looks up a key without holding the writer's lock
+ *
+ * Safe to call while another thread modifies the map, but the result may be stale or
+ * combine a key with a value written for a different key. Callers must validate it, e.g.
+ * with a sequence counter that writers bump around every change that matters to them.
+ *
+ * @param map Map to search
+ * @param key Key to find
+ * @param[out] value Copy of the value, only set when the key was found
+ * @return true if the key was found
+ */
+bool
+zn_flatmap_find_concurrent(const struct zn_flatmap *map, uint32_t key, uint64_t *value);
+
+/**
+ * @brief Finds a key, inserting it with `value` if it is not present
+ *
+ * @param map Map to insert into
+ * @param key Key to insert
+ * @param value Value of the key if it is inserted, left alone if the key was present
+ * @param[out] inserted Set to true if the key was not present before the call
+ * @return Pointer to the inline value. The pointer is invalidated by the next insert or erase.
+ *
+ * Concurrent readers see the new slot only after its value and then its key are written, so a
+ * reader that finds the key never reads the value a reused slot held before. If the insert
+ * rehashes, the old table moves to the retired list.
+ */
+uint64_t *
+zn_flatmap_insert(struct zn_flatmap *map, uint32_t key, uint64_t value, bool *inserted);
+
+/**
+ * @brief Removes a key
+ *
+ * @param map Map to remove from
+ * @param key Key to remove
+ * @return true if the key was present
+ */
+bool
+zn_flatmap_erase(struct zn_flatmap *map, uint32_t key);
+
+/**
+ * @brief Erases every key for which `keep` returns false
+ *
+ * @param map Map to filter
+ * @param keep Predicate receiving the key, its value, and `user_data`
+ * @param user_data Passed through to `keep`
+ * @return Number of keys erased
+ */
+uint32_t
+zn_flatmap_retain(struct zn_flatmap *map, bool (*keep)(uint32_t key, uint64_t value, void *user_data),
+                  void *user_data);
+
+/**
+ * @brief Whether any replaced tables are waiting to be freed
+ *
+ * @param map Map to check
+ * @return true if zn_flatmap_reclaim() has work to do
+ */
+bool
+zn_flatmap_has_retired(const struct zn_flatmap *map);
+
+/**
+ * @brief Frees the tables replaced by earlier rehashes
+ *
+ * The caller must ensure no zn_flatmap_find_concurrent() call that started before the
+ * rehash is still running.
+ *
+ * @param map Map to reclaim from
+ */
+void
+zn_flatmap_reclaim(struct zn_flatmap *map);
+
+/**
+ * @brief Bytes of memory held by the table
+ *
+ * @param map Map to measure
+ * @return Size of the control and slot arrays in bytes, including retired tables
+ */
+size_t
+zn_flatmap_memory(const struct zn_flatmap *map);
+
+/**
+ * @brief Calls `fn` for every key in the map. The map must not be modified during iteration.
+ *
+ * @param map Map to iterate
+ * @param fn Callback receiving the key, a pointer to the inline value, and `user_data`
+ * @param user_data Passed through to `fn`
+ */
+void
+zn_flatmap_foreach(struct zn_flatmap *map, void (*fn)(uint32_t key, uint64_t *value, void *user_data),
+                   void *user_data);
+
+#endif // ZN_FLATMAP_H
@@ -0,0 +1,114 @@
+#ifndef ZN_READ_BUFFER_H
+#define ZN_READ_BUFFER_H
+
+#include <glib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "znbackend.h"
+
+/*
+ * Lossy buffers of hits for an eviction policy.
+ *
+ * Recording recency under the policy lock would serialize every hit. Instead, a hit is
+ * appended to the ring of the calling thread's stripe without taking a lock, and the policy
+ * applies the rings in batches while it holds its lock anyway: on writes, before evicting,
+ * and when a reader finds its ring half full and the lock free. A hit is dropped when its
+ * ring is full or another thread claims the same entry first, which only costs recency.
+ *
+ * Hits may be applied after their object was evicted or moved, so the policy has to ignore
+ * locations it no longer holds.
+ */
+
+/** Rings of a read buffer, threads are spread over them */
+#define ZN_READ_BUFFER_STRIPES 16
+
+/**
+ * @struct zn_read_buffer_entry
+ * @brief One recorded hit
+ */
+struct zn_read_buffer_entry {
+    struct zn_pair location;
+    gint seq; /**< Write index + 1 of the hit, once `location` is published */
+};
+
+/**
+ * @struct zn_read_buffer_stripe
+ * @brief Ring of hits shared by the threads of one stripe
+ */
+struct zn_read_buffer_stripe {
+    gint writes;     /**< Entries claimed by readers */
+    gint reads;      /**< Entries drained, only advanced by the holder of the policy lock */
+    gint nr_dropped; /**< Hits lost to a full or contended ring */
+    struct zn_read_buffer_entry *entries;
+} __attribute__((aligned(64)));
+
+/**
+ * @struct zn_read_buffer
+ * @brief Striped rings of hits, drained by the holder of the policy lock
+ */
+struct zn_read_buffer {
+    struct zn_read_buffer_stripe stripes[ZN_READ_BUFFER_STRIPES];
+    uint32_t capacity;   /**< Entries per ring, a power of two, or 0 when hits are not buffered */
+    uint64_t nr_drains;  /**< Drains that applied at least one hit */
+    uint64_t nr_applied; /**< Hits applied to the policy */
+};
+
+/**
+ * @struct zn_read_buffer_stats
+ * @brief Hits that went through a buffer, see zn_read_buffer_get_stats()
+ */
+struct zn_read_buffer_stats {
+    uint64_t nr_applied; /**< Hits applied to the policy */
+    uint64_t nr_dropped; /**< Hits lost, the policy never saw them */
+    uint64_t nr_drains;  /**< Batches the applied hits came in */
+};
+
+/** Applies one hit to the policy, called with the policy lock held */
+typedef void (*zn_read_buffer_apply_t)(void *policy, struct zn_pair location);
+
+/**
+ * @brief Initialize the buffer
+ *
+ * @param capacity Entries per ring, rounded up to a power of two, 0 to not buffer hits
+ */
+void
+zn_read_buffer_init(struct zn_read_buffer *buffer, uint32_t capacity);
+
+void
+zn_read_buffer_destroy(struct zn_read_buffer *buffer);
+
+/**
+ * @brief Whether hits go through the buffer, rather than straight to the policy
+ */
+static inline bool
+zn_read_buffer_enabled(const struct zn_read_buffer *buffer) {
+    return buffer->capacity > 0;
+}
+
+/**
+ * @brief Append a hit to the calling thread's ring, or drop it
+ *
+ * @return Whether the ring is at least half full, so the caller should drain the buffer if
+ *     it can take the policy lock without waiting
+ */
+bool
+zn_read_buffer_record(struct zn_read_buffer *buffer, struct zn_pair location);
+
+/**
+ * @brief Apply the published hits of every ring to the policy, oldest first per ring
+ * @note Assumes that the policy lock is held
+ *
+ * @return Hits applied
+ */
+uint32_t
+zn_read_buffer_drain(struct zn_read_buffer *buffer, zn_read_buffer_apply_t apply, void *policy);
+
+/**
+ * @brief Get the hit counts of the buffer
+ * @note Assumes that the policy lock is held
+ */
+void
+zn_read_buffer_get_stats(struct zn_read_buffer *buffer, struct zn_read_buffer_stats *stats);
+
+#endif // ZN_READ_BUFFER_H
@@ -0,0 +1,204 @@
+#ifndef ZN_SMALL_CACHE_H
+#define ZN_SMALL_CACHE_H
+
+#include <glib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "flatmap.h"
+#include "znbackend.h"
+#include "znbuf.h"
+#include "znio.h"
+#include "zone_state_manager.h"
+
+/*
+ * Set-associative cache for objects far smaller than a chunk, in the style of Kangaroo.
+ *
+ * Every ID hashes to one set, a ZN_SMALL_SET_SIZE page holding as many objects as fit. The
+ * pages are appended to zones of the engine's own zone state manager, so rewriting a set
+ * writes a new page and leaves the old one stale. DRAM holds the page of each set, a small
+ * Bloom filter over its IDs and a hit bit per object. That is a few bits per object instead
+ * of a cache map entry per ID.
+ *
+ * New objects go to a small DRAM log, partitioned by set. When a partition is over its share
+ * of the log, the set of its oldest object is rewritten with every logged object of that set,
+ * so one page write admits several objects. When a set overflows, objects hit since their
+ * page was written are kept first, then the logged objects, then the objects never hit.
+ *
+ * Zones are reclaimed in the order they filled up. Sets whose page is still in the reclaimed
+ * zone are dropped, as if their objects were evicted.
+ */
+
+/** Bytes per set, one page on the device */
+#define ZN_SMALL_SET_SIZE 4096
+
+/** Lock partitions of the log and the sets */
+#define ZN_SMALL_PARTITIONS 64
+
+/** Share of the pages that hold live sets, the rest keeps reclaimed zones mostly stale */
+#define ZN_SMALL_SETS_PERCENT 50
+
+/** Words of Bloom filter per set */
+#define ZN_SMALL_BLOOM_WORDS 4
+
+/** Objects per set with a hit bit, later objects of a page count as not hit */
+#define ZN_SMALL_HIT_BITS 64
+
+/**
+ * @struct zn_small_page_header
+ * @brief Start of a set page on the device
+ */
+struct zn_small_page_header {
+    uint32_t set;        /**< Set the page was written for, checked by lookups */
+    uint16_t nr_records; /**< Objects in the page */
+    uint16_t bytes;      /**< Bytes used, including this header */
+};
+
+/**
+ * @struct zn_small_record
+ * @brief Header of an object in a set page, followed by its data
+ */
+struct zn_small_record {
+    uint32_t id;  /**< Fingerprint of the key, the key is in the object header */
+    uint16_t len; /**< Bytes of object data */
+    uint16_t reserved;
+};
+
+/** Largest object, alone in its set page */
+#define ZN_SMALL_OBJECT_MAX                                                                        \
+    (ZN_SMALL_SET_SIZE - sizeof(struct zn_small_page_header) - sizeof(struct zn_small_record))
+
+/**
+ * @struct zn_small_log_entry
+ * @brief An object in the DRAM log, waiting for its set to be rewritten
+ */
+struct zn_small_log_entry {
+    uint32_t id;
+    uint32_t set;
+    uint16_t len;          /**< Bytes of object data */
+    unsigned char data[];  /**< `len` bytes */
+};
+
+/**
+ * @struct zn_small_partition
+ * @brief The log and the sets of one lock partition, set `s` belongs to `s % ZN_SMALL_PARTITIONS`
+ */
+struct zn_small_partition {
+    GMutex lock;              /**< Protects the log and the DRAM metadata of the sets */
+    struct zn_flatmap index;  /**< Data ID → log entry pointer */
+    GQueue log;               /**< Log entries, oldest at the head */
+    size_t log_bytes;         /**< Bytes of the logged objects, with their record headers */
+    uint64_t hits;
+    uint64_t lookups;
+    uint64_t set_writes;      /**< Set pages written */
+    uint64_t objects_flushed; /**< Logged objects written to set pages */
+} __attribute__((aligned(64)));
+
+/**
+ * @struct zn_small_cache
+ * @brief The small object engine of a cache
+ */
+struct zn_small_cache {
+    struct zone_state_manager zones; /**< Zones of the engine, one set page per chunk */
+    struct zn_io *io;                /**< Non-owning, shared with the chunk engine */
+    struct zn_buffer_pool *buffers;  /**< Non-owning, buffers of at least a set page */
+    uint32_t nr_sets;                /**< 0 when the engine is disabled */
+    uint32_t pages_per_zone;
+    size_t log_capacity;             /**< Bytes a partition logs before a set is rewritten */
+    uint32_t *set_page;              /**< Page of each set plus one, 0 for an empty set */
+    uint32_t *page_set;              /**< Set each page was written for, UINT32_MAX if none */
+    uint64_t *blooms;                /**< ZN_SMALL_BLOOM_WORDS per set, over the IDs of its page */
+    uint64_t *hit_bits;              /**< Objects of each set's page hit since it was written */
+    struct zn_small_partition partitions[ZN_SMALL_PARTITIONS];
+    GMutex reclaim_lock;             /**< One thread reclaims a zone at a time */
+    uint64_t zones_reclaimed;        /**< Under the reclaim lock */
+    uint64_t sets_dropped;           /**< Under the reclaim lock */
+};
+
+/**
+ * @struct zn_small_cache_stats
+ * @brief Counters summed over the partitions, see zn_small_cache_get_stats()
+ */
+struct zn_small_cache_stats {
+    uint64_t nr_sets;
+    uint64_t nr_logged;       /**< Objects in the DRAM log now */
+    uint64_t hits;            /**< Lookups served from the log or a set page */
+    uint64_t lookups;         /**< All lookups */
+    uint64_t set_writes;      /**< Set pages written */
+    uint64_t objects_flushed; /**< Logged objects written to set pages */
+    uint64_t zones_reclaimed;
+    uint64_t sets_dropped;    /**< Sets lost with a reclaimed zone */
+    size_t metadata_bytes;    /**< DRAM held per set and per page */
+};
+
+/**
+ * @brief Set up the small object engine on a range of zones
+ *
+ * @param sc Engine to initialize
+ * @param io I/O engine of the device
+ * @param buffers Pool of buffers of at least ZN_SMALL_SET_SIZE bytes, owned by the caller
+ * @param fd Device file descriptor
+ * @param backend Type of the device
+ * @param zone_base First device zone of the engine
+ * @param nr_zones Zones of the engine, the engine is disabled at 0
+ * @param zone_size Size of a device zone in bytes
+ * @param zone_cap Writable bytes of a device zone
+ * @param log_size Bytes of objects held in the DRAM log
+ */
+void
+zn_small_cache_init(struct zn_small_cache *sc, struct zn_io *io, struct zn_buffer_pool *buffers,
+                    int fd, enum zn_backend backend, uint32_t zone_base, uint32_t nr_zones,
+                    uint64_t zone_size, uint64_t zone_cap, size_t log_size);
+
+/**
+ * @brief Free the log and the DRAM metadata. No other thread may use the engine.
+ */
+void
+zn_small_cache_destroy(struct zn_small_cache *sc);
+
+/**
+ * @brief Whether the cache has a small object engine
+ */
+static inline bool
+zn_small_cache_enabled(const struct zn_small_cache *sc) {
+    return sc->nr_sets != 0;
+}
+
+/**
+ * @brief Copy an object out of the log or its set page
+ *
+ * @param sc Small object engine
+ * @param id Data ID to look up
+ * @param dst Room for the object, at most ZN_SMALL_OBJECT_MAX bytes
+ * @param[out] len Set to the bytes of object data on a hit
+ * @return true on a hit
+ */
+bool
+zn_small_cache_get(struct zn_small_cache *sc, uint32_t id, unsigned char *dst, size_t *len);
+
+/**
+ * @brief Add an object to the log, rewriting sets of its partition while the log is over
+ * its share
+ *
+ * Nothing happens if the ID is already logged.
+ *
+ * @param sc Small object engine
+ * @param id Data ID of the object
+ * @param data Object data, copied
+ * @param len Bytes of object data, at most ZN_SMALL_OBJECT_MAX
+ */
+void
+zn_small_cache_insert(struct zn_small_cache *sc, uint32_t id, const unsigned char *data,
+                      size_t len);
+
+/**
+ * @brief Counters of the engine. Locks each partition in turn.
+ *
+ * @param sc Small object engine
+ * @param[out] stats Filled in with the current counters
+ */
+void
+zn_small_cache_get_stats(struct zn_small_cache *sc, struct zn_small_cache_stats *stats);
+
+#endif // ZN_SMALL_CACHE_H
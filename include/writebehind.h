@@ -0,0 +1,95 @@
+#ifndef ZN_WRITE_BEHIND_H
+#define ZN_WRITE_BEHIND_H
+
+#include <glib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Write-behind completion of misses. The thread that fetched a miss hands a copy of the data
+ * to a pool of writer threads and returns right away. Until the writer has put the chunk on
+ * the device and published its location, lookups of the ID are served from that copy.
+ */
+
+/** Jobs queued per writer thread before misses wait for the writers to catch up */
+#define ZN_WRITE_BEHIND_PENDING_PER_THREAD 8
+
+struct zn_cache;
+
+/**
+ * @struct zn_write_behind_stats
+ * @brief Counters, see zn_write_behind_get_stats()
+ */
+struct zn_write_behind_stats {
+    uint64_t nr_writes;  /**< Misses written by the pool */
+    uint64_t nr_failed;  /**< Misses the pool could not write, later lookups miss again */
+    uint64_t nr_stalls;  /**< Submissions that waited for a free pending slot */
+};
+
+/**
+ * @struct zn_write_behind
+ * @brief Writer pool of a cache
+ */
+struct zn_write_behind {
+    struct zn_cache *cache;    /**< Non-owning */
+    GThreadPool *pool;         /**< Writer threads, NULL when write-behind is disabled */
+    uint32_t max_pending;      /**< Jobs queued or being written at most */
+
+    GMutex lock;               /**< Protects `pending` and `stats` */
+    GCond cond;                /**< Signalled when a job completes */
+    uint32_t pending;          /**< Jobs queued or being written */
+    struct zn_write_behind_stats stats;
+};
+
+/**
+ * @brief Start the writer pool of a cache
+ *
+ * @param wb Write-behind state to initialize
+ * @param cache Cache the misses belong to, its cache map must use `cache->buffers`
+ * @param nr_threads Writer threads, 0 disables write-behind
+ */
+void
+zn_write_behind_init(struct zn_write_behind *wb, struct zn_cache *cache, uint32_t nr_threads);
+
+/**
+ * @brief Wait until every submitted write has completed
+ */
+void
+zn_write_behind_drain(struct zn_write_behind *wb);
+
+/**
+ * @brief Wait for every queued write to complete and stop the writers
+ */
+void
+zn_write_behind_destroy(struct zn_write_behind *wb);
+
+/**
+ * @brief Whether misses are completed by the writer pool
+ */
+static inline bool
+zn_write_behind_enabled(const struct zn_write_behind *wb) {
+    return wb->pool != NULL;
+}
+
+/**
+ * @brief Queue the write of a miss. Blocks while the pool is too far behind.
+ *
+ * @param wb Write-behind state
+ * @param id Data ID the caller got RESULT_COND for
+ * @param data Object fetched for `id`, copied before returning
+ * @param len Bytes of object data, a multiple of the chunk size
+ */
+void
+zn_write_behind_submit(struct zn_write_behind *wb, uint32_t id, const unsigned char *data,
+                       size_t len);
+
+/**
+ * @brief Write-behind counters
+ *
+ * @param wb Write-behind state
+ * @param[out] stats Filled in with the current counters
+ */
+void
+zn_write_behind_get_stats(struct zn_write_behind *wb, struct zn_write_behind_stats *stats);
+
+#endif // ZN_WRITE_BEHIND_H
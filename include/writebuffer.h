@@ -0,0 +1,180 @@
+#ifndef ZN_WRITE_BUFFER_H
+#define ZN_WRITE_BUFFER_H
+
+#include <glib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "zone_state_manager.h"
+
+/*
+ * Log-structured DRAM write buffer in front of the zone state manager. Misses copy their
+ * object into a segment, a batch of consecutive chunks of one zone reserved as a single writer,
+ * and the segment is written to the device in one I/O once every slot is filled. An object
+ * takes as many consecutive slots as it spans chunks.
+ *
+ * A chunk's location is published in the cache map as soon as its data is in the segment, and
+ * hits on it are served from DRAM until the flush completes. The eviction policy and the zone
+ * state only learn about the chunks after the flush, so nothing can evict or relocate a chunk
+ * that is not on the device yet.
+ */
+
+struct zn_cache;
+
+/**
+ * @struct zn_write_segment
+ * @brief DRAM copy of a batch of consecutive chunks of one zone
+ */
+struct zn_write_segment {
+    unsigned char *data;       /**< `nr_chunks` chunks, ZN_DIRECT_ALIGNMENT aligned */
+    uint32_t *ids;             /**< Data ID of the object starting at each slot */
+    uint32_t *extents;         /**< Chunks spanned by the object starting at each slot */
+    struct zn_pair start;      /**< Zone and first chunk of the batch reservation */
+    uint32_t nr_chunks;        /**< Chunks reserved */
+    uint32_t taken;            /**< Slots handed out, under the buffer lock */
+    bool open;                 /**< Slots can still be taken, under the buffer lock. Closed
+                                    when an object does not fit in the slots left */
+    gint filled;               /**< Slots whose data and cache map entry are in place */
+    gint flushing;             /**< Claimed by the thread that writes the segment */
+    gint readers;              /**< Hits copying a chunk out of `data` */
+    struct zn_write_segment *next; /**< Next segment on the free or used list */
+};
+
+/**
+ * @struct zn_write_buffer_slot
+ * @brief Consecutive chunks of a segment, handed to a miss by zn_write_buffer_reserve()
+ */
+struct zn_write_buffer_slot {
+    struct zn_write_segment *segment;
+    uint32_t index;          /**< First slot within the segment */
+    struct zn_pair location; /**< Where the object will be on the device */
+};
+
+/**
+ * @struct zn_write_buffer_stats
+ * @brief Flush counters, see zn_write_buffer_get_stats()
+ */
+struct zn_write_buffer_stats {
+    uint64_t nr_flushes;   /**< Segments written */
+    uint64_t nr_partial;   /**< Segments written before every reserved chunk was filled */
+    uint64_t nr_chunks;    /**< Chunks written */
+    uint64_t nr_failed;    /**< Segments whose write failed */
+};
+
+/**
+ * @struct zn_write_buffer
+ * @brief Segments of a cache, one per active zone at most
+ */
+struct zn_write_buffer {
+    struct zn_cache *cache;      /**< Non-owning, provides the zones, I/O engine, map and policy */
+    uint32_t segment_chunks;     /**< Chunks per segment, 0 when the buffer is disabled */
+    size_t io_size;              /**< Largest single write of a flush */
+    uint32_t nr_segments;        /**< Segments in `segments` */
+    struct zn_write_segment *segments; /**< Backing array, segment data is allocated on first use */
+
+    GMutex lock;                 /**< Protects the lists, `taken`, `open` and `stats` */
+    struct zn_write_segment *free; /**< Segments not holding a reservation */
+    struct zn_write_segment *used; /**< Open and flushing segments */
+    gint *zone_segments;         /**< Zone ID → used segments in that zone, read without the lock */
+    struct zn_write_buffer_stats stats;
+};
+
+/**
+ * @brief Set up the write buffer of a cache
+ *
+ * @param wb Write buffer to initialize
+ * @param cache Cache the buffer belongs to, its zone state and I/O engine must be set up
+ * @param segment_size Bytes per segment, the buffer is disabled below two chunks and raised
+ *                     to fit the largest object
+ * @param nr_segments Most segments reserved at once
+ */
+void
+zn_write_buffer_init(struct zn_write_buffer *wb, struct zn_cache *cache, size_t segment_size,
+                     uint32_t nr_segments);
+
+/**
+ * @brief Free the segments. Flush them first with zn_write_buffer_flush_all().
+ */
+void
+zn_write_buffer_destroy(struct zn_write_buffer *wb);
+
+/**
+ * @brief Whether misses go through the write buffer
+ */
+static inline bool
+zn_write_buffer_enabled(const struct zn_write_buffer *wb) {
+    return wb->segment_chunks != 0;
+}
+
+/**
+ * @brief Take slots in an open segment, reserving a new segment if none has room
+ *
+ * @param wb Write buffer
+ * @param nr_chunks Chunks the object spans, at most `segment_chunks`
+ * @param[out] slot Slot to fill with zn_write_buffer_fill()
+ * @return Same as zsm_get_active_zone(), ZSM_GET_ACTIVE_ZONE_RETRY also when every segment is
+ *         being flushed
+ */
+enum zsm_get_active_zone_error
+zn_write_buffer_reserve(struct zn_write_buffer *wb, uint32_t nr_chunks,
+                        struct zn_write_buffer_slot *slot);
+
+/**
+ * @brief Copy an object into its slots. Publish `slot->location` in the cache map afterwards,
+ * then hand the slot back with zn_write_buffer_commit().
+ *
+ * @param wb Write buffer
+ * @param slot Slot from zn_write_buffer_reserve()
+ * @param id Data ID of the object
+ * @param data `slot->location.nr_chunks` chunks to buffer
+ */
+void
+zn_write_buffer_fill(struct zn_write_buffer *wb, struct zn_write_buffer_slot *slot, uint32_t id,
+                     const unsigned char *data);
+
+/**
+ * @brief Mark a slot as complete. The thread that completes a closed segment flushes it.
+ *
+ * @param wb Write buffer
+ * @param slot Slot passed to zn_write_buffer_fill()
+ */
+void
+zn_write_buffer_commit(struct zn_write_buffer *wb, struct zn_write_buffer_slot *slot);
+
+/**
+ * @brief Copy an object that has not been flushed yet
+ *
+ * @param wb Write buffer
+ * @param location Location from the cache map
+ * @param dst `location->nr_chunks` chunks to copy into
+ * @return true if the chunk was copied, false if it has to be read from the device
+ */
+bool
+zn_write_buffer_read(struct zn_write_buffer *wb, const struct zn_pair *location,
+                     unsigned char *dst);
+
+/**
+ * @brief Stop the open segment from taking more chunks, so it is flushed once its slots are
+ * filled. Used when zones run out, so reservations held by segments are given back.
+ *
+ * @return true if a segment was closed
+ */
+bool
+zn_write_buffer_flush_open(struct zn_write_buffer *wb);
+
+/**
+ * @brief Flush every segment. No other thread may be using the buffer.
+ */
+void
+zn_write_buffer_flush_all(struct zn_write_buffer *wb);
+
+/**
+ * @brief Flush counters
+ *
+ * @param wb Write buffer
+ * @param[out] stats Filled in with the current counters
+ */
+void
+zn_write_buffer_get_stats(struct zn_write_buffer *wb, struct zn_write_buffer_stats *stats);
+
+#endif // ZN_WRITE_BUFFER_H
@@ -22,7 +22,8 @@ enum zn_backend {
 struct zn_pair {
     uint32_t zone;         /**< Identifier of the zone where the data is stored. */
     uint32_t chunk_offset; /**< Offset within the zone where the data chunk is located. */
-    uint32_t id;           /**< Unique ID */
+    uint32_t nr_chunks;    /**< Consecutive chunks the object spans, starting at `chunk_offset`. */
+    uint32_t id;           /**< Fingerprint of the key, see zn_key_fingerprint() */
     bool in_use;           /**< Defines if ze_pair is in use. */
 };
 
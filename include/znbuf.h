@@ -0,0 +1,138 @@
+#ifndef ZN_BUF_H
+#define ZN_BUF_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Pool of O_DIRECT aligned data buffers in size classes, from ZN_DIRECT_ALIGNMENT doubling up
+ * to the pool's buffer size. Buffers are carved out of mmap'd slabs that are never returned to
+ * the system while the pool exists, so getting and putting a buffer does not allocate in the
+ * common case.
+ *
+ * Each class maps its slabs into its own reserved range of address space, so a buffer is put
+ * back without its size.
+ *
+ * Each thread keeps a small cache of free buffers, so gets and puts only lock the pool when
+ * the cache runs empty or overflows. A slab is faulted in by the thread that needs it, which
+ * places its pages on that thread's NUMA node under the default first-touch policy. Slabs can
+ * optionally be backed by huge pages.
+ */
+
+/** Bytes per slab, at least one buffer. A multiple of the huge page size. */
+#define ZN_BUFFER_SLAB_SIZE (2u << 20)
+
+/** Free buffers of each class a thread keeps before giving half of them back to the pool */
+#define ZN_BUFFER_THREAD_CACHE 32
+
+/** Size classes of a pool at most */
+#define ZN_BUFFER_MAX_CLASSES 24
+
+/** Address space reserved for each class, the bytes of buffers of one class at most */
+#define ZN_BUFFER_CLASS_SPAN (UINT64_C(64) << 30)
+
+struct zn_buffer_arena;
+
+/** Called with the memory of each slab of a pool, see zn_buffer_pool_watch_slabs() */
+typedef void (*zn_buffer_slab_fn)(void *user_data, void *base, size_t len);
+
+/**
+ * @struct zn_buffer_pool
+ * @brief Buffers of a few sizes shared by all threads
+ */
+struct zn_buffer_pool {
+    size_t buffer_size;            /**< Size of the largest buffers, a multiple of the alignment */
+    uint32_t buffers_per_slab;     /**< Buffers of `buffer_size` carved out of each slab */
+    uint32_t nr_classes;           /**< Buffer sizes, the last one is `buffer_size` */
+    bool hugepages;                /**< Slabs are requested as huge pages */
+    struct zn_buffer_arena *arena; /**< Slabs and shared free list, outlives the pool while
+                                        thread caches still reference it */
+};
+
+/**
+ * @struct zn_buffer_pool_stats
+ * @brief Memory held by a pool, see zn_buffer_pool_get_stats()
+ */
+struct zn_buffer_pool_stats {
+    uint64_t nr_slabs;    /**< Slabs mapped, of every class */
+    uint64_t nr_buffers;  /**< Buffers carved out of the slabs, of every class */
+    size_t total_bytes;   /**< Bytes mapped for slabs */
+    bool hugepages;       /**< At least one slab is backed by huge pages */
+};
+
+/**
+ * @brief Initialize a buffer pool
+ *
+ * @param pool Pool to initialize
+ * @param buffer_size Size of the largest buffers in bytes, a multiple of ZN_DIRECT_ALIGNMENT
+ * @param hugepages Back slabs with huge pages, falls back to regular pages if none are free
+ */
+void
+zn_buffer_pool_init(struct zn_buffer_pool *pool, size_t buffer_size, bool hugepages);
+
+/**
+ * @brief Release a pool. Buffers must not be used afterwards, whether or not they were put
+ * back. The memory is unmapped once every thread cache that referenced it is gone.
+ *
+ * @param pool Pool to destroy
+ */
+void
+zn_buffer_pool_destroy(struct zn_buffer_pool *pool);
+
+/**
+ * @brief Take a buffer of the largest class from the pool
+ *
+ * @param pool Pool to take from
+ * @return A `buffer_size` buffer aligned to ZN_DIRECT_ALIGNMENT, never NULL
+ */
+unsigned char *
+zn_buffer_get(struct zn_buffer_pool *pool);
+
+/**
+ * @brief Take a buffer of the smallest class that holds `size` bytes
+ *
+ * @param pool Pool to take from
+ * @param size Bytes needed, at most `buffer_size`
+ * @return A buffer aligned to ZN_DIRECT_ALIGNMENT, never NULL
+ */
+unsigned char *
+zn_buffer_get_size(struct zn_buffer_pool *pool, size_t size);
+
+/**
+ * @brief Usable bytes of a buffer taken from the pool, the size of its class
+ */
+size_t
+zn_buffer_size(struct zn_buffer_pool *pool, const unsigned char *buffer);
+
+/**
+ * @brief Return a buffer taken with zn_buffer_get() or zn_buffer_get_size(), from any thread
+ *
+ * @param pool Pool the buffer came from
+ * @param buffer Buffer to return, may be NULL
+ */
+void
+zn_buffer_put(struct zn_buffer_pool *pool, unsigned char *buffer);
+
+/**
+ * @brief Call `fn` with every slab the pool has mapped, and with each slab it maps later before
+ * any of its buffers is handed out. Used to register the slabs with the I/O engine.
+ * @note `fn` is called with the pool lock held, and a pool takes one watcher
+ *
+ * @param pool Pool to watch
+ * @param fn Called with `user_data` and the slab
+ * @param user_data Passed to `fn`
+ */
+void
+zn_buffer_pool_watch_slabs(struct zn_buffer_pool *pool, zn_buffer_slab_fn fn, void *user_data);
+
+/**
+ * @brief Memory held by the pool
+ *
+ * @param pool Pool to inspect
+ * @param[out] stats Filled in with the current totals
+ */
+void
+zn_buffer_pool_get_stats(struct zn_buffer_pool *pool, struct zn_buffer_pool_stats *stats);
+
+#endif // ZN_BUF_H
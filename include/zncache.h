@@ -7,9 +7,17 @@
 #include <libzbd/zbd.h>
 
 #include "cachemap.h"
+#include "dramtier.h"
+#include "extentmap.h"
+#include "smallcache.h"
+#include "writebehind.h"
+#include "writebuffer.h"
 #include "zone_state_manager.h"
 #include "eviction_policy.h"
 #include "znbackend.h"
+#include "znbuf.h"
+#include "znio.h"
+#include "znkey.h"
 #include "znprofiler.h"
 
 #define PRINT_THRESH_PERCENT 1
@@ -20,6 +28,12 @@
 
 #define MAX_OPEN_ZONES 14
 
+/** Bytes of small objects logged in DRAM before their sets are rewritten, see SMALL_OBJECT_ZONES */
+#define SMALL_OBJECT_LOG_SIZE (16 * 1024 * 1024)
+
+/** Alignment of every data buffer, required for O_DIRECT I/O */
+#define ZN_DIRECT_ALIGNMENT 4096
+
 /**
  * @struct zn_reader
  * @brief Manages concurrent read operations within the cache.
@@ -31,14 +45,17 @@ struct zn_reader {
     GMutex lock;             /**< Mutex to synchronize access to the reader state. */
     uint64_t workload_index; /**< Index of the workload associated with the reader. */
     uint32_t* workload_buffer;
+    struct zn_key *workload_keys; /**< Keys of a byte-string workload, or NULL for the IDs */
     uint64_t workload_max;
     uint64_t thresh_perc; /**< The next percentage to report numbers at */
 };
 
 struct zn_cache_hitratio {
     GMutex lock;
-    uint64_t hits;
+    uint64_t hits;      /**< All hits, including `dram_hits` */
+    uint64_t dram_hits; /**< Hits served by the DRAM tier */
     uint64_t misses;
+    uint64_t collisions; /**< Fingerprints of a key found holding another key's object */
 };
 
 /**
@@ -55,14 +72,25 @@ struct zn_cache {
     uint32_t max_nr_active_zones; /**< Maximum number of zones that can be active at once. */
     uint32_t nr_zones;            /**< Total number of zones availible. */
     uint64_t max_zone_chunks;     /**< Maximum number of chunks a zone can hold. */
-    size_t chunk_sz;              /**< Size of each chunk in bytes. */
+    size_t chunk_sz;              /**< Size of each chunk in bytes, ZN_DIRECT_ALIGNMENT with OBJECT_SIZE_MAX. */
+    uint32_t max_object_chunks;   /**< Chunks the largest object spans, see OBJECT_SIZE_MAX. */
+    size_t max_object_sz;         /**< Size of the largest object in bytes, a whole number of chunks. */
+    uint32_t max_extent_chunks;   /**< Chunks of the longest extent, longer objects take several. */
     uint64_t zone_cap;            /**< Maximum storage capacity per zone in bytes. */
     uint64_t zone_size;           /**< Storage size per zone in bytes. */
     ssize_t io_size;              /**< IO size in bytes. */
+    struct zn_io io;              /**< Engine used for chunk reads and writes. */
+    struct zn_buffer_pool buffers; /**< Buffers up to `max_object_sz` handed out by zn_cache_get(). */
 
     struct zn_cachemap cache_map;
+    struct zn_extent_map extent_map; /**< Extents of objects longer than `max_extent_chunks` */
+    GMutex extent_lock;              /**< Held while reserving the extents of such an object */
     struct zn_evict_policy eviction_policy;
     struct zone_state_manager zone_state;
+    struct zn_write_buffer write_buffer; /**< Packs misses into segments, see WRITE_BUFFER_SIZE */
+    struct zn_write_behind write_behind; /**< Writes misses in the background, see WRITE_BEHIND_THREADS */
+    struct zn_dram_tier dram_tier; /**< Hot chunks kept in DRAM, see DRAM_TIER_SIZE */
+    struct zn_small_cache small;   /**< Objects of at most SMALL_OBJECT_SIZE bytes, see SMALL_OBJECT_ZONES */
     struct zn_reader reader; /**< Reader structure for tracking workload location. */
     gint *active_readers;    /**< Owning reference of the list of active readers per zone */
 
@@ -71,6 +99,20 @@ struct zn_cache {
     struct zn_profiler * profiler; /**< Stores metrics */
 };
 
+/**
+ * @struct zn_cache_handle
+ * @brief Refcounted reference to the data of one cache get
+ *
+ * The data stays valid until the last reference is dropped with zn_cache_handle_unref(),
+ * then the buffer goes back to the cache's buffer pool.
+ */
+struct zn_cache_handle {
+    unsigned char *data;     /**< `len` bytes, ZN_DIRECT_ALIGNMENT aligned */
+    size_t len;              /**< Size of the object */
+    gint refcount;           /**< References held, the buffer is returned at zero */
+    struct zn_cache *cache;  /**< Cache whose pool the buffer belongs to */
+};
+
 /**
  * @brief Execute eviction in foreground
  *
@@ -82,15 +124,120 @@ zn_fg_evict(struct zn_cache *cache);
 /**
  * @brief Get data from cache
  *
- * Gets data from cache if present, otherwise pulls from emulated remote
+ * Gets data from cache if present, otherwise pulls from emulated remote. The object starts
+ * with a zn_object_header and the key, followed by the object data.
  *
  * @param cache Pointer to the `zn_cache` structure.
- * @param id Cache item ID to get
+ * @param key Key of the object to get, see zn_key_init()
  * @param random_buffer Buffer used for read simulation
- * @returns Buffer of data recieved or NULL on error (callee is responsible for freeing)
+ * @returns Buffer of data recieved or NULL on error, return it with
+ *          zn_buffer_put(&cache->buffers, ...)
  */
 unsigned char *
-zn_cache_get(struct zn_cache *cache, const uint32_t id, unsigned char *random_buffer);
+zn_cache_get(struct zn_cache *cache, const struct zn_key *key, unsigned char *random_buffer);
+
+/**
+ * @brief Get data from cache into a buffer owned by the caller
+ *
+ * Hits are read from the device, and misses fetched, directly into `buf` when it is
+ * ZN_DIRECT_ALIGNMENT aligned. An unaligned `buf` is filled through a pool buffer and a copy.
+ *
+ * @param cache Pointer to the `zn_cache` structure.
+ * @param key Key of the object to get
+ * @param random_buffer Buffer used for read simulation
+ * @param buf Destination, at least zn_cache_object_size() bytes
+ * @param len Size of `buf` in bytes
+ * @return 0 on success, -1 on error or if `len` is smaller than the object
+ */
+int
+zn_cache_get_into(struct zn_cache *cache, const struct zn_key *key, unsigned char *random_buffer,
+                  unsigned char *buf, size_t len);
+
+/**
+ * @brief Get bytes [offset, offset + len) of an object, like an S3 Range request
+ *
+ * A device hit reads only the ZN_DIRECT_ALIGNMENT blocks that cover the range, along with the
+ * block holding the object header to check the key, and only from the extents that the range
+ * overlaps. It is not promoted to the DRAM tier. A miss fetches and caches the whole object,
+ * so later ranges of it are hits. Objects that are whole in DRAM are copied from there.
+ *
+ * @param cache Pointer to the `zn_cache` structure.
+ * @param key Key of the object to get
+ * @param random_buffer Buffer used for read simulation
+ * @param offset First byte to get, counted from the start of the object header
+ * @param len Bytes to get, fewer are returned at the end of the object
+ * @param buf Destination of at least `len` bytes, any alignment
+ * @return Bytes copied into `buf`, or -1 on error
+ */
+ssize_t
+zn_cache_get_range(struct zn_cache *cache, const struct zn_key *key, unsigned char *random_buffer,
+                   size_t offset, size_t len, unsigned char *buf);
+
+/**
+ * @brief Get data from cache as a refcounted handle
+ *
+ * The data is read into a pool buffer that can be shared without copying, for example by
+ * several responses, and is returned to the pool when the last reference is dropped.
+ *
+ * @param cache Pointer to the `zn_cache` structure.
+ * @param key Key of the object to get
+ * @param random_buffer Buffer used for read simulation
+ * @return A handle holding one reference, or NULL on error
+ */
+struct zn_cache_handle *
+zn_cache_get_handle(struct zn_cache *cache, const struct zn_key *key,
+                    unsigned char *random_buffer);
+
+/**
+ * @brief Take another reference to a handle
+ *
+ * @param handle Handle from zn_cache_get_handle()
+ * @return `handle`
+ */
+struct zn_cache_handle *
+zn_cache_handle_ref(struct zn_cache_handle *handle);
+
+/**
+ * @brief Drop a reference to a handle, from any thread
+ *
+ * @param handle Handle from zn_cache_get_handle(), may be NULL
+ */
+void
+zn_cache_handle_unref(struct zn_cache_handle *handle);
+
+/**
+ * @brief Write the data fetched by a miss and publish its location in the cache map
+ *
+ * Goes through the write buffer when it is enabled. An object longer than `max_extent_chunks`
+ * is written as one extent per zone, all submitted at once, and its extents are listed in the
+ * extent map. On error the ID is failed in the cache map, so its next lookup is a miss again.
+ *
+ * @param cache Pointer to the `zn_cache` structure.
+ * @param id Fingerprint of the key the caller got RESULT_COND for
+ * @param data Object to write, still owned by the caller, `len` bytes padded to whole chunks
+ * @param len Size of the object in bytes, up to `max_object_sz`
+ * @param share Hand a copy of `data` to threads waiting for `id`, false if they are served
+ *              from pending data
+ * @return 0 on success, -1 on error
+ */
+int
+zn_cache_write_miss(struct zn_cache *cache, const uint32_t id, const unsigned char *data,
+                    size_t len, bool share);
+
+/**
+ * @brief Size of an object at the emulated remote source
+ *
+ * Objects are one chunk, or with OBJECT_SIZE_MAX any number of bytes from their header up to
+ * it, picked from the key's hash so that every get of a key sees the same size. With a small
+ * object engine, half of the keys are small objects with up to SMALL_OBJECT_SIZE bytes of data
+ * instead.
+ *
+ * @param cache Pointer to the `zn_cache` structure.
+ * @param key Key of the object
+ * @return Size of the object in bytes, its header and key included
+ */
+size_t
+zn_cache_object_size(struct zn_cache *cache, const struct zn_key *key);
 
 /**
  * @brief Initializes a `zn_cache` structure with the given parameters.
@@ -101,15 +248,17 @@ zn_cache_get(struct zn_cache *cache, const uint32_t id, unsigned char *random_bu
  *
  * @param cache Pointer to the `zn_cache` structure to initialize.
  * @param info Pointer to `zbd_info` providing zone details.
- * @param chunk_sz The size of each chunk in bytes.
+ * @param chunk_sz The size of each chunk in bytes, ZN_DIRECT_ALIGNMENT is used instead when
+ *                 OBJECT_SIZE_MAX packs objects of several sizes.
  * @param zone_cap The maximum capacity per zone in bytes.
  * @param fd File descriptor associated with the disk
  * @param eviction_policy Eviction policy used
+ * @param io_engine I/O engine for chunk reads and writes
  */
 void
 zn_init_cache(struct zn_cache *cache, struct zbd_info *info, size_t chunk_sz, uint64_t zone_cap,
               int fd, enum zn_evict_policy_type policy, enum zn_backend backend, uint32_t* workload_buffer,
-              uint64_t workload_max, char *metrics_file);
+              uint64_t workload_max, char *metrics_file, enum zn_io_engine io_engine);
 
 /**
  * @brief Destroys and cleans up a `zn_cache` structure.
@@ -128,15 +277,46 @@ void
 zn_destroy_cache(struct zn_cache *cache);
 
 /**
- * @brief Read a chunk from disk
+ * @brief Read one extent from disk, exactly its `nr_chunks` chunks
  *
  * @param cache Pointer to the `zn_cache` structure
  * @param zone_pair Chunk, zone pair
- * @return Buffer read from disk, to be freed by caller
+ * @return Buffer read from disk from `cache->buffers`, to be returned by caller
  */
 unsigned char *
 zn_read_from_disk(struct zn_cache *cache, struct zn_pair *zone_pair);
 
+/**
+ * @brief Start reading one extent from disk, finish with zn_io_wait() on the same thread
+ *
+ * @param cache Pointer to the `zn_cache` structure
+ * @param zone_pair Chunk, zone pair
+ * @param[out] request In-flight read, valid until zn_io_wait() returns
+ * @return Buffer being read into from `cache->buffers`, to be returned by caller, or NULL
+ *         on error
+ */
+unsigned char *
+zn_read_from_disk_submit(struct zn_cache *cache, struct zn_pair *zone_pair,
+                         struct zn_io_request *request);
+
+/**
+ * @brief Write one extent reserved with zsm_get_active_zone_extent() in write pointer order
+ *
+ * The extent is submitted along with the other extents of its zone that are waiting, see
+ * zsm_write_ordered(). In zone append mode it is appended to its zone instead. On success
+ * the write turn is passed, the caller publishes the extent and returns its zone. On error nothing is passed and the caller gives the extent
+ * back with zsm_failed_to_write().
+ *
+ * @param cache Pointer to the `zn_cache` structure
+ * @param data Object to write, `location->nr_chunks` chunks
+ * @param[in,out] location Reserved extent, in zone append mode the chunk offset is set to
+ *                where the device wrote it
+ * @return 0 on success, -1 on error
+ */
+int
+zn_cache_write_extent(struct zn_cache *cache, const unsigned char *data,
+                      struct zn_pair *location);
+
 /**
  * @brief Write buffer to disk
  *
@@ -153,12 +333,12 @@ zn_write_out(int fd, size_t const to_write, const unsigned char *buffer, ssize_t
              unsigned long long wp_start);
 
 /**
- * Allocate a buffer prefixed by `zone_id`, with the rest being `RANDOM_DATA`
+ * Allocate a buffer holding the object of `zone_id`, with its data being `RANDOM_DATA`
  * Simulates remote read with ZE_READ_SLEEP_US
  *
  * @param cache Pointer to the `zn_cache` structure.
- * @param zone_id ID to write to first 4 bytes
- * @return Allocated buffer or NULL, caller is responsible for free
+ * @param zone_id ID whose bytes are the key of the object
+ * @return Buffer from `cache->buffers`, caller is responsible for returning it
  */
 unsigned char *
 zn_gen_write_buffer(struct zn_cache *cache, uint32_t zone_id, unsigned char *buffer);
@@ -168,11 +348,27 @@ zn_gen_write_buffer(struct zn_cache *cache, uint32_t zone_id, unsigned char *buf
  *
  * @param cache Pointer to the `zn_cache` structure.
  * @param data Data to validate against RANDOM_DATA
- * @param id Identifier that should be in first 4 bytes
+ * @param key Key that should be in the object header, the data after it is compared up to
+ *            zn_cache_object_size() bytes
  * @return Non-zero on error
  */
 int
-zn_validate_read(struct zn_cache *cache, unsigned char *data, uint32_t id, unsigned char *compare_buffer);
+zn_validate_read(struct zn_cache *cache, unsigned char *data, const struct zn_key *key,
+                 unsigned char *compare_buffer);
+
+/**
+ * Validate contents of a range read with zn_cache_get_range()
+ *
+ * @param cache Pointer to the `zn_cache` structure.
+ * @param data Bytes returned for the range
+ * @param len Number of bytes returned
+ * @param key Key of the object, its header and key are compared where the range covers them
+ * @param offset Offset the range was read from
+ * @return Non-zero on error, including a range past the end of the object
+ */
+int
+zn_validate_range(struct zn_cache *cache, const unsigned char *data, size_t len,
+                  const struct zn_key *key, size_t offset, unsigned char *compare_buffer);
 
 /**
  * Get the cache hitratio
@@ -183,4 +379,22 @@ zn_validate_read(struct zn_cache *cache, unsigned char *data, uint32_t id, unsig
 double
 zn_cache_get_hit_ratio(struct zn_cache * cache);
 
+/**
+ * Get the share of gets served by the DRAM tier
+ *
+ * @param cache Pointer to the `zn_cache` structure.
+ * @return DRAM hits over all gets
+ */
+double
+zn_cache_get_dram_hit_ratio(struct zn_cache *cache);
+
+/**
+ * Get the share of gets served by the device
+ *
+ * @param cache Pointer to the `zn_cache` structure.
+ * @return Device hits over all gets
+ */
+double
+zn_cache_get_device_hit_ratio(struct zn_cache *cache);
+
 #endif // ZNCACHE_H
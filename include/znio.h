@@ -0,0 +1,230 @@
+#ifndef ZN_IO_H
+#define ZN_IO_H
+
+#include <glib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Chunk I/O engines. The psync engine issues a blocking pread/pwrite per `io_size` piece.
+ * The io_uring engine (only built when liburing is found) gives each thread its own ring,
+ * with the device registered as a fixed file, and submits all pieces of a transfer with a
+ * single system call. Memory the data buffers are carved from, such as the slabs of the buffer
+ * pool, is registered with zn_io_register_region(). Every ring registers it as fixed buffers
+ * on its next transfer, and transfers from it then skip the per-I/O page pinning of the kernel.
+ *
+ * A request is started with zn_io_submit() and finished with zn_io_wait(), so the caller can
+ * do other work while the device is busy. Both calls have to be made by the same thread.
+ * zn_io_submit_batch() starts several requests at once, with ordered writes chained so they
+ * reach the device one after the other.
+ * Pieces that fail are redone with the blocking engine and its retries.
+ *
+ * Zone appends go to NVMe ZNS namespaces as passthrough commands, whichever engine is in use.
+ * The device picks where in the zone the data goes and reports it back.
+ */
+
+/** Submission queue entries per thread ring */
+#define ZN_IO_QUEUE_DEPTH 64
+
+/** Regions registered as fixed buffers with each ring, later regions are used unregistered */
+#define ZN_IO_MAX_REGIONS 1024
+
+/**
+ * @struct zn_io_region
+ * @brief Memory that transfers can use as a fixed buffer
+ */
+struct zn_io_region {
+    unsigned char *base;
+    size_t len;
+};
+
+/**
+ * @enum zn_io_engine
+ * @brief Available I/O engines
+ */
+enum zn_io_engine {
+    ZN_IO_ENGINE_PSYNC = 0, /**< Blocking pread/pwrite */
+    ZN_IO_ENGINE_URING = 1, /**< io_uring, falls back to ZN_IO_ENGINE_PSYNC when unavailable */
+};
+
+/**
+ * @struct zn_io
+ * @brief I/O engine configuration for one device
+ */
+struct zn_io {
+    enum zn_io_engine engine; /**< Engine in use, may differ from the one requested */
+    int fd;                   /**< Device file descriptor */
+    size_t io_size;           /**< Largest single transfer, larger requests are split */
+    bool ordered_writes;      /**< Pieces of a write must reach the device in order (ZNS) */
+    uint32_t instance;        /**< Distinguishes this configuration in thread-local rings */
+    uint32_t append_nsid;     /**< Namespace zone appends are sent to, 0 if they are not set up */
+    uint32_t append_lba_size; /**< Bytes per logical block of the namespace */
+
+    struct zn_io_region *regions; /**< ZN_IO_MAX_REGIONS entries, appended to and never removed */
+    gint nr_regions;              /**< Entries of `regions` published to the rings */
+    GMutex regions_lock;          /**< Serializes zn_io_register_region() */
+};
+
+/**
+ * @struct zn_io_request
+ * @brief One read or write, split into `io_size` pieces
+ */
+struct zn_io_request {
+    unsigned char *buffer;     /**< Source or destination, aligned for O_DIRECT */
+    size_t len;                /**< Total bytes to transfer */
+    unsigned long long offset; /**< Device offset in bytes */
+    bool write;                /**< Write `buffer` instead of reading into it */
+    size_t io_size;            /**< Largest piece, 0 for the engine's `io_size` */
+
+    void *ring;         /**< Thread ring the pieces were submitted to, NULL if already done */
+    uint32_t pending;   /**< Submitted pieces not yet completed */
+    size_t transferred; /**< Bytes completed so far */
+    bool failed;        /**< A piece returned an error */
+    int result;         /**< 0 on success, -1 on failure, valid after zn_io_wait() */
+};
+
+/**
+ * @brief Sets up an I/O engine
+ *
+ * @param io Configuration to initialize
+ * @param engine Requested engine, ZN_IO_ENGINE_URING falls back to ZN_IO_ENGINE_PSYNC if it
+ *               cannot be used
+ * @param fd Device file descriptor
+ * @param io_size Largest single transfer in bytes
+ * @param ordered_writes Whether pieces of a write have to be written in order
+ */
+void
+zn_io_init(struct zn_io *io, enum zn_io_engine engine, int fd, size_t io_size,
+           bool ordered_writes);
+
+/**
+ * @brief Releases the calling thread's ring for `io` and the list of regions. Other threads
+ * must have exited, which releases their rings.
+ *
+ * @param io Configuration to tear down
+ */
+void
+zn_io_destroy(struct zn_io *io);
+
+/**
+ * @brief Parses an engine name
+ *
+ * @param name "psync" or "io_uring"
+ * @param[out] engine Parsed engine
+ * @return 0 on success, -1 if the name is unknown
+ */
+int
+zn_io_engine_parse(const char *name, enum zn_io_engine *engine);
+
+/**
+ * @brief Returns the name of an engine
+ */
+const char *
+zn_io_engine_name(enum zn_io_engine engine);
+
+/**
+ * @brief Starts a transfer
+ *
+ * @param io Engine to use
+ * @param req Request with buffer, len, offset and write set. With the psync engine the
+ *            transfer is done before this returns.
+ * @return 0 if the transfer was started, -1 on failure
+ */
+int
+zn_io_submit(struct zn_io *io, struct zn_io_request *req);
+
+/**
+ * @brief Starts several transfers with one submission
+ *
+ * With `ordered_writes`, consecutive writes reach the device in the order given.
+ *
+ * @param io Engine to use
+ * @param reqs Requests as for zn_io_submit(), wait for each with zn_io_wait() in order
+ * @param nr Number of requests
+ * @return 0 if the transfers were started, -1 if one failed with the psync engine. Each
+ *         result is still given by zn_io_wait().
+ */
+int
+zn_io_submit_batch(struct zn_io *io, struct zn_io_request *reqs, uint32_t nr);
+
+/**
+ * @brief Waits for a transfer started with zn_io_submit() on the same thread
+ *
+ * @param io Engine the request was submitted to
+ * @param req Request to wait for
+ * @return 0 on success, -1 on failure
+ */
+int
+zn_io_wait(struct zn_io *io, struct zn_io_request *req);
+
+/**
+ * @brief Reads `len` bytes at `offset` into `buffer` and waits for it
+ * @return 0 on success, -1 on failure
+ */
+int
+zn_io_read(struct zn_io *io, unsigned char *buffer, size_t len, unsigned long long offset);
+
+/**
+ * @brief Writes `len` bytes from `buffer` at `offset` and waits for it
+ * @return 0 on success, -1 on failure
+ */
+int
+zn_io_write(struct zn_io *io, const unsigned char *buffer, size_t len, unsigned long long offset);
+
+/**
+ * @brief Sets up zone appends, which need an NVMe ZNS namespace opened by a user allowed to
+ * send it I/O commands
+ *
+ * @param io Engine to set up
+ * @param max_len Longest append that will be issued, in bytes
+ * @return 0 if zn_io_append() can be used, -1 otherwise
+ */
+int
+zn_io_enable_append(struct zn_io *io, size_t max_len);
+
+/**
+ * @brief Appends `len` bytes from `buffer` to a zone and waits for it
+ *
+ * The append is a single command, it is not split or retried. Appends to the same zone from
+ * several threads are on the device at once.
+ *
+ * @param io Engine set up with zn_io_enable_append()
+ * @param zone_start Device offset of the zone's first byte
+ * @param[out] offset Device offset the device wrote the data at
+ * @return 0 on success, -1 on failure, in which case nothing was written
+ */
+int
+zn_io_append(struct zn_io *io, const unsigned char *buffer, size_t len,
+             unsigned long long zone_start, unsigned long long *offset);
+
+/**
+ * @brief Registers memory that transfers use as fixed buffers, from any thread
+ *
+ * The memory has to stay mapped until the engine is destroyed. A transfer is done from a fixed
+ * buffer when it lies within one region. Does nothing for the psync engine, or once
+ * ZN_IO_MAX_REGIONS regions are registered.
+ *
+ * @param io Engine to register with
+ * @param base Start of the region
+ * @param len Bytes in the region
+ */
+void
+zn_io_register_region(struct zn_io *io, void *base, size_t len);
+
+/**
+ * @brief Blocking read with retries, split into `io_size` pieces
+ * @return 0 on success, -1 on failure
+ */
+int
+zn_io_pread_all(int fd, unsigned char *buffer, size_t len, size_t io_size, unsigned long long offset);
+
+/**
+ * @brief Blocking write with retries, split into `io_size` pieces
+ * @return 0 on success, -1 on failure
+ */
+int
+zn_io_pwrite_all(int fd, const unsigned char *buffer, size_t len, size_t io_size,
+                 unsigned long long offset);
+
+#endif // ZN_IO_H
@@ -0,0 +1,119 @@
+#ifndef ZN_KEY_H
+#define ZN_KEY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Keys of cached objects. A key is any byte string of up to ZN_KEY_MAX bytes, hashed to 64 bits
+ * once when it is made. The DRAM indexes only hold a 32-bit fingerprint of the hash next to the
+ * object's location, the full key is stored in the header of the object on the device and
+ * compared on every hit. A key whose fingerprint is held by another key's object is indexed by
+ * its next one, only a key whose ZN_KEY_FINGERPRINTS fingerprints are all held is not cached.
+ */
+
+/** Longest key in bytes */
+#define ZN_KEY_MAX 255
+
+/** Fingerprints a key can be indexed by, see zn_key_fingerprint_at() */
+#define ZN_KEY_FINGERPRINTS 4
+
+/**
+ * @struct zn_key
+ * @brief A key and its hash, see zn_key_init()
+ */
+struct zn_key {
+    const unsigned char *data; /**< Not owned, valid while the key is in use */
+    size_t len;
+    uint64_t hash;
+};
+
+/**
+ * @struct zn_object_header
+ * @brief Start of every object on the device, followed by the key and then the object data
+ */
+struct zn_object_header {
+    uint64_t key_hash;
+    uint32_t len;     /**< Bytes of the whole object, header and key included */
+    uint16_t key_len;
+    uint16_t reserved;
+};
+
+/** @brief splitmix64 finalizer, every input bit affects every output bit */
+static inline uint64_t
+zn_key_mix(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9ull;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EBull;
+    x ^= x >> 31;
+    return x;
+}
+
+/**
+ * @brief 64-bit hash of a byte string, eight bytes at a time
+ */
+static inline uint64_t
+zn_key_hash(const void *data, size_t len) {
+    const unsigned char *p = data;
+    uint64_t h = 0x9E3779B97F4A7C15ull ^ ((uint64_t) len * 0xC2B2AE3D27D4EB4Full);
+    for (; len >= sizeof(uint64_t); p += sizeof(uint64_t), len -= sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        h = (h ^ zn_key_mix(word)) * 0x9E3779B97F4A7C15ull;
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, p, len);
+    return zn_key_mix(h ^ tail);
+}
+
+/**
+ * @brief Make a key of `len` bytes at `data`, which must outlive it
+ */
+static inline void
+zn_key_init(struct zn_key *key, const void *data, size_t len) {
+    key->data = data;
+    key->len = len;
+    key->hash = zn_key_hash(data, len);
+}
+
+/**
+ * @brief The `probe`th ID a key can be indexed by in DRAM, below ZN_KEY_FINGERPRINTS
+ *
+ * Lookups try them in order, and the key is cached under the first one that no other key's
+ * object holds. The first is the top half of the hash, the others are mixed from the whole
+ * hash so that two keys sharing one fingerprint are unlikely to share the next.
+ */
+static inline uint32_t
+zn_key_fingerprint_at(const struct zn_key *key, uint32_t probe) {
+    uint64_t hash = probe == 0 ? key->hash : zn_key_mix(key->hash + probe);
+    return (uint32_t) (hash >> 32);
+}
+
+/**
+ * @brief The first ID a key is indexed by in DRAM, the top half of its hash
+ *
+ * The bottom half picks the emulated object size, so both are independent.
+ */
+static inline uint32_t
+zn_key_fingerprint(const struct zn_key *key) {
+    return zn_key_fingerprint_at(key, 0);
+}
+
+/**
+ * @brief Whether `object`, `len` bytes read from any tier, is the object of `key`
+ */
+static inline bool
+zn_key_matches(const struct zn_key *key, const unsigned char *object, size_t len) {
+    struct zn_object_header header;
+    if (len < sizeof(header) + key->len) {
+        return false;
+    }
+    memcpy(&header, object, sizeof(header));
+    return header.key_hash == key->hash && header.key_len == key->len && header.len == len &&
+           memcmp(object + sizeof(header), key->data, key->len) == 0;
+}
+
+#endif // ZN_KEY_H
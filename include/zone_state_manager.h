@@ -7,6 +7,12 @@
 
 #include <stdint.h>
 
+/** Chunk offset handed out in zone append mode, until the device reports where it wrote */
+#define ZSM_APPEND_OFFSET UINT32_MAX
+
+/** Most writes of a zone submitted together by zsm_write_ordered() */
+#define ZSM_MAX_WRITE_RUN 32
+
 /**
  * @enum zn_zone_condition
  * @brief Defines possible conditions of a cache zone.
@@ -17,7 +23,7 @@ enum zn_zone_condition {
     ZN_ZONE_FREE = 0,   /**< The zone is available for new allocations. */
     ZN_ZONE_FULL = 1,   /**< The zone is completely occupied and cannot accept new data. */
     ZN_ZONE_ACTIVE = 2, /**< The zone is currently in use and may still have space for new data. */
-    ZN_ZONE_WRITE_OCCURING = 3, /**< The zone is currently being written to. */
+    ZN_ZONE_WRITE_OCCURING = 3, /**< The zone is being written to and has no chunks left to reserve. */
 };
 
 /**
@@ -38,10 +44,38 @@ enum zsm_get_active_zone_error {
 struct zn_zone {
     enum zn_zone_condition state;
     uint32_t zone_id;
-    uint32_t chunk_offset;
+    uint32_t chunk_offset;  /**< The next chunk to hand out to a writer */
+    uint32_t write_pointer; /**< The next chunk allowed to be written to the device, in zone
+                                 append mode the chunks appended so far */
+    uint32_t writers;       /**< Writers holding a chunk in this zone that have not returned it */
+    bool batch;             /**< A batch reservation holds the newest chunks, see zsm_get_active_zone_batch() */
+    GQueue *queued;         /**< struct zsm_write waiting to be submitted, by chunk offset */
+    bool submitting;        /**< A thread is submitting queued writes, see zsm_write_ordered() */
+    GCond write_turn;       /**< Signalled when write_pointer, writers or queued writes change */
     GQueue *invalid; /**< Invalidated chunks, used after filled on SSD */
 };
 
+/**
+ * @struct zsm_write
+ * @brief A write waiting in its zone's submission queue, see zsm_write_ordered()
+ */
+struct zsm_write {
+    struct zn_pair pair; /**< Chunks to write, reserved with zsm_get_active_zone() */
+    void *data;          /**< The caller's data to write */
+    int result;          /**< 0 if the write reached the device, set by the submitter */
+    bool done;           /**< The write was submitted and finished */
+};
+
+/** @brief Writes a run of writes of one zone in the order given, and waits for all of them
+ *  @param user_data Passed to zsm_write_ordered()
+ *  @param writes Writes of consecutive chunks, the first at the zone's write pointer
+ *  @param nr_writes Number of writes, at most ZSM_MAX_WRITE_RUN
+ *  Implementation notes:
+ *  - Sets the result of every write. The writes after a failed one are submitted again once
+ * its chunks are skipped, so they may fail as well
+ */
+typedef void (*zsm_submit_fn)(void *user_data, struct zsm_write **writes, uint32_t nr_writes);
+
 /**
  * @struct zone_state_manager
  * @brief Stores the state of all zones on a ZNS SSD.
@@ -50,9 +84,13 @@ struct zone_state_manager {
     GMutex state_mutex; /**< The lock protecting this data structure */
     GQueue *active;     /**< The queue of zones that are currently active. Stores pointers to zn_zones. */
     GQueue *free;       /**< The queue of zones that are free. Stores pointers to zn_zones. */
+    GQueue *filled;     /**< Zones closed since the eviction policy last took them, see
+                             zsm_pop_full_zone(). Stores zone IDs. */
     struct zn_zone *state; /**< An array that stores the state of each zone, and acts as the backing
     memory for the active and free queues. */
-    int writes_occurring;  /**< The current number of writes occuring on active zones */
+    int writes_occurring;  /**< The number of zones taken off the active queue while still being written */
+    uint32_t max_zone_writers; /**< Maximum number of chunks reserved in one zone at a time */
+    bool zone_append;          /**< Writers reserve space, the device picks the chunk offsets */
 
     // Information about the cache
     int fd;                       /**< File descriptor of the SSD */
@@ -62,6 +100,7 @@ struct zone_state_manager {
     uint32_t max_nr_active_zones; /**< Maximum number of zones that can be active at once. */
     uint64_t max_zone_chunks;     /**< Maximum amount of chunks that a zone can store */
     uint32_t num_zones;           /**< Number of zones */
+    uint32_t zone_base;           /**< Device zone of zone 0, when only a range of the device is managed */
 	enum zn_backend backend_type; /**< The type of backend */
 };
 
@@ -90,26 +129,118 @@ zsm_init(struct zone_state_manager *state, const uint32_t num_zones, const int f
  *  Implementation notes:
  *  - Gets an active zone if it can, otherwise get from the free list (and move it to the active
  * list)
- *  - Increment the corresponding chunk pointer to point to the next free zone
- *  - If chunk pointer reaches the end, move zone to full list
+ *  - Reserves the zone's next chunk, so up to `max_zone_writers` threads can hold consecutive
+ * chunks of the same zone. The zone leaves the active queue once no more chunks can be reserved
+ *  - The caller must write the chunk between zsm_wait_write_turn() and zsm_pass_write_turn(),
+ * then release it with zsm_return_active_zone() or zsm_failed_to_write()
  */
 enum zsm_get_active_zone_error
 zsm_get_active_zone(struct zone_state_manager *state, struct zn_pair *pair);
 
-/** @brief Not yet thought out well, but a function for host-side gc (when we need to relocate a
- * number of chunks)
- *  @param chunks specifies how many chunks we need
- *  @return which chunks can be written to, in the form of a dynamic array
+/** @brief zsm_get_active_zone() for an object spanning `nr_chunks` consecutive chunks
+ *  @param[in]  state zone_state data structure
+ *  @param[in]  nr_chunks chunks to reserve, at most `max_zone_chunks`
+ *  @param[out] pair the new location to write to, `pair->nr_chunks` is set to `nr_chunks`
+ *  @return Same as zsm_get_active_zone()
+ *  Implementation notes:
+ *  - An active zone with fewer chunks left is sealed: it takes no more reservations and is
+ * closed with its tail unwritten once its writers return their chunks
+ */
+enum zsm_get_active_zone_error
+zsm_get_active_zone_extent(struct zone_state_manager *state, uint32_t nr_chunks,
+                           struct zn_pair *pair);
+
+/** @brief Reserves up to `max_chunks` consecutive chunks of one active zone as a single writer
+ *  @param[in]  state zone_state data structure
+ *  @param[in]  min_chunks fewest chunks to reserve, active zones with fewer left are sealed as
+ * in zsm_get_active_zone_extent()
+ *  @param[in]  max_chunks most chunks to reserve
+ *  @param[out] pair first chunk of the batch, at a fixed offset even in zone append mode
+ *  @param[out] nr_chunks chunks reserved, at least `min_chunks`
+ *  @return Same as zsm_get_active_zone()
+ *  Implementation notes:
+ *  - The zone leaves the active queue until the batch is returned, so no chunk is reserved
+ * behind it and the unused tail can be given back with zsm_trim_batch()
+ *  - The batch is written between zsm_wait_write_turn() and zsm_pass_write_turn_batch(), then
+ * released with zsm_return_active_zone_batch() or zsm_failed_to_write_batch()
+ */
+enum zsm_get_active_zone_error
+zsm_get_active_zone_batch(struct zone_state_manager *state, uint32_t min_chunks,
+                          uint32_t max_chunks, struct zn_pair *pair, uint32_t *nr_chunks);
+
+/** @brief Gives back the chunks of a batch after the first `nr_used`, before it is written
+ *  @param state zone_state data structure
+ *  @param pair first chunk of the batch
+ *  @param nr_chunks chunks reserved by zsm_get_active_zone_batch()
+ *  @param nr_used chunks that will be written, at least one
+ */
+void
+zsm_trim_batch(struct zone_state_manager *state, struct zn_pair *pair, uint32_t nr_chunks,
+               uint32_t nr_used);
+
+/** @brief Blocks until every chunk reserved before `pair` in its zone has been written
+ *  @param state zone_state data structure
+ *  @param pair chunk returned by zsm_get_active_zone()
  *  Implementation notes:
- *  - Updates the zone state accordingly
+ *  - Chunks of a zone reach the device in write pointer order, as ZNS requires, while the
+ * reservation, data copy and metadata updates of other writers overlap with the write
+ *  - In zone append mode the reservation only holds space in the zone and this returns right
+ * away. The writer issues a zone append and sets the chunk offset to where the device wrote
+ * it, so the appends of all writers of a zone are on the device at once
  */
-GArray
-zsm_get_active_zone_batch(int chunks);
+void
+zsm_wait_write_turn(struct zone_state_manager *state, struct zn_pair *pair);
+
+/** @brief Writes a reservation in write pointer order, with the writes queued behind it
+ *  @param state zone_state data structure
+ *  @param write Reserved chunks and the data for them, owned by the caller until this returns
+ *  @param submit Writes a run of writes to the device
+ *  @param user_data Passed to `submit`
+ *  @return 0 once the write is on the device and the write turn passed on, otherwise the
+ * result of the failed write, to be released with zsm_failed_to_write()
+ *  Implementation notes:
+ *  - The write joins the zone's submission queue. Whichever waiting thread finds the queue
+ * at the write pointer takes every queued write that follows on from it and submits them
+ * together, so the writes of a zone are on the device at once and their writers only wait
+ * for their own write to finish
+ *  - The writes after a failed one in a run go back into the queue, and are submitted again
+ * once the failed chunks are skipped by zsm_failed_to_write()
+ *  - Not for zone append mode, where nothing waits for the write pointer
+ */
+int
+zsm_write_ordered(struct zone_state_manager *state, struct zsm_write *write,
+                  zsm_submit_fn submit, void *user_data);
 
-// Returns the active zone after it's written to
+/** @brief Lets the writer of the next chunk in the zone start its write
+ *  @param state zone_state data structure
+ *  @param pair chunks that were just written to the device, at the offset the device picked
+ * in zone append mode
+ */
+void
+zsm_pass_write_turn(struct zone_state_manager *state, struct zn_pair *pair);
+
+/** @brief zsm_pass_write_turn() for a batch of `nr_chunks` chunks starting at `pair` */
+void
+zsm_pass_write_turn_batch(struct zone_state_manager *state, struct zn_pair *pair,
+                          uint32_t nr_chunks);
+
+/** @brief Releases a chunk after it is written and its metadata is published
+ *  @param state zone_state data structure
+ *  @param pair chunks returned by zsm_get_active_zone() or zsm_get_active_zone_extent()
+ *  @return 0 on success, otherwise the error from closing the zone
+ *  Implementation notes:
+ *  - The last writer to return a zone without room left closes it and queues it for
+ * zsm_pop_full_zone(). Report the chunks to the eviction policy before returning them, so the
+ * policy knows every chunk of a zone before it gets the zone
+ */
 int
 zsm_return_active_zone(struct zone_state_manager *state, struct zn_pair *pair);
 
+/** @brief zsm_return_active_zone() for a batch of `nr_chunks` chunks starting at `pair` */
+int
+zsm_return_active_zone_batch(struct zone_state_manager *state, struct zn_pair *pair,
+                             uint32_t nr_chunks);
+
 /** @brief Moves full zones to the free zone to make them available again
  *  @param zone_to_free the zone to make free again
  *  Implementation notes
@@ -120,9 +251,22 @@ zsm_return_active_zone(struct zone_state_manager *state, struct zn_pair *pair);
 int
 zsm_evict(struct zone_state_manager *state, int zone_to_free);
 
+/** @brief Releases a chunk whose write failed, without passing the write turn first
+ *  @param state zone_state data structure
+ *  @param pair chunks returned by zsm_get_active_zone() or zsm_get_active_zone_extent()
+ *  Implementation notes:
+ *  - If no later chunk of the zone is reserved, the chunk is handed out again
+ *  - Otherwise later writers already depend on it, so it is skipped and marked invalid
+ *  - In zone append mode nothing was written, so the space is always given back
+ */
 void
 zsm_failed_to_write(struct zone_state_manager *state, struct zn_pair pair);
 
+/** @brief zsm_failed_to_write() for a batch of `nr_chunks` chunks starting at `pair` */
+void
+zsm_failed_to_write_batch(struct zone_state_manager *state, struct zn_pair pair,
+                          uint32_t nr_chunks);
+
 /** @brief Returns the active zone count */
 uint32_t
 zsm_get_num_active_zones(struct zone_state_manager *state);
@@ -135,7 +279,16 @@ zsm_get_num_free_zones(struct zone_state_manager *state);
 uint32_t
 zsm_get_num_full_zones(struct zone_state_manager *state);
 
-/** @brief Mark a chunk as invalid */
+/** @brief Takes the oldest zone that was closed since the last call
+ *  @return the zone, or -1 if no zone was closed
+ *  Implementation notes:
+ *  - Zones fill up at different chunks when objects span several chunks, so the eviction
+ * policies learn which zones are full here instead of from the offsets they see written
+ */
+int
+zsm_pop_full_zone(struct zone_state_manager *state);
+
+/** @brief Mark the chunks of an object as invalid */
 void
 zsm_mark_chunk_invalid(struct zone_state_manager *state, struct zn_pair *location);
 
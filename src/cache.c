@@ -1,5 +1,3 @@
-// For pread
-#define _XOPEN_SOURCE 500
 #include <stdint.h>
 #include <unistd.h>
 
@@ -8,22 +6,20 @@
 #include "znprofiler.h"
 
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <linux/fs.h>
 
 #include "libzbd/zbd.h"
 #include <inttypes.h>
 
-#define ZN_DIRECT_ALIGNMENT 4096
-
-#define BACKOFF_US_START 100000
-#define BACKOFF_RETRIES 5
-
 void
 zn_fg_evict(struct zn_cache *cache) {
     ZN_PROFILER_PRINTF(cache->profiler, "EVICTIONBEGIN_EVERY,%p\n", (void *) g_thread_self());
     uint32_t free_zones = zsm_get_num_free_zones(&cache->zone_state);
-    if (cache->eviction_policy.type == ZN_EVICT_PROMOTE_ZONE) {
+    if (cache->eviction_policy.type == ZN_EVICT_ZONE ||
+        cache->eviction_policy.type == ZN_EVICT_PROMOTE_ZONE ||
+        cache->eviction_policy.type == ZN_EVICT_S3FIFO_ZONE) {
         for (uint32_t i = 0; i < EVICT_LOW_THRESH_ZONES - free_zones; i++) {
             int zone =
                 cache->eviction_policy.do_evict(cache->eviction_policy.data);
@@ -33,6 +29,8 @@ zn_fg_evict(struct zn_cache *cache) {
             }
 
             zn_cachemap_clear_zone(&cache->cache_map, zone);
+            // Objects with an extent in the zone go as a whole
+            zn_extent_map_clear_zone(&cache->extent_map, &cache->cache_map, zone);
 
             while (cache->active_readers[zone] > 0) {
                 g_thread_yield();
@@ -45,7 +43,8 @@ zn_fg_evict(struct zn_cache *cache) {
                 assert(!"Issue occurred with evicting zones\n");
             }
         }
-    } else if (cache->eviction_policy.type == ZN_EVICT_CHUNK) {
+    } else if (cache->eviction_policy.type == ZN_EVICT_CHUNK ||
+               cache->eviction_policy.type == ZN_EVICT_CHUNK_CLOCK) {
         (void)cache->eviction_policy.do_evict(cache->eviction_policy.data);
     } else {
         assert(!"NYI");
@@ -53,119 +52,1001 @@ zn_fg_evict(struct zn_cache *cache) {
     ZN_PROFILER_PRINTF(cache->profiler, "EVICTIONEND_EVERY,%p\n", (void *) g_thread_self());
 }
 
-unsigned char *
-zn_cache_get(struct zn_cache *cache, const uint32_t id, unsigned char *random_buffer) {
-    unsigned char *data = NULL;
+/**
+ * @brief Start reading the extent of an object into `data`, a ZN_DIRECT_ALIGNMENT aligned
+ * buffer
+ *
+ * @return 0 if the read was started, -1 on error
+ */
+static int
+read_submit(struct zn_cache *cache, struct zn_pair *zone_pair, struct zn_io_request *request,
+            unsigned char *data) {
+    size_t chunk_sz = cache->chunk_sz;
+    size_t max_io = cache->io_size;
+    size_t align = ZN_DIRECT_ALIGNMENT;
 
-    // PROFILE
-    struct timespec total_start_time, total_end_time;
-    TIME_NOW(&total_start_time);
+    // Sanity checks
+    if ((chunk_sz % align) != 0 || (max_io % align) != 0) {
+        fprintf(stderr, "Error: Sizes must be aligned to %zu bytes for O_DIRECT\n", align);
+        return -1;
+    }
 
-    struct zone_map_result result = zn_cachemap_find(&cache->cache_map, id);
-    assert(result.type != RESULT_EMPTY);
+    // Calculate starting offset
+    unsigned long long wp = CHUNK_POINTER(cache->zone_size, chunk_sz, zone_pair->chunk_offset, zone_pair->zone);
+    if ((wp % align) != 0) {
+        fprintf(stderr, "Error: Read offset (%llu) not aligned to %zu for O_DIRECT\n", wp, align);
+        return -1;
+    }
 
-    // Found the entry, read it from disk, update eviction, and decrement reader.
-    if (result.type == RESULT_LOC) {
-        struct timespec start_time, end_time;
-        TIME_NOW(&start_time);
-        unsigned char *data = zn_read_from_disk(cache, &result.location);
-        TIME_NOW(&end_time);
-        double t = TIME_DIFFERENCE_NSEC(start_time, end_time);
-        ZN_PROFILER_UPDATE(cache->profiler, ZN_PROFILER_METRIC_READ_LATENCY, t);
-        ZN_PROFILER_PRINTF(cache->profiler, "READLATENCY_EVERY,%f\n", t);
+    // Only the extent is read
+    assert(zone_pair->nr_chunks > 0 && zone_pair->nr_chunks <= cache->max_extent_chunks);
+    size_t len = (size_t) zone_pair->nr_chunks * chunk_sz;
+    *request = (struct zn_io_request) {.buffer = data, .len = len, .offset = wp, .write = false};
+    return zn_io_submit(&cache->io, request);
+}
+
+/**
+ * @brief Wait for `nr` requests started on this thread
+ *
+ * @return 0 if all of them succeeded, -1 otherwise
+ */
+static int
+wait_all(struct zn_cache *cache, struct zn_io_request *requests, uint32_t nr) {
+    int ret = 0;
+    for (uint32_t i = 0; i < nr; i++) {
+        if (zn_io_wait(&cache->io, &requests[i]) != 0) {
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+/**
+ * @brief Start reading bytes [offset, offset + len) of an object into `data`, each byte at its
+ * offset in the object
+ *
+ * Only the extents that overlap the range are read, from the ZN_DIRECT_ALIGNMENT blocks that
+ * cover it, all at once. The caller holds a reader count on the zone of every extent, and
+ * finishes the reads with wait_all().
+ *
+ * @param[out] requests One per extent read, ZN_EXTENT_MAP_MAX_EXTENTS at most
+ * @param[in,out] nr_requests Requests already started in `requests`, advanced past the ones
+ *                started here
+ * @return 0 if the reads were started, -1 on error with none left in flight
+ */
+static int
+read_extents_submit(struct zn_cache *cache, const struct zn_extent_list *list, size_t offset,
+                    size_t len, unsigned char *data, struct zn_io_request *requests,
+                    uint32_t *nr_requests) {
+    size_t align = ZN_DIRECT_ALIGNMENT;
+    size_t end = offset + len;
+    size_t start = 0;
+    for (uint32_t i = 0; i < list->nr_extents && start < end; i++) {
+        const struct zn_pair *extent = &list->extents[i];
+        size_t bytes = (size_t) extent->nr_chunks * cache->chunk_sz;
+        size_t lo = MAX(offset, start);
+        size_t hi = MIN(end, start + bytes);
+        if (lo < hi) {
+            // Extents start at chunk boundaries, so the blocks stay inside the extent
+            lo -= lo % align;
+            hi += (align - hi % align) % align;
+            unsigned long long wp = CHUNK_POINTER(cache->zone_size, cache->chunk_sz,
+                                                  extent->chunk_offset, extent->zone);
+            struct zn_io_request *request = &requests[*nr_requests];
+            *request = (struct zn_io_request) {
+                .buffer = data + lo, .len = hi - lo, .offset = wp + (lo - start), .write = false};
+            if (zn_io_submit(&cache->io, request) != 0) {
+                (void) wait_all(cache, requests, *nr_requests);
+                return -1;
+            }
+            (*nr_requests)++;
+        }
+        start += bytes;
+    }
+    return 0;
+}
 
-        cache->eviction_policy.update_policy(cache->eviction_policy.data, result.location,
-                                             ZN_READ);
+size_t
+zn_cache_object_size(struct zn_cache *cache, const struct zn_key *key) {
+    if (OBJECT_SIZE_MAX == 0) {
+        return cache->chunk_sz;
+    }
+    // The fingerprint is the top half of the hash, the size is picked from the bottom half
+    uint32_t hash = (uint32_t) key->hash;
+    size_t header = sizeof(struct zn_object_header) + key->len;
+    size_t max = MAX(header, MIN((size_t) OBJECT_SIZE_MAX, cache->max_object_sz));
+    return header + hash % (max - header + 1);
+}
 
-        // Sadly, we have to remember to decrement the reader count here
-        g_atomic_int_dec_and_test(&cache->active_readers[result.location.zone]);
+/**
+ * @brief Whether `key` is a small object, served by the small object engine
+ *
+ * Objects with at most SMALL_OBJECT_SIZE bytes of data behind their header and key are small.
+ */
+static bool
+is_small_object(struct zn_cache *cache, const struct zn_key *key) {
+    return zn_small_cache_enabled(&cache->small) &&
+           zn_cache_object_size(cache, key) - sizeof(struct zn_object_header) - key->len <=
+               SMALL_OBJECT_SIZE;
+}
 
-        g_mutex_lock(&cache->ratio.lock);
+/**
+ * @brief Bytes an object of `len` bytes takes on the device and in transfers, whole chunks
+ */
+static size_t
+chunk_bytes(struct zn_cache *cache, size_t len) {
+    return ((len + cache->chunk_sz - 1) / cache->chunk_sz) * cache->chunk_sz;
+}
+
+/**
+ * @brief Fill `data` with the emulated remote contents of `key`, behind its object header
+ * Simulates remote read with ZE_READ_SLEEP_US
+ *
+ * @return Bytes of object data written to `data`
+ */
+static size_t
+fetch_remote(struct zn_cache *cache, const struct zn_key *key, unsigned char *random_buffer,
+             unsigned char *data) {
+    size_t len = zn_cache_object_size(cache, key);
+    struct zn_object_header header = {
+        .key_hash = key->hash, .len = (uint32_t) len, .key_len = (uint16_t) key->len};
+    memcpy(data, random_buffer, len);
+    memcpy(data, &header, sizeof(header));
+    memcpy(data + sizeof(header), key->data, key->len);
+
+    g_usleep(ZN_READ_SLEEP_US);
+    return len;
+}
+
+/**
+ * @brief Write a miss through the write buffer
+ *
+ * The object is copied into a segment and its location published right away, hits on it are
+ * served from the segment until it is flushed. Whichever thread fills the last slot of a
+ * segment writes it out.
+ */
+static int
+write_miss_buffered(struct zn_cache *cache, const uint32_t id, const unsigned char *data,
+                    size_t len, bool share) {
+    uint32_t nr_chunks = (uint32_t) (chunk_bytes(cache, len) / cache->chunk_sz);
+    struct zn_write_buffer_slot slot;
+    while (true) {
+        enum zsm_get_active_zone_error ret =
+            zn_write_buffer_reserve(&cache->write_buffer, nr_chunks, &slot);
+
+        if (ret == ZSM_GET_ACTIVE_ZONE_RETRY) {
+            // Segments hold their zones until written, close one so its zone comes back
+            zn_write_buffer_flush_open(&cache->write_buffer);
+            g_thread_yield();
+        } else if (ret == ZSM_GET_ACTIVE_ZONE_ERROR) {
+            zn_cachemap_fail(&cache->cache_map, id);
+            return -1;
+        } else if (ret == ZSM_GET_ACTIVE_ZONE_EVICT) {
+            zn_fg_evict(cache);
+        } else {
+            break;
+        }
+    }
+
+    zn_write_buffer_fill(&cache->write_buffer, &slot, id, data);
+
+    // The segment cannot be flushed, and the zone cannot fill up, before the slot is committed
+    zn_cachemap_insert_data(&cache->cache_map, id, slot.location, share ? data : NULL, len);
+    zn_write_buffer_commit(&cache->write_buffer, &slot);
+    return 0;
+}
+
+/**
+ * @brief Give back the extents of a multi-extent write from `from` on, none of them written
+ */
+static void
+fail_extents(struct zn_cache *cache, const struct zn_extent_list *list, uint32_t from) {
+    for (uint32_t i = from; i < list->nr_extents; i++) {
+        struct zn_pair extent = list->extents[i];
+        // Writers that reserved earlier chunks of the zone may still be writing them
+        zsm_wait_write_turn(&cache->zone_state, &extent);
+        zsm_failed_to_write_batch(&cache->zone_state, extent, extent.nr_chunks);
+    }
+}
+
+/**
+ * @brief Write a miss longer than one extent, as one extent in each of several zones
+ *
+ * Each extent is a batch, so no other writer reserves chunks behind it and the extents can be
+ * written at once without waiting on each other. The extents are reserved by one thread at a
+ * time, which holds the zones it has until it gets the rest. The extents are listed in the
+ * extent map before the head is published, and the zones are returned once the policy knows
+ * the object.
+ */
+static int
+write_miss_extents(struct zn_cache *cache, const uint32_t id, const unsigned char *data,
+                   size_t len, bool share) {
+    uint32_t nr_chunks = (uint32_t) (chunk_bytes(cache, len) / cache->chunk_sz);
+    struct zn_extent_list list = {.nr_extents = 0};
+
+    g_mutex_lock(&cache->extent_lock);
+    for (uint32_t reserved = 0; reserved < nr_chunks;) {
+        uint32_t want = MIN(nr_chunks - reserved, cache->max_extent_chunks);
+        struct zn_pair *extent = &list.extents[list.nr_extents];
+        uint32_t got;
+        enum zsm_get_active_zone_error ret =
+            zsm_get_active_zone_batch(&cache->zone_state, want, want, extent, &got);
+
+        if (ret == ZSM_GET_ACTIVE_ZONE_RETRY) {
+            // The zones held here are not full, so nothing asks for an eviction while they
+            // are held. Make room once the free zones run out.
+            zn_write_buffer_flush_open(&cache->write_buffer);
+            if (zsm_get_num_free_zones(&cache->zone_state) == 0) {
+                zn_fg_evict(cache);
+            }
+            g_thread_yield();
+        } else if (ret == ZSM_GET_ACTIVE_ZONE_ERROR) {
+            g_mutex_unlock(&cache->extent_lock);
+            fail_extents(cache, &list, 0);
+            zn_cachemap_fail(&cache->cache_map, id);
+            return -1;
+        } else if (ret == ZSM_GET_ACTIVE_ZONE_EVICT) {
+            zn_fg_evict(cache);
+        } else {
+            assert(got == want);
+            extent->id = id;
+            list.nr_extents++;
+            reserved += got;
+        }
+    }
+    g_mutex_unlock(&cache->extent_lock);
+    assert(list.nr_extents > 1);
+
+    // Every extent is the newest reservation of its zone, so the writes only wait for the
+    // writers that reserved before this one
+    struct timespec start_time, end_time;
+    TIME_NOW(&start_time);
+    struct zn_io_request requests[ZN_EXTENT_MAP_MAX_EXTENTS];
+    uint32_t nr_submitted = 0;
+    size_t offset = 0;
+    for (uint32_t i = 0; i < list.nr_extents; i++) {
+        struct zn_pair *extent = &list.extents[i];
+        size_t bytes = (size_t) extent->nr_chunks * cache->chunk_sz;
+        zsm_wait_write_turn(&cache->zone_state, extent);
+        unsigned long long wp =
+            CHUNK_POINTER(cache->zone_size, cache->chunk_sz, extent->chunk_offset, extent->zone);
+        requests[i] = (struct zn_io_request) {
+            .buffer = (unsigned char *) data + offset, .len = bytes, .offset = wp, .write = true};
+        if (zn_io_submit(&cache->io, &requests[i]) != 0) {
+            break;
+        }
+        nr_submitted++;
+        offset += bytes;
+    }
+    bool failed = nr_submitted < list.nr_extents;
+    for (uint32_t i = 0; i < nr_submitted; i++) {
+        failed = zn_io_wait(&cache->io, &requests[i]) != 0 || failed;
+    }
+    TIME_NOW(&end_time);
+    double t = TIME_DIFFERENCE_NSEC(start_time, end_time);
+    ZN_PROFILER_UPDATE(cache->profiler, ZN_PROFILER_METRIC_WRITE_LATENCY, t);
+    ZN_PROFILER_PRINTF(cache->profiler, "WRITELATENCY_EVERY,%f\n", t);
+
+    if (failed) {
+        dbg_printf("Couldn't write data_id=%u, %u of %u extents were submitted\n", id,
+                   nr_submitted, list.nr_extents);
+        for (uint32_t i = 0; i < nr_submitted; i++) {
+            // The write pointer moved, the chunks are left unused
+            struct zn_pair *extent = &list.extents[i];
+            zsm_pass_write_turn(&cache->zone_state, extent);
+            zsm_mark_chunk_invalid(&cache->zone_state, extent);
+            zsm_return_active_zone_batch(&cache->zone_state, extent, extent->nr_chunks);
+        }
+        fail_extents(cache, &list, nr_submitted);
+        zn_cachemap_fail(&cache->cache_map, id);
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < list.nr_extents; i++) {
+        zsm_pass_write_turn(&cache->zone_state, &list.extents[i]);
+    }
+
+    // Published while the zones are still held, so none of them can be evicted before the
+    // object is complete in both maps
+    zn_extent_map_insert(&cache->extent_map, &list);
+    zn_cachemap_insert_data(&cache->cache_map, id, list.extents[0], share ? data : NULL, len);
+    cache->eviction_policy.update_policy(cache->eviction_policy.data, list.extents[0], ZN_WRITE);
+    for (uint32_t i = 0; i < list.nr_extents; i++) {
+        zsm_return_active_zone_batch(&cache->zone_state, &list.extents[i],
+                                     list.extents[i].nr_chunks);
+    }
+    return 0;
+}
+
+/**
+ * @brief Write a run of extents of one zone as one chain, see zsm_submit_fn
+ */
+static void
+submit_extents(void *user_data, struct zsm_write **writes, uint32_t nr_writes) {
+    struct zn_cache *cache = user_data;
+    struct zn_io_request requests[ZSM_MAX_WRITE_RUN];
+    for (uint32_t i = 0; i < nr_writes; i++) {
+        struct zn_pair *location = &writes[i]->pair;
+        requests[i] = (struct zn_io_request) {
+            .buffer = writes[i]->data,
+            .len = (size_t) location->nr_chunks * cache->chunk_sz,
+            .offset = CHUNK_POINTER(cache->zone_size, cache->chunk_sz, location->chunk_offset,
+                                    location->zone),
+            .write = true};
+    }
+    zn_io_submit_batch(&cache->io, requests, nr_writes);
+    for (uint32_t i = 0; i < nr_writes; i++) {
+        writes[i]->result = zn_io_wait(&cache->io, &requests[i]);
+    }
+}
+
+int
+zn_cache_write_extent(struct zn_cache *cache, const unsigned char *data,
+                      struct zn_pair *location) {
+    struct timespec start_time, end_time;
+    TIME_NOW(&start_time);
+    int ret;
+    if (cache->zone_state.zone_append) {
+        // Appends don't wait, the device puts them one after the other
+        size_t len = (size_t) location->nr_chunks * cache->chunk_sz;
+        unsigned long long zone_start =
+            CHUNK_POINTER(cache->zone_size, cache->chunk_sz, 0, location->zone);
+        unsigned long long written;
+        zsm_wait_write_turn(&cache->zone_state, location);
+        ret = zn_io_append(&cache->io, data, len, zone_start, &written);
+        if (ret == 0) {
+            location->chunk_offset = (uint32_t) ((written - zone_start) / cache->chunk_sz);
+            zsm_pass_write_turn(&cache->zone_state, location);
+        }
+    } else {
+        // Other threads may hold earlier chunks of the same zone, which have to reach the
+        // device first. The write is queued behind them and submitted along with them.
+        struct zsm_write write = {.pair = *location, .data = (void *) data};
+        ret = zsm_write_ordered(&cache->zone_state, &write, submit_extents, cache);
+    }
+    TIME_NOW(&end_time);
+    double t = TIME_DIFFERENCE_NSEC(start_time, end_time);
+    ZN_PROFILER_UPDATE(cache->profiler, ZN_PROFILER_METRIC_WRITE_LATENCY, t);
+    ZN_PROFILER_PRINTF(cache->profiler, "WRITELATENCY_EVERY,%f\n", t);
+
+    if (ret != 0) {
+        dbg_printf("Couldn't write zone=%u, chunk=%u\n", location->zone, location->chunk_offset);
+        return -1;
+    }
+    return 0;
+}
+
+int
+zn_cache_write_miss(struct zn_cache *cache, const uint32_t id, const unsigned char *data,
+                    size_t len, bool share) {
+    // Objects take whole chunks, so every extent starts aligned
+    assert(len > 0 && len <= cache->max_object_sz);
+    uint32_t nr_chunks = (uint32_t) (chunk_bytes(cache, len) / cache->chunk_sz);
+    if (nr_chunks > cache->max_extent_chunks) {
+        return write_miss_extents(cache, id, data, len, share);
+    }
+    if (zn_write_buffer_enabled(&cache->write_buffer)) {
+        return write_miss_buffered(cache, id, data, len, share);
+    }
+
+    // Repeatedly attempt to get an active zone. This function can fail when there all active
+    // zones are writing, so put this into a while loop.
+    struct zn_pair location;
+    int attempts = 0;
+    while (true) {
+
+        enum zsm_get_active_zone_error ret =
+            zsm_get_active_zone_extent(&cache->zone_state, nr_chunks, &location);
+
+        if (ret == ZSM_GET_ACTIVE_ZONE_RETRY) {
+            attempts++;
+            g_thread_yield();
+        } else if (ret == ZSM_GET_ACTIVE_ZONE_ERROR) {
+            goto UNDO_MAP;
+        } else if (ret == ZSM_GET_ACTIVE_ZONE_EVICT) {
+            zn_fg_evict(cache);
+        } else {
+            break;
+        }
+    }
+    location.id = id;
+
+    if (zn_cache_write_extent(cache, data, &location) != 0) {
+        goto UNDO_ZONE_GET;
+    }
+
+    // Publish the location while the zone is still being written, so it cannot be evicted
+    // between the insert and the zone generation it is stamped with. Threads waiting for
+    // this ID get a copy of the buffer instead of reading it back.
+    zn_cachemap_insert_data(&cache->cache_map, id, location, share ? data : NULL, len);
+
+    // The policy learns about the extent before returning it can close the zone
+    cache->eviction_policy.update_policy(cache->eviction_policy.data, location, ZN_WRITE);
+    zsm_return_active_zone(&cache->zone_state, &location);
+    return 0;
+
+UNDO_ZONE_GET:
+    zsm_failed_to_write(&cache->zone_state, location);
+UNDO_MAP:
+    zn_cachemap_fail(&cache->cache_map, id);
+    return -1;
+}
+
+/**
+ * @brief Hand an object that left the DRAM tier to the device, unless the device still holds it
+ */
+static void
+dram_demote_one(struct zn_cache *cache, struct zn_dram_victim *victim) {
+    while (true) {
+        struct zone_map_result result = zn_cachemap_find(&cache->cache_map, victim->id);
+        if (result.type == RESULT_LOC) {
+            // Promoted from the device earlier and not evicted there since
+            g_atomic_int_dec_and_test(&cache->active_readers[result.location.zone]);
+            break;
+        }
+        if (result.type == RESULT_DATA) {
+            // Another thread is writing or just wrote the ID, look again
+            zn_buffer_put(&cache->buffers, result.data);
+            g_thread_yield();
+            continue;
+        }
+
+        if (zn_write_behind_enabled(&cache->write_behind)) {
+            zn_write_behind_submit(&cache->write_behind, victim->id, victim->data, victim->len);
+        } else {
+            // On failure the ID is a miss next time
+            (void) zn_cache_write_miss(cache, victim->id, victim->data, victim->len, true);
+        }
+        break;
+    }
+}
+
+/**
+ * @brief Hand the victims of a DRAM tier insert to the device
+ *
+ * Each victim stays readable in DRAM until the device has taken it over, so it is not a miss
+ * in between.
+ */
+static void
+dram_demote(struct zn_cache *cache, struct zn_dram_victim *victim) {
+    do {
+        dram_demote_one(cache, victim);
+    } while (zn_dram_tier_release(&cache->dram_tier, victim));
+}
+
+/**
+ * @brief cache_get() for a small object, served by the small object engine alone
+ *
+ * Misses are fetched and logged by the calling thread, no other tier sees small objects. The
+ * key is logged under the first of its fingerprints that is not found holding another key's
+ * object.
+ */
+static unsigned char *
+small_get(struct zn_cache *cache, const struct zn_key *key, unsigned char *random_buffer,
+          unsigned char *dst, size_t *len, struct timespec start_time) {
+    unsigned char *data =
+        dst != NULL ? dst : zn_buffer_get_size(&cache->buffers, ZN_SMALL_OBJECT_MAX);
+    bool hit = false, logged = false;
+    uint64_t collisions = 0;
+    for (uint32_t probe = 0; probe < ZN_KEY_FINGERPRINTS && !hit && !logged; probe++) {
+        uint32_t id = zn_key_fingerprint_at(key, probe);
+        if (!zn_small_cache_get(&cache->small, id, data, len)) {
+            *len = fetch_remote(cache, key, random_buffer, data);
+            zn_small_cache_insert(&cache->small, id, data, *len);
+            logged = true;
+        } else if (zn_key_matches(key, data, *len)) {
+            hit = true;
+        } else {
+            collisions++;
+        }
+    }
+    if (!hit && !logged) {
+        // Every fingerprint is held by another key, which stay cached
+        *len = fetch_remote(cache, key, random_buffer, data);
+    }
+
+    g_mutex_lock(&cache->ratio.lock);
+    if (hit) {
         cache->ratio.hits++;
-        g_mutex_unlock(&cache->ratio.lock);
+    } else {
+        cache->ratio.misses++;
+    }
+    cache->ratio.collisions += collisions;
+    g_mutex_unlock(&cache->ratio.lock);
 
-        TIME_NOW(&total_end_time);
-        t = TIME_DIFFERENCE_NSEC(total_start_time, total_end_time);
+    struct timespec end_time;
+    TIME_NOW(&end_time);
+    double t = TIME_DIFFERENCE_NSEC(start_time, end_time);
+    if (hit) {
         ZN_PROFILER_PRINTF(cache->profiler, "CACHEHITLATENCY_EVERY,%f\n", t);
         ZN_PROFILER_UPDATE(cache->profiler, ZN_PROFILER_METRIC_HIT_LATENCY, t);
-        ZN_PROFILER_UPDATE(cache->profiler, ZN_PROFILER_METRIC_CACHE_HIT_THROUGHPUT, cache->chunk_sz);
+        ZN_PROFILER_UPDATE(cache->profiler, ZN_PROFILER_METRIC_CACHE_HIT_THROUGHPUT, *len);
+    } else {
+        ZN_PROFILER_PRINTF(cache->profiler, "CACHEMISSLATENCY_EVERY,%f\n", t);
+        ZN_PROFILER_UPDATE(cache->profiler, ZN_PROFILER_METRIC_MISS_LATENCY, t);
+        ZN_PROFILER_UPDATE(cache->profiler, ZN_PROFILER_METRIC_CACHE_MISS_THROUGHPUT, *len);
+    }
+    return data;
+}
+
+/**
+ * @brief Count a hit of `len` bytes for a get that started at `start_time`
+ *
+ * @param dram Whether the hit was served by the DRAM tier
+ */
+static void
+record_hit(struct zn_cache *cache, struct timespec start_time, size_t len, bool dram) {
+    g_mutex_lock(&cache->ratio.lock);
+    cache->ratio.hits++;
+    cache->ratio.dram_hits += dram ? 1 : 0;
+    g_mutex_unlock(&cache->ratio.lock);
 
-        return data;
-    } else { // result.type == RESULT_COND
+    struct timespec end_time;
+    TIME_NOW(&end_time);
+    double t = TIME_DIFFERENCE_NSEC(start_time, end_time);
+    ZN_PROFILER_PRINTF(cache->profiler, "CACHEHITLATENCY_EVERY,%f\n", t);
+    ZN_PROFILER_UPDATE(cache->profiler, ZN_PROFILER_METRIC_HIT_LATENCY, t);
+    ZN_PROFILER_UPDATE(cache->profiler, ZN_PROFILER_METRIC_CACHE_HIT_THROUGHPUT, len);
+}
 
-        // Repeatedly attempt to get an active zone. This function can fail when there all active
-        // zones are writing, so put this into a while loop.
-        struct zn_pair location;
-	int attempts = 0;
-        while (true) {
+/**
+ * @brief Count a miss of `len` bytes for a get that started at `start_time`
+ */
+static void
+record_miss(struct zn_cache *cache, struct timespec start_time, size_t len) {
+    g_mutex_lock(&cache->ratio.lock);
+    cache->ratio.misses++;
+    g_mutex_unlock(&cache->ratio.lock);
 
-            enum zsm_get_active_zone_error ret = zsm_get_active_zone(&cache->zone_state, &location);
+    struct timespec end_time;
+    TIME_NOW(&end_time);
+    double t = TIME_DIFFERENCE_NSEC(start_time, end_time);
+    ZN_PROFILER_PRINTF(cache->profiler, "CACHEMISSLATENCY_EVERY,%f\n", t);
+    ZN_PROFILER_UPDATE(cache->profiler, ZN_PROFILER_METRIC_MISS_LATENCY, t);
+    ZN_PROFILER_UPDATE(cache->profiler, ZN_PROFILER_METRIC_CACHE_MISS_THROUGHPUT, len);
+}
 
-            if (ret == ZSM_GET_ACTIVE_ZONE_RETRY) {
-                attempts++;
-                g_thread_yield();
-            } else if (ret == ZSM_GET_ACTIVE_ZONE_ERROR) {
-                goto UNDO_MAP;
-            } else if (ret == ZSM_GET_ACTIVE_ZONE_EVICT) {
-                zn_fg_evict(cache);
-            } else {
-                break;
-            }
+/**
+ * @brief Bytes of [offset, offset + len) inside an object of `object_len` bytes
+ */
+static size_t
+range_bytes(size_t object_len, size_t offset, size_t len) {
+    return offset < object_len ? MIN(len, object_len - offset) : 0;
+}
+
+/**
+ * @brief Read bytes [offset, offset + len) of the object at `location` into `data`, each byte
+ * at its offset in the object, along with the ZN_DIRECT_ALIGNMENT block holding its header
+ *
+ * Only the blocks that cover the range are read from the device, and only from the extents
+ * that overlap it. Objects still in the write buffer are copied whole. Drops the reader count
+ * that the cache map lookup of `location` took.
+ *
+ * Objects take whole chunks on the device, the header in their first block has their bytes.
+ * Only that block is read of an object longer than `data`, which cannot be the key's.
+ *
+ * @param location Location of the object's head, a RESULT_LOC of the cache map
+ * @param len Bytes to read, clipped to the end of the object
+ * @param data A ZN_DIRECT_ALIGNMENT aligned buffer of `max_len` bytes
+ * @param max_len Bytes `data` holds, at least the object of the key rounded up to chunks
+ * @param[out] object_len Set to the bytes of the whole object
+ * @param[out] torn Set if the object lost extents to eviction while they were read
+ * @return 0 on success, -1 on error
+ */
+static int
+read_hit(struct zn_cache *cache, struct zn_pair location, size_t offset, size_t len,
+         unsigned char *data, size_t max_len, size_t *object_len, bool *torn) {
+    struct timespec start_time, end_time;
+    TIME_NOW(&start_time);
+    *torn = false;
+    int ret = 0;
+
+    // Only a full extent can be the head of a longer object
+    struct zn_extent_list extents = {.nr_extents = 1, .extents = {location}};
+    bool several = location.nr_chunks == cache->max_extent_chunks &&
+                   cache->max_object_chunks > cache->max_extent_chunks &&
+                   zn_extent_map_acquire(&cache->extent_map, &location, &extents);
+    *object_len = zn_extent_list_chunks(&extents) * cache->chunk_sz;
+    bool oversize = *object_len > max_len;
+    if (oversize) {
+        offset = len = 0;
+    }
+
+    // Objects still in the write buffer are copied from DRAM. The policy has not been told about
+    // them yet, the flush reports them as written.
+    bool from_device =
+        several || oversize || !zn_write_buffer_read(&cache->write_buffer, &location, data);
+    if (from_device) {
+        assert(location.nr_chunks > 0 && location.nr_chunks <= cache->max_extent_chunks);
+        size_t block = ZN_DIRECT_ALIGNMENT;
+        len = range_bytes(*object_len, offset, len);
+
+        // The header is in the first block, read along with the range when they are next to
+        // each other. Objects are whole chunks, so the first block is always there.
+        bool apart = offset - offset % block > block;
+        struct zn_io_request requests[ZN_EXTENT_MAP_MAX_EXTENTS + 1];
+        uint32_t nr_requests = 0;
+        ret = read_extents_submit(cache, &extents, 0, apart ? block : MAX(offset + len, block),
+                                  data, requests, &nr_requests);
+        if (ret == 0 && apart) {
+            ret = read_extents_submit(cache, &extents, offset, len, data, requests,
+                                      &nr_requests);
+        }
+
+        // A failed submit already waited for the reads it left behind
+        if (ret == 0) {
+            ret = wait_all(cache, requests, nr_requests);
+        }
+    }
+    if (ret == 0) {
+        // The last chunk of an object is padded, unless the header is another object's
+        struct zn_object_header header;
+        memcpy(&header, data, sizeof(header));
+        if (header.len <= *object_len && header.len + cache->chunk_sz > *object_len) {
+            *object_len = header.len;
         }
+    }
+    if (several) {
+        // An eviction that does not wait for readers may have reset an extent under the reads,
+        // the data is only whole if the object was not dropped in the meantime
+        *torn = !zn_extent_map_release(&cache->extent_map, &extents);
+    }
 
-        // Emulates pulling in data from a remote source by filling in a cache entry with random
-        // bytes
-        data = zn_gen_write_buffer(cache, id, random_buffer);
+    TIME_NOW(&end_time);
+    double t = TIME_DIFFERENCE_NSEC(start_time, end_time);
+    ZN_PROFILER_UPDATE(cache->profiler, ZN_PROFILER_METRIC_READ_LATENCY, t);
+    ZN_PROFILER_PRINTF(cache->profiler, "READLATENCY_EVERY,%f\n", t);
 
-        // Write buffer to disk, 4kb blocks at a time
-        unsigned long long wp =
-            CHUNK_POINTER(cache->zone_size, cache->chunk_sz, location.chunk_offset, location.zone);
-
-        struct timespec start_time, end_time;
-        TIME_NOW(&start_time);
-        int ret = zn_write_out(cache->fd, cache->chunk_sz, data, cache->io_size, wp);
-        TIME_NOW(&end_time);
-        double t = TIME_DIFFERENCE_NSEC(start_time, end_time);
-        ZN_PROFILER_UPDATE(cache->profiler, ZN_PROFILER_METRIC_WRITE_LATENCY, t);
-        ZN_PROFILER_PRINTF(cache->profiler, "WRITELATENCY_EVERY,%f\n", t);
-
-        if (ret != 0) {
-            dbg_printf("Couldn't write to fd at wp=%llu, zone=%u, chunk=%u\n", wp, location.chunk_offset, location.zone);
-            goto UNDO_ZONE_GET;
+    // Sadly, we have to remember to decrement the reader count here
+    g_atomic_int_dec_and_test(&cache->active_readers[location.zone]);
+
+    // Only once no reader count is held: chunk GC waits for the readers of a zone with the
+    // policy lock held. Both policies ignore a location that was evicted in between.
+    if (from_device) {
+        cache->eviction_policy.update_policy(cache->eviction_policy.data, location, ZN_READ);
+    }
+    return ret;
+}
+
+/**
+ * @brief Fetch a miss into `data` and hand it to the tiers under `id`, called with RESULT_COND
+ * for it
+ *
+ * The fetch happens before an active zone is reserved, so a zone is only held for the device
+ * write and concurrent misses are not limited by the number of active zones.
+ *
+ * @param[out] len Set to the bytes of object data
+ * @return 0 on success, -1 if the write failed
+ */
+static int
+fill_miss(struct zn_cache *cache, const struct zn_key *key, uint32_t id,
+          unsigned char *random_buffer, unsigned char *data, size_t *len) {
+    // Emulates pulling in data from a remote source by filling in a cache entry with random
+    // bytes
+    *len = fetch_remote(cache, key, random_buffer, data);
+
+    // With a DRAM tier the miss only goes to DRAM, the device takes objects as they leave
+    // it. With write-behind the caller does not wait for the device, lookups of the ID are
+    // served from a copy until the writer pool has published its location.
+    if (zn_dram_tier_enabled(&cache->dram_tier)) {
+        struct zn_dram_victim victim;
+        bool evicted = zn_dram_tier_insert(&cache->dram_tier, id, data, *len, &victim);
+        // Inserted first, so lookups find the ID in one of the two
+        zn_cachemap_fail_data(&cache->cache_map, id, data, *len);
+        if (evicted) {
+            dram_demote(cache, &victim);
+        }
+    } else if (zn_write_behind_enabled(&cache->write_behind)) {
+        zn_write_behind_submit(&cache->write_behind, id, data, *len);
+    } else if (zn_cache_write_miss(cache, id, data, *len, true) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Outcome of a lookup under one fingerprint of a key, see get_at()
+ */
+enum get_outcome {
+    GET_SERVED, /**< The key was served, by a hit or by a miss */
+    GET_TAKEN,  /**< Another key's object holds the fingerprint */
+    GET_ERROR,
+};
+
+/**
+ * @brief Serve bytes [offset, offset + len) of `key`, looked up under fingerprint `id`
+ *
+ * Hot entries are served from DRAM without a lookup in the cache map. Device hits read only the
+ * blocks that cover the range, and are promoted to the DRAM tier if they are whole because it
+ * holds whole objects. Anything else is served whole: from DRAM, from a copy of another
+ * thread's write, or by a miss, which fetches and caches the whole object under `id` so that
+ * later ranges of it are hits. Hits and misses are counted with the bytes of the range.
+ *
+ * Every tier is indexed by fingerprints, so whatever a tier returns is checked against the key
+ * in its object header.
+ *
+ * @param data A ZN_DIRECT_ALIGNMENT aligned buffer of `max_len` bytes, left to the caller when
+ *     another key's object holds `id`
+ * @param max_len Bytes `data` holds, at least the object of `key` rounded up to chunks
+ * @param copy Whether the object has to end up in `data`. Otherwise a copy of another thread's
+ *     write is served in its place, and `data` is returned to the pool.
+ * @param[out] out Set to the buffer holding the object when the key was served
+ * @param[out] object_len Set to the bytes of the whole object when the key was served
+ */
+static enum get_outcome
+get_at(struct zn_cache *cache, const struct zn_key *key, uint32_t id, unsigned char *random_buffer,
+       size_t offset, size_t len, unsigned char *data, size_t max_len, bool copy,
+       struct timespec start_time, unsigned char **out, size_t *object_len) {
+    *out = data;
+
+    // A longer object than the key's is another key's, and was not copied
+    if (zn_dram_tier_enabled(&cache->dram_tier) &&
+        zn_dram_tier_get(&cache->dram_tier, id, data, max_len, object_len)) {
+        if (*object_len > max_len || !zn_key_matches(key, data, *object_len)) {
+            return GET_TAKEN;
         }
+        record_hit(cache, start_time, range_bytes(*object_len, offset, len), true);
+        return GET_SERVED;
+    }
 
+    struct zone_map_result result = zn_cachemap_find(&cache->cache_map, id);
+    assert(result.type != RESULT_EMPTY);
+
+    // Waited for another thread's write of the same ID and got a copy of its data. The
+    // writer already updated the eviction policy, and no reader count is held. The other
+    // thread may have fetched another key with the same fingerprint.
+    if (result.type == RESULT_DATA) {
+        if (!zn_key_matches(key, result.data, result.size)) {
+            zn_buffer_put(&cache->buffers, result.data);
+            return GET_TAKEN;
+        }
+        *object_len = result.size;
+        assert(*object_len <= max_len);
+        if (copy) {
+            memcpy(data, result.data, *object_len);
+            zn_buffer_put(&cache->buffers, result.data);
+        } else {
+            zn_buffer_put(&cache->buffers, data);
+            *out = result.data;
+        }
+        record_hit(cache, start_time, range_bytes(*object_len, offset, len), false);
+        return GET_SERVED;
+    }
+
+    // Found the entry, read it from disk, update eviction, and decrement reader.
+    if (result.type == RESULT_LOC) {
+        bool torn;
+        if (read_hit(cache, result.location, offset, len, data, max_len, object_len, &torn) !=
+            0) {
+            return GET_ERROR;
+        }
+        if (torn || !zn_key_matches(key, data, *object_len)) {
+            // The key's own object when it lost extents, or when only its head is left and
+            // reads as the start of a longer object of the key. It is fetched and not cached.
+            struct zn_object_header header;
+            memcpy(&header, data, sizeof(header));
+            if (!torn && (header.key_hash != key->hash || header.len <= *object_len)) {
+                return GET_TAKEN;
+            }
+            *object_len = fetch_remote(cache, key, random_buffer, data);
+            record_miss(cache, start_time, range_bytes(*object_len, offset, len));
+            return GET_SERVED;
+        }
+
+        // Back into DRAM, the device keeps its copy until it evicts it
+        struct zn_dram_victim victim;
+        if (offset == 0 && len >= *object_len && zn_dram_tier_enabled(&cache->dram_tier) &&
+            zn_dram_tier_insert(&cache->dram_tier, id, data, *object_len, &victim)) {
+            dram_demote(cache, &victim);
+        }
+
+        record_hit(cache, start_time, range_bytes(*object_len, offset, len), false);
+        return GET_SERVED;
+    }
+
+    // result.type == RESULT_COND
+    if (fill_miss(cache, key, id, random_buffer, data, object_len) != 0) {
+        return GET_ERROR;
+    }
+    record_miss(cache, start_time, range_bytes(*object_len, offset, len));
+    return GET_SERVED;
+}
+
+/**
+ * @brief Serve bytes [offset, offset + len) of `key` with get_at(), under the first of its
+ * fingerprints that does not hold another key's object
+ *
+ * A key whose fingerprints all hold other keys' objects is fetched into `data` and not cached,
+ * the other keys stay cached. A key cached under a later fingerprint is cached again under an
+ * earlier one once that is free, and its older copy is left to eviction.
+ *
+ * @return The buffer holding the object, or NULL on error, which returns `data` to the pool
+ *         unless `copy` is set
+ */
+static unsigned char *
+lookup(struct zn_cache *cache, const struct zn_key *key, unsigned char *random_buffer,
+       size_t offset, size_t len, unsigned char *data, size_t max_len, bool copy,
+       struct timespec start_time, size_t *object_len) {
+    for (uint32_t probe = 0; probe < ZN_KEY_FINGERPRINTS; probe++) {
+        uint32_t id = zn_key_fingerprint_at(key, probe);
+        unsigned char *out;
+        enum get_outcome outcome = get_at(cache, key, id, random_buffer, offset, len, data,
+                                          max_len, copy, start_time, &out, object_len);
+        if (outcome == GET_SERVED) {
+            return out;
+        }
+        if (outcome == GET_ERROR) {
+            if (!copy) {
+                zn_buffer_put(&cache->buffers, data);
+            }
+            return NULL;
+        }
+        dbg_printf("Key of %zu bytes collides on fingerprint %u\n", key->len, id);
         g_mutex_lock(&cache->ratio.lock);
-        cache->ratio.misses++;
+        cache->ratio.collisions++;
         g_mutex_unlock(&cache->ratio.lock);
+    }
 
-        // Update metadata
-        zsm_return_active_zone(&cache->zone_state, &location);
+    *object_len = fetch_remote(cache, key, random_buffer, data);
+    record_miss(cache, start_time, range_bytes(*object_len, offset, len));
+    return data;
+}
 
-        cache->eviction_policy.update_policy(cache->eviction_policy.data, location, ZN_WRITE);
+/**
+ * @brief Get an entry into `dst`, or into a buffer from the pool if `dst` is NULL
+ *
+ * Hits read from the device and misses fetch straight into the destination, which the miss
+ * then writes to the device. Only a thread that waited for another thread's miss copies,
+ * and only if it brought its own destination.
+ *
+ * Buffers from the pool are of the size class of the key's object. An object found for a
+ * fingerprint that is longer than the buffer is another key's and is not copied into it.
+ *
+ * @param dst A ZN_DIRECT_ALIGNMENT aligned buffer of `dst_len` bytes, or NULL
+ * @param dst_len Bytes `dst` holds, at least the key's object rounded up to chunks
+ * @param[out] len Set to the bytes of object data on success
+ * @return The buffer holding the data (`dst` if it was given), or NULL on error
+ */
+static unsigned char *
+cache_get(struct zn_cache *cache, const struct zn_key *key, unsigned char *random_buffer,
+          unsigned char *dst, size_t dst_len, size_t *len) {
+    assert(key->len <= ZN_KEY_MAX);
 
-        zn_cachemap_insert(&cache->cache_map, id, location);
+    // PROFILE
+    struct timespec total_start_time;
+    TIME_NOW(&total_start_time);
 
-        TIME_NOW(&total_end_time);
-        t = TIME_DIFFERENCE_NSEC(total_start_time, total_end_time);
-        ZN_PROFILER_PRINTF(cache->profiler, "CACHEMISSLATENCY_EVERY,%f\n", t);
-        ZN_PROFILER_UPDATE(cache->profiler, ZN_PROFILER_METRIC_MISS_LATENCY, t);
-        ZN_PROFILER_UPDATE(cache->profiler, ZN_PROFILER_METRIC_CACHE_MISS_THROUGHPUT, cache->chunk_sz);
+    if (is_small_object(cache, key)) {
+        return small_get(cache, key, random_buffer, dst, len, total_start_time);
+    }
+    unsigned char *data =
+        dst != NULL ? dst : zn_buffer_get_size(&cache->buffers, zn_cache_object_size(cache, key));
+    size_t max_len = dst != NULL ? dst_len : zn_buffer_size(&cache->buffers, data);
+    return lookup(cache, key, random_buffer, 0, SIZE_MAX, data, max_len, dst != NULL,
+                  total_start_time, len);
+}
 
-        return data;
+/**
+ * @brief zn_cache_get_range() for an object of the device tiers, into a buffer from the pool
+ *
+ * @param[out] object_len Set to the bytes of the whole object on success
+ * @return The buffer holding the range at its offset in the object, or NULL on error
+ */
+static unsigned char *
+range_get(struct zn_cache *cache, const struct zn_key *key, unsigned char *random_buffer,
+          size_t offset, size_t len, size_t *object_len) {
+    struct timespec start_time;
+    TIME_NOW(&start_time);
+
+    unsigned char *data = zn_buffer_get_size(&cache->buffers, zn_cache_object_size(cache, key));
+    size_t max_len = zn_buffer_size(&cache->buffers, data);
+    return lookup(cache, key, random_buffer, offset, len, data, max_len, false, start_time,
+                  object_len);
+}
 
-    UNDO_ZONE_GET:
-        zsm_failed_to_write(&cache->zone_state, location);
-    UNDO_MAP:
-        zn_cachemap_fail(&cache->cache_map, id);
+ssize_t
+zn_cache_get_range(struct zn_cache *cache, const struct zn_key *key, unsigned char *random_buffer,
+                   size_t offset, size_t len, unsigned char *buf) {
+    assert(key->len <= ZN_KEY_MAX);
+    assert(buf);
+
+    // A small object is read with the rest of its set page, and is shorter than a block
+    size_t object_len;
+    unsigned char *data = is_small_object(cache, key)
+                              ? cache_get(cache, key, random_buffer, NULL, 0, &object_len)
+                              : range_get(cache, key, random_buffer, offset, len, &object_len);
+    if (data == NULL) {
+        return -1;
+    }
 
+    size_t bytes = range_bytes(object_len, offset, len);
+    if (bytes > 0) {
+        memcpy(buf, data + offset, bytes);
+    }
+    zn_buffer_put(&cache->buffers, data);
+    return (ssize_t) bytes;
+}
+
+unsigned char *
+zn_cache_get(struct zn_cache *cache, const struct zn_key *key, unsigned char *random_buffer) {
+    size_t len;
+    return cache_get(cache, key, random_buffer, NULL, 0, &len);
+}
+
+int
+zn_cache_get_into(struct zn_cache *cache, const struct zn_key *key, unsigned char *random_buffer,
+                  unsigned char *buf, size_t len) {
+    assert(buf);
+    size_t object_sz = zn_cache_object_size(cache, key);
+    if (len < object_sz) {
+        return -1;
+    }
+
+    // O_DIRECT needs an aligned destination that holds whole chunks, bounce through the pool
+    // otherwise
+    size_t object_len;
+    if (((uintptr_t) buf % ZN_DIRECT_ALIGNMENT) != 0 || len < chunk_bytes(cache, object_sz)) {
+        unsigned char *data = cache_get(cache, key, random_buffer, NULL, 0, &object_len);
+        if (data == NULL) {
+            return -1;
+        }
+        memcpy(buf, data, object_len);
+        zn_buffer_put(&cache->buffers, data);
+        return 0;
+    }
+
+    return cache_get(cache, key, random_buffer, buf, len, &object_len) == NULL ? -1 : 0;
+}
+
+struct zn_cache_handle *
+zn_cache_get_handle(struct zn_cache *cache, const struct zn_key *key,
+                    unsigned char *random_buffer) {
+    size_t len;
+    unsigned char *data = cache_get(cache, key, random_buffer, NULL, 0, &len);
+    if (data == NULL) {
         return NULL;
     }
+
+    struct zn_cache_handle *handle = g_new(struct zn_cache_handle, 1);
+    handle->data = data;
+    handle->len = len;
+    handle->refcount = 1;
+    handle->cache = cache;
+    return handle;
+}
+
+struct zn_cache_handle *
+zn_cache_handle_ref(struct zn_cache_handle *handle) {
+    assert(handle);
+    g_atomic_int_inc(&handle->refcount);
+    return handle;
+}
+
+void
+zn_cache_handle_unref(struct zn_cache_handle *handle) {
+    if (handle == NULL || !g_atomic_int_dec_and_test(&handle->refcount)) {
+        return;
+    }
+    zn_buffer_put(&handle->cache->buffers, handle->data);
+    g_free(handle);
+}
+
+/**
+ * @brief Register a slab of the buffer pool with the I/O engine, see zn_buffer_pool_watch_slabs()
+ */
+static void
+register_slab(void *io, void *base, size_t len) {
+    zn_io_register_region(io, base, len);
 }
 
 void
 zn_init_cache(struct zn_cache *cache, struct zbd_info *info, size_t chunk_sz, uint64_t zone_cap,
               int fd, enum zn_evict_policy_type policy, enum zn_backend backend, uint32_t* workload_buffer,
-              uint64_t workload_max, char *metrics_file) {
+              uint64_t workload_max, char *metrics_file, enum zn_io_engine io_engine) {
+    // Objects of several sizes are packed at the I/O alignment, whatever the chunk size
+    if (OBJECT_SIZE_MAX > 0) {
+        chunk_sz = ZN_DIRECT_ALIGNMENT;
+    }
     cache->fd = fd;
     cache->chunk_sz = chunk_sz;
     cache->nr_zones = info->nr_zones;
@@ -176,6 +1057,43 @@ zn_init_cache(struct zn_cache *cache, struct zbd_info *info, size_t chunk_sz, ui
     cache->zone_size = info->zone_size;
     cache->max_zone_chunks = zone_cap / chunk_sz;
     cache->backend = backend;
+
+    // The small object engine takes the last zones and one of the active zones
+    uint32_t small_zones = SMALL_OBJECT_ZONES;
+    if (small_zones > 0) {
+        assert(small_zones < cache->nr_zones && cache->max_nr_active_zones > 1);
+        cache->nr_zones -= small_zones;
+        cache->max_nr_active_zones--;
+        if (OBJECT_SIZE_MAX == 0) {
+            fprintf(stderr, "Objects all take a chunk, none is small enough for the small object "
+                            "engine without OBJECT_SIZE_MAX\n");
+        }
+    }
+
+    // Cache map entries hold the zone and the chunk offset in fixed bits. Release builds leave
+    // out the asserts that pack them, a device that does not fit would wrap into other fields.
+    if (cache->max_zone_chunks > ZN_CACHEMAP_MAX_ZONE_CHUNKS) {
+        fprintf(stderr,
+                "Error: Zones of %" PRIu64 " chunks of %zu bytes, at most %u chunks per zone fit "
+                "in a cache map entry\n",
+                cache->max_zone_chunks, chunk_sz, ZN_CACHEMAP_MAX_ZONE_CHUNKS);
+        exit(EXIT_FAILURE);
+    }
+    if (cache->nr_zones > ZN_CACHEMAP_MAX_ZONES) {
+        fprintf(stderr, "Error: %u zones, at most %u fit in a cache map entry\n", cache->nr_zones,
+                ZN_CACHEMAP_MAX_ZONES);
+        exit(EXIT_FAILURE);
+    }
+
+    // Objects span whole chunks. An extent is as long as a cache map entry can describe and
+    // fits in a zone, longer objects take one extent per active zone.
+    cache->max_extent_chunks =
+        (uint32_t) MIN(ZN_CACHEMAP_MAX_EXTENT_CHUNKS, cache->max_zone_chunks);
+    uint64_t object_chunks = ((uint64_t) OBJECT_SIZE_MAX + chunk_sz - 1) / chunk_sz;
+    uint32_t max_extents = MIN(ZN_EXTENT_MAP_MAX_EXTENTS, cache->max_nr_active_zones);
+    cache->max_object_chunks = (uint32_t) CLAMP(
+        object_chunks, 1, (uint64_t) cache->max_extent_chunks * max_extents);
+    cache->max_object_sz = cache->max_object_chunks * chunk_sz;
     cache->active_readers = calloc(cache->nr_zones, sizeof(gint));
     cache->reader.workload_buffer = workload_buffer;
     cache->reader.workload_max = workload_max;
@@ -186,17 +1104,43 @@ zn_init_cache(struct zn_cache *cache, struct zbd_info *info, size_t chunk_sz, ui
     printf("\tnr_zones=%u\n", cache->nr_zones);
     printf("\tzone_cap=%" PRIu64 "\n", cache->zone_cap);
     printf("\tmax_zone_chunks=%" PRIu64 "\n", cache->max_zone_chunks);
+    printf("\tmax_extent_chunks=%u\n", cache->max_extent_chunks);
+    printf("\tmax_object_chunks=%u\n", cache->max_object_chunks);
     printf("\tmax_nr_active_zones=%u\n", cache->max_nr_active_zones);
+    printf("\tsmall_object_zones=%u\n", small_zones);
 #endif
 
     // Set up the data structures
-    zn_cachemap_init(&cache->cache_map, cache->nr_zones, cache->active_readers);
+#ifdef HUGEPAGE_BUFFERS
+    zn_buffer_pool_init(&cache->buffers, cache->max_object_sz, true);
+#else
+    zn_buffer_pool_init(&cache->buffers, cache->max_object_sz, false);
+#endif
+    // Objects average half of the largest size, entries take the size class of theirs
+    size_t entry_sz = OBJECT_SIZE_MAX == 0 ? chunk_sz : MAX(chunk_sz, cache->max_object_sz / 2);
+    zn_dram_tier_init(&cache->dram_tier, DRAM_TIER_SIZE, entry_sz, &cache->buffers);
+    zn_cachemap_init(&cache->cache_map, cache->nr_zones, cache->active_readers, CACHEMAP_SHARDS);
+    cache->cache_map.buffers = &cache->buffers;
+    zn_extent_map_init(&cache->extent_map, cache->nr_zones, cache->active_readers);
+    g_mutex_init(&cache->extent_lock);
     zn_evict_policy_init(&cache->eviction_policy, policy, cache);
     zsm_init(&cache->zone_state, cache->nr_zones, fd, zone_cap, cache->zone_size, chunk_sz,
              cache->max_nr_active_zones, cache->backend);
+    zn_write_buffer_init(&cache->write_buffer, cache, WRITE_BUFFER_SIZE,
+                         cache->max_nr_active_zones);
+    if (zn_write_buffer_enabled(&cache->write_buffer)) {
+        // Segments are written at the offsets they reserved
+        cache->zone_state.zone_append = false;
+    }
+    if (cache->max_object_chunks > cache->max_extent_chunks) {
+        // So are the extents of an object, which reserve their zones together
+        cache->zone_state.zone_append = false;
+    }
 
     cache->ratio.hits = 0;
+    cache->ratio.dram_hits = 0;
     cache->ratio.misses = 0;
+    cache->ratio.collisions = 0;
     g_mutex_init(&cache->ratio.lock);
 
     cache->profiler = NULL;
@@ -209,7 +1153,19 @@ zn_init_cache(struct zn_cache *cache, struct zbd_info *info, size_t chunk_sz, ui
     cache->reader.workload_index = 0;
     cache->reader.thresh_perc = 0;
 
-    cache->io_size = MAX_IO == 0 ? cache->chunk_sz : MAX_IO;
+    cache->io_size = MAX_IO == 0 ? cache->max_object_sz : MAX_IO;
+    zn_io_init(&cache->io, io_engine, fd, cache->io_size, backend == ZE_BACKEND_ZNS);
+    // Gets and misses transfer straight from the pool's buffers
+    zn_buffer_pool_watch_slabs(&cache->buffers, register_slab, &cache->io);
+    if (cache->zone_state.zone_append &&
+        zn_io_enable_append(&cache->io, cache->max_object_sz) != 0) {
+        fprintf(stderr, "Zone append is not available, writing at reserved offsets\n");
+        cache->zone_state.zone_append = false;
+    }
+    // Set pages are read into the cache's buffers, which hold at least one chunk
+    zn_small_cache_init(&cache->small, &cache->io, &cache->buffers, fd, backend, cache->nr_zones,
+                        small_zones, cache->zone_size, zone_cap, SMALL_OBJECT_LOG_SIZE);
+    zn_write_behind_init(&cache->write_behind, cache, WRITE_BEHIND_THREADS);
 
     /* VERIFY_ZE_CACHE(cache); */
 }
@@ -217,10 +1173,85 @@ zn_init_cache(struct zn_cache *cache, struct zbd_info *info, size_t chunk_sz, ui
 void
 zn_destroy_cache(struct zn_cache *cache) {
     (void) cache;
+    // Misses still queued reach the device before anything is torn down
+    if (zn_write_behind_enabled(&cache->write_behind)) {
+        zn_write_behind_drain(&cache->write_behind);
+        struct zn_write_behind_stats behind_stats;
+        zn_write_behind_get_stats(&cache->write_behind, &behind_stats);
+        printf("Write-behind: %" PRIu64 " misses written (%" PRIu64 " failed), %" PRIu64
+               " stalls\n", behind_stats.nr_writes, behind_stats.nr_failed, behind_stats.nr_stalls);
+    }
+    zn_write_behind_destroy(&cache->write_behind);
+    zn_write_buffer_flush_all(&cache->write_buffer);
+    if (zn_write_buffer_enabled(&cache->write_buffer)) {
+        struct zn_write_buffer_stats wb_stats;
+        zn_write_buffer_get_stats(&cache->write_buffer, &wb_stats);
+        printf("Write buffer: %" PRIu64 " chunks in %" PRIu64 " segment writes (%" PRIu64
+               " partial, %" PRIu64 " failed)\n",
+               wb_stats.nr_chunks, wb_stats.nr_flushes, wb_stats.nr_partial, wb_stats.nr_failed);
+    }
+    zn_write_buffer_destroy(&cache->write_buffer);
+    if (zn_dram_tier_enabled(&cache->dram_tier)) {
+        struct zn_dram_tier_stats dram_stats;
+        zn_dram_tier_get_stats(&cache->dram_tier, &dram_stats);
+        printf("DRAM tier: %" PRIu64 " entries, %" PRIu64 " hits in %" PRIu64 " lookups, %" PRIu64
+               " moved to the device tier\n",
+               dram_stats.nr_entries, dram_stats.hits, dram_stats.lookups, dram_stats.evictions);
+    }
+    zn_dram_tier_destroy(&cache->dram_tier);
+    if (zn_small_cache_enabled(&cache->small)) {
+        struct zn_small_cache_stats small_stats;
+        zn_small_cache_get_stats(&cache->small, &small_stats);
+        printf("Small objects: %" PRIu64 " hits in %" PRIu64 " lookups, %" PRIu64 " objects in %"
+               PRIu64 " set writes, %" PRIu64 " logged, %" PRIu64 " sets dropped with %" PRIu64
+               " zones, %zu bytes of metadata for %" PRIu64 " sets\n",
+               small_stats.hits, small_stats.lookups, small_stats.objects_flushed,
+               small_stats.set_writes, small_stats.nr_logged, small_stats.sets_dropped,
+               small_stats.zones_reclaimed, small_stats.metadata_bytes, small_stats.nr_sets);
+    }
+    zn_small_cache_destroy(&cache->small);
+
     if (cache->profiler != NULL) {
         zn_profiler_close(cache->profiler);
     }
 
+    printf("Keys: %" PRIu64 " fingerprints found holding another key's object\n",
+           cache->ratio.collisions);
+
+    struct zn_cachemap_stats stats;
+    zn_cachemap_get_stats(&cache->cache_map, &stats);
+    printf("Cache map: %" PRIu64 " resident keys, %" PRIu64 " entries, %zu bytes of metadata "
+           "(index=%zu, waiters=%zu), %.1f bytes per resident key\n",
+           stats.nr_keys, stats.nr_entries, stats.total_bytes, stats.index_bytes, stats.waiter_bytes,
+           stats.nr_keys > 0 ? (double) stats.total_bytes / stats.nr_keys : 0.0);
+
+    struct zn_buffer_pool_stats buffer_stats;
+    zn_buffer_pool_get_stats(&cache->buffers, &buffer_stats);
+    printf("Buffer pool: %" PRIu64 " buffers in %" PRIu64 " slabs, %zu bytes%s\n",
+           buffer_stats.nr_buffers, buffer_stats.nr_slabs, buffer_stats.total_bytes,
+           buffer_stats.hugepages ? " (huge pages)" : "");
+
+    struct zn_read_buffer_stats read_stats;
+    if (zn_evict_policy_get_read_buffer_stats(&cache->eviction_policy, &read_stats)) {
+        uint64_t nr_hits = read_stats.nr_applied + read_stats.nr_dropped;
+        printf("Read buffer: %" PRIu64 " hits applied in %" PRIu64 " batches, %" PRIu64
+               " dropped (%.2f%%)\n",
+               read_stats.nr_applied, read_stats.nr_drains, read_stats.nr_dropped,
+               nr_hits > 0 ? 100.0 * read_stats.nr_dropped / nr_hits : 0.0);
+    }
+
+    if (cache->max_object_chunks > cache->max_extent_chunks) {
+        printf("Extent map: %u objects of several extents, %" PRIu64 " inserted, %" PRIu64
+               " dropped with an evicted zone\n",
+               zn_extent_map_size(&cache->extent_map), cache->extent_map.nr_inserted,
+               cache->extent_map.nr_dropped);
+    }
+    zn_extent_map_destroy(&cache->extent_map);
+    g_mutex_clear(&cache->extent_lock);
+    zn_cachemap_destroy(&cache->cache_map);
+    zn_io_destroy(&cache->io);
+    zn_buffer_pool_destroy(&cache->buffers);
+
     // TODO assert(!"Todo: clean up cache");
 
     /* g_hash_table_destroy(cache->zone_map); */
@@ -241,130 +1272,82 @@ zn_destroy_cache(struct zn_cache *cache) {
 }
 
 unsigned char *
-zn_read_from_disk(struct zn_cache *cache, struct zn_pair *zone_pair) {
-    size_t chunk_sz = cache->chunk_sz;
-    size_t max_io = cache->io_size;
-    size_t align = ZN_DIRECT_ALIGNMENT;
-
-    // Sanity checks
-    if ((chunk_sz % align) != 0 || (max_io % align) != 0) {
-        fprintf(stderr, "Error: Sizes must be aligned to %zu bytes for O_DIRECT\n", align);
+zn_read_from_disk_submit(struct zn_cache *cache, struct zn_pair *zone_pair,
+                         struct zn_io_request *request) {
+    unsigned char *data =
+        zn_buffer_get_size(&cache->buffers, (size_t) zone_pair->nr_chunks * cache->chunk_sz);
+    if (read_submit(cache, zone_pair, request, data) != 0) {
+        zn_buffer_put(&cache->buffers, data);
         return NULL;
     }
+    return data;
+}
 
-    // Allocate aligned buffer
-    unsigned char *data;
-    if (posix_memalign((void **)&data, align, chunk_sz) != 0) {
-        nomem();
-    }
-    // Calculate starting offset
-    unsigned long long wp = CHUNK_POINTER(cache->zone_size, chunk_sz, zone_pair->chunk_offset, zone_pair->zone);
-    if ((wp % align) != 0) {
-        fprintf(stderr, "Error: Read offset (%llu) not aligned to %zu for O_DIRECT\n", wp, align);
-        free(data);
+unsigned char *
+zn_read_from_disk(struct zn_cache *cache, struct zn_pair *zone_pair) {
+    struct zn_io_request request;
+    unsigned char *data = zn_read_from_disk_submit(cache, zone_pair, &request);
+    if (data != NULL && zn_io_wait(&cache->io, &request) != 0) {
+        zn_buffer_put(&cache->buffers, data);
         return NULL;
     }
-
-    // Loop in max_io chunks
-    size_t total_read = 0;
-    while (total_read < chunk_sz) {
-        size_t to_read = (chunk_sz - total_read > max_io) ? max_io : (chunk_sz - total_read);
-
-        int attempts = 0;
-        ssize_t r;
-        while (true) {
-            r = pread(cache->fd, data + total_read, to_read, wp + total_read);
-            if (r == (ssize_t)to_read) {
-                break; // success
-            }
-
-            if (++attempts >= BACKOFF_RETRIES) {
-                fprintf(stderr, "Partial read at offset %llu (%zd/%zu): %s\n",
-                        wp + total_read, r, to_read, strerror(errno));
-                free(data);
-                return NULL;
-            }
-
-            // exponential backoff: 100ms, 200ms, 400ms
-            g_usleep(BACKOFF_US_START * (1 << (attempts - 1))); // g_usleep in microseconds
-        }
-
-        total_read += r;
-    }
-
     return data;
 }
 
-#define BACKOFF_US_START 100000   // 100 ms in microseconds
-#define BACKOFF_RETRIES 8         // number of retries
-
 int
 zn_write_out(int fd, size_t const to_write, const unsigned char *buffer, ssize_t write_size,
              unsigned long long wp_start) {
-    ssize_t bytes_written;
-    size_t total_written = 0;
-
-    while (total_written < to_write) {
-        ssize_t remaining = to_write - total_written;
-        size_t chunk_size = (remaining < write_size) ? remaining : write_size;
-
-        int attempts = 0;
-        while (true) {
-            errno = 0;
-            bytes_written = pwrite(fd, buffer + total_written, chunk_size, wp_start + total_written);
-
-            if (bytes_written == (ssize_t)chunk_size) {
-                break; // success
-            }
-
-            fprintf(stdout, "Write failed at offset %llu (%zd/%zu), retry=(%d/%d): %s\n",
-                        wp_start + total_written, bytes_written, chunk_size, attempts, BACKOFF_RETRIES, strerror(errno));
-
-            if (++attempts >= BACKOFF_RETRIES) {
-                fprintf(stderr, "Write failure exceeded retries=(%d/%d)\n", attempts, BACKOFF_RETRIES);
-                return -1;
-            }
-
-            // Exponential backoff: 100ms, 200ms, 400ms, 800ms, 1600ms, 3200ms, 6400ms...
-            g_usleep(BACKOFF_US_START * (1 << (attempts - 1)));
-        }
-
-        total_written += bytes_written;
-    }
-
-    assert(total_written == to_write);
-    return 0;
+    return zn_io_pwrite_all(fd, buffer, to_write, write_size, wp_start);
 }
 
 
 unsigned char *
 zn_gen_write_buffer(struct zn_cache *cache, uint32_t zone_id, unsigned char *buffer) {
-    unsigned char *data;
-
-    if (posix_memalign((void **)&data, ZN_DIRECT_ALIGNMENT, cache->chunk_sz) != 0) {
-        nomem();
-    }
-
-    memcpy(data, buffer, cache->chunk_sz);
-    memcpy(data, &zone_id, sizeof(uint32_t));
-
-    g_usleep(ZN_READ_SLEEP_US);
-
+    struct zn_key key;
+    zn_key_init(&key, &zone_id, sizeof(zone_id));
+    unsigned char *data = zn_buffer_get_size(&cache->buffers, zn_cache_object_size(cache, &key));
+    fetch_remote(cache, &key, buffer, data);
     return data;
 }
 
 int
-zn_validate_read(struct zn_cache *cache, unsigned char *data, uint32_t id, unsigned char *compare_buffer) {
-    uint32_t read_id;
-    memcpy(&read_id, data, sizeof(uint32_t));
-    if (read_id != id) {
-        dbg_printf("Invalid read_id(%u)!=id(%u)\n", read_id, id);
+zn_validate_read(struct zn_cache *cache, unsigned char *data, const struct zn_key *key,
+                 unsigned char *compare_buffer) {
+    size_t len = zn_cache_object_size(cache, key);
+    if (!zn_key_matches(key, data, len)) {
+        dbg_printf("Invalid object header for fingerprint %u\n", zn_key_fingerprint(key));
         return -1;
     }
-    // 4 bytes for int
-    for (uint32_t i = sizeof(uint32_t); i < cache->chunk_sz; i++) {
+    for (size_t i = sizeof(struct zn_object_header) + key->len; i < len; i++) {
         if (data[i] != compare_buffer[i]) {
-            dbg_printf("data[%d]!=RANDOM_DATA[%d]\n", read_id, id);
+            dbg_printf("data[%zu]!=RANDOM_DATA[%zu]\n", i, i);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int
+zn_validate_range(struct zn_cache *cache, const unsigned char *data, size_t len,
+                  const struct zn_key *key, size_t offset, unsigned char *compare_buffer) {
+    size_t object_len = zn_cache_object_size(cache, key);
+    if (len != range_bytes(object_len, offset, len)) {
+        dbg_printf("Range of %zu bytes at %zu is past the end of %zu bytes\n", len, offset,
+                   object_len);
+        return -1;
+    }
+
+    // The object starts with its header and key, the rest is the remote data
+    struct zn_object_header header = {
+        .key_hash = key->hash, .len = (uint32_t) object_len, .key_len = (uint16_t) key->len};
+    size_t data_start = sizeof(header) + key->len;
+    for (size_t i = 0; i < len; i++) {
+        size_t at = offset + i;
+        unsigned char expected = at < sizeof(header)  ? ((unsigned char *) &header)[at]
+                                 : at < data_start ? key->data[at - sizeof(header)]
+                                                   : compare_buffer[at];
+        if (data[i] != expected) {
+            dbg_printf("data[%zu]!=object[%zu]\n", i, at);
             return -1;
         }
     }
@@ -382,3 +1365,27 @@ zn_cache_get_hit_ratio(struct zn_cache * cache) {
     }
     return num / den;
 }
+
+double
+zn_cache_get_dram_hit_ratio(struct zn_cache *cache) {
+    g_mutex_lock(&cache->ratio.lock);
+    double num = cache->ratio.dram_hits;
+    double den = cache->ratio.misses + cache->ratio.hits;
+    g_mutex_unlock(&cache->ratio.lock);
+    if (den == 0) {
+        return 0;
+    }
+    return num / den;
+}
+
+double
+zn_cache_get_device_hit_ratio(struct zn_cache *cache) {
+    g_mutex_lock(&cache->ratio.lock);
+    double num = cache->ratio.hits - cache->ratio.dram_hits;
+    double den = cache->ratio.misses + cache->ratio.hits;
+    g_mutex_unlock(&cache->ratio.lock);
+    if (den == 0) {
+        return 0;
+    }
+    return num / den;
+}
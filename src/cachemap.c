@@ -10,163 +10,883 @@
 #include <string.h>
 #include <znutil.h>
 
+/** Initial number of slots in each shard's index */
+#define SHARD_INITIAL_CAPACITY 1024
+
+/** Waiters allocated at a time when a shard's waiter pool runs dry */
+#define WAITER_BLOCK_SIZE 16
+
+/** Lock-free attempts at a hit before falling back to the shard lock */
+#define OPTIMISTIC_ATTEMPTS 4
+
+/*
+ * Entries are stored inline in the flat index as a single word:
+ *   [63:48] zone, [47:28] chunk offset, [27:18] extent length in chunks minus one,
+ *   [17:2] zone generation, [1:0] entry type (RESULT_*)
+ * A RESULT_COND entry has no location, its chunk field holds the index of the attached
+ * waiter slot (0 if no thread is waiting).
+ */
+#define ENTRY_TYPE_BITS 2
+#define ENTRY_GEN_BITS 16
+#define ENTRY_EXTENT_BITS 10
+#define ENTRY_CHUNK_BITS 20
+#define ENTRY_GEN_SHIFT ENTRY_TYPE_BITS
+#define ENTRY_EXTENT_SHIFT (ENTRY_GEN_SHIFT + ENTRY_GEN_BITS)
+#define ENTRY_CHUNK_SHIFT (ENTRY_EXTENT_SHIFT + ENTRY_EXTENT_BITS)
+#define ENTRY_ZONE_SHIFT (ENTRY_CHUNK_SHIFT + ENTRY_CHUNK_BITS)
+#define ENTRY_TYPE_MASK ((UINT64_C(1) << ENTRY_TYPE_BITS) - 1)
+#define ENTRY_GEN_MASK ((UINT64_C(1) << ENTRY_GEN_BITS) - 1)
+#define ENTRY_EXTENT_MASK ((UINT64_C(1) << ENTRY_EXTENT_BITS) - 1)
+#define ENTRY_CHUNK_MASK ((UINT64_C(1) << ENTRY_CHUNK_BITS) - 1)
+
+_Static_assert(ZN_CACHEMAP_MAX_ZONES == UINT64_C(1) << (64 - ENTRY_ZONE_SHIFT), "zone bits");
+_Static_assert(ZN_CACHEMAP_MAX_ZONE_CHUNKS == ENTRY_CHUNK_MASK + 1, "chunk bits");
+_Static_assert(ZN_CACHEMAP_MAX_EXTENT_CHUNKS == ENTRY_EXTENT_MASK + 1, "extent bits");
+
+/** Evictions of a zone between sweeps of its stale entries, half the generations an entry tells
+ * apart so a stale entry never matches a wrapped generation */
+#define ZONE_SWEEP_INTERVAL (UINT32_C(1) << (ENTRY_GEN_BITS - 1))
+
+static inline uint64_t
+entry_pack(const uint32_t zone, const uint32_t chunk_offset, const uint32_t nr_chunks,
+           const uint32_t generation, const int type) {
+    assert(zone < ZN_CACHEMAP_MAX_ZONES);
+    assert(chunk_offset <= ENTRY_CHUNK_MASK);
+    assert(nr_chunks > 0 && nr_chunks <= ZN_CACHEMAP_MAX_EXTENT_CHUNKS);
+    return ((uint64_t) zone << ENTRY_ZONE_SHIFT) | ((uint64_t) chunk_offset << ENTRY_CHUNK_SHIFT) |
+           ((uint64_t) (nr_chunks - 1) << ENTRY_EXTENT_SHIFT) |
+           (((uint64_t) generation & ENTRY_GEN_MASK) << ENTRY_GEN_SHIFT) | (uint64_t) type;
+}
+
+static inline int
+entry_type(const uint64_t entry) {
+    return (int) (entry & ENTRY_TYPE_MASK);
+}
+
+static inline uint64_t
+entry_pack_cond(const uint32_t waiter) {
+    return entry_pack(0, waiter, 1, 0, RESULT_COND);
+}
+
+static inline uint32_t
+entry_waiter(const uint64_t entry) {
+    assert(entry_type(entry) == RESULT_COND);
+    return (uint32_t) ((entry >> ENTRY_CHUNK_SHIFT) & ENTRY_CHUNK_MASK);
+}
+
+static inline uint32_t
+entry_generation(const uint64_t entry) {
+    return (uint32_t) ((entry >> ENTRY_GEN_SHIFT) & ENTRY_GEN_MASK);
+}
+
+/** @brief Stores an entry, concurrent readers load it without the shard lock */
+static inline void
+entry_store(uint64_t *entry, const uint64_t value) {
+    __atomic_store_n(entry, value, __ATOMIC_RELAXED);
+}
+
+static inline struct zone_map_result
+entry_unpack(const uint32_t data_id, const uint64_t entry) {
+    return (struct zone_map_result) {
+        .location = {
+            .zone = (uint32_t) (entry >> ENTRY_ZONE_SHIFT),
+            .chunk_offset = (uint32_t) ((entry >> ENTRY_CHUNK_SHIFT) & ENTRY_CHUNK_MASK),
+            .nr_chunks = (uint32_t) ((entry >> ENTRY_EXTENT_SHIFT) & ENTRY_EXTENT_MASK) + 1,
+            .id = data_id,
+            .in_use = true,
+        },
+        .type = entry_type(entry),
+    };
+}
+
+/**
+ * @brief Map a data ID to its shard
+ *
+ * Uses a multiplicative hash so sequential IDs spread across shards, then scales the
+ * hash into [0, nr_shards) without a division.
+ */
+static inline struct zn_cachemap_shard *
+get_shard(struct zn_cachemap *map, const uint32_t data_id) {
+    uint32_t hash = data_id * 2654435769u;
+    uint32_t index = (uint32_t) (((uint64_t) hash * map->nr_shards) >> 32);
+    return &map->shards[index];
+}
+
+/** @brief Current generation of a zone, truncated to the bits stored in an entry */
+static inline uint32_t
+zone_generation(struct zn_cachemap *map, const uint32_t zone) {
+    return (uint32_t) g_atomic_int_get(&map->zone_generation[zone]) & ENTRY_GEN_MASK;
+}
+
+/**
+ * @brief Take a reader reference on the zone of a RESULT_LOC entry
+ *
+ * The reference is only kept if the entry's generation is still current after it is
+ * taken. An evictor bumps the generation before waiting for the zone's readers to drain,
+ * so it either sees this reader or this reader sees the new generation.
+ *
+ * @return true if the reference was taken, false if the entry is stale
+ */
+static inline bool
+zone_acquire(struct zn_cachemap *map, const uint64_t entry, const uint32_t zone) {
+    if (entry_generation(entry) != zone_generation(map, zone)) {
+        return false;
+    }
+    g_atomic_int_inc(&map->active_readers[zone]);
+    if (entry_generation(entry) != zone_generation(map, zone)) {
+        g_atomic_int_dec_and_test(&map->active_readers[zone]);
+        return false;
+    }
+    return true;
+}
+
+/** @brief Waiter slot by index, indices start at 1. Called with the shard lock. */
+static inline struct zn_cachemap_waiter *
+waiter_at(struct zn_cachemap_shard *shard, const uint32_t index) {
+    assert(index > 0 && index <= shard->nr_waiter_blocks * WAITER_BLOCK_SIZE);
+    return &shard->waiter_blocks[(index - 1) / WAITER_BLOCK_SIZE][(index - 1) % WAITER_BLOCK_SIZE];
+}
+
+/**
+ * @brief Take a waiter slot from the shard's pool, growing it by a block if it is empty.
+ * Called with the shard lock.
+ *
+ * @return Index of the slot
+ */
+static uint32_t
+waiter_get(struct zn_cachemap_shard *shard) {
+    if (shard->free_waiters == 0) {
+        uint32_t base = shard->nr_waiter_blocks * WAITER_BLOCK_SIZE;
+        assert(base + WAITER_BLOCK_SIZE <= ENTRY_CHUNK_MASK);
+
+        shard->waiter_blocks = g_renew(struct zn_cachemap_waiter *, shard->waiter_blocks,
+                                       shard->nr_waiter_blocks + 1);
+        struct zn_cachemap_waiter *block = g_new0(struct zn_cachemap_waiter, WAITER_BLOCK_SIZE);
+        shard->waiter_blocks[shard->nr_waiter_blocks++] = block;
+
+        for (uint32_t i = 0; i < WAITER_BLOCK_SIZE; i++) {
+            g_cond_init(&block[i].cond);
+            block[i].next_free = shard->free_waiters;
+            shard->free_waiters = base + i + 1;
+        }
+    }
+
+    uint32_t index = shard->free_waiters;
+    struct zn_cachemap_waiter *waiter = waiter_at(shard, index);
+    shard->free_waiters = waiter->next_free;
+    waiter->nr_waiters = 0;
+    waiter->done = false;
+    waiter->inflight = NULL;
+    waiter->pending = NULL;
+    return index;
+}
+
+/** @brief Return a waiter slot to the shard's pool. Called with the shard lock. */
+static void
+waiter_put(struct zn_cachemap_shard *shard, const uint32_t index) {
+    struct zn_cachemap_waiter *waiter = waiter_at(shard, index);
+    assert(waiter->nr_waiters == 0);
+    waiter->next_free = shard->free_waiters;
+    shard->free_waiters = index;
+}
+
+/**
+ * @brief Copy a buffer into a new ZN_DIRECT_ALIGNMENT aligned buffer from the map's pool
+ */
+static unsigned char *
+buffer_dup(struct zn_cachemap *map, const unsigned char *data, const size_t size) {
+    unsigned char *copy;
+    if (map->buffers != NULL) {
+        copy = zn_buffer_get_size(map->buffers, size);
+    } else if (posix_memalign((void **) &copy, ZN_DIRECT_ALIGNMENT, size) != 0) {
+        nomem();
+    }
+    memcpy(copy, data, size);
+    return copy;
+}
+
+/**
+ * @brief Release a buffer from buffer_dup()
+ */
+static void
+buffer_release(struct zn_cachemap *map, unsigned char *data) {
+    if (map->buffers != NULL) {
+        zn_buffer_put(map->buffers, data);
+    } else {
+        free(data);
+    }
+}
+
+/**
+ * @brief Take a waiter's reference to published data
+ *
+ * Every waiter but the last copies the shared buffer, the last one takes it over, so
+ * the writer's data is copied exactly once per waiter.
+ *
+ * @return A buffer owned by the caller
+ */
+static unsigned char *
+inflight_take(struct zn_cachemap *map, struct zn_inflight *inflight) {
+    unsigned char *data;
+    if (g_atomic_int_compare_and_exchange(&inflight->refcount, 1, 0)) {
+        data = inflight->data;
+        g_free(inflight);
+        return data;
+    }
+
+    data = buffer_dup(map, inflight->data, inflight->size);
+    if (g_atomic_int_dec_and_test(&inflight->refcount)) {
+        buffer_release(map, inflight->data);
+        g_free(inflight);
+    }
+    return data;
+}
+
+/**
+ * @brief Drop a reference to published data without taking a copy
+ */
+static void
+inflight_release(struct zn_cachemap *map, struct zn_inflight *inflight) {
+    if (g_atomic_int_dec_and_test(&inflight->refcount)) {
+        buffer_release(map, inflight->data);
+        g_free(inflight);
+    }
+}
+
+/**
+ * @brief Number of threads waiting for an in-flight entry. Called with the shard lock.
+ *
+ * @param entry A RESULT_COND entry
+ */
+static uint32_t
+waiters_count(struct zn_cachemap_shard *shard, const uint64_t entry) {
+    uint32_t index = entry_waiter(entry);
+    return index == 0 ? 0 : waiter_at(shard, index)->nr_waiters;
+}
+
+/**
+ * @brief Wake the threads waiting for an in-flight entry, if any. Called with the shard lock
+ * by the writer, after it has replaced or erased the entry.
+ *
+ * @param entry The RESULT_COND entry as it was before the writer replaced it
+ * @param inflight Data to hand to the waiters, holding one reference per waiter, or NULL
+ */
+static void
+waiters_wake(struct zn_cachemap *map, struct zn_cachemap_shard *shard, const uint64_t entry,
+             struct zn_inflight *inflight) {
+    uint32_t index = entry_waiter(entry);
+    if (index == 0) {
+        assert(inflight == NULL);
+        return;
+    }
+    struct zn_cachemap_waiter *waiter = waiter_at(shard, index);
+    if (waiter->pending != NULL) {
+        inflight_release(map, waiter->pending);
+        waiter->pending = NULL;
+    }
+    waiter->done = true;
+    waiter->inflight = inflight;
+
+    // Attached by zn_cachemap_publish_pending() with nobody left asleep on it
+    if (waiter->nr_waiters == 0) {
+        assert(inflight == NULL);
+        waiter_put(shard, index);
+        return;
+    }
+    g_cond_broadcast(&waiter->cond);
+}
+
+/**
+ * @brief Sleep until the write of an in-flight entry finishes. Called with the shard lock,
+ * which is released while sleeping. The entry may have moved or been erased on return.
+ *
+ * @return The data published by the writer, or the pending data if the write is still
+ *     running, with one reference for the caller. NULL if the writer did not publish any
+ *     and the caller has to look the entry up again.
+ */
+static struct zn_inflight *
+waiters_wait(struct zn_cachemap_shard *shard, uint64_t *entry) {
+    uint32_t index = entry_waiter(*entry);
+    if (index == 0) {
+        index = waiter_get(shard);
+        entry_store(entry, entry_pack_cond(index));
+    }
+
+    struct zn_cachemap_waiter *waiter = waiter_at(shard, index);
+    waiter->nr_waiters++;
+    // Loop for spurious wakeups
+    while (!waiter->done && waiter->pending == NULL) {
+        g_cond_wait(&waiter->cond, &shard->lock);
+    }
+    waiter->nr_waiters--;
+
+    // Still being written, the slot stays attached to the entry
+    if (!waiter->done) {
+        g_atomic_int_inc(&waiter->pending->refcount);
+        return waiter->pending;
+    }
+
+    struct zn_inflight *inflight = waiter->inflight;
+    if (waiter->nr_waiters == 0) {
+        waiter_put(shard, index);
+    }
+    return inflight;
+}
+
+static bool
+entry_is_current(uint32_t data_id, uint64_t entry, void *user_data) {
+    struct zn_cachemap *map = user_data;
+    return entry_type(entry) != RESULT_LOC ||
+           entry_generation(entry) == zone_generation(map, entry_unpack(data_id, entry).location.zone);
+}
+
+/**
+ * @brief Erase entries left stale by zone evictions once the index has doubled since the
+ * last sweep, so the index tracks resident keys rather than every key ever cached.
+ * Called with the shard lock.
+ */
+static void
+shard_sweep(struct zn_cachemap *map, struct zn_cachemap_shard *shard) {
+    if (G_LIKELY(shard->zone_map.size < shard->sweep_at)) {
+        return;
+    }
+    zn_flatmap_retain(&shard->zone_map, entry_is_current, map);
+    shard->sweep_at = MAX(shard->zone_map.size * 2, SHARD_INITIAL_CAPACITY / 2);
+}
+
+/*
+ * Lock-free readers announce themselves so a writer knows when a table replaced by a
+ * rehash can be freed. Each thread gets a slot whose counter is odd while the thread is
+ * probing a table without the shard lock. Slots are shared by every cache map, and are
+ * returned when the thread exits.
+ */
+struct optimistic_reader {
+    gint seq;
+} __attribute__((aligned(64)));
+
+static struct optimistic_reader optimistic_readers[ZN_CACHEMAP_MAX_OPTIMISTIC_READERS];
+static guint free_reader_slots[ZN_CACHEMAP_MAX_OPTIMISTIC_READERS];
+static guint nr_free_reader_slots = 0;
+static gint nr_reader_slots = 0; /**< High-water mark of slots handed out */
+static GMutex reader_slots_lock;
+
+static void
+release_reader_slot(gpointer data) {
+    g_mutex_lock(&reader_slots_lock);
+    free_reader_slots[nr_free_reader_slots++] = GPOINTER_TO_UINT(data) - 1;
+    g_mutex_unlock(&reader_slots_lock);
+}
+
+static GPrivate reader_slot = G_PRIVATE_INIT(release_reader_slot);
+
+/**
+ * @brief Get the calling thread's reader slot, assigning one on first use
+ *
+ * @return The slot, or NULL if all slots are taken
+ */
+static struct optimistic_reader *
+optimistic_reader_self(void) {
+    guint slot = GPOINTER_TO_UINT(g_private_get(&reader_slot));
+    if (G_LIKELY(slot != 0)) {
+        return &optimistic_readers[slot - 1];
+    }
+
+    g_mutex_lock(&reader_slots_lock);
+    if (nr_free_reader_slots > 0) {
+        slot = free_reader_slots[--nr_free_reader_slots] + 1;
+    } else if (g_atomic_int_get(&nr_reader_slots) < ZN_CACHEMAP_MAX_OPTIMISTIC_READERS) {
+        slot = g_atomic_int_add(&nr_reader_slots, 1) + 1;
+    }
+    g_mutex_unlock(&reader_slots_lock);
+
+    if (slot == 0) {
+        return NULL;
+    }
+    g_private_set(&reader_slot, GUINT_TO_POINTER(slot));
+    return &optimistic_readers[slot - 1];
+}
+
+/**
+ * @brief Wait until every lock-free reader that may hold a pointer to a retired table is done
+ *
+ * Readers that start probing after this call load the current table, so only readers that
+ * are inside a probe when their slot is sampled need to be waited for.
+ */
+static void
+wait_for_optimistic_readers(void) {
+    gint nr_slots = g_atomic_int_get(&nr_reader_slots);
+    for (gint i = 0; i < nr_slots; i++) {
+        gint seq = g_atomic_int_get(&optimistic_readers[i].seq);
+        if (seq % 2 == 0) {
+            continue;
+        }
+        while (g_atomic_int_get(&optimistic_readers[i].seq) == seq) {
+            g_thread_yield();
+        }
+    }
+}
+
+/**
+ * @brief Frees tables replaced by a rehash of the shard index. Called with the shard lock.
+ */
+static void
+shard_reclaim(struct zn_cachemap_shard *shard) {
+    if (G_UNLIKELY(zn_flatmap_has_retired(&shard->zone_map))) {
+        wait_for_optimistic_readers();
+        zn_flatmap_reclaim(&shard->zone_map);
+    }
+}
+
+/** Context of zone_sweep() */
+struct zone_sweep_args {
+    struct zn_cachemap *map;
+    uint32_t zone;
+};
+
+static bool
+entry_is_current_in_zone(uint32_t data_id, uint64_t entry, void *user_data) {
+    struct zone_sweep_args *args = user_data;
+    return entry_type(entry) != RESULT_LOC ||
+           entry_unpack(data_id, entry).location.zone != args->zone ||
+           entry_generation(entry) == zone_generation(args->map, args->zone);
+}
+
+/**
+ * @brief Erase the stale entries of a zone from every shard
+ *
+ * Entries only store the low ENTRY_GEN_BITS of the generation. An entry left behind by an
+ * eviction would match again once the zone's generation wraps around, so the zone's stale
+ * entries are erased every ZONE_SWEEP_INTERVAL evictions of it, and stale entries are never
+ * more than ZONE_SWEEP_INTERVAL generations old.
+ */
+static void
+zone_sweep(struct zn_cachemap *map, uint32_t zone) {
+    struct zone_sweep_args args = {.map = map, .zone = zone};
+    for (uint32_t s = 0; s < map->nr_shards; s++) {
+        struct zn_cachemap_shard *shard = &map->shards[s];
+        g_mutex_lock(&shard->lock);
+        // Stale entries fail validation in lock-free readers, no need to bracket the erase
+        zn_flatmap_retain(&shard->zone_map, entry_is_current_in_zone, &args);
+        g_mutex_unlock(&shard->lock);
+    }
+}
+
+/*
+ * Writers that invalidate or move a single RESULT_LOC entry bracket the change with these,
+ * so a lock-free reader that read the old location fails validation. Other transitions do
+ * not need to: a reader that sees a COND or EMPTY entry goes through the lock anyway, and
+ * whole zones are invalidated through their generation.
+ */
+static inline void
+shard_write_begin(struct zn_cachemap_shard *shard) {
+    g_atomic_int_inc(&shard->seq);
+}
+
+static inline void
+shard_write_end(struct zn_cachemap_shard *shard) {
+    g_atomic_int_inc(&shard->seq);
+}
+
+/**
+ * @brief Try to serve a hit without the shard lock
+ *
+ * On success the reader count of the returned zone has been incremented, and the location
+ * was current at the time it was incremented.
+ *
+ * @return true on a hit, false if the caller has to take the shard lock
+ */
+static bool
+find_optimistic(struct zn_cachemap *map, struct zn_cachemap_shard *shard, const uint32_t data_id,
+                struct zone_map_result *result) {
+    struct optimistic_reader *reader = optimistic_reader_self();
+    if (reader == NULL) {
+        return false;
+    }
+
+    for (uint32_t attempt = 0; attempt < OPTIMISTIC_ATTEMPTS; attempt++) {
+        gint seq = g_atomic_int_get(&shard->seq);
+        if (seq % 2 != 0) {
+            g_thread_yield();
+            continue;
+        }
+
+        uint64_t entry = 0;
+        g_atomic_int_inc(&reader->seq);
+        bool found = zn_flatmap_find_concurrent(&shard->zone_map, data_id, &entry);
+        g_atomic_int_inc(&reader->seq);
+
+        if (!found || entry_type(entry) != RESULT_LOC) {
+            return false;
+        }
+
+        *result = entry_unpack(data_id, entry);
+        // A torn read can produce any zone, do not touch a counter that does not exist
+        if (result->location.zone >= map->nr_zones) {
+            continue;
+        }
+
+        // Stale entries are reclaimed under the lock
+        if (!zone_acquire(map, entry, result->location.zone)) {
+            if (g_atomic_int_get(&shard->seq) == seq) {
+                return false;
+            }
+            continue;
+        }
+        if (g_atomic_int_get(&shard->seq) == seq) {
+            return true;
+        }
+        g_atomic_int_dec_and_test(&map->active_readers[result->location.zone]);
+    }
+
+    return false;
+}
+
 void
-zn_cachemap_init(struct zn_cachemap *map, const int num_zones, gint *active_readers_arr) {
-    g_mutex_init(&map->cache_map_mutex);
+zn_cachemap_init(struct zn_cachemap *map, const int num_zones, gint *active_readers_arr,
+                 const uint32_t nr_shards) {
+    assert(nr_shards > 0 && nr_shards <= ZN_CACHEMAP_MAX_SHARDS);
+    assert(num_zones > 0 && (uint32_t) num_zones <= ZN_CACHEMAP_MAX_ZONES);
+
+    map->nr_shards = nr_shards;
+    map->nr_zones = num_zones;
 
-    map->zone_map = g_hash_table_new(g_direct_hash, g_direct_equal);
-    assert(map->zone_map);
+    map->shards = g_new0(struct zn_cachemap_shard, nr_shards);
+    assert(map->shards);
 
-    map->data_map = g_new(GHashTable *, num_zones);
-    assert(map->data_map);
+    for (uint32_t s = 0; s < nr_shards; s++) {
+        struct zn_cachemap_shard *shard = &map->shards[s];
+        g_mutex_init(&shard->lock);
+        shard->seq = 0;
 
-    // Zone → Data ID
-    for (int i = 0; i < num_zones; i++) {
-        map->data_map[i] = g_hash_table_new(g_direct_hash, g_direct_equal); // Chunk -> data ID
-        assert(map->data_map[i]);
+        zn_flatmap_init(&shard->zone_map, SHARD_INITIAL_CAPACITY);
+        shard->sweep_at = SHARD_INITIAL_CAPACITY / 2;
+
+        shard->waiter_blocks = NULL;
+        shard->nr_waiter_blocks = 0;
+        shard->free_waiters = 0;
     }
 
+    map->zone_generation = g_new0(gint, num_zones);
+    assert(map->zone_generation);
+
     map->active_readers = active_readers_arr;
+    map->buffers = NULL;
 }
 
-#ifdef UNUSED
-static void
-free_cond_var(GCond *cond) {
-    g_cond_clear(cond);
+void
+zn_cachemap_destroy(struct zn_cachemap *map) {
+    for (uint32_t s = 0; s < map->nr_shards; s++) {
+        struct zn_cachemap_shard *shard = &map->shards[s];
+
+        zn_flatmap_destroy(&shard->zone_map);
+        for (uint32_t b = 0; b < shard->nr_waiter_blocks; b++) {
+            for (uint32_t i = 0; i < WAITER_BLOCK_SIZE; i++) {
+                g_cond_clear(&shard->waiter_blocks[b][i].cond);
+            }
+            g_free(shard->waiter_blocks[b]);
+        }
+        g_free(shard->waiter_blocks);
+        g_mutex_clear(&shard->lock);
+    }
+
+    g_free(map->shards);
+    g_free(map->zone_generation);
 }
-#endif
 
 struct zone_map_result
 zn_cachemap_find(struct zn_cachemap *map, const uint32_t data_id) {
     assert(map);
 
-    g_mutex_lock(&map->cache_map_mutex);
+    struct zn_cachemap_shard *shard = get_shard(map, data_id);
+
+    struct zone_map_result hit;
+    if (find_optimistic(map, shard, data_id, &hit)) {
+        return hit;
+    }
+
+    g_mutex_lock(&shard->lock);
 
     // Loop for spurious wakeups
     while (true) {
+        bool inserted = false;
+        // A new entry is a miss from the start, lock-free readers never see it as a location
+        uint64_t *entry =
+            zn_flatmap_insert(&shard->zone_map, data_id, entry_pack_cond(0), &inserted);
+
+        // The thread needs to write an entry.
+        if (inserted) {
+            struct zone_map_result lookup = entry_unpack(data_id, *entry);
+            shard_sweep(map, shard);
+            shard_reclaim(shard);
+            g_mutex_unlock(&shard->lock);
+            return lookup;
+        }
 
         // We found an entry
-        if (g_hash_table_contains(map->zone_map, GINT_TO_POINTER(data_id))) {
-
-            struct zone_map_result *lookup =
-                g_hash_table_lookup(map->zone_map, GINT_TO_POINTER(data_id));
-
-	    switch (lookup->type) {
+        struct zone_map_result lookup = entry_unpack(data_id, *entry);
+        switch (lookup.type) {
             case RESULT_LOC:
-                g_atomic_int_inc(&map->active_readers[lookup->location.zone]);
-                g_mutex_unlock(&map->cache_map_mutex);
-                return *lookup;                
-            case RESULT_COND:
-                g_cond_wait(&lookup->write_finished, &map->cache_map_mutex);
-                break;
-            case RESULT_EMPTY:
-                lookup->type = RESULT_COND;
-                g_mutex_unlock(&map->cache_map_mutex);
-		return *lookup;
-                break;
+                if (zone_acquire(map, *entry, lookup.location.zone)) {
+                    g_mutex_unlock(&shard->lock);
+                    return lookup;
+                }
+                // The zone was evicted since the entry was written, reclaim it as a miss
+                entry_store(entry, entry_pack_cond(0));
+                lookup.type = RESULT_COND;
+                g_mutex_unlock(&shard->lock);
+                return lookup;
+            case RESULT_COND: {
+                struct zn_inflight *inflight = waiters_wait(shard, entry);
+                if (inflight == NULL) {
+                    // Loop to recheck the entry
+                    break;
+                }
+                g_mutex_unlock(&shard->lock);
+
+                // Served from the writer's buffer, no device read and no reader count needed
+                lookup.type = RESULT_DATA;
+                lookup.size = inflight->size;
+                lookup.data = inflight_take(map, inflight);
+                return lookup;
+            }
             default:
                 assert(FALSE);
-            }
-
-        } else { // The thread needs to write an entry.
-            struct zone_map_result *wait_cond = g_new0(struct zone_map_result, 1);
-            wait_cond->type = RESULT_COND;
-            g_cond_init(&wait_cond->write_finished);
-            g_hash_table_insert(map->zone_map, GINT_TO_POINTER(data_id), wait_cond);
-            g_mutex_unlock(&map->cache_map_mutex);
-            return *wait_cond;
         }
     };
 }
 
 void
 zn_cachemap_insert(struct zn_cachemap *map, const uint32_t data_id, struct zn_pair location) {
-    assert(map);
+    zn_cachemap_insert_data(map, data_id, location, NULL, 0);
+}
 
-    g_mutex_lock(&map->cache_map_mutex);
+void
+zn_cachemap_insert_data(struct zn_cachemap *map, const uint32_t data_id, struct zn_pair location,
+                        const unsigned char *data, size_t size) {
+    assert(map);
+    assert(location.zone < map->nr_zones);
+
+    struct zn_cachemap_shard *shard = get_shard(map, data_id);
+
+    // Copy outside the lock if threads already appear to be waiting. The peek is racy, a
+    // waiter that arrives later is served by a copy made under the lock. It is bracketed like
+    // an optimistic lookup, so the table it probes is not reclaimed under it.
+    unsigned char *copy = NULL;
+    struct optimistic_reader *reader = optimistic_reader_self();
+    if (data != NULL && reader != NULL) {
+        uint64_t peek = 0;
+        g_atomic_int_inc(&reader->seq);
+        bool found = zn_flatmap_find_concurrent(&shard->zone_map, data_id, &peek);
+        g_atomic_int_inc(&reader->seq);
+        if (found && entry_type(peek) == RESULT_COND && entry_waiter(peek) != 0) {
+            copy = buffer_dup(map, data, size);
+        }
+    }
 
-    dbg_print_g_hash_table("map->data_map[location.zone]", map->data_map[location.zone], PRINT_G_HASH_TABLE_GINT);
+    g_mutex_lock(&shard->lock);
 
     // It must contain an entry if the thread called zn_cachemap_find beforehand
-    assert(g_hash_table_contains(map->zone_map, GUINT_TO_POINTER(data_id)));
+    uint64_t *entry = zn_flatmap_find(&shard->zone_map, data_id);
+    assert(entry);
+
+    // LOC when the data was relocated by GC
+    uint64_t old = *entry;
+    assert(entry_type(old) == RESULT_COND || entry_type(old) == RESULT_LOC);
+
+    // The zone cannot be evicted while a write to it is in progress, so its generation is
+    // stable until the caller returns the zone
+    uint64_t value = entry_pack(location.zone, location.chunk_offset, location.nr_chunks,
+                                zone_generation(map, location.zone), RESULT_LOC);
+
+    shard_write_begin(shard);
+    entry_store(entry, value);
+    shard_write_end(shard);
+
+    struct zn_inflight *inflight = NULL;
+    if (entry_type(old) == RESULT_COND) {
+        uint32_t nr_waiters = waiters_count(shard, old);
+        if (data != NULL && nr_waiters > 0) {
+            inflight = g_new(struct zn_inflight, 1);
+            inflight->refcount = nr_waiters;
+            inflight->size = size;
+            inflight->data = copy != NULL ? copy : buffer_dup(map, data, size);
+            copy = NULL;
+        }
+        waiters_wake(map, shard, old, inflight);       // Wake up threads waiting for it
+    }
+
+    g_mutex_unlock(&shard->lock);
+
+    if (copy != NULL) {
+        buffer_release(map, copy);
+    }
+}
+
+void
+zn_cachemap_publish_pending(struct zn_cachemap *map, const uint32_t data_id, unsigned char *data,
+                            size_t size) {
+    assert(map);
+    assert(data);
+
+    struct zn_cachemap_shard *shard = get_shard(map, data_id);
 
-    struct zone_map_result *result = g_hash_table_lookup(map->zone_map, GUINT_TO_POINTER(data_id));
-    assert(result->type == RESULT_COND);
+    struct zn_inflight *pending = g_new(struct zn_inflight, 1);
+    pending->refcount = 1;
+    pending->size = size;
+    pending->data = data;
 
-    result->location = location; // Does this mutate the entry in the hash table?
-    result->type = RESULT_LOC;
-    assert(map->data_map[location.zone]);
-    g_hash_table_insert(map->data_map[location.zone], GUINT_TO_POINTER(location.chunk_offset), GINT_TO_POINTER(data_id));
-    g_cond_broadcast(&result->write_finished);            // Wake up threads waiting for it
+    g_mutex_lock(&shard->lock);
 
-    dbg_print_g_hash_table("map->data_map[location.zone]", map->data_map[location.zone], PRINT_G_HASH_TABLE_GINT);
+    uint64_t *entry = zn_flatmap_find(&shard->zone_map, data_id);
+    assert(entry);
+    assert(entry_type(*entry) == RESULT_COND);
 
-    g_mutex_unlock(&map->cache_map_mutex);
+    // The slot carries the data, lookups find it without sleeping
+    uint32_t index = entry_waiter(*entry);
+    if (index == 0) {
+        index = waiter_get(shard);
+        entry_store(entry, entry_pack_cond(index));
+    }
+    struct zn_cachemap_waiter *waiter = waiter_at(shard, index);
+    assert(waiter->pending == NULL);
+    waiter->pending = pending;
+    g_cond_broadcast(&waiter->cond);
+
+    g_mutex_unlock(&shard->lock);
 }
 
 void
 zn_cachemap_clear_chunk(struct zn_cachemap *map, struct zn_pair *location) {
     assert(map);
 
-    g_mutex_lock(&map->cache_map_mutex);
+    struct zn_cachemap_shard *shard = get_shard(map, location->id);
 
-    dbg_print_g_hash_table("map->data_map[location.zone] before", map->data_map[location->zone], PRINT_G_HASH_TABLE_GINT);
+    g_mutex_lock(&shard->lock);
 
-    dbg_printf("Looking up zone=%u, chunk=%u\n", location->zone, location->chunk_offset);
-    int data_id = GPOINTER_TO_INT(g_hash_table_lookup(map->data_map[location->zone], GUINT_TO_POINTER(location->chunk_offset)));
+    dbg_printf("Clearing zone=%u, chunk=%u, data_id=%u\n", location->zone, location->chunk_offset,
+               location->id);
 
-    dbg_printf("Got data_id=%d\n", data_id);
+    uint64_t *entry = zn_flatmap_find(&shard->zone_map, location->id);
+    assert(entry);
+    assert(entry_type(*entry) == RESULT_LOC);
+    assert(entry_unpack(location->id, *entry).location.zone == location->zone);
+    assert(entry_unpack(location->id, *entry).location.chunk_offset == location->chunk_offset);
+    (void) entry;
 
-    assert(g_hash_table_contains(map->zone_map, GINT_TO_POINTER(data_id)));
-    struct zone_map_result *res = g_hash_table_lookup(map->zone_map, GINT_TO_POINTER(data_id));
-    assert(res->type == RESULT_LOC);
-    assert(res->location.zone == location->zone);
-    assert(res->location.chunk_offset == location->chunk_offset);
+    // Erase the entry
+    shard_write_begin(shard);
+    zn_flatmap_erase(&shard->zone_map, location->id);
+    shard_write_end(shard);
 
-    // Erase the entry and free the zone_map_result memory
-    res->type = RESULT_EMPTY;
+    g_mutex_unlock(&shard->lock);
+}
 
-    g_hash_table_remove(map->data_map[location->zone], GUINT_TO_POINTER(location->chunk_offset));
+bool
+zn_cachemap_clear_extent(struct zn_cachemap *map, const struct zn_pair *location) {
+    assert(map);
 
-    dbg_print_g_hash_table("map->data_map[location.zone] after", map->data_map[location->zone], PRINT_G_HASH_TABLE_GINT);
+    struct zn_cachemap_shard *shard = get_shard(map, location->id);
+    g_mutex_lock(&shard->lock);
+
+    // The entry may have gone stale, been reused for a write in flight, or moved
+    uint64_t *entry = zn_flatmap_find(&shard->zone_map, location->id);
+    bool cleared = false;
+    if (entry != NULL && entry_type(*entry) == RESULT_LOC) {
+        struct zn_pair current = entry_unpack(location->id, *entry).location;
+        if (current.zone == location->zone && current.chunk_offset == location->chunk_offset) {
+            shard_write_begin(shard);
+            zn_flatmap_erase(&shard->zone_map, location->id);
+            shard_write_end(shard);
+            cleared = true;
+        }
+    }
 
-    g_mutex_unlock(&map->cache_map_mutex);
+    g_mutex_unlock(&shard->lock);
+    return cleared;
 }
 
 void
 zn_cachemap_clear_zone(struct zn_cachemap *map, uint32_t zone) {
     assert(map);
+    assert(zone < map->nr_zones);
+
+    // Every entry written with the old generation is now stale. Lookups treat stale entries
+    // as misses and reuse them, so entries only need to be visited before the truncated
+    // generation could wrap around to one of them. Sweeping first leaves stale entries of
+    // one generation back at most, and entries are stamped with the current one.
+    guint next = (guint) g_atomic_int_get(&map->zone_generation[zone]) + 1;
+    if (G_UNLIKELY(next % ZONE_SWEEP_INTERVAL == 0)) {
+        zone_sweep(map, zone);
+    }
+    g_atomic_int_inc(&map->zone_generation[zone]);
+}
 
-    g_mutex_lock(&map->cache_map_mutex);
-
-    GHashTableIter iter;
-    gpointer key = NULL;
-    gpointer value = NULL;
-
-    g_hash_table_iter_init(&iter, map->data_map[zone]);
-    while (g_hash_table_iter_next(&iter, &key, &value)) {
-        int data_id = GPOINTER_TO_INT(value);
-        assert(g_hash_table_contains(map->zone_map, GINT_TO_POINTER(data_id)));
-        struct zone_map_result *res = g_hash_table_lookup(map->zone_map, GINT_TO_POINTER(data_id));
-        assert(res->type == RESULT_LOC);
-        assert(res->location.zone == zone);
+void
+zn_cachemap_fail(struct zn_cachemap *map, const uint32_t id) {
+    zn_cachemap_fail_data(map, id, NULL, 0);
+}
 
-	res->type = RESULT_EMPTY;
+void
+zn_cachemap_fail_data(struct zn_cachemap *map, const uint32_t id, const unsigned char *data,
+                      size_t size) {
+    struct zn_cachemap_shard *shard = get_shard(map, id);
+
+    g_mutex_lock(&shard->lock);
+
+    uint64_t *entry = zn_flatmap_find(&shard->zone_map, id);
+    assert(entry);
+    assert(entry_type(*entry) == RESULT_COND);
+
+    // Erase the entry, a woken waiter takes over the write unless it was handed the data
+    uint64_t old = *entry;
+    zn_flatmap_erase(&shard->zone_map, id);
+
+    struct zn_inflight *inflight = NULL;
+    uint32_t nr_waiters = waiters_count(shard, old);
+    if (data != NULL && nr_waiters > 0) {
+        inflight = g_new(struct zn_inflight, 1);
+        inflight->refcount = nr_waiters;
+        inflight->size = size;
+        inflight->data = buffer_dup(map, data, size);
     }
+    waiters_wake(map, shard, old, inflight);       // Wake up threads waiting for it
+    g_mutex_unlock(&shard->lock);
+}
 
-    g_hash_table_remove_all(map->data_map[zone]);
+struct stats_count {
+    struct zn_cachemap *map;
+    struct zn_cachemap_stats *stats;
+};
 
-    g_mutex_unlock(&map->cache_map_mutex);
+static void
+stats_count_entry(uint32_t data_id, uint64_t *entry, void *user_data) {
+    struct stats_count *count = user_data;
+    count->stats->nr_entries++;
+    if (entry_type(*entry) == RESULT_LOC && entry_is_current(data_id, *entry, count->map)) {
+        count->stats->nr_keys++;
+    }
 }
 
 void
-zn_cachemap_fail(struct zn_cachemap *map, const uint32_t id) {
-    g_mutex_lock(&map->cache_map_mutex);
-
-    assert(g_hash_table_contains(map->zone_map, GINT_TO_POINTER(id)));
-    struct zone_map_result *entry = g_hash_table_lookup(map->zone_map, GINT_TO_POINTER(id));
-    assert(entry->type == RESULT_COND);
-    g_cond_broadcast(&entry->write_finished);            // Wake up threads waiting for it
-    entry->type = RESULT_EMPTY;
-    g_mutex_unlock(&map->cache_map_mutex);
+zn_cachemap_get_stats(struct zn_cachemap *map, struct zn_cachemap_stats *stats) {
+    assert(map);
+    assert(stats);
+
+    *stats = (struct zn_cachemap_stats) {0};
+    struct stats_count count = {.map = map, .stats = stats};
+
+    for (uint32_t s = 0; s < map->nr_shards; s++) {
+        struct zn_cachemap_shard *shard = &map->shards[s];
+        g_mutex_lock(&shard->lock);
+        zn_flatmap_foreach(&shard->zone_map, stats_count_entry, &count);
+        stats->index_bytes += zn_flatmap_memory(&shard->zone_map);
+        stats->waiter_bytes += (size_t) shard->nr_waiter_blocks *
+                               ((WAITER_BLOCK_SIZE * sizeof(struct zn_cachemap_waiter)) +
+                                sizeof(struct zn_cachemap_waiter *));
+        g_mutex_unlock(&shard->lock);
+    }
+
+    stats->total_bytes = stats->index_bytes + stats->waiter_bytes +
+                         ((size_t) map->nr_shards * sizeof(struct zn_cachemap_shard)) +
+                         ((size_t) map->nr_zones * sizeof(gint));
 }
@@ -0,0 +1,294 @@
+#include "dramtier.h"
+
+#include "znutil.h"
+
+#include <assert.h>
+#include <glib.h>
+#include <string.h>
+
+static struct zn_dram_shard *
+shard_of(struct zn_dram_tier *tier, uint32_t id) {
+    // Consecutive IDs are common in traces, spread them before picking a shard
+    return &tier->shards[(id * 2654435761u) % tier->nr_shards];
+}
+
+static void
+fifo_push(struct zn_dram_fifo *fifo, struct zn_dram_entry *entry) {
+    entry->prev = NULL;
+    entry->next = fifo->head;
+    if (fifo->head != NULL) {
+        fifo->head->prev = entry;
+    } else {
+        fifo->tail = entry;
+    }
+    fifo->head = entry;
+    fifo->length++;
+    fifo->bytes += entry->size;
+}
+
+static struct zn_dram_entry *
+fifo_pop(struct zn_dram_fifo *fifo) {
+    struct zn_dram_entry *entry = fifo->tail;
+    assert(entry != NULL);
+    fifo->tail = entry->prev;
+    if (fifo->tail != NULL) {
+        fifo->tail->next = NULL;
+    } else {
+        fifo->head = NULL;
+    }
+    entry->prev = entry->next = NULL;
+    fifo->length--;
+    fifo->bytes -= entry->size;
+    return entry;
+}
+
+/**
+ * @brief Remember an ID that left the small FIFO, forgetting the oldest one if the ring is full
+ * @note Assumes that the shard lock is held
+ */
+static void
+ghost_push(struct zn_dram_shard *shard, uint32_t id) {
+    uint64_t pos = shard->ghost_next++;
+    uint32_t slot = (uint32_t) (pos % shard->ghost_capacity);
+    if (pos >= shard->ghost_capacity) {
+        // Only forget the old ID if it was not pushed again since
+        uint32_t old = shard->ghost_ring[slot];
+        uint64_t *old_pos = zn_flatmap_find(&shard->ghosts, old);
+        if (old_pos != NULL && *old_pos == pos - shard->ghost_capacity) {
+            zn_flatmap_erase(&shard->ghosts, old);
+        }
+    }
+    shard->ghost_ring[slot] = id;
+    bool inserted;
+    *zn_flatmap_insert(&shard->ghosts, id, pos, &inserted) = pos;
+    zn_flatmap_reclaim(&shard->ghosts);
+}
+
+/**
+ * @brief Take one entry out of the FIFOs, S3-FIFO style
+ * @note Assumes that the shard lock is held and that the FIFOs are not empty
+ */
+static struct zn_dram_entry *
+shard_evict(struct zn_dram_shard *shard) {
+    while (true) {
+        if (shard->small.bytes >= shard->small_capacity || shard->main.length == 0) {
+            struct zn_dram_entry *entry = fifo_pop(&shard->small);
+            if (entry->freq > 0) {
+                // Hit while it was new, worth keeping
+                entry->freq = 0;
+                entry->queue = ZN_DRAM_QUEUE_MAIN;
+                fifo_push(&shard->main, entry);
+                continue;
+            }
+            ghost_push(shard, entry->id);
+            return entry;
+        }
+
+        struct zn_dram_entry *entry = fifo_pop(&shard->main);
+        if (entry->freq > 0) {
+            entry->freq--;
+            fifo_push(&shard->main, entry);
+            continue;
+        }
+        return entry;
+    }
+}
+
+void
+zn_dram_tier_init(struct zn_dram_tier *tier, uint64_t capacity, size_t entry_sz,
+                  struct zn_buffer_pool *buffers) {
+    assert(tier);
+    assert(entry_sz > 0);
+
+    *tier = (struct zn_dram_tier) {.buffers = buffers, .entry_sz = entry_sz};
+    if (capacity / entry_sz == 0) {
+        return;
+    }
+    assert(buffers);
+    // Every shard holds the largest object
+    uint64_t max_shards = capacity / buffers->buffer_size;
+    if (max_shards == 0) {
+        return;
+    }
+
+    tier->nr_shards = (uint32_t) CLAMP(capacity / entry_sz / ZN_DRAM_TIER_MIN_SHARD_ENTRIES, 1,
+                                       MIN(max_shards, ZN_DRAM_TIER_SHARDS));
+    tier->shards = g_new0(struct zn_dram_shard, tier->nr_shards);
+    for (uint32_t i = 0; i < tier->nr_shards; i++) {
+        struct zn_dram_shard *shard = &tier->shards[i];
+        g_mutex_init(&shard->lock);
+        shard->capacity = capacity / tier->nr_shards;
+        shard->small_capacity = MAX(1, shard->capacity * ZN_DRAM_TIER_SMALL_PERCENT / 100);
+        // As many ghosts as the main FIFO holds entries of the expected size
+        uint64_t nr_entries = shard->capacity / entry_sz;
+        assert(nr_entries <= UINT32_MAX);
+        shard->ghost_capacity =
+            MAX(1, (uint32_t) ((shard->capacity - shard->small_capacity) / entry_sz));
+        shard->ghost_ring = g_new(uint32_t, shard->ghost_capacity);
+        zn_flatmap_init(&shard->index, (uint32_t) nr_entries);
+        zn_flatmap_init(&shard->ghosts, shard->ghost_capacity);
+    }
+}
+
+static void
+free_entry(uint32_t key, uint64_t *value, void *user_data) {
+    (void) key;
+    struct zn_dram_tier *tier = user_data;
+    struct zn_dram_entry *entry = (struct zn_dram_entry *) (uintptr_t) *value;
+    assert(entry->queue != ZN_DRAM_QUEUE_LEAVING);
+    zn_buffer_put(tier->buffers, entry->data);
+    g_free(entry);
+}
+
+void
+zn_dram_tier_destroy(struct zn_dram_tier *tier) {
+    assert(tier);
+
+    for (uint32_t i = 0; i < tier->nr_shards; i++) {
+        struct zn_dram_shard *shard = &tier->shards[i];
+        zn_flatmap_foreach(&shard->index, free_entry, tier);
+        zn_flatmap_destroy(&shard->index);
+        zn_flatmap_destroy(&shard->ghosts);
+        g_free(shard->ghost_ring);
+        g_mutex_clear(&shard->lock);
+    }
+    g_free(tier->shards);
+    tier->shards = NULL;
+    tier->nr_shards = 0;
+}
+
+bool
+zn_dram_tier_get(struct zn_dram_tier *tier, uint32_t id, unsigned char *dst, size_t max_len,
+                 size_t *len) {
+    assert(tier);
+    assert(dst);
+    assert(len);
+    assert(zn_dram_tier_enabled(tier));
+
+    struct zn_dram_shard *shard = shard_of(tier, id);
+    g_mutex_lock(&shard->lock);
+    shard->lookups++;
+    uint64_t *value = zn_flatmap_find(&shard->index, id);
+    if (value == NULL) {
+        g_mutex_unlock(&shard->lock);
+        return false;
+    }
+    struct zn_dram_entry *entry = (struct zn_dram_entry *) (uintptr_t) *value;
+    if (entry->freq < ZN_DRAM_TIER_MAX_FREQ) {
+        entry->freq++;
+    }
+    shard->hits++;
+    g_atomic_int_inc(&entry->readers);
+    g_mutex_unlock(&shard->lock);
+
+    *len = entry->len;
+    if (entry->len <= max_len) {
+        memcpy(dst, entry->data, entry->len);
+    }
+    g_atomic_int_dec_and_test(&entry->readers);
+    return true;
+}
+
+bool
+zn_dram_tier_insert(struct zn_dram_tier *tier, uint32_t id, const unsigned char *data,
+                    size_t len, struct zn_dram_victim *victim) {
+    assert(tier);
+    assert(data);
+    assert(victim);
+    assert(len > 0 && len <= tier->buffers->buffer_size);
+    assert(zn_dram_tier_enabled(tier));
+
+    // Copy before taking the lock, the ID is rarely inserted twice
+    struct zn_dram_entry *entry = g_new0(struct zn_dram_entry, 1);
+    entry->id = id;
+    entry->len = len;
+    entry->data = zn_buffer_get_size(tier->buffers, len);
+    entry->size = zn_buffer_size(tier->buffers, entry->data);
+    memcpy(entry->data, data, len);
+
+    struct zn_dram_shard *shard = shard_of(tier, id);
+    g_mutex_lock(&shard->lock);
+    bool inserted;
+    zn_flatmap_insert(&shard->index, id, (uint64_t) (uintptr_t) entry, &inserted);
+    if (!inserted) {
+        g_mutex_unlock(&shard->lock);
+        zn_buffer_put(tier->buffers, entry->data);
+        g_free(entry);
+        return false;
+    }
+    zn_flatmap_reclaim(&shard->index);
+
+    // Victims are linked through `next`, which they no longer use for a FIFO
+    struct zn_dram_entry *evicted = NULL;
+    struct zn_dram_entry **tail = &evicted;
+    while (shard->small.bytes + shard->main.bytes + entry->size > shard->capacity) {
+        struct zn_dram_entry *leaving = shard_evict(shard);
+        leaving->queue = ZN_DRAM_QUEUE_LEAVING;
+        shard->evictions++;
+        *tail = leaving;
+        tail = &leaving->next;
+    }
+
+    // Seen recently enough to still be a ghost, so it goes to the main FIFO right away
+    if (zn_flatmap_erase(&shard->ghosts, id)) {
+        entry->queue = ZN_DRAM_QUEUE_MAIN;
+        fifo_push(&shard->main, entry);
+    } else {
+        entry->queue = ZN_DRAM_QUEUE_SMALL;
+        fifo_push(&shard->small, entry);
+    }
+    g_mutex_unlock(&shard->lock);
+
+    if (evicted == NULL) {
+        return false;
+    }
+    *victim = (struct zn_dram_victim) {
+        .id = evicted->id, .data = evicted->data, .len = evicted->len, .entry = evicted};
+    return true;
+}
+
+bool
+zn_dram_tier_release(struct zn_dram_tier *tier, struct zn_dram_victim *victim) {
+    assert(tier);
+    assert(victim);
+    assert(victim->entry->queue == ZN_DRAM_QUEUE_LEAVING);
+
+    struct zn_dram_shard *shard = shard_of(tier, victim->id);
+    g_mutex_lock(&shard->lock);
+    bool erased = zn_flatmap_erase(&shard->index, victim->id);
+    assert(erased);
+    (void) erased;
+    g_mutex_unlock(&shard->lock);
+
+    // Lookups that found it before the erase are still copying
+    while (g_atomic_int_get(&victim->entry->readers) > 0) {
+        g_thread_yield();
+    }
+    struct zn_dram_entry *next = victim->entry->next;
+    zn_buffer_put(tier->buffers, victim->entry->data);
+    g_free(victim->entry);
+    if (next == NULL) {
+        *victim = (struct zn_dram_victim) {0};
+        return false;
+    }
+    *victim = (struct zn_dram_victim) {
+        .id = next->id, .data = next->data, .len = next->len, .entry = next};
+    return true;
+}
+
+void
+zn_dram_tier_get_stats(struct zn_dram_tier *tier, struct zn_dram_tier_stats *stats) {
+    assert(tier);
+    assert(stats);
+
+    *stats = (struct zn_dram_tier_stats) {0};
+    for (uint32_t i = 0; i < tier->nr_shards; i++) {
+        struct zn_dram_shard *shard = &tier->shards[i];
+        g_mutex_lock(&shard->lock);
+        stats->nr_entries += shard->small.length + shard->main.length;
+        stats->hits += shard->hits;
+        stats->lookups += shard->lookups;
+        stats->evictions += shard->evictions;
+        g_mutex_unlock(&shard->lock);
+    }
+}
@@ -5,77 +5,289 @@
 #include "zone_state_manager.h"
 
 #include <assert.h>
+#include <inttypes.h>
 #include <stdint.h>
 #include <stdbool.h> // Cortes
 #include <stdlib.h>
 #include <glib.h>
 #include <glibconfig.h>
 
+#ifdef DEBUG
+/**
+ * @brief Print the LRU list, least recently used first
+ */
+static void
+print_lru(struct zn_policy_chunk *p) {
+    printf("lru (zone,chunk,id): ");
+    for (uint32_t i = p->lru_head; i != ZN_CHUNK_LRU_NONE; i = p->slots[i].lru_next) {
+        struct zn_pair *zp = &p->slots[i].pair;
+        printf("(%u,%u,%u), ", zp->zone, zp->chunk_offset, zp->id);
+    }
+    puts("");
+}
+#    define dbg_print_lru(p) print_lru(p)
+#else
+#    define dbg_print_lru(...)
+#endif
+
+/**
+ * @brief Add the zones that filled up since the last call to the GC priority queue
+ * @note Assumes that the policy lock is held
+ */
+static void
+take_full_zones(struct zn_policy_chunk *p) {
+    int zone;
+    while ((zone = zsm_pop_full_zone(&p->cache->zone_state)) != -1) {
+        struct eviction_policy_chunk_zone *zpc = &p->zone_pool[zone];
+        dbg_printf("Adding zone=%d to pqueue\n", zone);
+        zpc->pqueue_entry = zn_minheap_insert(p->invalid_pqueue, zpc, zpc->chunks_in_use);
+        assert(zpc->pqueue_entry);
+        zpc->filled = true;
+    }
+}
+
+/**
+ * @brief The slot of the chunk at `location`
+ */
+static inline struct eviction_policy_chunk_slot *
+slot_at(struct zn_policy_chunk *p, const struct zn_pair *location) {
+    return &p->zone_pool[location->zone].chunks[location->chunk_offset];
+}
+
+static inline uint32_t
+slot_index(struct zn_policy_chunk *p, const struct eviction_policy_chunk_slot *slot) {
+    return (uint32_t) (slot - p->slots);
+}
+
+/**
+ * @brief Whether `slot` is the head of an object in the LRU list, rather than a free slot or
+ * a further extent
+ */
+static inline bool
+lru_contains(struct zn_policy_chunk *p, const struct eviction_policy_chunk_slot *slot) {
+    return slot->lru_prev != ZN_CHUNK_LRU_NONE || p->lru_head == slot_index(p, slot);
+}
+
+/**
+ * @brief Append `slot` to the LRU list as the most recently used object
+ * @note Assumes that the policy lock is held
+ */
+static void
+lru_push_tail(struct zn_policy_chunk *p, struct eviction_policy_chunk_slot *slot) {
+    uint32_t index = slot_index(p, slot);
+    slot->lru_prev = p->lru_tail;
+    slot->lru_next = ZN_CHUNK_LRU_NONE;
+    if (p->lru_tail != ZN_CHUNK_LRU_NONE) {
+        p->slots[p->lru_tail].lru_next = index;
+    } else {
+        p->lru_head = index;
+    }
+    p->lru_tail = index;
+    p->nr_objects++;
+}
+
+/**
+ * @brief Take `slot` out of the LRU list
+ * @note Assumes that the policy lock is held
+ */
+static void
+lru_unlink(struct zn_policy_chunk *p, struct eviction_policy_chunk_slot *slot) {
+    if (slot->lru_prev != ZN_CHUNK_LRU_NONE) {
+        p->slots[slot->lru_prev].lru_next = slot->lru_next;
+    } else {
+        p->lru_head = slot->lru_next;
+    }
+    if (slot->lru_next != ZN_CHUNK_LRU_NONE) {
+        p->slots[slot->lru_next].lru_prev = slot->lru_prev;
+    } else {
+        p->lru_tail = slot->lru_prev;
+    }
+    slot->lru_prev = ZN_CHUNK_LRU_NONE;
+    slot->lru_next = ZN_CHUNK_LRU_NONE;
+    p->nr_objects--;
+}
+
+/**
+ * @brief Put `to` in the place of `from` in the LRU list, for an object that moved
+ * @note Assumes that the policy lock is held
+ */
+static void
+lru_replace(struct zn_policy_chunk *p, struct eviction_policy_chunk_slot *from,
+            struct eviction_policy_chunk_slot *to) {
+    uint32_t index = slot_index(p, to);
+    to->lru_prev = from->lru_prev;
+    to->lru_next = from->lru_next;
+    if (to->lru_prev != ZN_CHUNK_LRU_NONE) {
+        p->slots[to->lru_prev].lru_next = index;
+    } else {
+        p->lru_head = index;
+    }
+    if (to->lru_next != ZN_CHUNK_LRU_NONE) {
+        p->slots[to->lru_next].lru_prev = index;
+    } else {
+        p->lru_tail = index;
+    }
+    from->lru_prev = ZN_CHUNK_LRU_NONE;
+    from->lru_next = ZN_CHUNK_LRU_NONE;
+}
+
+/**
+ * @brief Drop the object or extent tracked in `slot` from the usage of its zone, and mark its
+ * chunks invalid
+ * @return Bytes it held
+ * @note Assumes that the policy lock is held
+ */
+static uint64_t
+invalidate_slot(struct zn_policy_chunk *p, struct eviction_policy_chunk_slot *slot) {
+    struct zn_pair *zp = &slot->pair;
+    struct eviction_policy_chunk_zone *zpc = &p->zone_pool[zp->zone];
+    assert(slot == &zpc->chunks[zp->chunk_offset] && zp->in_use);
+    uint64_t bytes = (uint64_t) zp->nr_chunks * p->cache->chunk_sz;
+    zp->in_use = false;
+    zpc->chunks_in_use -= zp->nr_chunks;
+    p->used_bytes -= bytes;
+
+    // Update priority
+    zn_minheap_update_by_entry(p->invalid_pqueue, zpc->pqueue_entry, zpc->chunks_in_use);
+    zsm_mark_chunk_invalid(&p->cache->zone_state, zp);
+    return bytes;
+}
+
+/**
+ * @brief Whether the object at `head` may have further extents in the extent map. Only
+ * objects filling their first extent do, so the map lock is not taken for others.
+ */
+static bool
+may_have_extents(struct zn_policy_chunk *p, const struct zn_pair *head) {
+    return head->nr_chunks == p->cache->max_extent_chunks &&
+           p->cache->max_object_chunks > p->cache->max_extent_chunks;
+}
+
+/**
+ * @brief Evict the object whose head is tracked in `slot`, with all of its extents
+ * @param extents Extents of the object, already removed from the extent map, or NULL for an
+ *     object of one extent
+ * @return Bytes it held
+ * @note Assumes that the policy lock is held
+ */
+static uint64_t
+evict_object(struct zn_policy_chunk *p, struct eviction_policy_chunk_slot *slot,
+             const struct zn_extent_list *extents) {
+    assert(lru_contains(p, slot));
+    lru_unlink(p, slot);
+
+    uint64_t bytes = invalidate_slot(p, slot);
+    for (uint32_t i = 1; extents != NULL && i < extents->nr_extents; i++) {
+        bytes += invalidate_slot(p, slot_at(p, &extents->extents[i]));
+    }
+    zn_cachemap_clear_chunk(&p->cache->cache_map, &slot->pair);
+    return bytes;
+}
+
+/**
+ * @brief Move the object of a hit to the tail of the LRU list
+ * @note Assumes that the policy lock is held
+ */
+static void
+promote(void *policy, struct zn_pair location) {
+    struct zn_policy_chunk *p = policy;
+    struct eviction_policy_chunk_slot *slot = slot_at(p, &location);
+
+    // The object may have been evicted, or its slot taken by another object, while the
+    // read occurred. Don't do anything then.
+    if (slot->pair.in_use && slot->pair.id == location.id && lru_contains(p, slot) &&
+        p->lru_tail != slot_index(p, slot)) {
+        lru_unlink(p, slot);
+        lru_push_tail(p, slot);
+    }
+}
+
 void
 zn_policy_chunk_update(policy_data_t _policy, struct zn_pair location,
                              enum zn_io_type io_type) {
     struct zn_policy_chunk *p = _policy;
     assert(p);
 
+    // Hits are applied in batches by whoever holds the lock, readers don't wait for it
+    if (io_type == ZN_READ && zn_read_buffer_enabled(&p->read_buffer)) {
+        if (zn_read_buffer_record(&p->read_buffer, location) &&
+            g_mutex_trylock(&p->policy_mutex)) {
+            zn_read_buffer_drain(&p->read_buffer, promote, p);
+            g_mutex_unlock(&p->policy_mutex);
+        }
+        return;
+    }
+
     g_mutex_lock(&p->policy_mutex);
-    assert(p->chunk_to_lru_map);
 
     dbg_printf("State before chunk update%s", "\n");
-
-    dbg_print_g_queue("lru_queue (zone,chunk,id,in_use)", &p->lru_queue, PRINT_G_QUEUE_ZN_PAIR);
-    dbg_print_g_hash_table("chunk_to_lru_map (id,zone,chunk,in_use)", p->chunk_to_lru_map, PRINT_G_HASH_TABLE_ZN_PAIR_NODE);
+    dbg_print_lru(p);
 
     struct eviction_policy_chunk_zone * zpc = &p->zone_pool[location.zone];
-    struct zn_pair * zp = &zpc->chunks[location.chunk_offset];
-
-    GList *node;
-    // Should always be present (might be NULL)
-    g_hash_table_lookup_extended(p->chunk_to_lru_map, zp, NULL, (gpointer *)&node);
+    struct eviction_policy_chunk_slot *slot = &zpc->chunks[location.chunk_offset];
+    struct zn_pair * zp = &slot->pair;
 
     if (io_type == ZN_WRITE) {
+        // An object is tracked in the slot of its first chunk
         assert(!zp->in_use);
         zp->chunk_offset = location.chunk_offset;
+        zp->nr_chunks = location.nr_chunks;
         zp->zone = location.zone;
         zp->id = location.id;
         zp->in_use = true;
-        zpc->chunks_in_use++; // Need to update here on SSD incase invalidated then re-written
+        zpc->chunks_in_use += location.nr_chunks; // Need to update here on SSD incase invalidated then re-written
         zpc->zone_id = location.zone;
-        g_queue_push_tail(&p->lru_queue, zp);
-        GList *node = g_queue_peek_tail_link(&p->lru_queue);
-        g_hash_table_insert(p->chunk_to_lru_map, zp, node);
-
-        if (location.chunk_offset == p->cache->max_zone_chunks-1) {
-            // We only add zones to the minheap when they are full.
-            dbg_printf("Adding %p (zone=%u) to pqueue\n", (void *)zp, location.zone);
-            zpc->pqueue_entry = zn_minheap_insert(p->invalid_pqueue, zpc, zpc->chunks_in_use);
-            assert(zpc->pqueue_entry);
-            zpc->filled = true;
-        }
-    } else if (io_type == ZN_READ) {
-
-        if (node) {
-			gpointer data = node->data;
-			g_queue_delete_link(&p->lru_queue, node);
-			g_queue_push_tail(&p->lru_queue, data);
-			GList *new_node = g_queue_peek_tail_link(&p->lru_queue);
-			g_hash_table_replace(p->chunk_to_lru_map, zp, new_node);
+        p->used_bytes += (uint64_t) location.nr_chunks * p->cache->chunk_sz;
+        __atomic_store_n(&slot->referenced, 0, __ATOMIC_RELAXED);
+        lru_push_tail(p, slot);
+
+        // The other extents of the object count towards their zones, the head stands for the
+        // object in the LRU list
+        struct zn_extent_list extents;
+        if (may_have_extents(p, &location) &&
+            zn_extent_map_get(&p->cache->extent_map, &location, &extents)) {
+            for (uint32_t i = 1; i < extents.nr_extents; i++) {
+                struct zn_pair *ext = &extents.extents[i];
+                struct eviction_policy_chunk_zone *ext_zone = &p->zone_pool[ext->zone];
+                struct zn_pair *ext_zp = &ext_zone->chunks[ext->chunk_offset].pair;
+                assert(!ext_zp->in_use);
+                *ext_zp = *ext;
+                ext_zp->in_use = true;
+                ext_zone->chunks_in_use += ext->nr_chunks;
+                ext_zone->zone_id = ext->zone;
+                p->used_bytes += (uint64_t) ext->nr_chunks * p->cache->chunk_sz;
+            }
         }
 
-        // If node->data == NULL, the zone is not in the LRU queue. This
-        // means that the zone is either not full, or has been removed
-        // by the eviction thread while the read occurred. Don't do
-        // anything
+        // We only add zones to the minheap when they are full.
+        take_full_zones(p);
+        // Apply buffered hits while the lock is held anyway
+        zn_read_buffer_drain(&p->read_buffer, promote, p);
+    } else if (io_type == ZN_READ) {
+        promote(p, location);
     }
 
-
-
     dbg_printf("State after chunk update%s", "\n");
-    dbg_print_g_queue("lru_queue (zone,chunk,id,in_use)", &p->lru_queue, PRINT_G_QUEUE_ZN_PAIR);
-    dbg_print_g_hash_table("chunk_to_lru_map (id,zone,chunk,in_use)", p->chunk_to_lru_map, PRINT_G_HASH_TABLE_ZN_PAIR_NODE);
+    dbg_print_lru(p);
 
     g_mutex_unlock(&p->policy_mutex);
 }
 
+void
+zn_policy_chunk_clock_update(policy_data_t _policy, struct zn_pair location,
+                             enum zn_io_type io_type) {
+    struct zn_policy_chunk *p = _policy;
+    assert(p && p->clock);
+
+    if (io_type == ZN_READ) {
+        // Hits never take the policy lock. A hit on a slot that was reused since gives its new
+        // object a second chance, which only costs precision.
+        __atomic_store_n(&slot_at(p, &location)->referenced, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    zn_policy_chunk_update(p, location, io_type);
+}
+
 static void
 zn_policy_chunk_gc(policy_data_t policy) {
     // TODO: If later separated from evict, lock here
@@ -94,61 +306,128 @@ zn_policy_chunk_gc(policy_data_t policy) {
 
         struct eviction_policy_chunk_zone * old_zone = ent->data;
         assert(old_zone);
+        old_zone->pqueue_entry = NULL;
         dbg_printf("Found minheap_entry priority=%u, chunks_in_use=%u, zone=%u\n",
             ent->priority,  old_zone->chunks_in_use, old_zone->zone_id);
-        dbg_printf("zone[%u] chunks:\n", old_zone->zone_id);
-        dbg_print_zn_pair_list(old_zone->chunks, p->cache->max_zone_chunks);
+        free(ent);
 
-        // Naive?
+        // Naive? Objects are tracked in the slot of their first chunk
         for (uint32_t i = 0; i < p->cache->max_zone_chunks; i++) {
-            if (!old_zone->chunks[i].in_use) {
+            struct eviction_policy_chunk_slot *old_slot = &old_zone->chunks[i];
+            if (!old_slot->pair.in_use) {
+                continue;
+            }
+            uint32_t nr_chunks = old_slot->pair.nr_chunks;
+
+            // Objects of several extents are evicted instead, moving them would take an
+            // active zone per extent
+            struct zn_extent_list extents;
+            if (p->cache->max_object_chunks > p->cache->max_extent_chunks &&
+                zn_extent_map_remove(&p->cache->extent_map, &old_slot->pair, &extents)) {
+                evict_object(p, slot_at(p, &extents.extents[0]), &extents);
                 continue;
             }
 
             struct zn_pair new_location;
-            enum zsm_get_active_zone_error ret = zsm_get_active_zone(&p->cache->zone_state, &new_location);
+            enum zsm_get_active_zone_error ret =
+                zsm_get_active_zone_extent(&p->cache->zone_state, nr_chunks, &new_location);
             if (ret != ZSM_GET_ACTIVE_ZONE_SUCCESS) {
-                assert(!"TODO");
-                // TODO: ???
+                // Every active zone is held by writers or write buffer segments, which may be
+                // waiting for this GC to free a zone. Flushing a segment would report it to
+                // this policy, whose lock is held here. Evict the object rather than wait.
+                dbg_printf("No active zone to move data_id=%u, evicting it\n",
+                           old_slot->pair.id);
+                evict_object(p, old_slot, NULL);
+                continue;
             }
 
-            // Read the chunk from the old zone
-            unsigned char *data = zn_read_from_disk(p->cache, &old_zone->chunks[i]);
+            // Read the object from the old zone
+            unsigned char *data = zn_read_from_disk(p->cache, &old_slot->pair);
             assert(data);
 
-            // Write the chunk to the new zone
-            unsigned long long wp = CHUNK_POINTER(p->cache->zone_size, p->cache->chunk_sz,
-                                                  new_location.chunk_offset, new_location.zone);
-            if (zn_write_out(p->cache->fd, p->cache->chunk_sz, data, p->cache->io_size, wp) != 0) {
+            // Write the object to the new zone
+            if (zn_cache_write_extent(p->cache, data, &new_location) != 0) {
                 assert(!"Failed to write chunk to new zone");
             }
 
             // Update the cache map
-            zn_cachemap_insert(&p->cache->cache_map, old_zone->chunks[i].id, new_location); // Add new mapping
+            new_location.id = old_slot->pair.id;
+            zn_cachemap_insert(&p->cache->cache_map, old_slot->pair.id, new_location); // Add new mapping
 
             // Update the eviction policy metadata
-            old_zone->chunks[i].in_use = false;
-            old_zone->chunks_in_use--;
+            old_slot->pair.in_use = false;
+            old_zone->chunks_in_use -= nr_chunks;
 
             // Update the new zone's metadata
             struct eviction_policy_chunk_zone *new_zone = &p->zone_pool[new_location.zone];
-            new_zone->chunks[new_location.chunk_offset] = old_zone->chunks[i];
-            new_zone->chunks[new_location.chunk_offset].in_use = true;
-            new_zone->chunks_in_use++;
-
-            // Update the LRU queue
-            g_queue_push_tail(&p->lru_queue, &new_zone->chunks[new_location.chunk_offset]);
-
-            // Free the data buffer
-            free(data);
+            struct eviction_policy_chunk_slot *new_slot = &new_zone->chunks[new_location.chunk_offset];
+            new_slot->pair = new_location;
+            new_slot->pair.in_use = true;
+            new_zone->chunks_in_use += nr_chunks;
+            new_zone->zone_id = new_location.zone;
+
+            // The object keeps its place in the LRU list, and its reference bit
+            lru_replace(p, old_slot, new_slot);
+            __atomic_store_n(&new_slot->referenced,
+                             __atomic_load_n(&old_slot->referenced, __ATOMIC_RELAXED),
+                             __ATOMIC_RELAXED);
+
+            // Writers waiting for an active zone get it back
+            zsm_return_active_zone(&p->cache->zone_state, &new_location);
+
+            // Return the data buffer
+            zn_buffer_put(&p->cache->buffers, data);
         }
         zn_cachemap_clear_zone(&p->cache->cache_map, old_zone->zone_id);
+        zn_extent_map_clear_zone(&p->cache->extent_map, &p->cache->cache_map, old_zone->zone_id);
+
+        // Readers that found a location in the zone before it was cleared finish first. They
+        // do not take the policy lock while they hold their reader counts.
+        while (g_atomic_int_get(&p->cache->active_readers[old_zone->zone_id]) > 0) {
+            g_thread_yield();
+        }
+
         // Reset the old zone
         zsm_evict(&p->cache->zone_state, old_zone->zone_id);
         free_zones = zsm_get_num_free_zones(&p->cache->zone_state);
     }
 }
 
+/**
+ * @brief The next object to evict. That is the least recently used one, or with `clock` the
+ * first one the hand finds without its reference bit, clearing the bits it passes.
+ * @note Assumes that the policy lock is held and that the LRU list is not empty
+ */
+static struct eviction_policy_chunk_slot *
+next_victim(struct zn_policy_chunk *p) {
+    if (!p->clock) {
+        return &p->slots[p->lru_head];
+    }
+
+    uint32_t max_zone_chunks = p->cache->max_zone_chunks;
+    // Two turns clear every bit. Past them, bits set by hits racing with the hand are ignored.
+    for (uint64_t steps = 0;; steps++) {
+        uint32_t zone = p->clock_hand / max_zone_chunks;
+        if (p->zone_pool[zone].chunks_in_use == 0) {
+            // Nothing to look at in the zone
+            p->clock_hand = (zone + 1) % p->cache->nr_zones * max_zone_chunks;
+            continue;
+        }
+
+        struct eviction_policy_chunk_slot *slot = &p->slots[p->clock_hand];
+        p->clock_hand = (p->clock_hand + 1) % p->nr_slots;
+        if (!lru_contains(p, slot)) {
+            continue;
+        }
+        if (steps < 2 * (uint64_t) p->nr_slots &&
+            __atomic_load_n(&slot->referenced, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&slot->referenced, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+        return slot;
+    }
+}
+
 int
 zn_policy_chunk_evict(policy_data_t policy) {
     struct zn_policy_chunk *p = policy;
@@ -158,59 +437,52 @@ zn_policy_chunk_evict(policy_data_t policy) {
         return -1;
     }
 
-    uint32_t in_lru = g_queue_get_length(&p->lru_queue);
-    uint32_t free_chunks = p->total_chunks - in_lru;
+    take_full_zones(p);
+    zn_read_buffer_drain(&p->read_buffer, promote, p);
 
-    if ((in_lru == 0) || (free_chunks > EVICT_HIGH_THRESH_CHUNKS)) {
+    // Objects span different numbers of chunks, so usage is tracked in bytes
+    uint32_t in_lru = p->nr_objects;
+    uint64_t free_bytes = p->total_bytes - p->used_bytes;
+    uint64_t high_thresh = (uint64_t) EVICT_HIGH_THRESH_CHUNKS * p->cache->chunk_sz;
+    uint64_t low_thresh = (uint64_t) EVICT_LOW_THRESH_CHUNKS * p->cache->chunk_sz;
+
+    // Chunks left unused when a zone is sealed count as free, but can only be reclaimed by
+    // GC, so GC also runs when zones run out
+    bool zones_low =
+        zsm_get_num_free_zones(&p->cache->zone_state) <= EVICT_HIGH_THRESH_ZONES;
+    if ((in_lru == 0) || (free_bytes > high_thresh && !zones_low)) {
         g_mutex_unlock(&p->policy_mutex);
         return 1;
     }
 
     dbg_printf("State before chunk evict%s", "\n");
-    dbg_print_g_queue("lru_queue (zone,chunk,id,in_use)", &p->lru_queue, PRINT_G_QUEUE_ZN_PAIR);
-    dbg_print_g_hash_table("chunk_to_lru_map (id,zone,chunk,in_use)", p->chunk_to_lru_map, PRINT_G_HASH_TABLE_ZN_PAIR_NODE);
+    dbg_print_lru(p);
     uint32_t free_zones = zsm_get_num_free_zones(&p->cache->zone_state);
     (void)free_zones;
 
     dbg_printf("Free zones before evict=%u\n", free_zones);
-    dbg_printf("Free chunks=%u, Chunks in lru=%u, EVICT_HIGH_THRESH_CHUNKS=%u\n",
-           free_chunks, in_lru, EVICT_HIGH_THRESH_CHUNKS);
-
-    uint32_t nr_evict = EVICT_LOW_THRESH_CHUNKS-free_chunks;
-
-    dbg_printf("Evicting %u chunks\n", nr_evict);
-
-    // We meet thresh for eviction - evict
-    for (uint32_t i = 0; i < nr_evict; i++) {
-        struct zn_pair * zp = g_queue_pop_head(&p->lru_queue);
-        g_hash_table_replace(p->chunk_to_lru_map, zp, NULL);
-
-        // Invalidate chunk
-        p->zone_pool[zp->zone].chunks[zp->chunk_offset].in_use = false;
-        p->zone_pool[zp->zone].chunks_in_use--;
+    dbg_printf("Free bytes=%" PRIu64 ", Objects in lru=%u, high thresh=%" PRIu64 "\n",
+           free_bytes, in_lru, high_thresh);
 
-        // Update priority
-        zn_minheap_update_by_entry(
-            p->invalid_pqueue,
-            p->zone_pool[zp->zone].pqueue_entry,
-            p->zone_pool[zp->zone].chunks_in_use
-        );
+    // We meet thresh for eviction - evict until the low threshold is free
+    while (free_bytes < low_thresh && p->lru_head != ZN_CHUNK_LRU_NONE) {
+        struct eviction_policy_chunk_slot *slot = next_victim(p);
 
-        // Update ZSM, cachemap
-        zsm_mark_chunk_invalid(&p->cache->zone_state, zp);
-        zn_cachemap_clear_chunk(&p->cache->cache_map, zp);
+        // Invalidate the object, with all of its extents
+        struct zn_extent_list extents;
+        bool has_extents = may_have_extents(p, &slot->pair) &&
+                           zn_extent_map_remove(&p->cache->extent_map, &slot->pair, &extents);
+        free_bytes += evict_object(p, slot, has_extents ? &extents : NULL);
 
         // TODO: SSD look at invalid (not here, on write)
     }
 
     dbg_printf("State after chunk evict%s\n", "");
-    dbg_print_g_queue("lru_queue (zone,chunk,id,in_use)", &p->lru_queue, PRINT_G_QUEUE_ZN_PAIR);
-    dbg_print_g_hash_table("chunk_to_lru_map (id,zone,chunk,in_use)", p->chunk_to_lru_map, PRINT_G_HASH_TABLE_ZN_PAIR_NODE);
+    dbg_print_lru(p);
 
-    in_lru = g_queue_get_length(&p->lru_queue);
-    free_chunks = p->total_chunks - in_lru;
-    dbg_printf("Free chunks=%u, Chunks in lru=%u, EVICT_HIGH_THRESH_CHUNKS=%u\n",
-               free_chunks, in_lru, EVICT_HIGH_THRESH_CHUNKS);
+    in_lru = p->nr_objects;
+    dbg_printf("Free bytes=%" PRIu64 ", Objects in lru=%u, high thresh=%" PRIu64 "\n",
+               free_bytes, in_lru, high_thresh);
 
     // Do GC
     zn_policy_chunk_gc(p);
@@ -0,0 +1,25 @@
+#include "eviction_policy.h"
+#include "eviction_policy_fifo.h"
+#include "zncache.h"
+#include "znutil.h"
+
+#include <assert.h>
+
+void
+zn_policy_fifo_update(policy_data_t policy, struct zn_pair location, enum zn_io_type io_type) {
+    (void) policy;
+    (void) location;
+    (void) io_type;
+}
+
+int
+zn_policy_fifo_get_zone_to_evict(policy_data_t _policy) {
+    struct zn_policy_fifo *policy = _policy;
+    assert(policy);
+
+    int zone = zsm_pop_full_zone(&policy->cache->zone_state);
+    if (zone != -1) {
+        dbg_printf("Evicted zone=%d\n", zone);
+    }
+    return zone;
+}
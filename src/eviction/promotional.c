@@ -2,49 +2,85 @@
 #include "eviction_policy_promotional.h"
 #include "glib.h"
 #include "glibconfig.h"
+#include "zncache.h"
 #include "znutil.h"
 
 #include <assert.h>
 #include <stdint.h>
 #include <stdlib.h>
 
+/**
+ * @brief Append the zones that filled up since the last call to the LRU
+ * @note Assumes that the policy lock is held
+ */
+static void
+take_full_zones(struct zn_policy_promotional *policy) {
+    int zone;
+    while ((zone = zsm_pop_full_zone(&policy->cache->zone_state)) != -1) {
+        gpointer zone_ptr = GUINT_TO_POINTER((uint32_t) zone);
+        g_queue_push_tail(&policy->lru_queue, zone_ptr);
+        GList *node = g_queue_peek_tail_link(&policy->lru_queue);
+        g_hash_table_insert(policy->zone_to_lru_map, zone_ptr, node);
+    }
+}
+
+/**
+ * @brief Move the zone of a hit to the tail of the LRU
+ * @note Assumes that the policy lock is held
+ */
+static void
+promote(void *_policy, struct zn_pair location) {
+    struct zn_policy_promotional *policy = _policy;
+    gpointer zone_ptr = GUINT_TO_POINTER(location.zone);
+
+    GList *node = g_hash_table_lookup(policy->zone_to_lru_map, zone_ptr);
+    if (node) {
+        gpointer data = node->data;
+        g_queue_delete_link(&policy->lru_queue, node);
+        g_queue_push_tail(&policy->lru_queue, data);
+        // Replace in map, pointer invalid after destroying link
+        GList *new_node = g_queue_peek_tail_link(&policy->lru_queue);
+        g_hash_table_replace(policy->zone_to_lru_map, zone_ptr, new_node);
+    }
+
+    // If lru_loc == NULL, the zone is not in the LRU queue. This
+    // means that the zone is either not full, or has been removed
+    // by the eviction thread while the read occurred. Don't do
+    // anything
+}
+
 void
 zn_policy_promotional_update(policy_data_t _policy, struct zn_pair location,
                              enum zn_io_type io_type) {
     struct zn_policy_promotional *policy = _policy;
     assert(policy);
 
+    // Hits are applied in batches by whoever holds the lock, readers don't wait for it
+    if (io_type == ZN_READ && zn_read_buffer_enabled(&policy->read_buffer)) {
+        if (zn_read_buffer_record(&policy->read_buffer, location) &&
+            g_mutex_trylock(&policy->policy_mutex)) {
+            zn_read_buffer_drain(&policy->read_buffer, promote, policy);
+            g_mutex_unlock(&policy->policy_mutex);
+        }
+        return;
+    }
+
     g_mutex_lock(&policy->policy_mutex);
     assert(policy->zone_to_lru_map);
 
-    gpointer zone_ptr = GUINT_TO_POINTER(location.zone);
-
     dbg_printf("State before promotional update%s", "\n");
 
     dbg_print_g_queue("lru_queue", &policy->lru_queue, PRINT_G_QUEUE_GINT);
     dbg_print_g_hash_table("zone_to_lru_map", policy->zone_to_lru_map, PRINT_G_HASH_TABLE_PROM_LRU_NODE);
 
-    // We only add zones to the LRU when they are full.
-    if (io_type == ZN_WRITE && location.chunk_offset == policy->zone_max_chunks-1) {
-        g_queue_push_tail(&policy->lru_queue, zone_ptr);
-        GList *node = g_queue_peek_tail_link(&policy->lru_queue);
-        g_hash_table_insert(policy->zone_to_lru_map, zone_ptr, node);
+    // We only add zones to the LRU when they are full. Zones are closed after their last
+    // write is reported, so a zone shows up on one of the following writes.
+    if (io_type == ZN_WRITE) {
+        take_full_zones(policy);
+        // Apply buffered hits while the lock is held anyway
+        zn_read_buffer_drain(&policy->read_buffer, promote, policy);
     } else if (io_type == ZN_READ) {
-
-        GList *node = g_hash_table_lookup(policy->zone_to_lru_map, zone_ptr);
-        if (node) {
-            gpointer data = node->data;
-            g_queue_delete_link(&policy->lru_queue, node);
-            g_queue_push_tail(&policy->lru_queue, data);
-            // Replace in map, pointer invalid after destroying link
-            GList *new_node = g_queue_peek_tail_link(&policy->lru_queue);
-            g_hash_table_replace(policy->zone_to_lru_map, zone_ptr, new_node);
-        }
-
-        // If lru_loc == NULL, the zone is not in the LRU queue. This
-        // means that the zone is either not full, or has been removed
-        // by the eviction thread while the read occurred. Don't do
-        // anything
+        promote(policy, location);
     }
 
     dbg_printf("State after promotional update%s", "\n");
@@ -63,6 +99,8 @@ zn_policy_promotional_get_zone_to_evict(policy_data_t policy) {
         return -1;
     }
 
+    take_full_zones(promote_policy);
+    zn_read_buffer_drain(&promote_policy->read_buffer, promote, promote_policy);
     dbg_print_g_queue("lru_queue", &promote_policy->lru_queue, PRINT_G_QUEUE_GINT);
 
     if (g_queue_get_length(&promote_policy->lru_queue) == 0) {
@@ -0,0 +1,163 @@
+#include "eviction_policy.h"
+#include "eviction_policy_s3fifo.h"
+#include "glib.h"
+#include "zncache.h"
+#include "znutil.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * @brief Remember an ID of a zone evicted from the small FIFO, forgetting the oldest one if
+ * the ring is full
+ * @note Assumes that the policy lock is held
+ */
+static void
+ghost_push(struct zn_policy_s3fifo *policy, uint32_t id) {
+    uint64_t pos = policy->ghost_next++;
+    uint32_t slot = (uint32_t) (pos % policy->ghost_capacity);
+    if (pos >= policy->ghost_capacity) {
+        // Only forget the old ID if it was not pushed again since
+        uint32_t old = policy->ghost_ring[slot];
+        uint64_t *old_pos = zn_flatmap_find(&policy->ghosts, old);
+        if (old_pos != NULL && *old_pos == pos - policy->ghost_capacity) {
+            zn_flatmap_erase(&policy->ghosts, old);
+        }
+    }
+    policy->ghost_ring[slot] = id;
+    bool inserted;
+    *zn_flatmap_insert(&policy->ghosts, id, pos, &inserted) = pos;
+    zn_flatmap_reclaim(&policy->ghosts);
+}
+
+/**
+ * @brief Queue the zones that filled up since the last call. Zones written mostly with ghosts
+ * skip probation.
+ * @note Assumes that the policy lock is held
+ */
+static void
+take_full_zones(struct zn_policy_s3fifo *policy) {
+    int zone;
+    while ((zone = zsm_pop_full_zone(&policy->cache->zone_state)) != -1) {
+        struct eviction_policy_s3fifo_zone *z = &policy->zones[zone];
+        gpointer zone_ptr = GUINT_TO_POINTER((uint32_t) zone);
+        if (z->nr_ghosts > 0 && (uint64_t) z->nr_ghosts * 2 >= z->objects->len) {
+            g_queue_push_tail(&policy->main, zone_ptr);
+            policy->nr_ghost_admitted++;
+        } else {
+            g_queue_push_tail(&policy->small, zone_ptr);
+        }
+    }
+}
+
+/**
+ * @brief Whether enough objects of the zone were hit since it was written, or since its last
+ * pass, and clear their hits
+ * @note Assumes that the policy lock is held
+ */
+static bool
+take_hits(struct zn_policy_s3fifo *policy, uint32_t zone) {
+    struct eviction_policy_s3fifo_zone *z = &policy->zones[zone];
+    uint32_t nr_hit = 0;
+    for (uint32_t i = 0; i < z->objects->len; i++) {
+        uint32_t chunk =
+            g_array_index(z->objects, struct eviction_policy_s3fifo_object, i).chunk_offset;
+        if (__atomic_exchange_n(&z->hit[chunk], 0, __ATOMIC_RELAXED)) {
+            nr_hit++;
+        }
+    }
+    return nr_hit > 0 && (uint64_t) nr_hit * 100 >= (uint64_t) z->objects->len * ZN_S3FIFO_HIT_PERCENT;
+}
+
+/**
+ * @brief Forget what the policy knows about an evicted zone, remembering its objects as ghosts
+ * if it was on probation
+ * @note Assumes that the policy lock is held
+ */
+static void
+reset_zone(struct zn_policy_s3fifo *policy, uint32_t zone, bool ghost) {
+    struct eviction_policy_s3fifo_zone *z = &policy->zones[zone];
+    for (uint32_t i = 0; ghost && i < z->objects->len; i++) {
+        ghost_push(policy, g_array_index(z->objects, struct eviction_policy_s3fifo_object, i).id);
+    }
+    g_array_set_size(z->objects, 0);
+    z->nr_ghosts = 0;
+    // Late hits from readers of the evicted objects may still land, which only costs accuracy
+    memset(z->hit, 0, policy->cache->max_zone_chunks);
+}
+
+void
+zn_policy_s3fifo_update(policy_data_t _policy, struct zn_pair location,
+                        enum zn_io_type io_type) {
+    struct zn_policy_s3fifo *policy = _policy;
+    assert(policy);
+    assert(location.zone < policy->cache->nr_zones);
+    assert(location.chunk_offset < policy->cache->max_zone_chunks);
+
+    // Hits only mark the object, the policy looks at the marks when the zone reaches the head
+    // of its FIFO
+    if (io_type == ZN_READ) {
+        __atomic_store_n(&policy->zones[location.zone].hit[location.chunk_offset], 1,
+                         __ATOMIC_RELAXED);
+        return;
+    }
+
+    g_mutex_lock(&policy->policy_mutex);
+
+    struct eviction_policy_s3fifo_zone *z = &policy->zones[location.zone];
+    struct eviction_policy_s3fifo_object object = {.id = location.id,
+                                                   .chunk_offset = location.chunk_offset};
+    g_array_append_val(z->objects, object);
+    __atomic_store_n(&z->hit[location.chunk_offset], 0, __ATOMIC_RELAXED);
+    if (zn_flatmap_erase(&policy->ghosts, location.id)) {
+        z->nr_ghosts++;
+    }
+
+    // Zones are closed after their last write is reported, so a zone shows up on one of the
+    // following writes
+    take_full_zones(policy);
+
+    g_mutex_unlock(&policy->policy_mutex);
+}
+
+int
+zn_policy_s3fifo_get_zone_to_evict(policy_data_t _policy) {
+    struct zn_policy_s3fifo *policy = _policy;
+
+    gboolean locked_by_us = g_mutex_trylock(&policy->policy_mutex);
+    if (!locked_by_us) {
+        return -1;
+    }
+
+    take_full_zones(policy);
+
+    // Every zone is looked at once at most, hits that keep coming can't keep us here
+    int zone = -1;
+    uint32_t budget = g_queue_get_length(&policy->small) + g_queue_get_length(&policy->main);
+    while (zone == -1 && !(g_queue_is_empty(&policy->small) && g_queue_is_empty(&policy->main))) {
+        bool from_small = !g_queue_is_empty(&policy->small) &&
+                          (g_queue_get_length(&policy->small) >= policy->small_zones ||
+                           g_queue_is_empty(&policy->main));
+        GQueue *queue = from_small ? &policy->small : &policy->main;
+        uint32_t candidate = GPOINTER_TO_UINT(g_queue_pop_head(queue));
+
+        if (take_hits(policy, candidate) && budget > 0) {
+            budget--;
+            g_queue_push_tail(&policy->main, GUINT_TO_POINTER(candidate));
+            if (from_small) {
+                policy->nr_promoted++;
+            } else {
+                policy->nr_reinserted++;
+            }
+            continue;
+        }
+
+        reset_zone(policy, candidate, from_small);
+        zone = (int) candidate;
+        dbg_printf("Evicted zone=%u from the %s FIFO\n", candidate, from_small ? "small" : "main");
+    }
+
+    g_mutex_unlock(&policy->policy_mutex);
+    return zone;
+}
@@ -2,6 +2,8 @@
 
 #include "eviction_policy_promotional.h"
 #include "eviction_policy_chunk.h"
+#include "eviction_policy_fifo.h"
+#include "eviction_policy_s3fifo.h"
 #include "zncache.h"
 
 #include <assert.h>
@@ -58,10 +60,10 @@ zn_evict_policy_init(struct zn_evict_policy *policy, enum zn_evict_policy_type t
             assert(data->zone_to_lru_map);
 
             data->cache = cache;
-            data->zone_max_chunks = cache->max_zone_chunks;
 
             assert(data->zone_to_lru_map);
             g_queue_init(&data->lru_queue);
+            zn_read_buffer_init(&data->read_buffer, READ_BUFFER_SIZE);
 
             *policy = (struct zn_evict_policy) {
                 .type = ZN_EVICT_PROMOTE_ZONE,
@@ -73,7 +75,8 @@ zn_evict_policy_init(struct zn_evict_policy *policy, enum zn_evict_policy_type t
         }
 
 
-        case ZN_EVICT_CHUNK: {
+        case ZN_EVICT_CHUNK:
+        case ZN_EVICT_CHUNK_CLOCK: {
             struct zn_policy_chunk *data = malloc(sizeof(struct zn_policy_chunk));
             assert(data);
 
@@ -82,12 +85,28 @@ zn_evict_policy_init(struct zn_evict_policy *policy, enum zn_evict_policy_type t
             data->chunk_buf = malloc(cache->max_zone_chunks * cache->chunk_sz);
             assert(data->chunk_buf);
 
-            data->total_chunks = cache->nr_zones * cache->max_zone_chunks;
+            data->total_bytes = (uint64_t) cache->nr_zones * cache->max_zone_chunks * cache->chunk_sz;
+            data->used_bytes = 0;
 
-            // zn_pair to lru_map
-            data->chunk_to_lru_map = g_hash_table_new(
-                g_direct_hash, g_direct_equal
-            );
+            // One slot per chunk, which also holds the LRU links of the object starting there
+            uint64_t nr_slots = (uint64_t) cache->nr_zones * cache->max_zone_chunks;
+            assert(nr_slots < ZN_CHUNK_LRU_NONE);
+            data->slots = g_new(struct eviction_policy_chunk_slot, nr_slots);
+            assert(data->slots);
+            for (uint64_t s = 0; s < nr_slots; s++) {
+                data->slots[s].pair.chunk_offset = 0;
+                data->slots[s].pair.nr_chunks = 0;
+                data->slots[s].pair.in_use = false;
+                data->slots[s].lru_prev = ZN_CHUNK_LRU_NONE;
+                data->slots[s].lru_next = ZN_CHUNK_LRU_NONE;
+                data->slots[s].referenced = 0;
+            }
+            data->lru_head = ZN_CHUNK_LRU_NONE;
+            data->lru_tail = ZN_CHUNK_LRU_NONE;
+            data->nr_objects = 0;
+            data->nr_slots = (uint32_t) nr_slots;
+            data->clock = type == ZN_EVICT_CHUNK_CLOCK;
+            data->clock_hand = 0;
 
             // Setup backing pool where zones marked not in use
             data->zone_pool = g_new(struct eviction_policy_chunk_zone, cache->nr_zones);
@@ -95,40 +114,80 @@ zn_evict_policy_init(struct zn_evict_policy *policy, enum zn_evict_policy_type t
             for (uint32_t z = 0; z < cache->nr_zones; z++) {
                 data->zone_pool[z].chunks_in_use = 0;
                 data->zone_pool[z].filled = false;
-                data->zone_pool[z].chunks = g_new(struct zn_pair, cache->max_zone_chunks);
-                assert(data->zone_pool[z].chunks);
-                for (uint32_t c = 0; c < cache->max_zone_chunks; c++) {
-                    data->zone_pool[z].chunks[c].chunk_offset = 0;
-                    data->zone_pool[z].chunks[c].in_use = false;
-                    g_hash_table_insert(
-                        data->chunk_to_lru_map,
-                        &data->zone_pool[z].chunks[c],
-                        NULL
-                    );
-                }
+                data->zone_pool[z].pqueue_entry = NULL;
+                data->zone_pool[z].chunks = &data->slots[(uint64_t) z * cache->max_zone_chunks];
             }
 
             data->invalid_pqueue = zn_minheap_init(cache->nr_zones);
             assert(data->invalid_pqueue);
 
             g_mutex_init(&data->policy_mutex);
+            // Hits only set a bit under CLOCK, there is nothing to buffer
+            zn_read_buffer_init(&data->read_buffer, data->clock ? 0 : READ_BUFFER_SIZE);
+
+            *policy = (struct zn_evict_policy) {
+                .type = type,
+                .data = data,
+                .update_policy = data->clock ? zn_policy_chunk_clock_update : zn_policy_chunk_update,
+                .do_evict = zn_policy_chunk_evict
+            };
+            break;
+        }
 
-            assert(data->chunk_to_lru_map);
+        case ZN_EVICT_S3FIFO_ZONE: {
+            struct zn_policy_s3fifo *data = malloc(sizeof(struct zn_policy_s3fifo));
+            assert(data);
+            g_mutex_init(&data->policy_mutex);
+            data->cache = cache;
 
-            g_queue_init(&data->lru_queue);
+            g_queue_init(&data->small);
+            g_queue_init(&data->main);
+            data->small_zones =
+                MAX(1, (uint32_t) ((uint64_t) cache->nr_zones * ZN_S3FIFO_SMALL_PERCENT / 100));
+
+            data->zones = g_new(struct eviction_policy_s3fifo_zone, cache->nr_zones);
+            uint8_t *hits = g_new0(uint8_t, (uint64_t) cache->nr_zones * cache->max_zone_chunks);
+            for (uint32_t z = 0; z < cache->nr_zones; z++) {
+                data->zones[z].objects =
+                    g_array_new(FALSE, FALSE, sizeof(struct eviction_policy_s3fifo_object));
+                data->zones[z].hit = &hits[(uint64_t) z * cache->max_zone_chunks];
+                data->zones[z].nr_ghosts = 0;
+            }
+
+            // As many ghosts as the main FIFO holds objects of a chunk
+            uint64_t ghost_capacity =
+                (uint64_t) MAX(1, cache->nr_zones - data->small_zones) * cache->max_zone_chunks;
+            assert(ghost_capacity <= UINT32_MAX);
+            data->ghost_capacity = (uint32_t) ghost_capacity;
+            data->ghost_ring = g_new(uint32_t, data->ghost_capacity);
+            data->ghost_next = 0;
+            zn_flatmap_init(&data->ghosts, data->ghost_capacity);
+
+            data->nr_promoted = 0;
+            data->nr_ghost_admitted = 0;
+            data->nr_reinserted = 0;
 
             *policy = (struct zn_evict_policy) {
-                .type = ZN_EVICT_CHUNK,
+                .type = ZN_EVICT_S3FIFO_ZONE,
                 .data = data,
-                .update_policy = zn_policy_chunk_update,
-                .do_evict = zn_policy_chunk_evict
+                .update_policy = zn_policy_s3fifo_update,
+                .do_evict = zn_policy_s3fifo_get_zone_to_evict
             };
             break;
         }
 
         case ZN_EVICT_ZONE: {
-            fprintf(stderr, "NYI\n");
-            exit(1);
+            struct zn_policy_fifo *data = malloc(sizeof(struct zn_policy_fifo));
+            assert(data);
+            data->cache = cache;
+
+            *policy = (struct zn_evict_policy) {
+                .type = ZN_EVICT_ZONE,
+                .data = data,
+                .update_policy = zn_policy_fifo_update,
+                .do_evict = zn_policy_fifo_get_zone_to_evict
+            };
+            break;
         }
     }
 }
@@ -141,16 +200,59 @@ zn_evict_policy_get_cache_size(struct zn_evict_policy *policy) {
             return g_queue_get_length(&data->lru_queue) * data->cache->zone_cap;
         }
 
-        case ZN_EVICT_CHUNK: {
+        case ZN_EVICT_CHUNK:
+        case ZN_EVICT_CHUNK_CLOCK: {
             struct zn_policy_chunk *data = policy->data;
-            return g_queue_get_length(&data->lru_queue) * data->cache->chunk_sz;
+            return data->used_bytes;
+        }
+
+        case ZN_EVICT_S3FIFO_ZONE: {
+            struct zn_policy_s3fifo *data = policy->data;
+            return (g_queue_get_length(&data->small) + g_queue_get_length(&data->main)) *
+                   data->cache->zone_cap;
         }
 
         case ZN_EVICT_ZONE: {
-            fprintf(stderr, "NYI\n");
-            exit(1);
+            struct zn_policy_fifo *data = policy->data;
+            return zsm_get_num_full_zones(&data->cache->zone_state) * data->cache->zone_cap;
         }
     }
 
     return 0;
-}
\ No newline at end of file
+}
+
+bool
+zn_evict_policy_get_read_buffer_stats(struct zn_evict_policy *policy,
+                                      struct zn_read_buffer_stats *stats) {
+    struct zn_read_buffer *buffer = NULL;
+    GMutex *lock = NULL;
+    switch (policy->type) {
+        case ZN_EVICT_PROMOTE_ZONE: {
+            struct zn_policy_promotional *data = policy->data;
+            buffer = &data->read_buffer;
+            lock = &data->policy_mutex;
+            break;
+        }
+
+        case ZN_EVICT_CHUNK:
+        case ZN_EVICT_CHUNK_CLOCK: {
+            struct zn_policy_chunk *data = policy->data;
+            buffer = &data->read_buffer;
+            lock = &data->policy_mutex;
+            break;
+        }
+
+        case ZN_EVICT_S3FIFO_ZONE:
+        case ZN_EVICT_ZONE: {
+            return false;
+        }
+    }
+
+    if (buffer == NULL || !zn_read_buffer_enabled(buffer)) {
+        return false;
+    }
+    g_mutex_lock(lock);
+    zn_read_buffer_get_stats(buffer, stats);
+    g_mutex_unlock(lock);
+    return true;
+}
@@ -0,0 +1,220 @@
+#include "extentmap.h"
+
+#include "znutil.h"
+
+#include <assert.h>
+#include <glib.h>
+
+/** Initial number of slots in the index */
+#define EXTENT_MAP_INITIAL_CAPACITY 64
+
+/**
+ * @brief The list of `id`, or NULL. Called with the map lock.
+ */
+static struct zn_extent_list *
+list_of(struct zn_extent_map *map, uint32_t id) {
+    uint64_t *value = zn_flatmap_find(&map->index, id);
+    return value != NULL ? (struct zn_extent_list *) (uintptr_t) *value : NULL;
+}
+
+static void
+free_list(uint32_t key, uint64_t *value, void *user_data) {
+    (void) key;
+    (void) user_data;
+    g_free((struct zn_extent_list *) (uintptr_t) *value);
+}
+
+void
+zn_extent_map_init(struct zn_extent_map *map, uint32_t nr_zones, gint *active_readers) {
+    assert(map);
+    assert(active_readers);
+
+    g_mutex_init(&map->lock);
+    zn_flatmap_init(&map->index, EXTENT_MAP_INITIAL_CAPACITY);
+    map->zone_ids = g_new(GArray *, nr_zones);
+    for (uint32_t i = 0; i < nr_zones; i++) {
+        map->zone_ids[i] = g_array_new(false, false, sizeof(uint32_t));
+    }
+    map->nr_zones = nr_zones;
+    map->active_readers = active_readers;
+    map->nr_inserted = 0;
+    map->nr_dropped = 0;
+}
+
+void
+zn_extent_map_destroy(struct zn_extent_map *map) {
+    assert(map);
+
+    zn_flatmap_foreach(&map->index, free_list, NULL);
+    zn_flatmap_destroy(&map->index);
+    for (uint32_t i = 0; i < map->nr_zones; i++) {
+        g_array_free(map->zone_ids[i], true);
+    }
+    g_free(map->zone_ids);
+    g_mutex_clear(&map->lock);
+}
+
+void
+zn_extent_map_insert(struct zn_extent_map *map, const struct zn_extent_list *list) {
+    assert(map);
+    assert(list->nr_extents > 1 && list->nr_extents <= ZN_EXTENT_MAP_MAX_EXTENTS);
+
+    uint32_t id = list->extents[0].id;
+    struct zn_extent_list *copy = g_new(struct zn_extent_list, 1);
+    *copy = *list;
+
+    g_mutex_lock(&map->lock);
+    bool inserted;
+    uint64_t *value = zn_flatmap_insert(&map->index, id, (uint64_t) (uintptr_t) copy, &inserted);
+    if (!inserted) {
+        // The ID was written again after its object was evicted without the map knowing
+        g_free((struct zn_extent_list *) (uintptr_t) *value);
+        *value = (uint64_t) (uintptr_t) copy;
+    }
+    zn_flatmap_reclaim(&map->index);
+
+    for (uint32_t i = 0; i < list->nr_extents; i++) {
+        assert(list->extents[i].id == id);
+        assert(list->extents[i].zone < map->nr_zones);
+        g_array_append_val(map->zone_ids[list->extents[i].zone], id);
+    }
+    map->nr_inserted++;
+    g_mutex_unlock(&map->lock);
+}
+
+bool
+zn_extent_map_acquire(struct zn_extent_map *map, const struct zn_pair *head,
+                      struct zn_extent_list *list) {
+    assert(map);
+    assert(head);
+    assert(list);
+
+    g_mutex_lock(&map->lock);
+    struct zn_extent_list *found = list_of(map, head->id);
+    if (found == NULL || found->extents[0].zone != head->zone ||
+        found->extents[0].chunk_offset != head->chunk_offset) {
+        g_mutex_unlock(&map->lock);
+        return false;
+    }
+
+    // A zone is only reset after its lists are dropped under the lock, so every extent of a
+    // list that is still here holds its data
+    for (uint32_t i = 1; i < found->nr_extents; i++) {
+        g_atomic_int_inc(&map->active_readers[found->extents[i].zone]);
+    }
+    *list = *found;
+    g_mutex_unlock(&map->lock);
+    return true;
+}
+
+bool
+zn_extent_map_release(struct zn_extent_map *map, const struct zn_extent_list *list) {
+    assert(map);
+    assert(list);
+
+    g_mutex_lock(&map->lock);
+    struct zn_extent_list *found = list_of(map, list->extents[0].id);
+    bool whole = found != NULL && found->nr_extents == list->nr_extents;
+    for (uint32_t i = 0; whole && i < list->nr_extents; i++) {
+        whole = found->extents[i].zone == list->extents[i].zone &&
+                found->extents[i].chunk_offset == list->extents[i].chunk_offset;
+    }
+    g_mutex_unlock(&map->lock);
+
+    for (uint32_t i = 1; i < list->nr_extents; i++) {
+        g_atomic_int_dec_and_test(&map->active_readers[list->extents[i].zone]);
+    }
+    return whole;
+}
+
+/**
+ * @brief The list with an extent at `location`, or NULL. Called with the map lock.
+ */
+static struct zn_extent_list *
+list_containing(struct zn_extent_map *map, const struct zn_pair *location) {
+    struct zn_extent_list *found = list_of(map, location->id);
+    return found != NULL && zn_extent_list_contains(found, location) ? found : NULL;
+}
+
+bool
+zn_extent_map_get(struct zn_extent_map *map, const struct zn_pair *location,
+                  struct zn_extent_list *list) {
+    assert(map);
+    assert(location);
+    assert(list);
+
+    g_mutex_lock(&map->lock);
+    struct zn_extent_list *found = list_containing(map, location);
+    if (found != NULL) {
+        *list = *found;
+    }
+    g_mutex_unlock(&map->lock);
+    return found != NULL;
+}
+
+bool
+zn_extent_map_remove(struct zn_extent_map *map, const struct zn_pair *location,
+                     struct zn_extent_list *list) {
+    assert(map);
+    assert(location);
+    assert(list);
+
+    g_mutex_lock(&map->lock);
+    struct zn_extent_list *found = list_containing(map, location);
+    if (found != NULL) {
+        *list = *found;
+        zn_flatmap_erase(&map->index, location->id);
+        g_free(found);
+    }
+    g_mutex_unlock(&map->lock);
+    // The IDs stay in the per-zone arrays until their zones are cleared
+    return found != NULL;
+}
+
+uint32_t
+zn_extent_map_clear_zone(struct zn_extent_map *map, struct zn_cachemap *cache_map,
+                         uint32_t zone) {
+    assert(map);
+    assert(cache_map);
+    assert(zone < map->nr_zones);
+
+    g_mutex_lock(&map->lock);
+    GArray *ids = map->zone_ids[zone];
+    uint32_t dropped = 0;
+    for (guint i = 0; i < ids->len; i++) {
+        uint32_t id = g_array_index(ids, uint32_t, i);
+        struct zn_extent_list *found = list_of(map, id);
+        if (found == NULL) {
+            continue;
+        }
+        bool in_zone = false;
+        for (uint32_t e = 0; e < found->nr_extents; e++) {
+            in_zone = in_zone || found->extents[e].zone == zone;
+        }
+        if (!in_zone) {
+            // Listed again with extents in other zones since
+            continue;
+        }
+
+        // The head goes with the zone of any extent, lookups of the ID are misses from here on
+        dbg_printf("Dropping data_id=%u with an extent in zone=%u\n", id, zone);
+        zn_cachemap_clear_extent(cache_map, &found->extents[0]);
+        zn_flatmap_erase(&map->index, id);
+        g_free(found);
+        dropped++;
+    }
+    g_array_set_size(ids, 0);
+    map->nr_dropped += dropped;
+    g_mutex_unlock(&map->lock);
+    return dropped;
+}
+
+uint32_t
+zn_extent_map_size(struct zn_extent_map *map) {
+    assert(map);
+
+    g_mutex_lock(&map->lock);
+    uint32_t size = map->index.size;
+    g_mutex_unlock(&map->lock);
+    return size;
+}
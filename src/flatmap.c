@@ -0,0 +1,436 @@
+#include "flatmap.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#    include <immintrin.h>
+#endif
+
+#include "znutil.h"
+
+#define CTRL_EMPTY ((int8_t) -128) /**< 0b10000000 */
+#define CTRL_DELETED ((int8_t) -2) /**< 0b11111110 */
+
+/** Maximum load (full + deleted slots) before the table is rehashed, as a fraction of 8 */
+#define MAX_LOAD_EIGHTHS 7
+
+/** Bitmask with one bit per slot in a group */
+typedef uint32_t group_mask_t;
+
+/**
+ * @brief Mixes the key so sequential IDs spread over groups and control bytes
+ *
+ * Finalizer from MurmurHash3 (fmix64).
+ */
+static inline uint64_t
+hash_key(uint32_t key) {
+    uint64_t h = key;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/** @brief Slot selector, the high bits of the hash */
+static inline uint64_t
+hash_h1(uint64_t hash) {
+    return hash >> 7;
+}
+
+/** @brief Control byte stored for a full slot, the low 7 bits of the hash */
+static inline int8_t
+hash_h2(uint64_t hash) {
+    return (int8_t) (hash & 0x7f);
+}
+
+#if defined(__AVX2__)
+
+static inline group_mask_t
+group_match(const int8_t *group, int8_t h2) {
+    __m256i ctrl = _mm256_load_si256((const __m256i *) group);
+    return (group_mask_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(ctrl, _mm256_set1_epi8(h2)));
+}
+
+static inline group_mask_t
+group_match_empty(const int8_t *group) {
+    return group_match(group, CTRL_EMPTY);
+}
+
+static inline group_mask_t
+group_match_empty_or_deleted(const int8_t *group) {
+    // EMPTY and DELETED are the only control bytes below -1
+    __m256i ctrl = _mm256_load_si256((const __m256i *) group);
+    return (group_mask_t) _mm256_movemask_epi8(_mm256_cmpgt_epi8(_mm256_set1_epi8(-1), ctrl));
+}
+
+#elif defined(__SSE2__)
+
+static inline group_mask_t
+group_match(const int8_t *group, int8_t h2) {
+    __m128i ctrl = _mm_load_si128((const __m128i *) group);
+    return (group_mask_t) _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(h2)));
+}
+
+static inline group_mask_t
+group_match_empty(const int8_t *group) {
+    return group_match(group, CTRL_EMPTY);
+}
+
+static inline group_mask_t
+group_match_empty_or_deleted(const int8_t *group) {
+    // EMPTY and DELETED are the only control bytes below -1
+    __m128i ctrl = _mm_load_si128((const __m128i *) group);
+    return (group_mask_t) _mm_movemask_epi8(_mm_cmplt_epi8(ctrl, _mm_set1_epi8(-1)));
+}
+
+#else
+
+static inline group_mask_t
+group_match(const int8_t *group, int8_t h2) {
+    group_mask_t mask = 0;
+    for (uint32_t i = 0; i < ZN_FLATMAP_GROUP_WIDTH; i++) {
+        mask |= (group_mask_t) (group[i] == h2) << i;
+    }
+    return mask;
+}
+
+static inline group_mask_t
+group_match_empty(const int8_t *group) {
+    return group_match(group, CTRL_EMPTY);
+}
+
+static inline group_mask_t
+group_match_empty_or_deleted(const int8_t *group) {
+    group_mask_t mask = 0;
+    for (uint32_t i = 0; i < ZN_FLATMAP_GROUP_WIDTH; i++) {
+        mask |= (group_mask_t) (group[i] < -1) << i;
+    }
+    return mask;
+}
+
+#endif
+
+/**
+ * @brief Triangular probe sequence over groups
+ *
+ * With a power of two group count, visiting group (start + i*(i+1)/2) for i = 0, 1, ...
+ * reaches every group exactly once.
+ */
+struct probe_seq {
+    uint32_t group;
+    uint32_t stride;
+    uint32_t group_mask;
+};
+
+static inline struct probe_seq
+probe_start(const struct zn_flatmap_table *table, uint64_t hash) {
+    uint32_t nr_groups = table->capacity / ZN_FLATMAP_GROUP_WIDTH;
+    return (struct probe_seq) {
+        .group = (uint32_t) hash_h1(hash) & (nr_groups - 1),
+        .stride = 0,
+        .group_mask = nr_groups - 1,
+    };
+}
+
+static inline void
+probe_next(struct probe_seq *seq) {
+    seq->stride++;
+    seq->group = (seq->group + seq->stride) & seq->group_mask;
+}
+
+static inline uint32_t
+next_pow2(uint32_t v) {
+    if (v <= 1) {
+        return 1;
+    }
+    return 1u << (32 - __builtin_clz(v - 1));
+}
+
+static struct zn_flatmap_table *
+alloc_table(uint32_t capacity) {
+    struct zn_flatmap_table *table = malloc(sizeof(struct zn_flatmap_table));
+    if (table == NULL) {
+        nomem();
+    }
+    table->capacity = capacity;
+    table->next_retired = NULL;
+
+    if (posix_memalign((void **) &table->ctrl, ZN_FLATMAP_GROUP_WIDTH, capacity) != 0) {
+        nomem();
+    }
+    memset(table->ctrl, CTRL_EMPTY, capacity);
+
+    table->slots = malloc((size_t) capacity * sizeof(struct zn_flatmap_slot));
+    if (table->slots == NULL) {
+        nomem();
+    }
+    return table;
+}
+
+static void
+free_table(struct zn_flatmap_table *table) {
+    free(table->ctrl);
+    free(table->slots);
+    free(table);
+}
+
+/**
+ * @brief Stores a control byte. Concurrent readers load control bytes without the lock.
+ */
+static inline void
+set_ctrl(struct zn_flatmap_table *table, uint32_t slot, int8_t ctrl) {
+    __atomic_store_n(&table->ctrl[slot], ctrl, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Finds the first EMPTY or DELETED slot in the probe sequence of `hash`
+ */
+static uint32_t
+find_insert_slot(const struct zn_flatmap_table *table, uint64_t hash) {
+    struct probe_seq seq = probe_start(table, hash);
+    while (true) {
+        const int8_t *group = &table->ctrl[seq.group * ZN_FLATMAP_GROUP_WIDTH];
+        group_mask_t avail = group_match_empty_or_deleted(group);
+        if (avail != 0) {
+            return (seq.group * ZN_FLATMAP_GROUP_WIDTH) + __builtin_ctz(avail);
+        }
+        probe_next(&seq);
+    }
+}
+
+/**
+ * @brief Builds a new table with `capacity` slots, dropping all tombstones
+ *
+ * The new table is fully populated before it is published, the old one is retired.
+ */
+static void
+rehash(struct zn_flatmap *map, uint32_t capacity) {
+    struct zn_flatmap_table *old = map->table;
+    struct zn_flatmap_table *table = alloc_table(capacity);
+
+    for (uint32_t i = 0; i < old->capacity; i++) {
+        if (old->ctrl[i] < 0) {
+            continue;
+        }
+        uint64_t hash = hash_key(old->slots[i].key);
+        uint32_t slot = find_insert_slot(table, hash);
+        table->ctrl[slot] = hash_h2(hash);
+        table->slots[slot] = old->slots[i];
+    }
+
+    __atomic_store_n(&map->table, table, __ATOMIC_RELEASE);
+    map->capacity = capacity;
+    map->tombstones = 0;
+
+    old->next_retired = map->retired;
+    map->retired = old;
+}
+
+void
+zn_flatmap_init(struct zn_flatmap *map, uint32_t capacity) {
+    assert(map);
+    capacity = next_pow2(capacity);
+    if (capacity < ZN_FLATMAP_GROUP_WIDTH) {
+        capacity = ZN_FLATMAP_GROUP_WIDTH;
+    }
+    map->table = alloc_table(capacity);
+    map->retired = NULL;
+    map->capacity = capacity;
+    map->size = 0;
+    map->tombstones = 0;
+}
+
+void
+zn_flatmap_destroy(struct zn_flatmap *map) {
+    zn_flatmap_reclaim(map);
+    if (map->table != NULL) {
+        free_table(map->table);
+    }
+    map->table = NULL;
+    map->capacity = 0;
+    map->size = 0;
+    map->tombstones = 0;
+}
+
+/**
+ * @brief Finds the slot index holding `key`
+ *
+ * @return Slot index, or UINT32_MAX if the key is not present
+ */
+static uint32_t
+find_slot(const struct zn_flatmap_table *table, uint32_t key) {
+    uint64_t hash = hash_key(key);
+    int8_t h2 = hash_h2(hash);
+    struct probe_seq seq = probe_start(table, hash);
+
+    while (true) {
+        const int8_t *group = &table->ctrl[seq.group * ZN_FLATMAP_GROUP_WIDTH];
+        group_mask_t match = group_match(group, h2);
+        while (match != 0) {
+            uint32_t slot = (seq.group * ZN_FLATMAP_GROUP_WIDTH) + __builtin_ctz(match);
+            if (table->slots[slot].key == key) {
+                return slot;
+            }
+            match &= match - 1;
+        }
+
+        // A group with an empty slot ends every probe sequence that reaches it
+        if (group_match_empty(group) != 0) {
+            return UINT32_MAX;
+        }
+        probe_next(&seq);
+    }
+}
+
+uint64_t *
+zn_flatmap_find(struct zn_flatmap *map, uint32_t key) {
+    uint32_t slot = find_slot(map->table, key);
+    return slot == UINT32_MAX ? NULL : &map->table->slots[slot].value;
+}
+
+bool
+zn_flatmap_find_concurrent(const struct zn_flatmap *map, uint32_t key, uint64_t *value) {
+    const struct zn_flatmap_table *table = __atomic_load_n(&map->table, __ATOMIC_ACQUIRE);
+    uint64_t hash = hash_key(key);
+    int8_t h2 = hash_h2(hash);
+    struct probe_seq seq = probe_start(table, hash);
+
+    // A writer can fill the empty slot that would have ended the sequence, so stop after
+    // visiting every group once
+    for (uint32_t probes = 0; probes <= seq.group_mask; probes++) {
+        const int8_t *group = &table->ctrl[seq.group * ZN_FLATMAP_GROUP_WIDTH];
+        group_mask_t match = group_match(group, h2);
+        while (match != 0) {
+            uint32_t slot = (seq.group * ZN_FLATMAP_GROUP_WIDTH) + __builtin_ctz(match);
+            if (__atomic_load_n(&table->slots[slot].key, __ATOMIC_ACQUIRE) == key) {
+                *value = __atomic_load_n(&table->slots[slot].value, __ATOMIC_ACQUIRE);
+                return true;
+            }
+            match &= match - 1;
+        }
+
+        if (group_match_empty(group) != 0) {
+            return false;
+        }
+        probe_next(&seq);
+    }
+    return false;
+}
+
+uint64_t *
+zn_flatmap_insert(struct zn_flatmap *map, uint32_t key, uint64_t value, bool *inserted) {
+    uint64_t *found = zn_flatmap_find(map, key);
+    if (found != NULL) {
+        *inserted = false;
+        return found;
+    }
+
+    uint64_t load = (uint64_t) map->size + map->tombstones + 1;
+    if (load * 8 > (uint64_t) map->capacity * MAX_LOAD_EIGHTHS) {
+        // Mostly tombstones: clean up in place, otherwise grow
+        uint32_t capacity = map->capacity;
+        if ((uint64_t) (map->size + 1) * 16 > (uint64_t) capacity * MAX_LOAD_EIGHTHS) {
+            capacity *= 2;
+        }
+        rehash(map, capacity);
+    }
+
+    struct zn_flatmap_table *table = map->table;
+    uint64_t hash = hash_key(key);
+    uint32_t slot = find_insert_slot(table, hash);
+    if (table->ctrl[slot] == CTRL_DELETED) {
+        map->tombstones--;
+    }
+    // Fill the slot before the control byte makes it visible to concurrent readers. A reused
+    // slot may still be probed for its old key, the value goes first so that a reader that
+    // loads the new key also loads the new value.
+    __atomic_store_n(&table->slots[slot].value, value, __ATOMIC_RELAXED);
+    __atomic_store_n(&table->slots[slot].key, key, __ATOMIC_RELEASE);
+    set_ctrl(table, slot, hash_h2(hash));
+    map->size++;
+
+    *inserted = true;
+    return &table->slots[slot].value;
+}
+
+/**
+ * @brief Empties a full slot, leaving a tombstone only if a probe sequence may pass it
+ */
+static void
+erase_slot(struct zn_flatmap *map, struct zn_flatmap_table *table, uint32_t slot) {
+    const int8_t *group = &table->ctrl[(slot / ZN_FLATMAP_GROUP_WIDTH) * ZN_FLATMAP_GROUP_WIDTH];
+
+    // If the group still has an empty slot, no probe sequence ever continued past it, so the
+    // slot can become empty again. Otherwise leave a tombstone to keep later keys reachable.
+    if (group_match_empty(group) != 0) {
+        set_ctrl(table, slot, CTRL_EMPTY);
+    } else {
+        set_ctrl(table, slot, CTRL_DELETED);
+        map->tombstones++;
+    }
+    map->size--;
+}
+
+bool
+zn_flatmap_erase(struct zn_flatmap *map, uint32_t key) {
+    struct zn_flatmap_table *table = map->table;
+    uint32_t slot = find_slot(table, key);
+    if (slot == UINT32_MAX) {
+        return false;
+    }
+    erase_slot(map, table, slot);
+    return true;
+}
+
+uint32_t
+zn_flatmap_retain(struct zn_flatmap *map, bool (*keep)(uint32_t key, uint64_t value, void *user_data),
+                  void *user_data) {
+    struct zn_flatmap_table *table = map->table;
+    uint32_t erased = 0;
+    for (uint32_t i = 0; i < table->capacity; i++) {
+        if (table->ctrl[i] >= 0 && !keep(table->slots[i].key, table->slots[i].value, user_data)) {
+            erase_slot(map, table, i);
+            erased++;
+        }
+    }
+    return erased;
+}
+
+bool
+zn_flatmap_has_retired(const struct zn_flatmap *map) {
+    return map->retired != NULL;
+}
+
+void
+zn_flatmap_reclaim(struct zn_flatmap *map) {
+    while (map->retired != NULL) {
+        struct zn_flatmap_table *table = map->retired;
+        map->retired = table->next_retired;
+        free_table(table);
+    }
+}
+
+size_t
+zn_flatmap_memory(const struct zn_flatmap *map) {
+    size_t slot_bytes = sizeof(int8_t) + sizeof(struct zn_flatmap_slot);
+    size_t bytes = (size_t) map->capacity * slot_bytes;
+    for (const struct zn_flatmap_table *t = map->retired; t != NULL; t = t->next_retired) {
+        bytes += (size_t) t->capacity * slot_bytes;
+    }
+    return bytes;
+}
+
+void
+zn_flatmap_foreach(struct zn_flatmap *map, void (*fn)(uint32_t key, uint64_t *value, void *user_data),
+                   void *user_data) {
+    struct zn_flatmap_table *table = map->table;
+    for (uint32_t i = 0; i < table->capacity; i++) {
+        if (table->ctrl[i] >= 0) {
+            fn(table->slots[i].key, &table->slots[i].value, user_data);
+        }
+    }
+}
@@ -0,0 +1,126 @@
+#include "readbuffer.h"
+
+#include <assert.h>
+#include <glib.h>
+
+/** Stripes handed out to threads so far, round robin */
+static gint nr_stripe_threads = 0;
+
+static GPrivate thread_stripe = G_PRIVATE_INIT(NULL);
+
+/**
+ * @brief Get the calling thread's stripe, assigning one on first use
+ */
+static guint
+stripe_self(void) {
+    guint stripe = GPOINTER_TO_UINT(g_private_get(&thread_stripe));
+    if (G_LIKELY(stripe != 0)) {
+        return stripe - 1;
+    }
+
+    stripe = (guint) g_atomic_int_add(&nr_stripe_threads, 1) % ZN_READ_BUFFER_STRIPES + 1;
+    g_private_set(&thread_stripe, GUINT_TO_POINTER(stripe));
+    return stripe - 1;
+}
+
+void
+zn_read_buffer_init(struct zn_read_buffer *buffer, uint32_t capacity) {
+    assert(buffer);
+    assert(capacity <= (1u << 30));
+
+    buffer->capacity = 0;
+    if (capacity > 0) {
+        buffer->capacity = 1;
+        while (buffer->capacity < capacity) {
+            buffer->capacity <<= 1;
+        }
+    }
+
+    for (uint32_t i = 0; i < ZN_READ_BUFFER_STRIPES; i++) {
+        struct zn_read_buffer_stripe *stripe = &buffer->stripes[i];
+        stripe->writes = 0;
+        stripe->reads = 0;
+        stripe->nr_dropped = 0;
+        // Zeroed sequence numbers are never a published write index + 1 for their entry
+        stripe->entries = buffer->capacity > 0
+                              ? g_new0(struct zn_read_buffer_entry, buffer->capacity)
+                              : NULL;
+    }
+    buffer->nr_drains = 0;
+    buffer->nr_applied = 0;
+}
+
+void
+zn_read_buffer_destroy(struct zn_read_buffer *buffer) {
+    assert(buffer);
+
+    for (uint32_t i = 0; i < ZN_READ_BUFFER_STRIPES; i++) {
+        g_free(buffer->stripes[i].entries);
+        buffer->stripes[i].entries = NULL;
+    }
+}
+
+bool
+zn_read_buffer_record(struct zn_read_buffer *buffer, struct zn_pair location) {
+    assert(zn_read_buffer_enabled(buffer));
+
+    struct zn_read_buffer_stripe *stripe = &buffer->stripes[stripe_self()];
+    guint writes = (guint) g_atomic_int_get(&stripe->writes);
+    guint pending = writes - (guint) g_atomic_int_get(&stripe->reads);
+
+    // A stale count of drained entries only makes the ring look fuller
+    if (pending >= buffer->capacity ||
+        !g_atomic_int_compare_and_exchange(&stripe->writes, (gint) writes, (gint) (writes + 1))) {
+        g_atomic_int_inc(&stripe->nr_dropped);
+        return pending >= buffer->capacity / 2;
+    }
+
+    // The entry was drained on the previous lap, as fewer than `capacity` are pending
+    struct zn_read_buffer_entry *entry = &stripe->entries[writes & (buffer->capacity - 1)];
+    entry->location = location;
+    g_atomic_int_set(&entry->seq, (gint) (writes + 1));
+    return pending + 1 >= buffer->capacity / 2;
+}
+
+uint32_t
+zn_read_buffer_drain(struct zn_read_buffer *buffer, zn_read_buffer_apply_t apply, void *policy) {
+    assert(buffer);
+    assert(apply);
+
+    uint32_t applied = 0;
+    for (uint32_t i = 0; i < ZN_READ_BUFFER_STRIPES && zn_read_buffer_enabled(buffer); i++) {
+        struct zn_read_buffer_stripe *stripe = &buffer->stripes[i];
+        guint reads = (guint) stripe->reads;
+        guint writes = (guint) g_atomic_int_get(&stripe->writes);
+        for (; reads != writes; reads++) {
+            struct zn_read_buffer_entry *entry = &stripe->entries[reads & (buffer->capacity - 1)];
+            // Claimed, but not published yet. Later entries wait for the next drain, so
+            // every hit is applied at most once.
+            if ((guint) g_atomic_int_get(&entry->seq) != reads + 1) {
+                break;
+            }
+            apply(policy, entry->location);
+            applied++;
+        }
+        g_atomic_int_set(&stripe->reads, (gint) reads);
+    }
+
+    if (applied > 0) {
+        buffer->nr_drains++;
+        buffer->nr_applied += applied;
+    }
+    return applied;
+}
+
+void
+zn_read_buffer_get_stats(struct zn_read_buffer *buffer, struct zn_read_buffer_stats *stats) {
+    assert(buffer);
+    assert(stats);
+
+    stats->nr_applied = buffer->nr_applied;
+    stats->nr_drains = buffer->nr_drains;
+    stats->nr_dropped = 0;
+    for (uint32_t i = 0; i < ZN_READ_BUFFER_STRIPES; i++) {
+        stats->nr_dropped += (guint) g_atomic_int_get(&buffer->stripes[i].nr_dropped);
+    }
+}
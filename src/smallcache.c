@@ -0,0 +1,514 @@
+#include "smallcache.h"
+
+#include "znutil.h"
+
+#include <assert.h>
+#include <glib.h>
+#include <inttypes.h>
+#include <string.h>
+
+/**
+ * @brief Hash of an ID, the high half picks the set and the low bits the Bloom filter bits
+ */
+static uint64_t
+hash_id(uint32_t id) {
+    uint64_t h = (uint64_t) id * 0x9E3779B97F4A7C15ull;
+    h ^= h >> 29;
+    h *= 0xBF58476D1CE4E5B9ull;
+    h ^= h >> 32;
+    return h;
+}
+
+static uint32_t
+set_of(struct zn_small_cache *sc, uint64_t hash) {
+    return (uint32_t) ((hash >> 32) % sc->nr_sets);
+}
+
+static struct zn_small_partition *
+partition_of(struct zn_small_cache *sc, uint32_t set) {
+    return &sc->partitions[set % ZN_SMALL_PARTITIONS];
+}
+
+static size_t
+record_bytes(size_t len) {
+    return sizeof(struct zn_small_record) + len;
+}
+
+static void
+bloom_add(uint64_t *bloom, uint64_t hash) {
+    uint32_t bits = ZN_SMALL_BLOOM_WORDS * 64;
+    uint32_t a = (uint32_t) (hash % bits);
+    uint32_t b = (uint32_t) ((hash >> 12) % bits);
+    bloom[a / 64] |= 1ull << (a % 64);
+    bloom[b / 64] |= 1ull << (b % 64);
+}
+
+static bool
+bloom_test(const uint64_t *bloom, uint64_t hash) {
+    uint32_t bits = ZN_SMALL_BLOOM_WORDS * 64;
+    uint32_t a = (uint32_t) (hash % bits);
+    uint32_t b = (uint32_t) ((hash >> 12) % bits);
+    return (bloom[a / 64] & (1ull << (a % 64))) != 0 && (bloom[b / 64] & (1ull << (b % 64))) != 0;
+}
+
+/**
+ * @brief Device offset of a page of the engine
+ */
+static unsigned long long
+page_offset(struct zn_small_cache *sc, uint32_t page) {
+    return CHUNK_POINTER(sc->zones.zone_size, ZN_SMALL_SET_SIZE, page % sc->pages_per_zone,
+                         sc->zones.zone_base + (page / sc->pages_per_zone));
+}
+
+/**
+ * @brief Walk the records of a set page, checking that they stay inside it
+ *
+ * @param[in,out] offset Offset of the record to read, moved past its data
+ * @param[out] record Header of the record, its data ends at the new `offset`
+ * @return false after the last record
+ */
+static bool
+page_next_record(const unsigned char *page, uint32_t *offset, struct zn_small_record *record) {
+    struct zn_small_page_header header;
+    memcpy(&header, page, sizeof(header));
+    if (*offset + sizeof(*record) > header.bytes) {
+        return false;
+    }
+    memcpy(record, page + *offset, sizeof(*record));
+    if (*offset + record_bytes(record->len) > header.bytes) {
+        return false;
+    }
+    *offset += (uint32_t) record_bytes(record->len);
+    return true;
+}
+
+/**
+ * @brief Whether a page read from the device is a page of `set`
+ */
+static bool
+page_valid(const unsigned char *page, uint32_t set) {
+    struct zn_small_page_header header;
+    memcpy(&header, page, sizeof(header));
+    return header.set == set && header.bytes >= sizeof(header) && header.bytes <= ZN_SMALL_SET_SIZE;
+}
+
+/**
+ * @brief Append an object to a page being built
+ * @return false if it does not fit
+ */
+static bool
+page_append(unsigned char *page, uint32_t id, const unsigned char *data, size_t len) {
+    struct zn_small_page_header header;
+    memcpy(&header, page, sizeof(header));
+    if (header.bytes + record_bytes(len) > ZN_SMALL_SET_SIZE) {
+        return false;
+    }
+    struct zn_small_record record = {.id = id, .len = (uint16_t) len, .reserved = 0};
+    memcpy(page + header.bytes, &record, sizeof(record));
+    memcpy(page + header.bytes + sizeof(record), data, len);
+    header.bytes += (uint16_t) record_bytes(len);
+    header.nr_records++;
+    memcpy(page, &header, sizeof(header));
+    return true;
+}
+
+/**
+ * @brief Append the objects of an old set page that were hit, or that were not
+ *
+ * Objects that are logged again are skipped, the logged copy replaces them.
+ *
+ * @note Assumes that the partition lock is held
+ */
+static void
+append_old_records(struct zn_small_cache *sc, struct zn_small_partition *part, uint32_t set,
+                   const unsigned char *old, bool hit, unsigned char *page, uint64_t *bloom) {
+    uint64_t hits = sc->hit_bits[set];
+    struct zn_small_record record;
+    uint32_t offset = sizeof(struct zn_small_page_header);
+    for (uint32_t i = 0; page_next_record(old, &offset, &record); i++) {
+        bool was_hit = i < ZN_SMALL_HIT_BITS && (hits & (1ull << i)) != 0;
+        if (was_hit != hit || zn_flatmap_find(&part->index, record.id) != NULL) {
+            continue;
+        }
+        if (page_append(page, record.id, old + offset - record.len, record.len)) {
+            bloom_add(bloom, hash_id(record.id));
+        }
+    }
+}
+
+/**
+ * @brief Build the next page of `set` from its logged objects and its current page
+ *
+ * Objects of the current page that were hit go first, then the logged objects, newest first,
+ * then the objects of the current page that were not hit. Objects that do not fit are evicted.
+ *
+ * @note Assumes that the partition lock is held
+ *
+ * @param[out] page ZN_SMALL_SET_SIZE bytes to build into
+ * @param[out] bloom Bloom filter over the IDs of the new page
+ * @return Logged objects that made it into the page
+ */
+static uint32_t
+build_page(struct zn_small_cache *sc, struct zn_small_partition *part, uint32_t set,
+           unsigned char *page, uint64_t *bloom) {
+    memset(page, 0, ZN_SMALL_SET_SIZE);
+    memset(bloom, 0, ZN_SMALL_BLOOM_WORDS * sizeof(uint64_t));
+    struct zn_small_page_header header = {
+        .set = set, .nr_records = 0, .bytes = sizeof(struct zn_small_page_header)};
+    memcpy(page, &header, sizeof(header));
+
+    // A page that cannot be read is dropped with its objects
+    unsigned char *old = NULL;
+    uint32_t current = sc->set_page[set];
+    if (current != 0) {
+        old = zn_buffer_get_size(sc->buffers, ZN_SMALL_SET_SIZE);
+        if (zn_io_read(sc->io, old, ZN_SMALL_SET_SIZE, page_offset(sc, current - 1)) != 0 ||
+            !page_valid(old, set)) {
+            zn_buffer_put(sc->buffers, old);
+            old = NULL;
+        }
+    }
+
+    if (old != NULL) {
+        append_old_records(sc, part, set, old, true, page, bloom);
+    }
+    uint32_t logged = 0;
+    for (GList *link = part->log.tail; link != NULL; link = link->prev) {
+        struct zn_small_log_entry *entry = link->data;
+        if (entry->set == set && page_append(page, entry->id, entry->data, entry->len)) {
+            bloom_add(bloom, hash_id(entry->id));
+            logged++;
+        }
+    }
+    if (old != NULL) {
+        append_old_records(sc, part, set, old, false, page, bloom);
+        zn_buffer_put(sc->buffers, old);
+    }
+    return logged;
+}
+
+/**
+ * @brief Drop the sets whose page is still in the oldest full zone, then reset it
+ *
+ * @note Must not be called with a partition lock held
+ */
+static void
+reclaim_zone(struct zn_small_cache *sc) {
+    g_mutex_lock(&sc->reclaim_lock);
+    // Another thread may have reclaimed a zone while this one waited
+    int zone = zsm_get_num_free_zones(&sc->zones) > 0 ? -1 : zsm_pop_full_zone(&sc->zones);
+    if (zone == -1) {
+        g_mutex_unlock(&sc->reclaim_lock);
+        return;
+    }
+
+    uint32_t first = (uint32_t) zone * sc->pages_per_zone;
+    for (uint32_t page = first; page < first + sc->pages_per_zone; page++) {
+        uint32_t set = sc->page_set[page];
+        if (set == UINT32_MAX) {
+            continue;
+        }
+        sc->page_set[page] = UINT32_MAX;
+
+        struct zn_small_partition *part = partition_of(sc, set);
+        g_mutex_lock(&part->lock);
+        if (sc->set_page[set] == page + 1) {
+            sc->set_page[set] = 0;
+            sc->hit_bits[set] = 0;
+            memset(&sc->blooms[(size_t) set * ZN_SMALL_BLOOM_WORDS], 0,
+                   ZN_SMALL_BLOOM_WORDS * sizeof(uint64_t));
+            sc->sets_dropped++;
+        }
+        g_mutex_unlock(&part->lock);
+    }
+
+    // Lookups that read a page of the zone from here on find another set's page, or none
+    int ret = zsm_evict(&sc->zones, zone);
+    assert(ret == 0);
+    (void) ret;
+    sc->zones_reclaimed++;
+    dbg_printf("Reclaimed small object zone %d\n", zone);
+    g_mutex_unlock(&sc->reclaim_lock);
+}
+
+/**
+ * @brief Reserve the page a set is rewritten to, reclaiming a zone if none is free
+ * @return 0 on success, -1 on error
+ */
+static int
+reserve_page(struct zn_small_cache *sc, struct zn_pair *pair) {
+    while (true) {
+        enum zsm_get_active_zone_error ret = zsm_get_active_zone(&sc->zones, pair);
+        if (ret == ZSM_GET_ACTIVE_ZONE_SUCCESS) {
+            return 0;
+        } else if (ret == ZSM_GET_ACTIVE_ZONE_ERROR) {
+            return -1;
+        } else if (ret == ZSM_GET_ACTIVE_ZONE_EVICT) {
+            reclaim_zone(sc);
+        } else {
+            g_thread_yield();
+        }
+    }
+}
+
+/**
+ * @brief Rewrite the set of the oldest logged object of a partition
+ *
+ * The page is reserved before the partition is locked, so a thread holding a partition lock
+ * never waits for a write turn or a reclaim. If other threads brought the partition back under
+ * its share meanwhile, the page is still written, later pages of the zone may be waiting on it.
+ *
+ * @return true if the partition is still over its share of the log
+ */
+static bool
+flush_oldest(struct zn_small_cache *sc, struct zn_small_partition *part) {
+    struct zn_pair pair;
+    if (reserve_page(sc, &pair) != 0) {
+        return false;
+    }
+    zsm_wait_write_turn(&sc->zones, &pair);
+
+    g_mutex_lock(&part->lock);
+    if (g_queue_is_empty(&part->log)) {
+        // Other threads rewrote every logged set of the partition meanwhile
+        g_mutex_unlock(&part->lock);
+        zsm_failed_to_write(&sc->zones, pair);
+        return false;
+    }
+
+    struct zn_small_log_entry *oldest = g_queue_peek_head(&part->log);
+    uint32_t set = oldest->set;
+    uint64_t bloom[ZN_SMALL_BLOOM_WORDS];
+    unsigned char *page = zn_buffer_get_size(sc->buffers, ZN_SMALL_SET_SIZE);
+    uint32_t logged = build_page(sc, part, set, page, bloom);
+
+    uint32_t page_no = pair.zone * sc->pages_per_zone + pair.chunk_offset;
+    int ret = zn_io_write(sc->io, page, ZN_SMALL_SET_SIZE, page_offset(sc, page_no));
+    if (ret == 0) {
+        zsm_pass_write_turn(&sc->zones, &pair);
+        sc->set_page[set] = page_no + 1;
+        sc->page_set[page_no] = set;
+        sc->hit_bits[set] = 0;
+        memcpy(&sc->blooms[(size_t) set * ZN_SMALL_BLOOM_WORDS], bloom, sizeof(bloom));
+        part->set_writes++;
+        part->objects_flushed += logged;
+    } else {
+        dbg_printf("Couldn't write set %u to page %u\n", set, page_no);
+        zsm_failed_to_write(&sc->zones, pair);
+    }
+
+    // The logged objects of the set leave the log, the ones that did not fit are evicted
+    for (GList *link = part->log.head; link != NULL;) {
+        GList *next = link->next;
+        struct zn_small_log_entry *entry = link->data;
+        if (entry->set == set) {
+            zn_flatmap_erase(&part->index, entry->id);
+            part->log_bytes -= record_bytes(entry->len);
+            g_queue_delete_link(&part->log, link);
+            g_free(entry);
+        }
+        link = next;
+    }
+    zn_flatmap_reclaim(&part->index);
+    bool over = part->log_bytes > sc->log_capacity;
+    g_mutex_unlock(&part->lock);
+    zn_buffer_put(sc->buffers, page);
+
+    if (ret != 0) {
+        return false;
+    }
+    zsm_return_active_zone(&sc->zones, &pair);
+    return over;
+}
+
+void
+zn_small_cache_init(struct zn_small_cache *sc, struct zn_io *io, struct zn_buffer_pool *buffers,
+                    int fd, enum zn_backend backend, uint32_t zone_base, uint32_t nr_zones,
+                    uint64_t zone_size, uint64_t zone_cap, size_t log_size) {
+    assert(sc);
+
+    memset(sc, 0, sizeof(*sc));
+    if (nr_zones == 0) {
+        return;
+    }
+    assert(io);
+    assert(buffers);
+    assert(buffers->buffer_size >= ZN_SMALL_SET_SIZE);
+
+    sc->io = io;
+    sc->buffers = buffers;
+    sc->pages_per_zone = (uint32_t) (zone_cap / ZN_SMALL_SET_SIZE);
+    uint64_t nr_pages = (uint64_t) nr_zones * sc->pages_per_zone;
+    assert(nr_pages < UINT32_MAX);
+    sc->nr_sets = (uint32_t) (nr_pages * ZN_SMALL_SETS_PERCENT / 100);
+    assert(sc->nr_sets > 0);
+    sc->log_capacity = MAX(log_size / ZN_SMALL_PARTITIONS, ZN_SMALL_SET_SIZE);
+
+    // One active zone, the sets are rewritten one page at a time
+    zsm_init(&sc->zones, nr_zones, fd, zone_cap, zone_size, ZN_SMALL_SET_SIZE, 1, backend);
+    sc->zones.zone_base = zone_base;
+    sc->zones.zone_append = false;
+
+    sc->set_page = g_new0(uint32_t, sc->nr_sets);
+    sc->page_set = g_new(uint32_t, nr_pages);
+    memset(sc->page_set, 0xff, nr_pages * sizeof(uint32_t));
+    sc->blooms = g_new0(uint64_t, (size_t) sc->nr_sets * ZN_SMALL_BLOOM_WORDS);
+    sc->hit_bits = g_new0(uint64_t, sc->nr_sets);
+
+    for (uint32_t i = 0; i < ZN_SMALL_PARTITIONS; i++) {
+        struct zn_small_partition *part = &sc->partitions[i];
+        g_mutex_init(&part->lock);
+        g_queue_init(&part->log);
+        zn_flatmap_init(&part->index, (uint32_t) (sc->log_capacity / 64) + 1);
+    }
+    g_mutex_init(&sc->reclaim_lock);
+}
+
+void
+zn_small_cache_destroy(struct zn_small_cache *sc) {
+    assert(sc);
+    if (!zn_small_cache_enabled(sc)) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < ZN_SMALL_PARTITIONS; i++) {
+        struct zn_small_partition *part = &sc->partitions[i];
+        g_queue_clear_full(&part->log, g_free);
+        zn_flatmap_destroy(&part->index);
+        g_mutex_clear(&part->lock);
+    }
+    g_free(sc->set_page);
+    g_free(sc->page_set);
+    g_free(sc->blooms);
+    g_free(sc->hit_bits);
+    g_mutex_clear(&sc->reclaim_lock);
+    sc->nr_sets = 0;
+}
+
+bool
+zn_small_cache_get(struct zn_small_cache *sc, uint32_t id, unsigned char *dst, size_t *len) {
+    assert(sc);
+    assert(dst);
+    assert(len);
+    assert(zn_small_cache_enabled(sc));
+
+    uint64_t hash = hash_id(id);
+    uint32_t set = set_of(sc, hash);
+    struct zn_small_partition *part = partition_of(sc, set);
+
+    g_mutex_lock(&part->lock);
+    part->lookups++;
+    uint64_t *value = zn_flatmap_find(&part->index, id);
+    if (value != NULL) {
+        struct zn_small_log_entry *entry = (struct zn_small_log_entry *) (uintptr_t) *value;
+        memcpy(dst, entry->data, entry->len);
+        *len = entry->len;
+        part->hits++;
+        g_mutex_unlock(&part->lock);
+        return true;
+    }
+    uint32_t page_no = sc->set_page[set];
+    if (page_no == 0 || !bloom_test(&sc->blooms[(size_t) set * ZN_SMALL_BLOOM_WORDS], hash)) {
+        g_mutex_unlock(&part->lock);
+        return false;
+    }
+    g_mutex_unlock(&part->lock);
+
+    // Read without the lock. If the zone was reclaimed meanwhile, the page is another set's
+    // or a later page of this set, and IDs always map to the same data.
+    unsigned char *page = zn_buffer_get_size(sc->buffers, ZN_SMALL_SET_SIZE);
+    bool found = false;
+    uint32_t index = 0;
+    if (zn_io_read(sc->io, page, ZN_SMALL_SET_SIZE, page_offset(sc, page_no - 1)) == 0 &&
+        page_valid(page, set)) {
+        struct zn_small_record record;
+        uint32_t offset = sizeof(struct zn_small_page_header);
+        for (; page_next_record(page, &offset, &record); index++) {
+            if (record.id == id) {
+                memcpy(dst, page + offset - record.len, record.len);
+                *len = record.len;
+                found = true;
+                break;
+            }
+        }
+    }
+    zn_buffer_put(sc->buffers, page);
+
+    if (found) {
+        g_mutex_lock(&part->lock);
+        if (sc->set_page[set] == page_no && index < ZN_SMALL_HIT_BITS) {
+            sc->hit_bits[set] |= 1ull << index;
+        }
+        part->hits++;
+        g_mutex_unlock(&part->lock);
+    }
+    return found;
+}
+
+void
+zn_small_cache_insert(struct zn_small_cache *sc, uint32_t id, const unsigned char *data,
+                      size_t len) {
+    assert(sc);
+    assert(data);
+    assert(len > 0 && len <= ZN_SMALL_OBJECT_MAX);
+    assert(zn_small_cache_enabled(sc));
+
+    uint32_t set = set_of(sc, hash_id(id));
+    struct zn_small_partition *part = partition_of(sc, set);
+
+    // Copy before taking the lock, the ID is rarely inserted twice
+    struct zn_small_log_entry *entry = g_malloc(sizeof(*entry) + len);
+    entry->id = id;
+    entry->set = set;
+    entry->len = (uint16_t) len;
+    memcpy(entry->data, data, len);
+
+    g_mutex_lock(&part->lock);
+    bool inserted;
+    zn_flatmap_insert(&part->index, id, (uint64_t) (uintptr_t) entry, &inserted);
+    if (!inserted) {
+        g_mutex_unlock(&part->lock);
+        g_free(entry);
+        return;
+    }
+    zn_flatmap_reclaim(&part->index);
+    g_queue_push_tail(&part->log, entry);
+    part->log_bytes += record_bytes(len);
+    bool over = part->log_bytes > sc->log_capacity;
+    g_mutex_unlock(&part->lock);
+
+    while (over) {
+        over = flush_oldest(sc, part);
+    }
+}
+
+void
+zn_small_cache_get_stats(struct zn_small_cache *sc, struct zn_small_cache_stats *stats) {
+    assert(sc);
+    assert(stats);
+
+    *stats = (struct zn_small_cache_stats) {0};
+    if (!zn_small_cache_enabled(sc)) {
+        return;
+    }
+    stats->nr_sets = sc->nr_sets;
+    for (uint32_t i = 0; i < ZN_SMALL_PARTITIONS; i++) {
+        struct zn_small_partition *part = &sc->partitions[i];
+        g_mutex_lock(&part->lock);
+        stats->nr_logged += g_queue_get_length(&part->log);
+        stats->hits += part->hits;
+        stats->lookups += part->lookups;
+        stats->set_writes += part->set_writes;
+        stats->objects_flushed += part->objects_flushed;
+        g_mutex_unlock(&part->lock);
+    }
+    g_mutex_lock(&sc->reclaim_lock);
+    stats->zones_reclaimed = sc->zones_reclaimed;
+    stats->sets_dropped = sc->sets_dropped;
+    g_mutex_unlock(&sc->reclaim_lock);
+
+    uint64_t nr_pages = (uint64_t) sc->zones.num_zones * sc->pages_per_zone;
+    stats->metadata_bytes = (size_t) sc->nr_sets * (sizeof(uint32_t) + sizeof(uint64_t) +
+                                                    ZN_SMALL_BLOOM_WORDS * sizeof(uint64_t)) +
+                            (size_t) nr_pages * sizeof(uint32_t);
+}
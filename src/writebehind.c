@@ -0,0 +1,123 @@
+#include "writebehind.h"
+
+#include "znutil.h"
+#include "zncache.h"
+
+#include <assert.h>
+#include <glib.h>
+#include <string.h>
+
+/** A miss waiting to be written */
+struct zn_write_behind_job {
+    uint32_t id;
+    unsigned char *data; /**< Pending data owned by the cache map */
+    size_t len;          /**< Bytes of object data */
+};
+
+static void
+writer_task(gpointer data, gpointer user_data) {
+    struct zn_write_behind_job *job = data;
+    struct zn_write_behind *wb = user_data;
+
+    // Lookups are served from the pending data, so nobody sleeps on the ID
+    int ret = zn_cache_write_miss(wb->cache, job->id, job->data, job->len, false);
+    g_free(job);
+
+    g_mutex_lock(&wb->lock);
+    if (ret == 0) {
+        wb->stats.nr_writes++;
+    } else {
+        wb->stats.nr_failed++;
+    }
+    wb->pending--;
+    g_cond_broadcast(&wb->cond);
+    g_mutex_unlock(&wb->lock);
+}
+
+void
+zn_write_behind_init(struct zn_write_behind *wb, struct zn_cache *cache, uint32_t nr_threads) {
+    assert(wb);
+    assert(cache);
+
+    *wb = (struct zn_write_behind) {.cache = cache};
+    g_mutex_init(&wb->lock);
+    g_cond_init(&wb->cond);
+    if (nr_threads == 0) {
+        return;
+    }
+
+    GError *error = NULL;
+    wb->pool = g_thread_pool_new(writer_task, wb, (gint) nr_threads, TRUE, &error);
+    if (error) {
+        fprintf(stderr, "Error creating write-behind pool: %s\n", error->message);
+        assert(!"Couldn't create write-behind pool");
+    }
+    wb->max_pending = nr_threads * ZN_WRITE_BEHIND_PENDING_PER_THREAD;
+}
+
+void
+zn_write_behind_destroy(struct zn_write_behind *wb) {
+    assert(wb);
+
+    if (wb->pool != NULL) {
+        // Runs the queued jobs before returning
+        g_thread_pool_free(wb->pool, FALSE, TRUE);
+        wb->pool = NULL;
+    }
+    assert(wb->pending == 0);
+    g_mutex_clear(&wb->lock);
+    g_cond_clear(&wb->cond);
+}
+
+void
+zn_write_behind_drain(struct zn_write_behind *wb) {
+    assert(wb);
+
+    g_mutex_lock(&wb->lock);
+    while (wb->pending > 0) {
+        g_cond_wait(&wb->cond, &wb->lock);
+    }
+    g_mutex_unlock(&wb->lock);
+}
+
+void
+zn_write_behind_submit(struct zn_write_behind *wb, uint32_t id, const unsigned char *data,
+                       size_t len) {
+    assert(wb);
+    assert(zn_write_behind_enabled(wb));
+
+    g_mutex_lock(&wb->lock);
+    if (wb->pending >= wb->max_pending) {
+        wb->stats.nr_stalls++;
+        while (wb->pending >= wb->max_pending) {
+            g_cond_wait(&wb->cond, &wb->lock);
+        }
+    }
+    wb->pending++;
+    g_mutex_unlock(&wb->lock);
+
+    // The caller keeps its buffer, the map serves lookups from this copy until it is written
+    struct zn_write_behind_job *job = g_new(struct zn_write_behind_job, 1);
+    job->id = id;
+    job->data = zn_buffer_get_size(&wb->cache->buffers, len);
+    job->len = len;
+    memcpy(job->data, data, len);
+    zn_cachemap_publish_pending(&wb->cache->cache_map, id, job->data, len);
+
+    GError *error = NULL;
+    g_thread_pool_push(wb->pool, job, &error);
+    if (error) {
+        fprintf(stderr, "Error pushing write-behind job: %s\n", error->message);
+        assert(!"Couldn't queue write-behind job");
+    }
+}
+
+void
+zn_write_behind_get_stats(struct zn_write_behind *wb, struct zn_write_behind_stats *stats) {
+    assert(wb);
+    assert(stats);
+
+    g_mutex_lock(&wb->lock);
+    *stats = wb->stats;
+    g_mutex_unlock(&wb->lock);
+}
@@ -0,0 +1,385 @@
+#include "writebuffer.h"
+
+#include "znutil.h"
+#include "zncache.h"
+#include "znprofiler.h"
+
+#include <assert.h>
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @brief Location of the object starting at slot `index` of a segment
+ */
+static struct zn_pair
+slot_location(struct zn_write_segment *seg, uint32_t index) {
+    return (struct zn_pair) {
+        .zone = seg->start.zone,
+        .chunk_offset = seg->start.chunk_offset + index,
+        .nr_chunks = seg->extents[index],
+        .id = seg->ids[index],
+        .in_use = false,
+    };
+}
+
+/**
+ * @brief Unlink a segment from the used list
+ * @note Assumes that the buffer lock is held
+ */
+static void
+used_remove(struct zn_write_buffer *wb, struct zn_write_segment *seg) {
+    struct zn_write_segment **link = &wb->used;
+    while (*link != seg) {
+        assert(*link != NULL);
+        link = &(*link)->next;
+    }
+    *link = seg->next;
+    seg->next = NULL;
+}
+
+/**
+ * @brief Write a segment, then hand its chunks to the zone state and the eviction policy
+ *
+ * Only called by the thread that claimed `flushing`, once the segment is closed and filled.
+ */
+static void
+segment_flush(struct zn_write_buffer *wb, struct zn_write_segment *seg) {
+    struct zn_cache *cache = wb->cache;
+    uint32_t nr = seg->taken;
+    assert(nr > 0);
+
+    // Give the unused tail back, so the zone can be reserved again after the batch
+    if (nr < seg->nr_chunks) {
+        zsm_trim_batch(&cache->zone_state, &seg->start, seg->nr_chunks, nr);
+    }
+
+    zsm_wait_write_turn(&cache->zone_state, &seg->start);
+
+    unsigned long long wp =
+        CHUNK_POINTER(cache->zone_size, cache->chunk_sz, seg->start.chunk_offset, seg->start.zone);
+    struct zn_io_request request = {
+        .buffer = seg->data,
+        .len = (size_t) nr * cache->chunk_sz,
+        .offset = wp,
+        .write = true,
+        .io_size = wb->io_size,
+    };
+
+    struct timespec start_time, end_time;
+    TIME_NOW(&start_time);
+    int ret = zn_io_submit(&cache->io, &request);
+    if (ret == 0) {
+        ret = zn_io_wait(&cache->io, &request);
+    }
+    TIME_NOW(&end_time);
+    double t = TIME_DIFFERENCE_NSEC(start_time, end_time);
+    ZN_PROFILER_UPDATE(cache->profiler, ZN_PROFILER_METRIC_WRITE_LATENCY, t);
+    ZN_PROFILER_PRINTF(cache->profiler, "WRITELATENCY_EVERY,%f\n", t);
+
+    if (ret == 0) {
+        zsm_pass_write_turn_batch(&cache->zone_state, &seg->start, nr);
+    } else {
+        dbg_printf("Couldn't write segment at wp=%llu, zone=%u, chunks=%u\n", wp, seg->start.zone,
+                   nr);
+        // The chunks never reached the device, so later gets of them are misses
+        for (uint32_t i = 0; i < nr; i += seg->extents[i]) {
+            struct zn_pair location = slot_location(seg, i);
+            zn_cachemap_clear_chunk(&cache->cache_map, &location);
+        }
+    }
+
+    // New hits read the device from here on, wait for the ones still copying from DRAM
+    g_mutex_lock(&wb->lock);
+    used_remove(wb, seg);
+    g_atomic_int_dec_and_test(&wb->zone_segments[seg->start.zone]);
+    if (ret == 0) {
+        wb->stats.nr_flushes++;
+        wb->stats.nr_chunks += nr;
+        if (nr < seg->nr_chunks) {
+            wb->stats.nr_partial++;
+        }
+    } else {
+        wb->stats.nr_failed++;
+    }
+    g_mutex_unlock(&wb->lock);
+    while (g_atomic_int_get(&seg->readers) > 0) {
+        g_thread_yield();
+    }
+
+    if (ret == 0) {
+        // In chunk order, as the policies expect from writes to a zone, and before the zone
+        // can be closed by returning it
+        for (uint32_t i = 0; i < nr; i += seg->extents[i]) {
+            cache->eviction_policy.update_policy(cache->eviction_policy.data,
+                                                 slot_location(seg, i), ZN_WRITE);
+        }
+        zsm_return_active_zone_batch(&cache->zone_state, &seg->start, nr);
+    } else {
+        zsm_failed_to_write_batch(&cache->zone_state, seg->start, nr);
+    }
+
+    g_mutex_lock(&wb->lock);
+    seg->next = wb->free;
+    wb->free = seg;
+    g_mutex_unlock(&wb->lock);
+}
+
+/**
+ * @brief Flush a segment if it is closed and filled, and no other thread got to it first
+ */
+static void
+segment_try_flush(struct zn_write_buffer *wb, struct zn_write_segment *seg) {
+    g_mutex_lock(&wb->lock);
+    bool complete = !seg->open && (uint32_t) g_atomic_int_get(&seg->filled) == seg->taken;
+    g_mutex_unlock(&wb->lock);
+
+    if (complete && g_atomic_int_compare_and_exchange(&seg->flushing, 0, 1)) {
+        segment_flush(wb, seg);
+    }
+}
+
+void
+zn_write_buffer_init(struct zn_write_buffer *wb, struct zn_cache *cache, size_t segment_size,
+                     uint32_t nr_segments) {
+    assert(wb);
+    assert(cache);
+    assert(nr_segments > 0);
+
+    *wb = (struct zn_write_buffer) {.cache = cache};
+    g_mutex_init(&wb->lock);
+
+    uint64_t chunks = MIN(segment_size / cache->chunk_sz, cache->max_zone_chunks);
+    if (chunks < 2) {
+        return;
+    }
+    // Every object of a single extent fits in a segment, longer objects bypass the buffer
+    chunks = MAX(chunks, MIN(cache->max_object_chunks, cache->max_extent_chunks));
+    wb->segment_chunks = (uint32_t) chunks;
+    wb->io_size = MAX_IO == 0 ? (size_t) chunks * cache->chunk_sz : MAX_IO;
+    wb->nr_segments = nr_segments;
+    wb->segments = g_new0(struct zn_write_segment, nr_segments);
+    wb->zone_segments = g_new0(gint, cache->nr_zones);
+    for (uint32_t i = 0; i < nr_segments; i++) {
+        wb->segments[i].next = wb->free;
+        wb->free = &wb->segments[i];
+    }
+}
+
+void
+zn_write_buffer_destroy(struct zn_write_buffer *wb) {
+    assert(wb);
+    assert(wb->used == NULL);
+
+    for (uint32_t i = 0; i < wb->nr_segments; i++) {
+        free(wb->segments[i].data);
+        g_free(wb->segments[i].ids);
+        g_free(wb->segments[i].extents);
+    }
+    g_free(wb->segments);
+    g_free(wb->zone_segments);
+    g_mutex_clear(&wb->lock);
+}
+
+/**
+ * @brief Hand out the `nr_chunks` slots of a segment starting at `index`
+ */
+static struct zn_write_buffer_slot
+slot_take(struct zn_write_segment *seg, uint32_t index, uint32_t nr_chunks) {
+    seg->extents[index] = nr_chunks;
+    return (struct zn_write_buffer_slot) {
+        .segment = seg, .index = index, .location = slot_location(seg, index)};
+}
+
+enum zsm_get_active_zone_error
+zn_write_buffer_reserve(struct zn_write_buffer *wb, uint32_t nr_chunks,
+                        struct zn_write_buffer_slot *slot) {
+    assert(wb);
+    assert(slot);
+    assert(zn_write_buffer_enabled(wb));
+    assert(nr_chunks > 0 && nr_chunks <= wb->segment_chunks);
+
+    struct zn_write_segment *full = NULL;
+    g_mutex_lock(&wb->lock);
+    for (struct zn_write_segment *seg = wb->used; seg != NULL; seg = seg->next) {
+        if (!seg->open) {
+            continue;
+        }
+        if (seg->nr_chunks - seg->taken < nr_chunks) {
+            // The object does not fit, the segment is written with what it holds
+            if (full == NULL) {
+                seg->open = false;
+                full = seg;
+            }
+            continue;
+        }
+        uint32_t index = seg->taken;
+        seg->taken += nr_chunks;
+        seg->open = seg->taken < seg->nr_chunks;
+        *slot = slot_take(seg, index, nr_chunks);
+        g_mutex_unlock(&wb->lock);
+
+        if (full != NULL) {
+            segment_try_flush(wb, full);
+        }
+        return ZSM_GET_ACTIVE_ZONE_SUCCESS;
+    }
+
+    // Every segment is being flushed
+    struct zn_write_segment *seg = wb->free;
+    if (seg == NULL) {
+        g_mutex_unlock(&wb->lock);
+        if (full != NULL) {
+            segment_try_flush(wb, full);
+        }
+        return ZSM_GET_ACTIVE_ZONE_RETRY;
+    }
+    wb->free = seg->next;
+    g_mutex_unlock(&wb->lock);
+    if (full != NULL) {
+        segment_try_flush(wb, full);
+    }
+
+    struct zn_pair start;
+    uint32_t seg_chunks;
+    enum zsm_get_active_zone_error ret = zsm_get_active_zone_batch(
+        &wb->cache->zone_state, nr_chunks, wb->segment_chunks, &start, &seg_chunks);
+    if (ret != ZSM_GET_ACTIVE_ZONE_SUCCESS) {
+        g_mutex_lock(&wb->lock);
+        seg->next = wb->free;
+        wb->free = seg;
+        g_mutex_unlock(&wb->lock);
+        return ret;
+    }
+
+    if (seg->data == NULL) {
+        if (posix_memalign((void **) &seg->data, ZN_DIRECT_ALIGNMENT,
+                           (size_t) wb->segment_chunks * wb->cache->chunk_sz) != 0) {
+            nomem();
+        }
+        // Kept until the buffer is destroyed, and written in one transfer each time
+        zn_io_register_region(&wb->cache->io, seg->data,
+                              (size_t) wb->segment_chunks * wb->cache->chunk_sz);
+        seg->ids = g_new(uint32_t, wb->segment_chunks);
+        seg->extents = g_new(uint32_t, wb->segment_chunks);
+    }
+    seg->start = start;
+    seg->nr_chunks = seg_chunks;
+    seg->taken = nr_chunks;
+    seg->open = seg_chunks > nr_chunks;
+    g_atomic_int_set(&seg->filled, 0);
+    g_atomic_int_set(&seg->flushing, 0);
+    g_atomic_int_set(&seg->readers, 0);
+
+    // Other threads may take the remaining slots as soon as it is on the list
+    g_mutex_lock(&wb->lock);
+    seg->next = wb->used;
+    wb->used = seg;
+    g_atomic_int_inc(&wb->zone_segments[start.zone]);
+    g_mutex_unlock(&wb->lock);
+
+    *slot = slot_take(seg, 0, nr_chunks);
+    return ZSM_GET_ACTIVE_ZONE_SUCCESS;
+}
+
+void
+zn_write_buffer_fill(struct zn_write_buffer *wb, struct zn_write_buffer_slot *slot, uint32_t id,
+                     const unsigned char *data) {
+    assert(wb);
+    assert(slot);
+    assert(data);
+
+    struct zn_write_segment *seg = slot->segment;
+    seg->ids[slot->index] = id;
+    slot->location.id = id;
+    memcpy(seg->data + ((size_t) slot->index * wb->cache->chunk_sz), data,
+           (size_t) slot->location.nr_chunks * wb->cache->chunk_sz);
+}
+
+void
+zn_write_buffer_commit(struct zn_write_buffer *wb, struct zn_write_buffer_slot *slot) {
+    assert(wb);
+    assert(slot);
+
+    g_atomic_int_add(&slot->segment->filled, (gint) slot->location.nr_chunks);
+    segment_try_flush(wb, slot->segment);
+}
+
+bool
+zn_write_buffer_read(struct zn_write_buffer *wb, const struct zn_pair *location,
+                     unsigned char *dst) {
+    assert(wb);
+    assert(location);
+    assert(dst);
+
+    // Hits on zones without buffered chunks, almost all of them, skip the lock
+    if (!zn_write_buffer_enabled(wb) ||
+        g_atomic_int_get(&wb->zone_segments[location->zone]) == 0) {
+        return false;
+    }
+
+    struct zn_write_segment *found = NULL;
+    g_mutex_lock(&wb->lock);
+    for (struct zn_write_segment *seg = wb->used; seg != NULL; seg = seg->next) {
+        if (seg->start.zone == location->zone && location->chunk_offset >= seg->start.chunk_offset &&
+            location->chunk_offset < seg->start.chunk_offset + seg->taken) {
+            found = seg;
+            g_atomic_int_inc(&seg->readers);
+            break;
+        }
+    }
+    g_mutex_unlock(&wb->lock);
+    if (found == NULL) {
+        return false;
+    }
+
+    size_t index = location->chunk_offset - found->start.chunk_offset;
+    memcpy(dst, found->data + (index * wb->cache->chunk_sz),
+           (size_t) location->nr_chunks * wb->cache->chunk_sz);
+    g_atomic_int_dec_and_test(&found->readers);
+    return true;
+}
+
+bool
+zn_write_buffer_flush_open(struct zn_write_buffer *wb) {
+    assert(wb);
+    if (!zn_write_buffer_enabled(wb)) {
+        return false;
+    }
+
+    struct zn_write_segment *closed = NULL;
+    g_mutex_lock(&wb->lock);
+    for (struct zn_write_segment *seg = wb->used; seg != NULL; seg = seg->next) {
+        if (seg->open) {
+            seg->open = false;
+            closed = seg;
+            break;
+        }
+    }
+    g_mutex_unlock(&wb->lock);
+
+    // Threads still filling a slot flush it otherwise
+    if (closed != NULL) {
+        segment_try_flush(wb, closed);
+    }
+    return closed != NULL;
+}
+
+void
+zn_write_buffer_flush_all(struct zn_write_buffer *wb) {
+    assert(wb);
+
+    while (zn_write_buffer_flush_open(wb)) {
+    }
+    assert(wb->used == NULL);
+}
+
+void
+zn_write_buffer_get_stats(struct zn_write_buffer *wb, struct zn_write_buffer_stats *stats) {
+    assert(wb);
+    assert(stats);
+
+    g_mutex_lock(&wb->lock);
+    *stats = wb->stats;
+    g_mutex_unlock(&wb->lock);
+}
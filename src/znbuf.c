@@ -0,0 +1,464 @@
+// For MAP_ANONYMOUS, MAP_HUGETLB, MAP_FIXED_NOREPLACE and MADV_HUGEPAGE
+#define _GNU_SOURCE
+#include "znbuf.h"
+
+#include "znutil.h"
+#include "zncache.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <glib.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+/** Pages are touched at this stride to fault a new slab in on the calling thread's node */
+#define PAGE_STRIDE 4096
+
+/** A free buffer, linked through its first bytes */
+struct zn_buffer_free {
+    struct zn_buffer_free *next;
+};
+
+/** A mapped slab */
+struct zn_buffer_slab {
+    void *base;
+    size_t size;
+    struct zn_buffer_slab *next;
+};
+
+/**
+ * @struct zn_buffer_class
+ * @brief Buffers of one size, carved out of slabs mapped one after the other in its range
+ */
+struct zn_buffer_class {
+    GMutex lock;
+    size_t buffer_size;
+    uint32_t buffers_per_slab;
+    size_t slab_size;
+    unsigned char *base;              /**< Start of the reserved range of the class */
+    uint64_t max_slabs;               /**< Slabs that fit in the range */
+    uint64_t next_slab;               /**< Slabs taken from the range, under `lock` */
+    struct zn_buffer_free *free_list; /**< Buffers not in any thread cache, under `lock` */
+};
+
+/**
+ * @struct zn_buffer_arena
+ * @brief Memory behind a pool, referenced by the pool and by every thread cache
+ */
+struct zn_buffer_arena {
+    gint refcount;
+    bool hugepages;
+    gint hugetlb_failed;             /**< Stop asking for huge pages once the kernel has none */
+    void *reserved;                  /**< Address space of every class */
+    size_t reserved_size;
+    unsigned char *base;             /**< Range of the first class, aligned for huge pages */
+    uint32_t nr_classes;
+    struct zn_buffer_class classes[ZN_BUFFER_MAX_CLASSES];
+
+    GMutex lock;
+    struct zn_buffer_slab *slabs;     /**< Every mapped slab, under `lock` */
+    zn_buffer_slab_fn on_slab;        /**< Told about every slab, under `lock` */
+    void *on_slab_data;
+    uint64_t nr_slabs;                /**< Under `lock` */
+    uint64_t nr_buffers;              /**< Under `lock` */
+    size_t total_bytes;               /**< Under `lock` */
+    bool hugetlb_mapped;              /**< Under `lock` */
+};
+
+/** A thread's free buffers of one class */
+struct zn_buffer_list {
+    struct zn_buffer_free *head;
+    uint32_t count;
+};
+
+/**
+ * @struct zn_buffer_cache
+ * @brief A thread's free buffers for one arena
+ */
+struct zn_buffer_cache {
+    struct zn_buffer_arena *arena;
+    struct zn_buffer_list lists[ZN_BUFFER_MAX_CLASSES];
+};
+
+static void
+arena_unref(struct zn_buffer_arena *arena) {
+    if (!g_atomic_int_dec_and_test(&arena->refcount)) {
+        return;
+    }
+    // The slabs are mapped over the reservation, one unmap takes them all
+    munmap(arena->reserved, arena->reserved_size);
+    while (arena->slabs != NULL) {
+        struct zn_buffer_slab *slab = arena->slabs;
+        arena->slabs = slab->next;
+        g_free(slab);
+    }
+    for (uint32_t i = 0; i < arena->nr_classes; i++) {
+        g_mutex_clear(&arena->classes[i].lock);
+    }
+    g_mutex_clear(&arena->lock);
+    g_free(arena);
+}
+
+/**
+ * @brief Class of a buffer of the arena, from the range it lies in
+ */
+static uint32_t
+class_of(struct zn_buffer_arena *arena, const unsigned char *buffer) {
+    assert(buffer >= arena->base);
+    uint64_t index = (uint64_t) (buffer - arena->base) / ZN_BUFFER_CLASS_SPAN;
+    assert(index < arena->nr_classes);
+    return (uint32_t) index;
+}
+
+/**
+ * @brief Smallest class of the arena holding `size` bytes
+ */
+static uint32_t
+class_for_size(struct zn_buffer_arena *arena, size_t size) {
+    uint32_t index = 0;
+    while (arena->classes[index].buffer_size < size) {
+        index++;
+        assert(index < arena->nr_classes);
+    }
+    return index;
+}
+
+/**
+ * @brief Move `count` buffers from the head of a thread cache list to the class free list
+ */
+static void
+cache_flush(struct zn_buffer_cache *c, uint32_t index, uint32_t count) {
+    if (count == 0) {
+        return;
+    }
+    struct zn_buffer_list *list = &c->lists[index];
+    struct zn_buffer_free *first = list->head;
+    struct zn_buffer_free *last = first;
+    for (uint32_t i = 1; i < count; i++) {
+        last = last->next;
+    }
+    list->head = last->next;
+    list->count -= count;
+
+    struct zn_buffer_class *cls = &c->arena->classes[index];
+    g_mutex_lock(&cls->lock);
+    last->next = cls->free_list;
+    cls->free_list = first;
+    g_mutex_unlock(&cls->lock);
+}
+
+static void
+release_cache(gpointer data) {
+    struct zn_buffer_cache *c = data;
+    for (uint32_t i = 0; i < c->arena->nr_classes; i++) {
+        cache_flush(c, i, c->lists[i].count);
+    }
+    arena_unref(c->arena);
+    g_free(c);
+}
+
+static GPrivate thread_cache = G_PRIVATE_INIT(release_cache);
+
+/**
+ * @brief Returns the calling thread's cache for `pool`, creating it on first use
+ */
+static struct zn_buffer_cache *
+cache_self(struct zn_buffer_pool *pool) {
+    struct zn_buffer_cache *c = g_private_get(&thread_cache);
+    if (c != NULL && c->arena == pool->arena) {
+        return c;
+    }
+
+    c = g_new0(struct zn_buffer_cache, 1);
+    c->arena = pool->arena;
+    g_atomic_int_inc(&c->arena->refcount);
+
+    // Gives the buffers of a cache for another pool back to it
+    g_private_replace(&thread_cache, c);
+    return c;
+}
+
+/**
+ * @brief Map regular pages at `addr` after a huge page mapping there failed
+ *
+ * A failed MAP_FIXED may already have unmapped the reservation, and another mapping may have
+ * taken its place since, so the reservation is only replaced if it is still there.
+ */
+static void *
+remap_regular(void *addr, size_t size) {
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_FIXED_NOREPLACE
+    void *base = mmap(addr, size, PROT_READ | PROT_WRITE, flags | MAP_FIXED_NOREPLACE, -1, 0);
+    if (base == addr || (base == MAP_FAILED && errno != EEXIST)) {
+        return base;
+    }
+    if (base != MAP_FAILED) {
+        // A kernel without MAP_FIXED_NOREPLACE took the address as a hint
+        munmap(base, size);
+        return MAP_FAILED;
+    }
+#endif
+    return mmap(addr, size, PROT_READ | PROT_WRITE, flags | MAP_FIXED, -1, 0);
+}
+
+/**
+ * @brief Map the next slab of a class over its reservation and fault it in from the calling
+ * thread
+ *
+ * @param[out] hugetlb Set if the slab is backed by huge pages
+ */
+static unsigned char *
+slab_map(struct zn_buffer_arena *arena, struct zn_buffer_class *cls, bool *hugetlb) {
+    g_mutex_lock(&cls->lock);
+    if (cls->next_slab == cls->max_slabs) {
+        nomem();
+    }
+    unsigned char *addr = cls->base + (cls->next_slab++ * cls->slab_size);
+    g_mutex_unlock(&cls->lock);
+
+    void *base = MAP_FAILED;
+    *hugetlb = false;
+
+#ifdef MAP_HUGETLB
+    if (arena->hugepages && !g_atomic_int_get(&arena->hugetlb_failed)) {
+        base = mmap(addr, cls->slab_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB, -1, 0);
+        if (base == MAP_FAILED) {
+            dbg_printf("No huge pages available, using regular pages for buffers%s", "\n");
+            g_atomic_int_set(&arena->hugetlb_failed, 1);
+            base = remap_regular(addr, cls->slab_size);
+            if (base == MAP_FAILED) {
+                nomem();
+            }
+        } else {
+            *hugetlb = true;
+        }
+    }
+#endif
+
+    if (base == MAP_FAILED) {
+        base = mmap(addr, cls->slab_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+        if (base == MAP_FAILED) {
+            nomem();
+        }
+    }
+#ifdef MADV_HUGEPAGE
+    // Transparent huge pages are the next best thing, the advice is only a hint
+    if (arena->hugepages && !*hugetlb) {
+        (void) madvise(base, cls->slab_size, MADV_HUGEPAGE);
+    }
+#endif
+
+    // First touch places the pages on the NUMA node of the thread that will use them
+    unsigned char *bytes = base;
+    for (size_t off = 0; off < cls->slab_size; off += PAGE_STRIDE) {
+        bytes[off] = 0;
+    }
+    return bytes;
+}
+
+/**
+ * @brief Refill an empty thread cache list from the class free list, or from a new slab
+ */
+static void
+cache_refill(struct zn_buffer_cache *c, uint32_t index) {
+    struct zn_buffer_arena *arena = c->arena;
+    struct zn_buffer_class *cls = &arena->classes[index];
+    struct zn_buffer_list *list = &c->lists[index];
+    assert(list->head == NULL);
+
+    g_mutex_lock(&cls->lock);
+    while (cls->free_list != NULL && list->count < ZN_BUFFER_THREAD_CACHE / 2) {
+        struct zn_buffer_free *b = cls->free_list;
+        cls->free_list = b->next;
+        b->next = list->head;
+        list->head = b;
+        list->count++;
+    }
+    g_mutex_unlock(&cls->lock);
+    if (list->head != NULL) {
+        return;
+    }
+
+    bool hugetlb;
+    unsigned char *base = slab_map(arena, cls, &hugetlb);
+    for (uint32_t i = cls->buffers_per_slab; i > 0; i--) {
+        struct zn_buffer_free *b = (struct zn_buffer_free *) (base + ((i - 1) * cls->buffer_size));
+        b->next = list->head;
+        list->head = b;
+        list->count++;
+    }
+
+    struct zn_buffer_slab *slab = g_new(struct zn_buffer_slab, 1);
+    slab->base = base;
+    slab->size = cls->slab_size;
+    g_mutex_lock(&arena->lock);
+    slab->next = arena->slabs;
+    arena->slabs = slab;
+    arena->nr_slabs++;
+    arena->nr_buffers += cls->buffers_per_slab;
+    arena->total_bytes += slab->size;
+    arena->hugetlb_mapped = arena->hugetlb_mapped || hugetlb;
+    // Before the buffers are handed out, so their first transfer can use the slab
+    if (arena->on_slab != NULL) {
+        arena->on_slab(arena->on_slab_data, slab->base, slab->size);
+    }
+    g_mutex_unlock(&arena->lock);
+}
+
+void
+zn_buffer_pool_init(struct zn_buffer_pool *pool, size_t buffer_size, bool hugepages) {
+    assert(pool);
+    assert(buffer_size > 0 && buffer_size % ZN_DIRECT_ALIGNMENT == 0);
+    assert(buffer_size <= ZN_BUFFER_CLASS_SPAN);
+
+    struct zn_buffer_arena *arena = g_new0(struct zn_buffer_arena, 1);
+    g_mutex_init(&arena->lock);
+    arena->refcount = 1;
+    arena->hugepages = hugepages;
+
+    // Sizes double from one block up to the largest buffers
+    size_t size = ZN_DIRECT_ALIGNMENT;
+    while (true) {
+        assert(arena->nr_classes < ZN_BUFFER_MAX_CLASSES);
+        struct zn_buffer_class *cls = &arena->classes[arena->nr_classes++];
+        g_mutex_init(&cls->lock);
+        cls->buffer_size = MIN(size, buffer_size);
+        cls->buffers_per_slab = (uint32_t) MAX(1, ZN_BUFFER_SLAB_SIZE / cls->buffer_size);
+        // Huge page mappings have to be a whole number of huge pages
+        size_t granularity = hugepages ? ZN_BUFFER_SLAB_SIZE : ZN_DIRECT_ALIGNMENT;
+        size_t used = (size_t) cls->buffers_per_slab * cls->buffer_size;
+        cls->slab_size = ((used + granularity - 1) / granularity) * granularity;
+        cls->max_slabs = ZN_BUFFER_CLASS_SPAN / cls->slab_size;
+        if (size >= buffer_size) {
+            break;
+        }
+        size *= 2;
+    }
+
+    // Address space only, slabs are mapped over it as they are needed
+    arena->reserved_size = (arena->nr_classes * ZN_BUFFER_CLASS_SPAN) + ZN_BUFFER_SLAB_SIZE;
+    arena->reserved = mmap(NULL, arena->reserved_size, PROT_NONE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (arena->reserved == MAP_FAILED) {
+        nomem();
+    }
+    uintptr_t start = (uintptr_t) arena->reserved;
+    arena->base = (unsigned char *) ((start + ZN_BUFFER_SLAB_SIZE - 1) &
+                                     ~((uintptr_t) ZN_BUFFER_SLAB_SIZE - 1));
+    for (uint32_t i = 0; i < arena->nr_classes; i++) {
+        arena->classes[i].base = arena->base + (i * ZN_BUFFER_CLASS_SPAN);
+    }
+
+    pool->buffer_size = buffer_size;
+    pool->buffers_per_slab = arena->classes[arena->nr_classes - 1].buffers_per_slab;
+    pool->nr_classes = arena->nr_classes;
+    pool->hugepages = hugepages;
+    pool->arena = arena;
+}
+
+void
+zn_buffer_pool_destroy(struct zn_buffer_pool *pool) {
+    assert(pool);
+    assert(pool->arena);
+
+    struct zn_buffer_cache *c = g_private_get(&thread_cache);
+    if (c != NULL && c->arena == pool->arena) {
+        g_private_replace(&thread_cache, NULL);
+    }
+    arena_unref(pool->arena);
+    pool->arena = NULL;
+}
+
+/**
+ * @brief Take a buffer of class `index` from the calling thread's cache
+ */
+static unsigned char *
+buffer_get_class(struct zn_buffer_pool *pool, uint32_t index) {
+    struct zn_buffer_cache *c = cache_self(pool);
+    struct zn_buffer_list *list = &c->lists[index];
+    if (list->head == NULL) {
+        cache_refill(c, index);
+    }
+    struct zn_buffer_free *b = list->head;
+    list->head = b->next;
+    list->count--;
+    return (unsigned char *) b;
+}
+
+unsigned char *
+zn_buffer_get(struct zn_buffer_pool *pool) {
+    assert(pool);
+    assert(pool->arena);
+
+    return buffer_get_class(pool, pool->nr_classes - 1);
+}
+
+unsigned char *
+zn_buffer_get_size(struct zn_buffer_pool *pool, size_t size) {
+    assert(pool);
+    assert(pool->arena);
+    assert(size <= pool->buffer_size);
+
+    return buffer_get_class(pool, class_for_size(pool->arena, size));
+}
+
+size_t
+zn_buffer_size(struct zn_buffer_pool *pool, const unsigned char *buffer) {
+    assert(pool);
+    assert(buffer);
+
+    return pool->arena->classes[class_of(pool->arena, buffer)].buffer_size;
+}
+
+void
+zn_buffer_put(struct zn_buffer_pool *pool, unsigned char *buffer) {
+    assert(pool);
+    if (buffer == NULL) {
+        return;
+    }
+    assert(((uintptr_t) buffer % ZN_DIRECT_ALIGNMENT) == 0);
+
+    struct zn_buffer_cache *c = cache_self(pool);
+    uint32_t index = class_of(c->arena, buffer);
+    struct zn_buffer_list *list = &c->lists[index];
+    struct zn_buffer_free *b = (struct zn_buffer_free *) buffer;
+    b->next = list->head;
+    list->head = b;
+    list->count++;
+
+    if (list->count > ZN_BUFFER_THREAD_CACHE) {
+        cache_flush(c, index, ZN_BUFFER_THREAD_CACHE / 2);
+    }
+}
+
+void
+zn_buffer_pool_watch_slabs(struct zn_buffer_pool *pool, zn_buffer_slab_fn fn, void *user_data) {
+    assert(pool);
+    assert(fn);
+
+    struct zn_buffer_arena *arena = pool->arena;
+    g_mutex_lock(&arena->lock);
+    assert(arena->on_slab == NULL);
+    arena->on_slab = fn;
+    arena->on_slab_data = user_data;
+    for (struct zn_buffer_slab *slab = arena->slabs; slab != NULL; slab = slab->next) {
+        fn(user_data, slab->base, slab->size);
+    }
+    g_mutex_unlock(&arena->lock);
+}
+
+void
+zn_buffer_pool_get_stats(struct zn_buffer_pool *pool, struct zn_buffer_pool_stats *stats) {
+    assert(pool);
+    assert(stats);
+
+    struct zn_buffer_arena *arena = pool->arena;
+    g_mutex_lock(&arena->lock);
+    stats->nr_slabs = arena->nr_slabs;
+    stats->nr_buffers = arena->nr_buffers;
+    stats->total_bytes = arena->total_bytes;
+    stats->hugepages = arena->hugetlb_mapped;
+    g_mutex_unlock(&arena->lock);
+}
@@ -22,6 +22,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 // No evict
@@ -96,6 +97,9 @@ task_function(gpointer data, gpointer user_data) {
 
     printf("Task %d started by thread %p\n", thread_data->tid, (void *) g_thread_self());
 
+    // With RANGE_GET_SIZE each get asks for a slice of the object, like an S3 Range request
+    unsigned char *range = RANGE_GET_SIZE > 0 ? g_malloc(RANGE_GET_SIZE) : NULL;
+
     // Handles any cache read requests
     while (true) {
         g_mutex_lock(&thread_data->cache->reader.lock);
@@ -122,24 +126,44 @@ task_function(gpointer data, gpointer user_data) {
         }
 		g_mutex_unlock(&thread_data->cache->reader.lock);
 
+        struct zn_key key;
+        if (thread_data->cache->reader.workload_keys != NULL) {
+            // Key workloads show the fingerprint of the key
+            key = thread_data->cache->reader.workload_keys[wi];
+            data_id = zn_key_fingerprint(&key);
+        } else {
+            // The binary workload holds 32-bit IDs, their bytes are the keys
+            data_id = thread_data->cache->reader.workload_buffer[wi];
+            zn_key_init(&key, &data_id, sizeof(data_id));
+        }
+
         if (print) {
-            printf("[%d]:\t(%lu%%)\tze_cache_get(workload[%lu]=%d)\n", thread_data->tid, percent, wi,
-		   thread_data->cache->reader.workload_buffer[wi]);
+            printf("[%d]:\t(%lu%%)\tze_cache_get(workload[%lu]=%u)\n", thread_data->tid, percent, wi,
+		   data_id);
             fflush(stdout);
         }
 
-        dbg_printf("[%d]: ze_cache_get(workload[%lu]=%d)\n", thread_data->tid, wi,
-               thread_data->cache->reader.workload_buffer[wi]);
-
-		data_id = thread_data->cache->reader.workload_buffer[wi];
+        dbg_printf("[%d]: ze_cache_get(workload[%lu]=%u)\n", thread_data->tid, wi, data_id);
 
         // Find the data in the cache
         // PROFILE START
         struct timespec start_time, end_time;
         TIME_NOW(&start_time);
-        unsigned char *data = zn_cache_get(thread_data->cache, data_id, RANDOM_DATA);
-        if (data == NULL) {
+        size_t size = zn_cache_object_size(thread_data->cache, &key);
+        unsigned char *data = NULL;
+        size_t offset = 0;
+        ssize_t got = 0;
+        if (range != NULL) {
+            // Offsets are spread over the object, the range is cut short at its end
+            offset = zn_key_mix(wi) % size;
+            got = zn_cache_get_range(thread_data->cache, &key, RANDOM_DATA, offset,
+                                     RANGE_GET_SIZE, range);
+        } else {
+            data = zn_cache_get(thread_data->cache, &key, RANDOM_DATA);
+        }
+        if (range != NULL ? got < 0 : data == NULL) {
             dbg_printf("ERROR: Couldn't get data for data_id=%u\n", data_id);
+            g_free(range);
             return;
         }
         TIME_NOW(&end_time);
@@ -148,14 +172,24 @@ task_function(gpointer data, gpointer user_data) {
         ZN_PROFILER_PRINTF(thread_data->cache->profiler, "GETLATENCY_EVERY,%f\n", t);
         // PROFILE END
 
+        if (range != NULL) {
+#ifdef VERIFY
+            assert((size_t) got == MIN((size_t) RANGE_GET_SIZE, size - offset));
+            assert(zn_validate_range(thread_data->cache, range, got, &key, offset, RANDOM_DATA) ==
+                   0);
+#endif
+            size = got;
+        } else {
 #ifdef VERIFY
-        assert(zn_validate_read(thread_data->cache, data, data_id, RANDOM_DATA) == 0);
+            assert(zn_validate_read(thread_data->cache, data, &key, RANDOM_DATA) == 0);
 #endif
-        free(data);
+            zn_buffer_put(&thread_data->cache->buffers, data);
+        }
 
         // PROFILE METRICS
         // Throughput
-        ZN_PROFILER_UPDATE(thread_data->cache->profiler, ZN_PROFILER_METRIC_CACHE_THROUGHPUT, thread_data->cache->chunk_sz);
+        ZN_PROFILER_UPDATE(thread_data->cache->profiler, ZN_PROFILER_METRIC_CACHE_THROUGHPUT,
+                           size);
         // Update cache size
         ZN_PROFILER_SET(
             thread_data->cache->profiler,
@@ -175,10 +209,22 @@ task_function(gpointer data, gpointer user_data) {
             ZN_PROFILER_METRIC_CACHE_HITRATIO,
             hr
         );
+        // Split by the tier that served the hits, the two add up to the hitratio
+        ZN_PROFILER_SET(
+            thread_data->cache->profiler,
+            ZN_PROFILER_METRIC_DRAM_HITRATIO,
+            zn_cache_get_dram_hit_ratio(thread_data->cache)
+        );
+        ZN_PROFILER_SET(
+            thread_data->cache->profiler,
+            ZN_PROFILER_METRIC_DEVICE_HITRATIO,
+            zn_cache_get_device_hit_ratio(thread_data->cache)
+        );
         // Show thread still active
         ZN_PROFILER_PRINTF(thread_data->cache->profiler, "THREADID_EVERY,%d\n", thread_data->tid);
         dbg_printf("Hitratio: %f\n", hr);
     }
+    g_free(range);
     printf("Task %d finished by thread %p\n", thread_data->tid, (void *) g_thread_self());
 
     g_mutex_lock(thread_data->thread_counter_lock);
@@ -209,8 +255,9 @@ profiling_task(gpointer user_data) {
 static void
 usage(FILE * file, char *progname) {
     fprintf(file,
-            "Usage: %s <DEVICE> <CHUNK_SZ> <THREADS> [-w workload_file] [-i iterations] [-m metrics_file ] [ -h]\n",
-            progname);
+            "Usage: %s <DEVICE> <CHUNK_SZ> <THREADS> [-w workload_file | -k key_file] [-i iterations] [-m metrics_file ] [-e psync|io_uring] [ -h]\n"
+            "CHUNK_SZ is ignored when built with OBJECT_SIZE_MAX, objects are then packed at %d bytes\n",
+            progname, ZN_DIRECT_ALIGNMENT);
 }
 
 /**
@@ -222,12 +269,13 @@ usage(FILE * file, char *progname) {
  * @return Non-zero on error
  */
 int
-read_workload(int fd, uint32_t *buffer, size_t size) {
+read_workload(int fd, void *buffer, size_t size) {
     size_t total_bytes_read = 0;
 
     while (total_bytes_read < size) {
         errno = 0;
-        ssize_t bytes_read = read(fd, buffer + total_bytes_read, size - total_bytes_read);
+        ssize_t bytes_read =
+            read(fd, (unsigned char *) buffer + total_bytes_read, size - total_bytes_read);
         if (bytes_read < 0) {
             if (errno == EINTR) {
                 // Interrupted
@@ -250,6 +298,43 @@ read_workload(int fd, uint32_t *buffer, size_t size) {
     return 0;
 }
 
+/**
+ * Read the keys of a byte-string workload, records of a one byte key length followed by the
+ * bytes of the key
+ *
+ * @param fd File to read from
+ * @param nr_keys Exact number of keys to read
+ * @return The keys, which point into a buffer that lives as long as the program, or NULL on error
+ */
+struct zn_key *
+read_key_workload(int fd, uint64_t nr_keys) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        fprintf(stderr, "Couldn't stat the file: '%s'\n", strerror(errno));
+        return NULL;
+    }
+    size_t size = st.st_size;
+    unsigned char *bytes = malloc(size + 1);
+    assert(bytes != NULL);
+    if (read_workload(fd, bytes, size) != 0) {
+        return NULL;
+    }
+
+    struct zn_key *keys = malloc(nr_keys * sizeof(*keys));
+    assert(keys != NULL);
+    size_t pos = 0;
+    for (uint64_t n = 0; n < nr_keys; n++) {
+        if (pos >= size || size - pos - 1 < bytes[pos]) {
+            fprintf(stderr, "Couldn't read the file fully, it ends at key %lu out of %lu\n", n,
+                    nr_keys);
+            return NULL;
+        }
+        zn_key_init(&keys[n], &bytes[pos + 1], bytes[pos]);
+        pos += 1 + bytes[pos];
+    }
+    return keys;
+}
+
 int
 main(int argc, char **argv) {
     zbd_set_log_level(ZBD_LOG_DEBUG);
@@ -259,7 +344,7 @@ main(int argc, char **argv) {
         return -1;
     }
 
-    if (argc < 4 || argc > 11) {
+    if (argc < 4 || argc > 13) {
         usage(stderr, argv[0]);
         return -1;
     }
@@ -272,23 +357,36 @@ main(int argc, char **argv) {
 
     char *metrics_file = NULL;
     char *workload_file = NULL;
+    char *key_file = NULL;
     uint64_t workload_max = UINT64_MAX;
-    uint32_t *workload_buffer;
+    uint32_t *workload_buffer = NULL;
+    struct zn_key *workload_keys = NULL;
+    enum zn_io_engine io_engine = ZN_IO_ENGINE_PSYNC;
 
     int c;
     opterr = 0;
     optind = 4;
-    while ((c = getopt(argc, argv, "w:i:m:h")) != -1) {
+    while ((c = getopt(argc, argv, "w:k:i:m:e:h")) != -1) {
         switch (c) {
             case 'w':
                 workload_file = optarg;
             break;
+            case 'k':
+                key_file = optarg;
+            break;
             case 'i':
                 workload_max = strtol(optarg, NULL, 10);
             break;
             case 'm':
                 metrics_file = optarg;
             break;
+            case 'e':
+                if (zn_io_engine_parse(optarg, &io_engine) != 0) {
+                    fprintf(stderr, "Unknown I/O engine '%s'\n", optarg);
+                    usage(stderr, argv[0]);
+                    return -1;
+                }
+            break;
             case 'h':
                 usage(stdout, argv[0]);
                 exit(EXIT_SUCCESS);
@@ -308,11 +406,30 @@ main(int argc, char **argv) {
 
     enum zn_backend device_type = zbd_device_is_zoned(device) ? ZE_BACKEND_ZNS : ZE_BACKEND_BLOCK;
 
-    if (workload_file != NULL) {
+    if (workload_file != NULL && key_file != NULL) {
+        fprintf(stderr, "Only one of 'workload_file' and 'key_file' can be set\n");
+        return 1;
+    }
+
+    if (workload_file != NULL || key_file != NULL) {
         if (workload_max == UINT64_MAX) {
-            fprintf(stderr, "'iterations' must be set if 'workload_file' is set\n");
+            fprintf(stderr, "'iterations' must be set if 'workload_file' or 'key_file' is set\n");
+            return 1;
+        }
+    }
+
+    if (key_file != NULL) {
+        int workload_fd = open(key_file, O_RDONLY);
+        if (workload_fd == -1) {
+            fprintf(stderr, "Couldn't read key file %s\n", key_file);
             return 1;
         }
+
+        workload_keys = read_key_workload(workload_fd, workload_max);
+        if (workload_keys == NULL) {
+            return 1;
+        }
+    } else if (workload_file != NULL) {
         int workload_fd = open(workload_file, O_RDONLY);
         if (workload_fd == -1) {
             fprintf(stderr, "Couldn't read workload file %s\n", workload_file);
@@ -387,28 +504,34 @@ main(int argc, char **argv) {
         info.zone_size = BLOCK_ZONE_CAPACITY;
     }
 
-    RANDOM_DATA = generate_random_buffer(chunk_sz);
-    if (RANDOM_DATA == NULL) {
-        nomem();
-    }
-
     printf("Running with configuration:\n"
        "\tDevice name: %s\n"
        "\tDevice type: %s\n"
-       "\tChunk size: %lu\n"
        "\tBLOCK_ZONE_CAPACITY: %u\n"
        "\tWorker threads: %u\n"
        "\tEviction threads: %u\n"
        "\tWorkload file: %s\n"
        "\tMetrics file: %s\n"
+       "\tI/O engine: %s\n"
        "\tNum zones: %d\n",
-       device, (device_type == ZE_BACKEND_ZNS) ? "ZNS" : "Block", chunk_sz,
+       device, (device_type == ZE_BACKEND_ZNS) ? "ZNS" : "Block",
        BLOCK_ZONE_CAPACITY, nr_threads, nr_eviction_threads,
-       workload_file != NULL ? workload_file : "Simple generator",
-       metrics_file != NULL ? metrics_file : "NO", info.nr_zones);
+       workload_file != NULL ? workload_file : key_file != NULL ? key_file : "Simple generator",
+       metrics_file != NULL ? metrics_file : "NO", zn_io_engine_name(io_engine), info.nr_zones);
 
     struct zn_cache cache = {0};
-    zn_init_cache(&cache, &info, chunk_sz, zone_capacity, fd, EVICTION_POLICY, device_type, workload_buffer, workload_max, metrics_file);
+    zn_init_cache(&cache, &info, chunk_sz, zone_capacity, fd, EVICTION_POLICY, device_type, workload_buffer, workload_max, metrics_file, io_engine);
+    cache.reader.workload_keys = workload_keys;
+
+    // The chunk size in use, OBJECT_SIZE_MAX replaces the argument
+    printf("\tChunk size: %lu%s\n", cache.chunk_sz,
+           cache.chunk_sz != chunk_sz ? " (CHUNK_SZ ignored with OBJECT_SIZE_MAX)" : "");
+
+    // Large enough for the largest object
+    RANDOM_DATA = generate_random_buffer(cache.max_object_sz);
+    if (RANDOM_DATA == NULL) {
+        nomem();
+    }
 
     GError *error = NULL;
     // Create a thread pool with a maximum of nr_threads
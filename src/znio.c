@@ -0,0 +1,619 @@
+// For pread
+#define _XOPEN_SOURCE 500
+#include "znio.h"
+
+#include "znutil.h"
+#include "zncache.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <glib.h>
+#include <linux/fs.h>
+#include <linux/nvme_ioctl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#ifdef ZN_IO_URING
+#include <liburing.h>
+#endif
+
+#define BACKOFF_US_START 100000 // 100 ms in microseconds
+#define READ_BACKOFF_RETRIES 5
+#define WRITE_BACKOFF_RETRIES 8
+
+/** NVMe Zone Append opcode, from the ZNS command set */
+#define NVME_CMD_ZONE_APPEND 0x7d
+
+/** Source of zn_io.instance, 0 is never handed out */
+static gint next_instance = 0;
+
+int
+zn_io_pread_all(int fd, unsigned char *buffer, size_t len, size_t io_size, unsigned long long offset) {
+    size_t total_read = 0;
+    while (total_read < len) {
+        size_t to_read = (len - total_read > io_size) ? io_size : (len - total_read);
+
+        int attempts = 0;
+        ssize_t r;
+        while (true) {
+            r = pread(fd, buffer + total_read, to_read, offset + total_read);
+            if (r == (ssize_t)to_read) {
+                break; // success
+            }
+
+            if (++attempts >= READ_BACKOFF_RETRIES) {
+                fprintf(stderr, "Partial read at offset %llu (%zd/%zu): %s\n",
+                        offset + total_read, r, to_read, strerror(errno));
+                return -1;
+            }
+
+            // exponential backoff: 100ms, 200ms, 400ms
+            g_usleep(BACKOFF_US_START * (1 << (attempts - 1))); // g_usleep in microseconds
+        }
+
+        total_read += r;
+    }
+
+    return 0;
+}
+
+int
+zn_io_pwrite_all(int fd, const unsigned char *buffer, size_t len, size_t io_size,
+                 unsigned long long offset) {
+    ssize_t bytes_written;
+    size_t total_written = 0;
+
+    while (total_written < len) {
+        size_t remaining = len - total_written;
+        size_t chunk_size = (remaining < io_size) ? remaining : io_size;
+
+        int attempts = 0;
+        while (true) {
+            errno = 0;
+            bytes_written = pwrite(fd, buffer + total_written, chunk_size, offset + total_written);
+
+            if (bytes_written == (ssize_t)chunk_size) {
+                break; // success
+            }
+
+            fprintf(stdout, "Write failed at offset %llu (%zd/%zu), retry=(%d/%d): %s\n",
+                        offset + total_written, bytes_written, chunk_size, attempts, WRITE_BACKOFF_RETRIES, strerror(errno));
+
+            if (++attempts >= WRITE_BACKOFF_RETRIES) {
+                fprintf(stderr, "Write failure exceeded retries=(%d/%d)\n", attempts, WRITE_BACKOFF_RETRIES);
+                return -1;
+            }
+
+            // Exponential backoff: 100ms, 200ms, 400ms, 800ms, 1600ms, 3200ms, 6400ms...
+            g_usleep(BACKOFF_US_START * (1 << (attempts - 1)));
+        }
+
+        total_written += bytes_written;
+    }
+
+    assert(total_written == len);
+    return 0;
+}
+
+/**
+ * @brief Largest piece a request is split into
+ */
+static size_t
+request_io_size(struct zn_io *io, struct zn_io_request *req) {
+    return req->io_size != 0 ? req->io_size : io->io_size;
+}
+
+/**
+ * @brief Does the part of a request the ring did not complete with the blocking engine
+ *
+ * @param io Engine configuration
+ * @param req Request to finish
+ * @param done Bytes at the start of the request known to be on the device
+ * @return 0 on success, -1 on failure
+ */
+static int
+psync_finish(struct zn_io *io, struct zn_io_request *req, size_t done) {
+    if (req->write) {
+        return zn_io_pwrite_all(io->fd, req->buffer + done, req->len - done, request_io_size(io, req),
+                                req->offset + done);
+    }
+    return zn_io_pread_all(io->fd, req->buffer + done, req->len - done, request_io_size(io, req),
+                           req->offset + done);
+}
+
+#ifdef ZN_IO_URING
+
+/**
+ * @struct zn_io_ring
+ * @brief A thread's ring, with the device and the engine's regions registered
+ */
+struct zn_io_ring {
+    struct io_uring ring;
+    uint32_t instance;       /**< zn_io.instance the registrations belong to */
+    bool fixed;              /**< Regions can be registered, a sparse buffer table is set up */
+    uint32_t nr_regions;     /**< Regions of the engine registered so far, in order */
+    uint32_t *by_address;    /**< Indexes of the registered regions, sorted by base address */
+};
+
+static void
+release_ring(gpointer data) {
+    struct zn_io_ring *r = data;
+    io_uring_queue_exit(&r->ring);
+    g_free(r->by_address);
+    free(r);
+}
+
+static GPrivate thread_ring = G_PRIVATE_INIT(release_ring);
+
+/**
+ * @brief Returns the calling thread's ring for `io`, creating it on first use
+ *
+ * @return The ring, or NULL if one could not be set up
+ */
+static struct zn_io_ring *
+ring_self(struct zn_io *io) {
+    struct zn_io_ring *r = g_private_get(&thread_ring);
+    if (r != NULL && r->instance == io->instance) {
+        return r;
+    }
+
+    r = calloc(1, sizeof(*r));
+    if (r == NULL) {
+        nomem();
+    }
+    if (io_uring_queue_init(ZN_IO_QUEUE_DEPTH, &r->ring, 0) != 0) {
+        free(r);
+        return NULL;
+    }
+    if (io_uring_register_files(&r->ring, &io->fd, 1) != 0) {
+        io_uring_queue_exit(&r->ring);
+        free(r);
+        return NULL;
+    }
+    r->instance = io->instance;
+
+    // Regions are filled in as they are registered with the engine
+    r->fixed = io_uring_register_buffers_sparse(&r->ring, ZN_IO_MAX_REGIONS) == 0;
+    if (r->fixed) {
+        r->by_address = g_new(uint32_t, ZN_IO_MAX_REGIONS);
+    } else {
+        dbg_printf("Couldn't set up fixed buffers, continuing without them%s", "\n");
+    }
+
+    // Drops a ring left over from an earlier configuration
+    g_private_replace(&thread_ring, r);
+    return r;
+}
+
+/**
+ * @brief Register the regions added to the engine since the ring last looked
+ */
+static void
+sync_regions(struct zn_io *io, struct zn_io_ring *r) {
+    uint32_t nr_regions = (uint32_t) g_atomic_int_get(&io->nr_regions);
+    for (; r->fixed && r->nr_regions < nr_regions; r->nr_regions++) {
+        uint32_t index = r->nr_regions;
+        struct iovec iov = {.iov_base = io->regions[index].base, .iov_len = io->regions[index].len};
+        if (io_uring_register_buffers_update_tag(&r->ring, index, &iov, NULL, 1) != 1) {
+            // Pinning counts against the memlock limit, carry on with the regions registered
+            dbg_printf("Couldn't register I/O region %u, using it unregistered\n", index);
+            r->fixed = false;
+            break;
+        }
+
+        // Regions are few and only ever added, insertion keeps them sorted
+        uint32_t pos = index;
+        while (pos > 0 && io->regions[r->by_address[pos - 1]].base > iov.iov_base) {
+            r->by_address[pos] = r->by_address[pos - 1];
+            pos--;
+        }
+        r->by_address[pos] = index;
+    }
+}
+
+/**
+ * @brief Index of the registered region that holds [buffer, buffer + len), or -1
+ */
+static int
+fixed_buffer_index(struct zn_io *io, struct zn_io_ring *r, const unsigned char *buffer,
+                   size_t len) {
+    // Last region that starts at or before the buffer
+    uint32_t lo = 0;
+    uint32_t hi = r->by_address != NULL ? r->nr_regions : 0;
+    while (lo < hi) {
+        uint32_t mid = lo + ((hi - lo) / 2);
+        if (io->regions[r->by_address[mid]].base <= buffer) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == 0) {
+        return -1;
+    }
+    uint32_t index = r->by_address[lo - 1];
+    const struct zn_io_region *region = &io->regions[index];
+    if (buffer + len > region->base + region->len) {
+        return -1;
+    }
+    return (int) index;
+}
+
+static void
+complete_one(struct io_uring *ring, struct io_uring_cqe *cqe) {
+    struct zn_io_request *req = io_uring_cqe_get_data(cqe);
+    assert(req->pending > 0);
+    req->pending--;
+    if (cqe->res < 0) {
+        req->failed = true;
+    } else {
+        req->transferred += cqe->res;
+    }
+    io_uring_cqe_seen(ring, cqe);
+}
+
+/**
+ * @brief Reaps completions, for any request on the ring, until `req` has none pending
+ */
+static void
+reap(struct zn_io_ring *r, struct zn_io_request *req) {
+    while (req->pending > 0) {
+        struct io_uring_cqe *cqe;
+        int ret = io_uring_wait_cqe(&r->ring, &cqe);
+        if (ret == -EINTR) {
+            continue;
+        }
+        assert(ret == 0);
+        complete_one(&r->ring, cqe);
+    }
+}
+
+static void
+submit_ring(struct zn_io_ring *r) {
+    int ret;
+    while ((ret = io_uring_submit(&r->ring)) < 0) {
+        if (ret == -EBUSY) {
+            // Completions have to be consumed before more can be submitted
+            struct io_uring_cqe *cqe;
+            if (io_uring_wait_cqe(&r->ring, &cqe) == 0) {
+                complete_one(&r->ring, cqe);
+            }
+        } else if (ret == -EAGAIN || ret == -EINTR) {
+            g_thread_yield();
+        } else {
+            assert(!"Failed to submit to io_uring");
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Queues every piece of `nr` requests and submits them together
+ *
+ * Pieces of ordered writes are linked, also across requests, so each starts only after the
+ * previous one completed. A chain cannot span submissions, so when the queue runs out of
+ * entries the queued part of the chain is completed before the rest is queued.
+ */
+static void
+uring_submit(struct zn_io *io, struct zn_io_ring *r, struct zn_io_request *reqs, uint32_t nr) {
+    sync_regions(io, r);
+    for (uint32_t i = 0; i < nr; i++) {
+        reqs[i].ring = r;
+    }
+
+    for (uint32_t i = 0; i < nr; i++) {
+        struct zn_io_request *req = &reqs[i];
+        bool linked = req->write && io->ordered_writes;
+        int fixed = fixed_buffer_index(io, r, req->buffer, req->len);
+        size_t io_size = request_io_size(io, req);
+
+        size_t queued = 0;
+        while (queued < req->len) {
+            unsigned space = io_uring_sq_space_left(&r->ring);
+            if (space == 0) {
+                submit_ring(r);
+                if (linked) {
+                    for (uint32_t j = 0; j <= i; j++) {
+                        reap(r, &reqs[j]);
+                    }
+                    for (uint32_t j = 0; j <= i; j++) {
+                        size_t expected = j < i ? reqs[j].len : queued;
+                        if (reqs[j].failed || reqs[j].transferred != expected) {
+                            // zn_io_wait() redoes the rest from where the device stopped
+                            return;
+                        }
+                    }
+                }
+                continue;
+            }
+
+            for (; space > 0 && queued < req->len; space--) {
+                size_t piece = MIN(io_size, req->len - queued);
+                struct io_uring_sqe *sqe = io_uring_get_sqe(&r->ring);
+                assert(sqe);
+
+                // The device is fixed file 0 of every ring
+                if (req->write && fixed >= 0) {
+                    io_uring_prep_write_fixed(sqe, 0, req->buffer + queued, piece, req->offset + queued, fixed);
+                } else if (req->write) {
+                    io_uring_prep_write(sqe, 0, req->buffer + queued, piece, req->offset + queued);
+                } else if (fixed >= 0) {
+                    io_uring_prep_read_fixed(sqe, 0, req->buffer + queued, piece, req->offset + queued, fixed);
+                } else {
+                    io_uring_prep_read(sqe, 0, req->buffer + queued, piece, req->offset + queued);
+                }
+
+                queued += piece;
+                bool more = queued < req->len ||
+                            (i + 1 < nr && reqs[i + 1].write && io->ordered_writes);
+                unsigned flags = IOSQE_FIXED_FILE;
+                if (linked && more && space > 1) {
+                    flags |= IOSQE_IO_LINK;
+                }
+                io_uring_sqe_set_flags(sqe, flags);
+                io_uring_sqe_set_data(sqe, req);
+                req->pending++;
+            }
+        }
+    }
+
+    submit_ring(r);
+}
+
+#endif // ZN_IO_URING
+
+void
+zn_io_init(struct zn_io *io, enum zn_io_engine engine, int fd, size_t io_size,
+           bool ordered_writes) {
+    assert(io);
+    assert(io_size > 0);
+
+    *io = (struct zn_io) {
+        .engine = engine,
+        .fd = fd,
+        .io_size = io_size,
+        .ordered_writes = ordered_writes,
+        .instance = (uint32_t) g_atomic_int_add(&next_instance, 1) + 1
+    };
+    g_mutex_init(&io->regions_lock);
+
+    if (engine != ZN_IO_ENGINE_URING) {
+        return;
+    }
+#ifdef ZN_IO_URING
+    struct io_uring probe;
+    if (io_uring_queue_init(ZN_IO_QUEUE_DEPTH, &probe, 0) == 0) {
+        io_uring_queue_exit(&probe);
+        io->regions = g_new(struct zn_io_region, ZN_IO_MAX_REGIONS);
+        return;
+    }
+    fprintf(stderr, "io_uring is not available, using psync\n");
+#else
+    fprintf(stderr, "Built without liburing, using psync\n");
+#endif
+    io->engine = ZN_IO_ENGINE_PSYNC;
+}
+
+void
+zn_io_destroy(struct zn_io *io) {
+    assert(io);
+#ifdef ZN_IO_URING
+    struct zn_io_ring *r = g_private_get(&thread_ring);
+    if (r != NULL && r->instance == io->instance) {
+        g_private_replace(&thread_ring, NULL);
+    }
+#endif
+    g_free(io->regions);
+    io->regions = NULL;
+    g_mutex_clear(&io->regions_lock);
+}
+
+int
+zn_io_engine_parse(const char *name, enum zn_io_engine *engine) {
+    if (strcmp(name, "psync") == 0) {
+        *engine = ZN_IO_ENGINE_PSYNC;
+    } else if (strcmp(name, "io_uring") == 0) {
+        *engine = ZN_IO_ENGINE_URING;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+const char *
+zn_io_engine_name(enum zn_io_engine engine) {
+    return engine == ZN_IO_ENGINE_URING ? "io_uring" : "psync";
+}
+
+int
+zn_io_submit(struct zn_io *io, struct zn_io_request *req) {
+    return zn_io_submit_batch(io, req, 1);
+}
+
+int
+zn_io_submit_batch(struct zn_io *io, struct zn_io_request *reqs, uint32_t nr) {
+    assert(io);
+    assert(reqs);
+
+    for (uint32_t i = 0; i < nr; i++) {
+        reqs[i].ring = NULL;
+        reqs[i].pending = 0;
+        reqs[i].transferred = 0;
+        reqs[i].failed = false;
+        reqs[i].result = 0;
+    }
+
+#ifdef ZN_IO_URING
+    if (io->engine == ZN_IO_ENGINE_URING) {
+        struct zn_io_ring *r = ring_self(io);
+        if (r != NULL) {
+            uring_submit(io, r, reqs, nr);
+            return 0;
+        }
+    }
+#endif
+
+    int ret = 0;
+    for (uint32_t i = 0; i < nr; i++) {
+        reqs[i].result = psync_finish(io, &reqs[i], 0);
+        if (reqs[i].result != 0) {
+            ret = -1;
+            if (reqs[i].write && io->ordered_writes) {
+                // The device would reject the writes that follow
+                for (uint32_t j = i + 1; j < nr; j++) {
+                    reqs[j].result = -1;
+                }
+                break;
+            }
+        }
+    }
+    return ret;
+}
+
+int
+zn_io_wait(struct zn_io *io, struct zn_io_request *req) {
+    assert(io);
+    assert(req);
+
+#ifdef ZN_IO_URING
+    if (req->ring != NULL) {
+        reap(req->ring, req);
+        req->ring = NULL;
+
+        if (req->failed || req->transferred != req->len) {
+            // Linked write pieces stop at the first failure, so everything before it is on the
+            // device. Reads and unordered writes can simply be redone.
+            size_t done = (req->write && io->ordered_writes) ? req->transferred : 0;
+            dbg_printf("io_uring transfer at %llu failed after %zu/%zu bytes\n", req->offset,
+                       req->transferred, req->len);
+            req->result = psync_finish(io, req, done);
+        }
+    }
+#endif
+
+    return req->result;
+}
+
+int
+zn_io_read(struct zn_io *io, unsigned char *buffer, size_t len, unsigned long long offset) {
+    struct zn_io_request req = {.buffer = buffer, .len = len, .offset = offset, .write = false};
+    if (zn_io_submit(io, &req) != 0) {
+        return -1;
+    }
+    return zn_io_wait(io, &req);
+}
+
+int
+zn_io_write(struct zn_io *io, const unsigned char *buffer, size_t len, unsigned long long offset) {
+    // The request type is shared with reads, the buffer is not modified
+    struct zn_io_request req = {
+        .buffer = (unsigned char *) buffer, .len = len, .offset = offset, .write = true};
+    if (zn_io_submit(io, &req) != 0) {
+        return -1;
+    }
+    return zn_io_wait(io, &req);
+}
+
+/**
+ * @brief Largest zone append the block device behind `fd` takes, 0 if it takes none
+ */
+static size_t
+zone_append_max_bytes(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISBLK(st.st_mode)) {
+        return 0;
+    }
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/queue/zone_append_max_bytes",
+             major(st.st_rdev), minor(st.st_rdev));
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        return 0;
+    }
+    unsigned long long max_bytes;
+    if (fscanf(fp, "%llu", &max_bytes) != 1) {
+        max_bytes = 0;
+    }
+    fclose(fp);
+    return (size_t) max_bytes;
+}
+
+int
+zn_io_enable_append(struct zn_io *io, size_t max_len) {
+    assert(io);
+
+    int nsid = ioctl(io->fd, NVME_IOCTL_ID);
+    if (nsid <= 0) {
+        dbg_printf("Zone append needs an NVMe namespace%s", "\n");
+        return -1;
+    }
+    int lba_size;
+    if (ioctl(io->fd, BLKSSZGET, &lba_size) != 0 || lba_size <= 0) {
+        return -1;
+    }
+    size_t max_bytes = zone_append_max_bytes(io->fd);
+    if (max_bytes < max_len) {
+        dbg_printf("Zone appends are limited to %zu bytes, %zu needed\n", max_bytes, max_len);
+        return -1;
+    }
+
+    io->append_nsid = (uint32_t) nsid;
+    io->append_lba_size = (uint32_t) lba_size;
+    return 0;
+}
+
+int
+zn_io_append(struct zn_io *io, const unsigned char *buffer, size_t len,
+             unsigned long long zone_start, unsigned long long *offset) {
+    assert(io);
+    assert(io->append_nsid != 0);
+    assert(offset);
+    assert(len > 0 && len % io->append_lba_size == 0);
+    assert(zone_start % io->append_lba_size == 0);
+
+    unsigned long long zslba = zone_start / io->append_lba_size;
+    struct nvme_passthru_cmd64 cmd = {
+        .opcode = NVME_CMD_ZONE_APPEND,
+        .nsid = io->append_nsid,
+        .addr = (uint64_t) (uintptr_t) buffer,
+        .data_len = (uint32_t) len,
+        .cdw10 = (uint32_t) zslba,
+        .cdw11 = (uint32_t) (zslba >> 32),
+        .cdw12 = (uint32_t) (len / io->append_lba_size - 1), // 0's based block count
+    };
+    // A positive return is the NVMe status of a command the device rejected
+    int ret = ioctl(io->fd, NVME_IOCTL_IO64_CMD, &cmd);
+    if (ret != 0) {
+        fprintf(stderr, "Zone append to the zone at %llu failed (%d): %s\n", zone_start, ret,
+                ret < 0 ? strerror(errno) : "NVMe error status");
+        return -1;
+    }
+
+    // The result is the first block written
+    *offset = cmd.result * io->append_lba_size;
+    assert(*offset >= zone_start);
+    return 0;
+}
+
+void
+zn_io_register_region(struct zn_io *io, void *base, size_t len) {
+    assert(io);
+    assert(base);
+    if (io->regions == NULL) {
+        return;
+    }
+
+    g_mutex_lock(&io->regions_lock);
+    gint nr_regions = g_atomic_int_get(&io->nr_regions);
+    if (nr_regions < ZN_IO_MAX_REGIONS) {
+        io->regions[nr_regions] = (struct zn_io_region) {.base = base, .len = len};
+        // Rings read the entry once they see the count
+        g_atomic_int_set(&io->nr_regions, nr_regions + 1);
+    }
+    g_mutex_unlock(&io->regions_lock);
+}
@@ -17,6 +17,8 @@ char *zn_profiler_metric_names[PROFILING_METRICS] = {
     "CACHETHROUGHPUT",
     "CACHEHITTHROUGHPUT",
     "CACHEMISSTHROUGHPUT",
+    "DRAMHITRATIO",
+    "DEVICEHITRATIO",
 };
 
 enum zn_profiler_type zn_profiler_metric_types[PROFILING_METRICS] = {
@@ -31,6 +33,8 @@ enum zn_profiler_type zn_profiler_metric_types[PROFILING_METRICS] = {
     ZN_PROFILER_OVER_TIME, // Cache throughput
     ZN_PROFILER_OVER_TIME, // Cache hit throughput
     ZN_PROFILER_OVER_TIME, // Cache miss throughput
+    ZN_PROFILER_SET, // DRAM tier hitratio
+    ZN_PROFILER_SET, // Device hitratio
 };
 
 struct zn_profiler *
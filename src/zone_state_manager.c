@@ -6,6 +6,7 @@
 #include "zncache.h"
 #include "znutil.h"
 
+#include <inttypes.h>
 #include <stdint.h>
 #include <stdlib.h>
 
@@ -23,7 +24,7 @@ close_zone(struct zone_state_manager *state, struct zn_zone *zone) {
         return 0;
     }
 
-    unsigned long long wp = CHUNK_POINTER(state->zone_size, state->chunk_size, 0, zone->zone_id);
+    unsigned long long wp = CHUNK_POINTER(state->zone_size, state->chunk_size, 0, state->zone_base + zone->zone_id);
     dbg_printf("Closing zone %u, zone pointer %llu\n", zone->zone_id, wp);
     zbd_set_log_level(ZBD_LOG_DEBUG);
 
@@ -51,6 +52,8 @@ close_zone(struct zone_state_manager *state, struct zn_zone *zone) {
     // }
     zone->state = ZN_ZONE_FULL;
     zone->chunk_offset = 0;
+    zone->write_pointer = 0;
+    g_queue_push_tail(state->filled, GUINT_TO_POINTER(zone->zone_id));
 
     return ret;
 }
@@ -70,7 +73,7 @@ reset_zone(struct zone_state_manager *state, struct zn_zone *zone) {
         return 0;
     }
 
-    unsigned long long wp = CHUNK_POINTER(state->zone_size, state->chunk_size, 0, zone->zone_id);
+    unsigned long long wp = CHUNK_POINTER(state->zone_size, state->chunk_size, 0, state->zone_base + zone->zone_id);
     dbg_printf("Resetting zone %u, zone pointer %llu\n", zone->zone_id, wp);
     zbd_set_log_level(ZBD_LOG_DEBUG);
 
@@ -86,6 +89,7 @@ reset_zone(struct zone_state_manager *state, struct zn_zone *zone) {
 
     zone->state = ZN_ZONE_FREE;
     zone->chunk_offset = 0;
+    zone->write_pointer = 0;
     g_queue_push_tail(state->free, zone);
 
     return ret;
@@ -113,7 +117,7 @@ open_zone(struct zone_state_manager *state, struct zn_zone *zone) {
 
 	if (state->backend_type == ZE_BACKEND_ZNS) {
         dbg_printf("chunk_offset=%u, zone=%u\n", zone->chunk_offset, zone->zone_id);
-		unsigned long long wp = CHUNK_POINTER(state->zone_size, state->chunk_size, 0, zone->zone_id);
+		unsigned long long wp = CHUNK_POINTER(state->zone_size, state->chunk_size, 0, state->zone_base + zone->zone_id);
 		dbg_printf("Opening zone %u, zone pointer %llu\n", zone->zone_id, wp);
 
 		int ret = zbd_open_zones(state->fd, wp, 1);
@@ -124,11 +128,72 @@ open_zone(struct zone_state_manager *state, struct zn_zone *zone) {
 
     zone->state = ZN_ZONE_ACTIVE;
     zone->chunk_offset = 0;
+    zone->write_pointer = 0;
     g_queue_push_tail(state->active, zone);
 
     return 0;
 }
 
+/**
+ * @brief Drops a writer's reservation on a zone
+ *
+ * @param state the zone state
+ * @param zone Zone the writer held a chunk in
+ *
+ * @note assumes that the lock is held
+ *
+ * @return Returns 0 on success, otherwise the error from closing the zone
+ */
+static int
+release_chunk(struct zone_state_manager *state, struct zn_zone *zone) {
+    assert(zone->writers > 0);
+
+    int ret = 0;
+    zone->writers--;
+    if (zone->state == ZN_ZONE_WRITE_OCCURING && !zone->batch) {
+        if (zone->chunk_offset < state->max_zone_chunks) {
+            // Below the writer limit again, so the zone can take reservations
+            state->writes_occurring--;
+            zone->state = ZN_ZONE_ACTIVE;
+            g_queue_push_tail(state->active, zone);
+        } else if (zone->writers == 0) {
+            state->writes_occurring--;
+            ret = close_zone(state, zone);
+        }
+    }
+    g_cond_broadcast(&zone->write_turn);
+
+    return ret;
+}
+
+/**
+ * @brief Stops handing out chunks of a zone whose remaining chunks are too few for a writer
+ *
+ * The zone closes once the writers holding chunks of it have returned them, with the tail
+ * left unwritten.
+ *
+ * @param state the zone state
+ * @param zone Zone popped off the active queue
+ *
+ * @note assumes that the lock is held
+ *
+ * @return Returns 0 on success, otherwise the error from closing the zone
+ */
+static int
+seal_zone(struct zone_state_manager *state, struct zn_zone *zone) {
+    assert(zone->state == ZN_ZONE_ACTIVE);
+    dbg_printf("Sealing zone %u with %" PRIu64 " chunks unused\n", zone->zone_id,
+               state->max_zone_chunks - zone->chunk_offset);
+
+    zone->chunk_offset = state->max_zone_chunks;
+    if (zone->writers == 0) {
+        return close_zone(state, zone);
+    }
+    zone->state = ZN_ZONE_WRITE_OCCURING;
+    state->writes_occurring++;
+    return 0;
+}
+
 void
 zsm_init(struct zone_state_manager *state, const uint32_t num_zones, const int fd,
          const uint64_t zone_cap, const uint64_t zone_size, const size_t chunk_size,
@@ -142,7 +207,14 @@ zsm_init(struct zone_state_manager *state, const uint32_t num_zones, const int f
     state->max_zone_chunks = zone_cap / chunk_size;
     state->max_nr_active_zones = max_nr_active_zones;
     state->writes_occurring = 0;
+    state->max_zone_writers = ZONE_WRITERS;
+#ifdef ZONE_APPEND
+    state->zone_append = backend_type == ZE_BACKEND_ZNS;
+#else
+    state->zone_append = false;
+#endif
     state->num_zones = num_zones;
+    state->zone_base = 0;
     state->backend_type = backend_type;
 
     g_mutex_init(&state->state_mutex);
@@ -151,8 +223,10 @@ zsm_init(struct zone_state_manager *state, const uint32_t num_zones, const int f
     assert(state->active);
 
     state->free = g_queue_new();
+    state->filled = g_queue_new();
     state->state = calloc(num_zones, sizeof(struct zn_zone));
     assert(state->free);
+    assert(state->filled);
     assert(state->state);
     for (uint32_t i = 0; i < num_zones; i++) {
         GQueue *queue = g_queue_new();
@@ -161,26 +235,36 @@ zsm_init(struct zone_state_manager *state, const uint32_t num_zones, const int f
             .state = ZN_ZONE_FREE,
             .zone_id = i,
             .chunk_offset = 0,
+            .write_pointer = 0,
+            .writers = 0,
+            .batch = false,
+            .queued = g_queue_new(),
+            .submitting = false,
             .invalid = queue
         };
+        g_cond_init(&state->state[i].write_turn);
         g_queue_push_tail(state->free, &state->state[i]);
     }
 }
 
-enum zsm_get_active_zone_error
-zsm_get_active_zone(struct zone_state_manager *state, struct zn_pair *pair) {
-    assert(state);
-    assert(pair);
-
-    g_mutex_lock(&state->state_mutex);
-
+/**
+ * @brief Takes the active zone to reserve chunks in next, opening a free zone if none is active
+ *
+ * @param state the zone state
+ * @param[out] zone Zone popped off the active queue, only set on success
+ *
+ * @note assumes that the lock is held
+ *
+ * @return ZSM_GET_ACTIVE_ZONE_SUCCESS, or the error to hand back to the caller
+ */
+static enum zsm_get_active_zone_error
+pop_active_zone(struct zone_state_manager *state, struct zn_zone **zone) {
     uint32_t active_queue_size = g_queue_get_length(state->active);
     uint32_t writer_size = state->writes_occurring;
     uint32_t free_queue_size = g_queue_get_length(state->free);
 
     // Perform foreground eviction
     if ((active_queue_size + writer_size) == 0 && free_queue_size == 0) {
-        g_mutex_unlock(&state->state_mutex);
         return ZSM_GET_ACTIVE_ZONE_EVICT;
     }
 
@@ -200,44 +284,255 @@ zsm_get_active_zone(struct zone_state_manager *state, struct zn_pair *pair) {
             if (ret) {
                 dbg_printf("Failed to open zone: %d with error: %d\n", new_zone->zone_id, ret);
                 assert(!"Failed to open zone");
-                g_mutex_unlock(&state->state_mutex);
                 return ZSM_GET_ACTIVE_ZONE_ERROR;
             }
 
         } else {
             // The thread needs to wait for a free zone
-            g_mutex_unlock(&state->state_mutex);
             return ZSM_GET_ACTIVE_ZONE_RETRY;
         }
     }
 
-    // Get an active zone
     dbg_print_g_queue("active queue (zone,chunk,state)", state->active, PRINT_G_QUEUE_ZN_ZONE);
-    struct zn_zone *active_pair = g_queue_pop_head(state->active);
-    assert(active_pair->state == ZN_ZONE_ACTIVE);
+    *zone = g_queue_pop_head(state->active);
+    assert((*zone)->state == ZN_ZONE_ACTIVE);
+    assert((*zone)->chunk_offset < state->max_zone_chunks);
+    return ZSM_GET_ACTIVE_ZONE_SUCCESS;
+}
+
+/**
+ * @brief pop_active_zone() for a zone with at least `nr_chunks` chunks left, sealing the active
+ * zones that have fewer
+ *
+ * @note assumes that the lock is held
+ */
+static enum zsm_get_active_zone_error
+pop_zone_with_room(struct zone_state_manager *state, uint32_t nr_chunks, struct zn_zone **zone) {
+    assert(nr_chunks > 0 && nr_chunks <= state->max_zone_chunks);
+
+    while (true) {
+        enum zsm_get_active_zone_error ret = pop_active_zone(state, zone);
+        if (ret != ZSM_GET_ACTIVE_ZONE_SUCCESS ||
+            state->max_zone_chunks - (*zone)->chunk_offset >= nr_chunks) {
+            return ret;
+        }
+        if (seal_zone(state, *zone) != 0) {
+            dbg_printf("Failed to seal zone: %u\n", (*zone)->zone_id);
+            return ZSM_GET_ACTIVE_ZONE_ERROR;
+        }
+    }
+}
+
+enum zsm_get_active_zone_error
+zsm_get_active_zone(struct zone_state_manager *state, struct zn_pair *pair) {
+    return zsm_get_active_zone_extent(state, 1, pair);
+}
+
+enum zsm_get_active_zone_error
+zsm_get_active_zone_extent(struct zone_state_manager *state, uint32_t nr_chunks,
+                           struct zn_pair *pair) {
+    assert(state);
+    assert(pair);
+
+    g_mutex_lock(&state->state_mutex);
+
+    // Reserve the next chunks of an active zone
+    struct zn_zone *active_pair;
+    enum zsm_get_active_zone_error ret = pop_zone_with_room(state, nr_chunks, &active_pair);
+    if (ret != ZSM_GET_ACTIVE_ZONE_SUCCESS) {
+        g_mutex_unlock(&state->state_mutex);
+        return ret;
+    }
 
     *pair = (struct zn_pair) {
         .zone = active_pair->zone_id,
-        .chunk_offset = active_pair->chunk_offset
+        .chunk_offset = state->zone_append ? ZSM_APPEND_OFFSET : active_pair->chunk_offset,
+        .nr_chunks = nr_chunks
     };
 
-    active_pair->state = ZN_ZONE_WRITE_OCCURING;
+    active_pair->chunk_offset += nr_chunks;
+    active_pair->writers++;
+    if (active_pair->writers == state->max_zone_writers ||
+        active_pair->chunk_offset == state->max_zone_chunks) {
+        active_pair->state = ZN_ZONE_WRITE_OCCURING;
+        state->writes_occurring++;
+    } else {
+        // Rotate, so writers spread over the active zones before they share one
+        g_queue_push_tail(state->active, active_pair);
+    }
+
+    g_mutex_unlock(&state->state_mutex);
+    return ZSM_GET_ACTIVE_ZONE_SUCCESS;
+}
+
+enum zsm_get_active_zone_error
+zsm_get_active_zone_batch(struct zone_state_manager *state, uint32_t min_chunks,
+                          uint32_t max_chunks, struct zn_pair *pair, uint32_t *nr_chunks) {
+    assert(state);
+    assert(pair);
+    assert(nr_chunks);
+    assert(min_chunks > 0 && min_chunks <= max_chunks);
+    // Appenders take the write pointer when they start, they could land inside the batch
+    assert(!state->zone_append);
+
+    g_mutex_lock(&state->state_mutex);
+
+    struct zn_zone *zone;
+    enum zsm_get_active_zone_error ret = pop_zone_with_room(state, min_chunks, &zone);
+    if (ret != ZSM_GET_ACTIVE_ZONE_SUCCESS) {
+        g_mutex_unlock(&state->state_mutex);
+        return ret;
+    }
+
+    *nr_chunks = MIN(max_chunks, state->max_zone_chunks - zone->chunk_offset);
+    *pair = (struct zn_pair) {
+        .zone = zone->zone_id, .chunk_offset = zone->chunk_offset, .nr_chunks = *nr_chunks};
+
+    // Held off the active queue until returned, the batch stays the newest reservation
+    zone->chunk_offset += *nr_chunks;
+    zone->writers++;
+    zone->batch = true;
+    zone->state = ZN_ZONE_WRITE_OCCURING;
     state->writes_occurring++;
 
     g_mutex_unlock(&state->state_mutex);
     return ZSM_GET_ACTIVE_ZONE_SUCCESS;
 }
 
-#ifdef TODO
-// TODO
-GArray
-zsm_get_active_zone_batch(int chunks) {
-    (void) chunks;
+void
+zsm_trim_batch(struct zone_state_manager *state, struct zn_pair *pair, uint32_t nr_chunks,
+               uint32_t nr_used) {
+    assert(state);
+    assert(pair);
+    assert(nr_used > 0 && nr_used <= nr_chunks);
+
+    g_mutex_lock(&state->state_mutex);
+    struct zn_zone *zone = &state->state[pair->zone];
+    assert(zone->batch);
+    assert(zone->chunk_offset == pair->chunk_offset + nr_chunks);
+    zone->chunk_offset = pair->chunk_offset + nr_used;
+    g_mutex_unlock(&state->state_mutex);
+}
+
+void
+zsm_wait_write_turn(struct zone_state_manager *state, struct zn_pair *pair) {
+    assert(state);
+    assert(pair);
+
+    if (state->zone_append) {
+        // The device orders the appends
+        assert(pair->chunk_offset == ZSM_APPEND_OFFSET);
+        return;
+    }
+
+    g_mutex_lock(&state->state_mutex);
+    struct zn_zone *zone = &state->state[pair->zone];
+    assert(pair->chunk_offset >= zone->write_pointer);
+    while (zone->write_pointer != pair->chunk_offset) {
+        g_cond_wait(&zone->write_turn, &state->state_mutex);
+    }
+    assert(pair->chunk_offset + pair->nr_chunks <= state->max_zone_chunks);
+    g_mutex_unlock(&state->state_mutex);
+}
+
+static gint
+compare_writes(gconstpointer a, gconstpointer b, gpointer user_data) {
+    (void) user_data;
+    uint32_t offset_a = ((const struct zsm_write *) a)->pair.chunk_offset;
+    uint32_t offset_b = ((const struct zsm_write *) b)->pair.chunk_offset;
+    return offset_a < offset_b ? -1 : offset_a > offset_b;
 }
-#endif
 
 int
-zsm_return_active_zone(struct zone_state_manager *state, struct zn_pair *pair) {
+zsm_write_ordered(struct zone_state_manager *state, struct zsm_write *write,
+                  zsm_submit_fn submit, void *user_data) {
+    assert(state);
+    assert(write);
+    assert(submit);
+    assert(!state->zone_append);
+
+    g_mutex_lock(&state->state_mutex);
+    struct zn_zone *zone = &state->state[write->pair.zone];
+    assert(write->pair.chunk_offset >= zone->write_pointer);
+    assert(write->pair.chunk_offset + write->pair.nr_chunks <= state->max_zone_chunks);
+    write->done = false;
+    write->result = 0;
+    g_queue_insert_sorted(zone->queued, write, compare_writes, NULL);
+    g_cond_broadcast(&zone->write_turn);
+
+    while (!write->done) {
+        struct zsm_write *head = g_queue_peek_head(zone->queued);
+        if (zone->submitting || head->pair.chunk_offset != zone->write_pointer) {
+            g_cond_wait(&zone->write_turn, &state->state_mutex);
+            continue;
+        }
+
+        // Take the writes that follow on from the write pointer, whoever queued them
+        struct zsm_write *run[ZSM_MAX_WRITE_RUN];
+        uint32_t nr_writes = 0;
+        uint32_t next = zone->write_pointer;
+        while (nr_writes < ZSM_MAX_WRITE_RUN && (head = g_queue_peek_head(zone->queued)) != NULL &&
+               head->pair.chunk_offset == next) {
+            run[nr_writes++] = g_queue_pop_head(zone->queued);
+            next += head->pair.nr_chunks;
+        }
+        zone->submitting = true;
+        g_mutex_unlock(&state->state_mutex);
+
+        submit(user_data, run, nr_writes);
+
+        g_mutex_lock(&state->state_mutex);
+        zone->submitting = false;
+        for (uint32_t i = 0; i < nr_writes; i++) {
+            run[i]->done = true;
+            if (run[i]->result != 0) {
+                // The writes behind it wait until its writer skips its chunks
+                for (uint32_t j = nr_writes; j > i + 1; j--) {
+                    g_queue_push_head(zone->queued, run[j - 1]);
+                }
+                break;
+            }
+            zone->write_pointer += run[i]->pair.nr_chunks;
+        }
+        g_cond_broadcast(&zone->write_turn);
+    }
+
+    g_mutex_unlock(&state->state_mutex);
+    return write->result;
+}
+
+void
+zsm_pass_write_turn(struct zone_state_manager *state, struct zn_pair *pair) {
+    zsm_pass_write_turn_batch(state, pair, pair->nr_chunks);
+}
+
+void
+zsm_pass_write_turn_batch(struct zone_state_manager *state, struct zn_pair *pair,
+                          uint32_t nr_chunks) {
+    assert(state);
+    assert(pair);
+
+    g_mutex_lock(&state->state_mutex);
+    struct zn_zone *zone = &state->state[pair->zone];
+    if (state->zone_append) {
+        assert(pair->chunk_offset != ZSM_APPEND_OFFSET);
+        assert(pair->chunk_offset + nr_chunks <= zone->chunk_offset);
+    } else {
+        assert(zone->write_pointer == pair->chunk_offset);
+    }
+    zone->write_pointer += nr_chunks;
+    g_cond_broadcast(&zone->write_turn);
+    g_mutex_unlock(&state->state_mutex);
+}
+
+/**
+ * @brief Releases `nr_chunks` chunks starting at `pair` after they are written
+ *
+ * @param batch The chunks were reserved by zsm_get_active_zone_batch()
+ */
+static int
+return_chunks(struct zone_state_manager *state, struct zn_pair *pair, uint32_t nr_chunks,
+              bool batch) {
     assert(state);
     assert(pair);
 
@@ -246,26 +541,33 @@ zsm_return_active_zone(struct zone_state_manager *state, struct zn_pair *pair) {
            state->max_nr_active_zones);
 
     struct zn_zone *zone = &state->state[pair->zone];
-    assert(zone->state == ZN_ZONE_WRITE_OCCURING);
-    assert(zone->chunk_offset == pair->chunk_offset);
-
-    // Update the state of the chunk
-    state->writes_occurring--;
-    zone->chunk_offset++;
-    if (zone->chunk_offset == state->max_zone_chunks) {
-        int ret = close_zone(state, zone);
-        if (ret != 0) {
-            dbg_printf("An error occurred while closing zone %u\n", zone->zone_id);
-            g_mutex_unlock(&state->state_mutex);
-            return ret;
-        }
-    } else {
-        zone->state = ZN_ZONE_ACTIVE;
-        g_queue_push_tail(state->active, zone);
+    assert(zone->state == ZN_ZONE_ACTIVE || zone->state == ZN_ZONE_WRITE_OCCURING);
+    // Appends complete out of order, so an appended chunk can be past the chunks counted
+    assert(pair->chunk_offset + nr_chunks <=
+           (state->zone_append ? zone->chunk_offset : zone->write_pointer));
+
+    if (batch) {
+        assert(zone->batch);
+        zone->batch = false;
+    }
+    int ret = release_chunk(state, zone);
+    if (ret != 0) {
+        dbg_printf("An error occurred while closing zone %u\n", zone->zone_id);
     }
 
     g_mutex_unlock(&state->state_mutex);
-    return 0;
+    return ret;
+}
+
+int
+zsm_return_active_zone(struct zone_state_manager *state, struct zn_pair *pair) {
+    return return_chunks(state, pair, pair->nr_chunks, false);
+}
+
+int
+zsm_return_active_zone_batch(struct zone_state_manager *state, struct zn_pair *pair,
+                             uint32_t nr_chunks) {
+    return return_chunks(state, pair, nr_chunks, true);
 }
 
 int
@@ -298,15 +600,49 @@ zsm_failed_to_write(struct zone_state_manager *state, struct zn_pair pair) {
     g_mutex_lock(&state->state_mutex);
     assert(g_queue_get_length(state->active) + state->writes_occurring <= state->max_nr_active_zones);
 
+    struct zn_zone *zone = &state->state[pair.zone];
+    assert(zone->state == ZN_ZONE_ACTIVE || zone->state == ZN_ZONE_WRITE_OCCURING);
+    assert(state->zone_append ? pair.chunk_offset == ZSM_APPEND_OFFSET
+                              : zone->write_pointer == pair.chunk_offset);
+
+    if (state->zone_append) {
+        // Nothing was appended, so give the space back
+        zone->chunk_offset -= pair.nr_chunks;
+    } else if (zone->chunk_offset == pair.chunk_offset + pair.nr_chunks) {
+        // Nobody reserved a later chunk, so hand these out again
+        zone->chunk_offset = pair.chunk_offset;
+    } else {
+        // Later writers are waiting on these chunks, skip them
+        zone->write_pointer += pair.nr_chunks;
+        for (uint32_t i = 0; i < pair.nr_chunks; i++) {
+            g_queue_push_tail(zone->invalid, GUINT_TO_POINTER(pair.chunk_offset + i));
+        }
+    }
+    int ret = release_chunk(state, zone);
+    assert(ret == 0);
+    (void) ret;
+
+    g_mutex_unlock(&state->state_mutex);
+}
+
+void
+zsm_failed_to_write_batch(struct zone_state_manager *state, struct zn_pair pair,
+                          uint32_t nr_chunks) {
+    assert(state);
+
+    g_mutex_lock(&state->state_mutex);
     struct zn_zone *zone = &state->state[pair.zone];
     assert(zone->state == ZN_ZONE_WRITE_OCCURING);
-    assert(zone->chunk_offset == pair.chunk_offset);
-    assert(zone->chunk_offset < state->max_zone_chunks);
+    assert(zone->batch);
+    assert(zone->write_pointer == pair.chunk_offset);
+    // Nothing can be reserved behind a batch, so the space is always handed out again
+    assert(zone->chunk_offset == pair.chunk_offset + nr_chunks);
 
-    // Update the state of the chunk
-    state->writes_occurring--;
-    zone->state = ZN_ZONE_ACTIVE;
-    g_queue_push_tail(state->active, zone);
+    zone->chunk_offset = pair.chunk_offset;
+    zone->batch = false;
+    int ret = release_chunk(state, zone);
+    assert(ret == 0);
+    (void) ret;
 
     g_mutex_unlock(&state->state_mutex);
 }
@@ -342,6 +678,15 @@ zsm_get_num_full_zones(struct zone_state_manager *state) {
     return count;
 }
 
+int
+zsm_pop_full_zone(struct zone_state_manager *state) {
+    g_mutex_lock(&state->state_mutex);
+    int zone = g_queue_is_empty(state->filled) ? -1
+                                               : (int) GPOINTER_TO_UINT(g_queue_pop_head(state->filled));
+    g_mutex_unlock(&state->state_mutex);
+    return zone;
+}
+
 uint32_t
 zsm_get_num_invalid_chunks(struct zone_state_manager *state, uint32_t zone) {
     g_mutex_lock(&state->state_mutex);
@@ -359,7 +704,9 @@ zsm_mark_chunk_invalid(struct zone_state_manager *state, struct zn_pair *locatio
         zone->invalid,
         PRINT_G_QUEUE_GINT
     );
-    g_queue_push_tail(zone->invalid, GUINT_TO_POINTER(location->chunk_offset));
+    for (uint32_t i = 0; i < location->nr_chunks; i++) {
+        g_queue_push_tail(zone->invalid, GUINT_TO_POINTER(location->chunk_offset + i));
+    }
     dbg_print_g_queue(
         "state[location.zone].state->invalid after mark",
         zone->invalid,
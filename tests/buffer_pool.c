@@ -0,0 +1,308 @@
+#include <assert.h>
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "zncache.h"
+#include "znbuf.h"
+
+/*
+ * Tests for the aligned buffer pool. Buffers have to be reused, never handed to two users at
+ * once, and may be returned from a different thread than the one that took them.
+ */
+
+#define BUFFER_SIZE 65536
+#define NR_THREADS 8
+#define HELD_BUFFERS 4
+#define ROUNDS 2000
+
+/**
+ * @brief A returned buffer is handed out again, and buffers are aligned
+ * @return 0 on success, non-zero on failure.
+ */
+int test_reuse() {
+    struct zn_buffer_pool pool;
+    zn_buffer_pool_init(&pool, BUFFER_SIZE, false);
+
+    unsigned char *first = zn_buffer_get(&pool);
+    if (((uintptr_t) first % ZN_DIRECT_ALIGNMENT) != 0) {
+        return 1;
+    }
+    memset(first, 0xab, BUFFER_SIZE);
+    zn_buffer_put(&pool, first);
+
+    unsigned char *second = zn_buffer_get(&pool);
+    if (second != first) {
+        return 2;
+    }
+    zn_buffer_put(&pool, second);
+    zn_buffer_put(&pool, NULL);
+
+    struct zn_buffer_pool_stats stats;
+    zn_buffer_pool_get_stats(&pool, &stats);
+    if (stats.nr_slabs != 1 || stats.nr_buffers != pool.buffers_per_slab) {
+        return 3;
+    }
+    zn_buffer_pool_destroy(&pool);
+    return 0;
+}
+
+/**
+ * @brief Buffers held at the same time never overlap, across several slabs
+ * @return 0 on success, non-zero on failure.
+ */
+int test_distinct(bool hugepages) {
+    struct zn_buffer_pool pool;
+    zn_buffer_pool_init(&pool, BUFFER_SIZE, hugepages);
+
+    uint32_t count = (pool.buffers_per_slab * 3) + 1;
+    unsigned char **buffers = g_new(unsigned char *, count);
+    for (uint32_t i = 0; i < count; i++) {
+        buffers[i] = zn_buffer_get(&pool);
+        memset(buffers[i], (int) i, BUFFER_SIZE);
+    }
+
+    int ret = 0;
+    for (uint32_t i = 0; i < count && ret == 0; i++) {
+        for (size_t b = 0; b < BUFFER_SIZE; b++) {
+            if (buffers[i][b] != (unsigned char) i) {
+                ret = 1;
+                break;
+            }
+        }
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        zn_buffer_put(&pool, buffers[i]);
+    }
+
+    struct zn_buffer_pool_stats stats;
+    zn_buffer_pool_get_stats(&pool, &stats);
+    if (ret == 0 && stats.nr_slabs != 4) {
+        ret = 2;
+    }
+    g_free(buffers);
+    zn_buffer_pool_destroy(&pool);
+    return ret;
+}
+
+/**
+ * @brief Buffers come in doubling size classes up to the pool's buffer size, and a buffer put
+ * back without its size is handed out again for its own class
+ * @return 0 on success, non-zero on failure.
+ */
+int test_classes() {
+    struct zn_buffer_pool pool;
+    zn_buffer_pool_init(&pool, 3 * BUFFER_SIZE, false);
+    if (pool.nr_classes != 7) {
+        return 1;
+    }
+
+    int ret = 0;
+    size_t sizes[] = {1, ZN_DIRECT_ALIGNMENT, ZN_DIRECT_ALIGNMENT + 1, BUFFER_SIZE,
+                      BUFFER_SIZE + 1, 3 * BUFFER_SIZE};
+    size_t expected[] = {ZN_DIRECT_ALIGNMENT, ZN_DIRECT_ALIGNMENT, 2 * ZN_DIRECT_ALIGNMENT,
+                         BUFFER_SIZE, 2 * BUFFER_SIZE, 3 * BUFFER_SIZE};
+    unsigned char *buffers[G_N_ELEMENTS(sizes)];
+    for (size_t i = 0; i < G_N_ELEMENTS(sizes) && ret == 0; i++) {
+        buffers[i] = zn_buffer_get_size(&pool, sizes[i]);
+        if (((uintptr_t) buffers[i] % ZN_DIRECT_ALIGNMENT) != 0 ||
+            zn_buffer_size(&pool, buffers[i]) != expected[i]) {
+            ret = 2;
+        }
+        memset(buffers[i], (int) i, expected[i]);
+    }
+    for (size_t i = 0; i < G_N_ELEMENTS(sizes) && ret == 0; i++) {
+        unsigned char tag = (unsigned char) i;
+        if (buffers[i][0] != tag || buffers[i][expected[i] - 1] != tag) {
+            ret = 3;
+        }
+    }
+
+    // The last buffer put of a class is the next one taken, while the thread cache has room
+    zn_buffer_put(&pool, buffers[4]);
+    zn_buffer_put(&pool, buffers[5]);
+    if (ret == 0 && (zn_buffer_get_size(&pool, 2 * BUFFER_SIZE) != buffers[4] ||
+                     zn_buffer_get(&pool) != buffers[5])) {
+        ret = 4;
+    }
+
+    zn_buffer_pool_destroy(&pool);
+    return ret;
+}
+
+/** Shared state of the concurrent test */
+struct pool_state {
+    struct zn_buffer_pool pool;
+    GAsyncQueue *handoff; /**< Buffers taken by one thread and returned by another */
+    gint failures;
+};
+
+static gpointer
+pool_thread(gpointer user_data) {
+    struct pool_state *state = user_data;
+    unsigned char tag = (unsigned char) GPOINTER_TO_UINT(g_thread_self());
+    unsigned char *held[HELD_BUFFERS];
+
+    for (uint32_t r = 0; r < ROUNDS; r++) {
+        for (uint32_t i = 0; i < HELD_BUFFERS; i++) {
+            held[i] = zn_buffer_get(&state->pool);
+            memset(held[i], tag, BUFFER_SIZE);
+        }
+        g_thread_yield();
+        for (uint32_t i = 0; i < HELD_BUFFERS; i++) {
+            if (held[i][0] != tag || held[i][BUFFER_SIZE - 1] != tag) {
+                g_atomic_int_inc(&state->failures);
+            }
+        }
+
+        // Hand one buffer to whichever thread comes next, return one handed over by another
+        g_async_queue_push(state->handoff, held[0]);
+        zn_buffer_put(&state->pool, g_async_queue_pop(state->handoff));
+        for (uint32_t i = 1; i < HELD_BUFFERS; i++) {
+            zn_buffer_put(&state->pool, held[i]);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Threads taking and returning buffers, some of them taken by other threads, never
+ * share a buffer, and the pool does not grow without bound.
+ * @return 0 on success, non-zero on failure.
+ */
+int test_concurrent() {
+    struct pool_state state = {0};
+    zn_buffer_pool_init(&state.pool, BUFFER_SIZE, false);
+    state.handoff = g_async_queue_new();
+
+    GThread *threads[NR_THREADS];
+    for (uint32_t t = 0; t < NR_THREADS; t++) {
+        threads[t] = g_thread_new("pool", pool_thread, &state);
+    }
+    for (uint32_t t = 0; t < NR_THREADS; t++) {
+        g_thread_join(threads[t]);
+    }
+
+    int ret = 0;
+    struct zn_buffer_pool_stats stats;
+    zn_buffer_pool_get_stats(&state.pool, &stats);
+    uint64_t bound =
+        NR_THREADS * (uint64_t) (ZN_BUFFER_THREAD_CACHE + HELD_BUFFERS + state.pool.buffers_per_slab);
+    if (state.failures != 0) {
+        ret = 1;
+    } else if (stats.nr_buffers > bound) {
+        ret = 2;
+    }
+
+    g_async_queue_unref(state.handoff);
+    zn_buffer_pool_destroy(&state.pool);
+    return ret;
+}
+
+/** Shared state of the destroy test */
+struct linger_state {
+    struct zn_buffer_pool *pool;
+    GMutex lock;
+    GCond cond;
+    bool used;
+    bool destroyed;
+};
+
+static gpointer
+linger_thread(gpointer user_data) {
+    struct linger_state *state = user_data;
+    zn_buffer_put(state->pool, zn_buffer_get(state->pool));
+
+    g_mutex_lock(&state->lock);
+    state->used = true;
+    g_cond_signal(&state->cond);
+    while (!state->destroyed) {
+        g_cond_wait(&state->cond, &state->lock);
+    }
+    g_mutex_unlock(&state->lock);
+
+    // Exits with buffers in its cache after the pool is gone
+    return NULL;
+}
+
+/**
+ * @brief A pool can be destroyed while a thread that used it is still running
+ * @return 0 on success, non-zero on failure.
+ */
+int test_destroy_with_live_thread() {
+    struct zn_buffer_pool pool;
+    zn_buffer_pool_init(&pool, BUFFER_SIZE, false);
+
+    struct linger_state state = {.pool = &pool};
+    g_mutex_init(&state.lock);
+    g_cond_init(&state.cond);
+    GThread *thread = g_thread_new("linger", linger_thread, &state);
+
+    g_mutex_lock(&state.lock);
+    while (!state.used) {
+        g_cond_wait(&state.cond, &state.lock);
+    }
+    zn_buffer_pool_destroy(&pool);
+    state.destroyed = true;
+    g_cond_signal(&state.cond);
+    g_mutex_unlock(&state.lock);
+    g_thread_join(thread);
+
+    // The main thread can use a new pool afterwards
+    zn_buffer_pool_init(&pool, BUFFER_SIZE, false);
+    unsigned char *buffer = zn_buffer_get(&pool);
+    memset(buffer, 0, BUFFER_SIZE);
+    zn_buffer_put(&pool, buffer);
+    zn_buffer_pool_destroy(&pool);
+
+    g_mutex_clear(&state.lock);
+    g_cond_clear(&state.cond);
+    return 0;
+}
+
+/**
+ * @brief Runs all test cases and prints the results.
+ */
+int main() {
+    int failures = 0;
+
+    if (test_reuse() != 0) {
+        printf("Test FAILED: test_reuse()\n");
+        failures++;
+    } else {
+        printf("Test PASSED: test_reuse()\n");
+    }
+
+    if (test_classes() != 0) {
+        printf("Test FAILED: test_classes()\n");
+        failures++;
+    } else {
+        printf("Test PASSED: test_classes()\n");
+    }
+
+    for (int hugepages = 0; hugepages <= 1; hugepages++) {
+        if (test_distinct(hugepages) != 0) {
+            printf("Test FAILED: test_distinct(%d)\n", hugepages);
+            failures++;
+        } else {
+            printf("Test PASSED: test_distinct(%d)\n", hugepages);
+        }
+    }
+
+    if (test_concurrent() != 0) {
+        printf("Test FAILED: test_concurrent()\n");
+        failures++;
+    } else {
+        printf("Test PASSED: test_concurrent()\n");
+    }
+
+    if (test_destroy_with_live_thread() != 0) {
+        printf("Test FAILED: test_destroy_with_live_thread()\n");
+        failures++;
+    } else {
+        printf("Test PASSED: test_destroy_with_live_thread()\n");
+    }
+
+    return failures;
+}
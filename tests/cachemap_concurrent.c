@@ -0,0 +1,729 @@
+#include <assert.h>
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cachemap.h"
+
+/*
+ * Stress tests for the lock-free hit path of the cache map. Readers hit keys while an
+ * evictor clears zones and a writer grows the index, and check that every location they
+ * are handed stays valid for as long as they hold the zone's reader count. Misses coalesce
+ * on the writer, and are served its data when it publishes some.
+ */
+
+#define NR_ZONES 8
+#define NR_KEYS 4096
+#define KEYS_PER_ZONE (NR_KEYS / NR_ZONES)
+#define NR_READERS 4
+#define NR_EVICTIONS 2000
+#define NR_GROWTH_KEYS (1u << 18)
+#define NR_FIRST_INSERTS (1u << 17)
+
+/** Shared state of one test run */
+struct stress_state {
+    struct zn_cachemap map;
+    gint active_readers[NR_ZONES];
+    gint zone_epoch[NR_ZONES];    /**< Bumped each time a zone is evicted and reset */
+    gint zone_evicting[NR_ZONES]; /**< Set while the evictor owns a zone */
+    gint zone_writers[NR_ZONES];  /**< Writers currently inserting into a zone */
+    gint fresh_id; /**< ID first_insert_thread() is inserting for the first time */
+    gint stop;
+    gint failures;
+    gint hits;
+};
+
+struct reader_args {
+    struct stress_state *state;
+    uint32_t seed;
+};
+
+/** @brief Chunk an ID is written to in a zone epoch, unique within the zone */
+static uint32_t
+expected_chunk(uint32_t id, gint epoch) {
+    return (id / NR_ZONES) + ((uint32_t) epoch * KEYS_PER_ZONE);
+}
+
+/**
+ * @brief Inserts `id` into its zone, waiting while the zone is being evicted.
+ * Mirrors the cache: writes never go to a zone that is being evicted.
+ */
+static void
+write_entry(struct stress_state *state, uint32_t id) {
+    uint32_t zone = id % NR_ZONES;
+    while (true) {
+        g_atomic_int_inc(&state->zone_writers[zone]);
+        if (!g_atomic_int_get(&state->zone_evicting[zone])) {
+            break;
+        }
+        g_atomic_int_dec_and_test(&state->zone_writers[zone]);
+        g_thread_yield();
+    }
+
+    gint epoch = g_atomic_int_get(&state->zone_epoch[zone]);
+    struct zn_pair location = {
+        .zone = zone, .chunk_offset = expected_chunk(id, epoch), .nr_chunks = 1, .id = id,
+        .in_use = true};
+    zn_cachemap_insert(&state->map, id, location);
+
+    g_atomic_int_dec_and_test(&state->zone_writers[zone]);
+}
+
+static gpointer
+reader_thread(gpointer user_data) {
+    struct reader_args *args = user_data;
+    struct stress_state *state = args->state;
+    uint32_t x = args->seed;
+
+    while (!g_atomic_int_get(&state->stop)) {
+        // xorshift32
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        uint32_t id = x % NR_KEYS;
+        uint32_t zone = id % NR_ZONES;
+
+        struct zone_map_result res = zn_cachemap_find(&state->map, id);
+        if (res.type == RESULT_COND) {
+            write_entry(state, id);
+            continue;
+        }
+        if (res.type != RESULT_LOC) {
+            g_atomic_int_inc(&state->failures);
+            continue;
+        }
+
+        // The location must be current, and must stay current while the reader count is held
+        gint epoch = g_atomic_int_get(&state->zone_epoch[zone]);
+        if (res.location.zone != zone || res.location.chunk_offset != expected_chunk(id, epoch)) {
+            g_atomic_int_inc(&state->failures);
+        }
+        g_thread_yield();
+        if (g_atomic_int_get(&state->zone_epoch[zone]) != epoch) {
+            g_atomic_int_inc(&state->failures);
+        }
+
+        g_atomic_int_dec_and_test(&state->active_readers[res.location.zone]);
+        g_atomic_int_inc(&state->hits);
+    }
+
+    return NULL;
+}
+
+static gpointer
+evictor_thread(gpointer user_data) {
+    struct stress_state *state = user_data;
+
+    for (uint32_t round = 0; round < NR_EVICTIONS; round++) {
+        uint32_t zone = round % NR_ZONES;
+
+        g_atomic_int_set(&state->zone_evicting[zone], 1);
+        while (g_atomic_int_get(&state->zone_writers[zone]) > 0) {
+            g_thread_yield();
+        }
+
+        // Same protocol as zn_fg_evict
+        zn_cachemap_clear_zone(&state->map, zone);
+        while (g_atomic_int_get(&state->active_readers[zone]) > 0) {
+            g_thread_yield();
+        }
+
+        g_atomic_int_inc(&state->zone_epoch[zone]);
+        g_atomic_int_set(&state->zone_evicting[zone], 0);
+    }
+
+    return NULL;
+}
+
+static gpointer
+growth_thread(gpointer user_data) {
+    struct stress_state *state = user_data;
+
+    // Keys outside the readers' range, forcing every shard's index to rehash several times
+    for (uint32_t i = 0; i < NR_GROWTH_KEYS; i++) {
+        uint32_t id = NR_KEYS + i;
+        struct zone_map_result res = zn_cachemap_find(&state->map, id);
+        if (res.type != RESULT_COND) {
+            g_atomic_int_inc(&state->failures);
+            continue;
+        }
+        struct zn_pair location = {
+            .zone = id % NR_ZONES, .chunk_offset = KEYS_PER_ZONE + (i / NR_ZONES), .nr_chunks = 1,
+            .id = id, .in_use = true};
+        zn_cachemap_insert(&state->map, id, location);
+    }
+
+    return NULL;
+}
+
+static void
+stress_init(struct stress_state *state, uint32_t nr_shards) {
+    *state = (struct stress_state) {0};
+    zn_cachemap_init(&state->map, NR_ZONES, state->active_readers, nr_shards);
+    for (uint32_t id = 0; id < NR_KEYS; id++) {
+        struct zone_map_result res = zn_cachemap_find(&state->map, id);
+        assert(res.type == RESULT_COND);
+        (void) res;
+        write_entry(state, id);
+    }
+}
+
+/**
+ * @brief Runs readers alongside `worker`, stopping them once it finishes.
+ * @return 0 on success, non-zero on failure.
+ */
+static int
+stress_run(struct stress_state *state, GThreadFunc worker) {
+    GThread *readers[NR_READERS];
+    struct reader_args args[NR_READERS];
+    for (uint32_t t = 0; t < NR_READERS; t++) {
+        args[t] = (struct reader_args) {.state = state, .seed = 2463534242u + (t * 7919u)};
+        readers[t] = g_thread_new("reader", reader_thread, &args[t]);
+    }
+
+    g_thread_join(g_thread_new("worker", worker, state));
+    g_atomic_int_set(&state->stop, 1);
+    for (uint32_t t = 0; t < NR_READERS; t++) {
+        g_thread_join(readers[t]);
+    }
+
+    int ret = 0;
+    if (g_atomic_int_get(&state->failures) != 0) {
+        printf("  %d stale or invalid lookups\n", g_atomic_int_get(&state->failures));
+        ret = 1;
+    } else if (g_atomic_int_get(&state->hits) == 0) {
+        ret = 2;
+    }
+    for (uint32_t z = 0; z < NR_ZONES && ret == 0; z++) {
+        if (state->active_readers[z] != 0) {
+            ret = 3;
+        }
+    }
+
+    zn_cachemap_destroy(&state->map);
+    return ret;
+}
+
+/**
+ * @brief Clearing a zone turns exactly its entries into misses, and they can be rewritten.
+ * @return 0 on success, non-zero on failure.
+ */
+int test_clear_zone_generation(uint32_t nr_shards) {
+    struct stress_state state;
+    stress_init(&state, nr_shards);
+
+    zn_cachemap_clear_zone(&state.map, 3);
+    state.zone_epoch[3] = 1;
+
+    int ret = 0;
+    for (uint32_t id = 0; id < NR_KEYS && ret == 0; id++) {
+        struct zone_map_result res = zn_cachemap_find(&state.map, id);
+        if (id % NR_ZONES == 3) {
+            if (res.type != RESULT_COND) {
+                ret = 1;
+                break;
+            }
+            write_entry(&state, id);
+        } else if (res.type != RESULT_LOC || res.location.chunk_offset != expected_chunk(id, 0)) {
+            ret = 2;
+        } else {
+            g_atomic_int_dec_and_test(&state.active_readers[res.location.zone]);
+        }
+    }
+
+    // Rewritten entries carry the new generation
+    for (uint32_t id = 3; id < NR_KEYS && ret == 0; id += NR_ZONES) {
+        struct zone_map_result res = zn_cachemap_find(&state.map, id);
+        if (res.type != RESULT_LOC || res.location.chunk_offset != expected_chunk(id, 1)) {
+            ret = 3;
+            break;
+        }
+        g_atomic_int_dec_and_test(&state.active_readers[3]);
+    }
+
+    zn_cachemap_destroy(&state.map);
+    return ret;
+}
+
+struct miss_args {
+    struct stress_state *state;
+    uint32_t id;
+    gint *writers;
+};
+
+static gpointer
+miss_thread(gpointer user_data) {
+    struct miss_args *args = user_data;
+    struct stress_state *state = args->state;
+
+    struct zone_map_result res = zn_cachemap_find(&state->map, args->id);
+    if (res.type == RESULT_COND) {
+        // The first writer fails, a waiter has to take over
+        if (g_atomic_int_add(args->writers, 1) == 0) {
+            g_usleep(1000);
+            zn_cachemap_fail(&state->map, args->id);
+        } else {
+            write_entry(state, args->id);
+        }
+        return NULL;
+    }
+    if (res.type != RESULT_LOC || res.location.chunk_offset != expected_chunk(args->id, 0)) {
+        g_atomic_int_inc(&state->failures);
+    } else {
+        g_atomic_int_dec_and_test(&state->active_readers[res.location.zone]);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Threads missing on the same ID wait for one writer, and one of them takes over if
+ * that write fails.
+ * @return 0 on success, non-zero on failure.
+ */
+int test_coalesced_miss(uint32_t nr_shards) {
+    struct stress_state state = {0};
+    zn_cachemap_init(&state.map, NR_ZONES, state.active_readers, nr_shards);
+
+    gint writers = 0;
+    GThread *threads[NR_READERS * 2];
+    struct miss_args args = {.state = &state, .id = 42, .writers = &writers};
+    for (uint32_t t = 0; t < G_N_ELEMENTS(threads); t++) {
+        threads[t] = g_thread_new("miss", miss_thread, &args);
+    }
+    for (uint32_t t = 0; t < G_N_ELEMENTS(threads); t++) {
+        g_thread_join(threads[t]);
+    }
+
+    int ret = 0;
+    if (state.failures != 0) {
+        ret = 1;
+    } else if (writers != 2) {
+        ret = 2;
+    }
+
+    struct zone_map_result res = zn_cachemap_find(&state.map, 42);
+    if (ret == 0 && res.type != RESULT_LOC) {
+        ret = 3;
+    }
+
+    zn_cachemap_destroy(&state.map);
+    return ret;
+}
+
+#define DATA_SIZE 8192
+
+struct data_waiter_args {
+    struct stress_state *state;
+    gint started;
+    gint served;
+};
+
+static gpointer
+data_waiter_thread(gpointer user_data) {
+    struct data_waiter_args *args = user_data;
+    struct stress_state *state = args->state;
+
+    g_atomic_int_inc(&args->started);
+    struct zone_map_result res = zn_cachemap_find(&state->map, 42);
+    if (res.type == RESULT_DATA) {
+        for (uint32_t i = 0; i < DATA_SIZE; i++) {
+            if (res.data[i] != (unsigned char) i) {
+                g_atomic_int_inc(&state->failures);
+                break;
+            }
+        }
+        free(res.data);
+        g_atomic_int_inc(&args->served);
+    } else if (res.type == RESULT_LOC) {
+        g_atomic_int_dec_and_test(&state->active_readers[res.location.zone]);
+    } else {
+        g_atomic_int_inc(&state->failures);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Threads waiting for a write are handed copies of the writer's buffer.
+ * @return 0 on success, non-zero on failure.
+ */
+int test_coalesced_miss_data(uint32_t nr_shards) {
+    struct stress_state state = {0};
+    zn_cachemap_init(&state.map, NR_ZONES, state.active_readers, nr_shards);
+
+    struct zone_map_result res = zn_cachemap_find(&state.map, 42);
+    if (res.type != RESULT_COND) {
+        return 1;
+    }
+
+    struct data_waiter_args args = {.state = &state, .started = 0, .served = 0};
+    GThread *threads[NR_READERS * 2];
+    for (uint32_t t = 0; t < G_N_ELEMENTS(threads); t++) {
+        threads[t] = g_thread_new("data-waiter", data_waiter_thread, &args);
+    }
+
+    // Give the waiters time to go to sleep on the entry
+    while (g_atomic_int_get(&args.started) < (gint) G_N_ELEMENTS(threads)) {
+        g_thread_yield();
+    }
+    g_usleep(10000);
+
+    unsigned char *data = malloc(DATA_SIZE);
+    for (uint32_t i = 0; i < DATA_SIZE; i++) {
+        data[i] = (unsigned char) i;
+    }
+    struct zn_pair location = {.zone = 1, .chunk_offset = 2, .nr_chunks = 1, .id = 42, .in_use = true};
+    zn_cachemap_insert_data(&state.map, 42, location, data, DATA_SIZE);
+    // The writer keeps ownership of its buffer
+    free(data);
+
+    for (uint32_t t = 0; t < G_N_ELEMENTS(threads); t++) {
+        g_thread_join(threads[t]);
+    }
+
+    int ret = 0;
+    if (state.failures != 0) {
+        ret = 2;
+    } else if (args.served == 0) {
+        ret = 3;
+    } else if (state.active_readers[1] != 0) {
+        ret = 4;
+    }
+
+    zn_cachemap_destroy(&state.map);
+    return ret;
+}
+
+/**
+ * @brief While a write is behind, lookups are served from the pending data without waiting
+ * for the insert, both by threads that were already asleep and by ones that come later.
+ * Once the write fails the next lookup is a miss again.
+ * @return 0 on success, non-zero on failure.
+ */
+int test_pending_data(uint32_t nr_shards) {
+    struct stress_state state = {0};
+    zn_cachemap_init(&state.map, NR_ZONES, state.active_readers, nr_shards);
+
+    struct zone_map_result res = zn_cachemap_find(&state.map, 42);
+    if (res.type != RESULT_COND) {
+        return 1;
+    }
+
+    struct data_waiter_args args = {.state = &state, .started = 0, .served = 0};
+    GThread *threads[NR_READERS * 2];
+    for (uint32_t t = 0; t < NR_READERS; t++) {
+        threads[t] = g_thread_new("data-waiter", data_waiter_thread, &args);
+    }
+    while (g_atomic_int_get(&args.started) < NR_READERS) {
+        g_thread_yield();
+    }
+    g_usleep(10000);
+
+    // Owned by the map once published
+    unsigned char *data = malloc(DATA_SIZE);
+    for (uint32_t i = 0; i < DATA_SIZE; i++) {
+        data[i] = (unsigned char) i;
+    }
+    zn_cachemap_publish_pending(&state.map, 42, data, DATA_SIZE);
+
+    for (uint32_t t = NR_READERS; t < G_N_ELEMENTS(threads); t++) {
+        threads[t] = g_thread_new("data-waiter", data_waiter_thread, &args);
+    }
+    // Nothing is inserted until every lookup returned
+    for (uint32_t t = 0; t < G_N_ELEMENTS(threads); t++) {
+        g_thread_join(threads[t]);
+    }
+
+    int ret = 0;
+    if (state.failures != 0) {
+        ret = 2;
+    } else if (args.served != (gint) G_N_ELEMENTS(threads)) {
+        ret = 3;
+    }
+
+    struct zn_pair location = {.zone = 1, .chunk_offset = 2, .nr_chunks = 5, .id = 42, .in_use = true};
+    zn_cachemap_insert(&state.map, 42, location);
+    res = zn_cachemap_find(&state.map, 42);
+    if (ret == 0 && (res.type != RESULT_LOC || res.location.chunk_offset != 2 ||
+                     res.location.nr_chunks != 5)) {
+        ret = 4;
+    }
+    if (res.type == RESULT_LOC) {
+        g_atomic_int_dec_and_test(&state.active_readers[res.location.zone]);
+    }
+
+    res = zn_cachemap_find(&state.map, 43);
+    data = malloc(DATA_SIZE);
+    zn_cachemap_publish_pending(&state.map, 43, data, DATA_SIZE);
+    zn_cachemap_fail(&state.map, 43);
+    res = zn_cachemap_find(&state.map, 43);
+    if (ret == 0 && res.type != RESULT_COND) {
+        ret = 5;
+    }
+
+    zn_cachemap_destroy(&state.map);
+    return ret;
+}
+
+/**
+ * @brief Entries of evicted zones that are never looked up again must not accumulate.
+ * @return 0 on success, non-zero on failure.
+ */
+int test_stale_entries_reclaimed(uint32_t nr_shards) {
+    struct stress_state state;
+    stress_init(&state, nr_shards);
+
+    // Cache many times as many distinct IDs as fit, evicting each zone before it is reused
+    uint32_t rounds = 40;
+    for (uint32_t round = 1; round <= rounds; round++) {
+        for (uint32_t zone = 0; zone < NR_ZONES; zone++) {
+            zn_cachemap_clear_zone(&state.map, zone);
+            state.zone_epoch[zone] = round;
+        }
+        for (uint32_t i = 0; i < NR_KEYS; i++) {
+            uint32_t id = (round * NR_KEYS) + i;
+            struct zone_map_result res = zn_cachemap_find(&state.map, id);
+            if (res.type != RESULT_COND) {
+                return 1;
+            }
+            write_entry(&state, id);
+        }
+    }
+
+    struct zn_cachemap_stats stats;
+    zn_cachemap_get_stats(&state.map, &stats);
+
+    int ret = 0;
+    if (stats.nr_keys != NR_KEYS) {
+        ret = 2;
+    } else if (stats.nr_entries > ((rounds + 1) * NR_KEYS) / 4) {
+        ret = 3;
+    }
+
+    zn_cachemap_destroy(&state.map);
+    return ret;
+}
+
+/**
+ * @brief Hits racing zn_cachemap_clear_zone must never see an evicted location.
+ * @return 0 on success, non-zero on failure.
+ */
+int test_hits_during_clear_zone(uint32_t nr_shards) {
+    struct stress_state state;
+    stress_init(&state, nr_shards);
+    return stress_run(&state, evictor_thread);
+}
+
+/**
+ * @brief Hits racing index growth must keep finding their keys while tables are replaced.
+ * @return 0 on success, non-zero on failure.
+ */
+int test_hits_during_growth(uint32_t nr_shards) {
+    struct stress_state state;
+    stress_init(&state, nr_shards);
+    return stress_run(&state, growth_thread);
+}
+
+/**
+ * @brief Entries of a zone stay stale after its generation wraps around the bits they store.
+ * @return 0 on success, non-zero on failure.
+ */
+int test_generation_wrap(uint32_t nr_shards) {
+    struct stress_state state;
+    stress_init(&state, nr_shards);
+
+    // Entries store 16 bits of the generation
+    for (uint32_t i = 0; i < (1u << 16); i++) {
+        zn_cachemap_clear_zone(&state.map, 3);
+    }
+
+    int ret = 0;
+    for (uint32_t id = 3; id < NR_KEYS && ret == 0; id += NR_ZONES) {
+        struct zone_map_result res = zn_cachemap_find(&state.map, id);
+        if (res.type != RESULT_COND) {
+            ret = 1;
+        }
+    }
+
+    zn_cachemap_destroy(&state.map);
+    return ret;
+}
+
+/**
+ * @brief Writes the location of a new ID into zone 1, which is never evicted
+ */
+static void
+write_fresh_entry(struct stress_state *state, uint32_t id) {
+    struct zn_pair location = {
+        .zone = 1, .chunk_offset = id % KEYS_PER_ZONE, .nr_chunks = 1, .id = id, .in_use = true};
+    zn_cachemap_insert(&state->map, id, location);
+}
+
+static gpointer
+fresh_reader_thread(gpointer user_data) {
+    struct reader_args *args = user_data;
+    struct stress_state *state = args->state;
+    uint32_t x = args->seed;
+
+    while (!g_atomic_int_get(&state->stop)) {
+        // xorshift32, mostly the ID being inserted and otherwise the ones just before it
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        uint32_t id = (uint32_t) g_atomic_int_get(&state->fresh_id) - (x % 8 < 6 ? 0 : x % 4);
+
+        struct zone_map_result res = zn_cachemap_find(&state->map, id);
+        if (res.type == RESULT_COND) {
+            write_fresh_entry(state, id);
+            continue;
+        }
+        if (res.type != RESULT_LOC) {
+            g_atomic_int_inc(&state->failures);
+            continue;
+        }
+        // Zone 0 is never written, and its generation never moves
+        if (res.location.zone != 1 || res.location.chunk_offset != id % KEYS_PER_ZONE) {
+            g_atomic_int_inc(&state->failures);
+        }
+        g_atomic_int_dec_and_test(&state->active_readers[res.location.zone]);
+        g_atomic_int_inc(&state->hits);
+    }
+
+    return NULL;
+}
+
+static gpointer
+first_insert_thread(gpointer user_data) {
+    struct stress_state *state = user_data;
+
+    for (uint32_t i = 0; i < NR_FIRST_INSERTS; i++) {
+        // Readers also look up the IDs just before, past the ones stress_init() wrote
+        uint32_t id = NR_KEYS + 4 + i;
+        g_atomic_int_set(&state->fresh_id, (gint) id);
+        struct zone_map_result res = zn_cachemap_find(&state->map, id);
+        if (res.type == RESULT_LOC) {
+            // A reader inserted it first
+            g_atomic_int_dec_and_test(&state->active_readers[res.location.zone]);
+        } else if (res.type != RESULT_COND) {
+            g_atomic_int_inc(&state->failures);
+        } else if (i % 4 == 0) {
+            // Erased, so its slot is reused by a later ID
+            zn_cachemap_fail(&state->map, id);
+        } else {
+            write_fresh_entry(state, id);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Lock-free lookups racing the first insert of an ID never see the new entry as a
+ * location. Zone 0 is never evicted, so a new entry read as zone 0 would pass validation.
+ * @return 0 on success, non-zero on failure.
+ */
+int test_first_inserts(uint32_t nr_shards) {
+    struct stress_state state;
+    stress_init(&state, nr_shards);
+    g_atomic_int_set(&state.fresh_id, NR_KEYS + 4);
+
+    GThread *readers[NR_READERS];
+    struct reader_args args[NR_READERS];
+    for (uint32_t t = 0; t < NR_READERS; t++) {
+        args[t] = (struct reader_args) {.state = &state, .seed = 2463534242u + (t * 7919u)};
+        readers[t] = g_thread_new("reader", fresh_reader_thread, &args[t]);
+    }
+    g_thread_join(g_thread_new("worker", first_insert_thread, &state));
+    g_atomic_int_set(&state.stop, 1);
+    for (uint32_t t = 0; t < NR_READERS; t++) {
+        g_thread_join(readers[t]);
+    }
+
+    int ret = 0;
+    if (g_atomic_int_get(&state.failures) != 0) {
+        printf("  %d invalid lookups\n", g_atomic_int_get(&state.failures));
+        ret = 1;
+    }
+    for (uint32_t z = 0; z < NR_ZONES && ret == 0; z++) {
+        if (state.active_readers[z] != 0) {
+            ret = 2;
+        }
+    }
+
+    zn_cachemap_destroy(&state.map);
+    return ret;
+}
+
+/**
+ * @brief Runs all test cases and prints the results.
+ */
+int main() {
+    int failures = 0;
+    uint32_t shard_configs[] = {1, CACHEMAP_SHARDS};
+
+    for (uint32_t c = 0; c < G_N_ELEMENTS(shard_configs); c++) {
+        if (test_clear_zone_generation(shard_configs[c]) != 0) {
+            printf("Test FAILED: test_clear_zone_generation(%u)\n", shard_configs[c]);
+            failures++;
+        } else {
+            printf("Test PASSED: test_clear_zone_generation(%u)\n", shard_configs[c]);
+        }
+
+        if (test_generation_wrap(shard_configs[c]) != 0) {
+            printf("Test FAILED: test_generation_wrap(%u)\n", shard_configs[c]);
+            failures++;
+        } else {
+            printf("Test PASSED: test_generation_wrap(%u)\n", shard_configs[c]);
+        }
+
+        if (test_coalesced_miss(shard_configs[c]) != 0) {
+            printf("Test FAILED: test_coalesced_miss(%u)\n", shard_configs[c]);
+            failures++;
+        } else {
+            printf("Test PASSED: test_coalesced_miss(%u)\n", shard_configs[c]);
+        }
+
+        if (test_coalesced_miss_data(shard_configs[c]) != 0) {
+            printf("Test FAILED: test_coalesced_miss_data(%u)\n", shard_configs[c]);
+            failures++;
+        } else {
+            printf("Test PASSED: test_coalesced_miss_data(%u)\n", shard_configs[c]);
+        }
+
+        if (test_pending_data(shard_configs[c]) != 0) {
+            printf("Test FAILED: test_pending_data(%u)\n", shard_configs[c]);
+            failures++;
+        } else {
+            printf("Test PASSED: test_pending_data(%u)\n", shard_configs[c]);
+        }
+
+        if (test_stale_entries_reclaimed(shard_configs[c]) != 0) {
+            printf("Test FAILED: test_stale_entries_reclaimed(%u)\n", shard_configs[c]);
+            failures++;
+        } else {
+            printf("Test PASSED: test_stale_entries_reclaimed(%u)\n", shard_configs[c]);
+        }
+
+        if (test_hits_during_clear_zone(shard_configs[c]) != 0) {
+            printf("Test FAILED: test_hits_during_clear_zone(%u)\n", shard_configs[c]);
+            failures++;
+        } else {
+            printf("Test PASSED: test_hits_during_clear_zone(%u)\n", shard_configs[c]);
+        }
+
+        if (test_hits_during_growth(shard_configs[c]) != 0) {
+            printf("Test FAILED: test_hits_during_growth(%u)\n", shard_configs[c]);
+            failures++;
+        } else {
+            printf("Test PASSED: test_hits_during_growth(%u)\n", shard_configs[c]);
+        }
+
+        if (test_first_inserts(shard_configs[c]) != 0) {
+            printf("Test FAILED: test_first_inserts(%u)\n", shard_configs[c]);
+            failures++;
+        } else {
+            printf("Test PASSED: test_first_inserts(%u)\n", shard_configs[c]);
+        }
+    }
+
+    return failures;
+}
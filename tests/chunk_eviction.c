@@ -3,6 +3,9 @@
 #include <libzbd/zbd.h>
 #include <stdbool.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <sys/ioctl.h>
 #include <linux/fs.h>
 
@@ -27,7 +30,7 @@ uint32_t workload[WORKLOAD_SZ] = {
 };
 
 int
-setup_dev(char *device, struct zn_cache *cfg) {
+setup_dev(char *device, struct zn_cache *cfg, enum zn_evict_policy_type policy) {
 
     struct zbd_info info = {0};
     uint64_t zone_capacity = 0;
@@ -75,19 +78,93 @@ setup_dev(char *device, struct zn_cache *cfg) {
     }
 
 	zn_init_cache(cfg, &info, CHUNK_SIZE, zone_capacity,
-              fd, ZN_EVICT_CHUNK, backend, workload,
-              WORKLOAD_SZ, NULL);
+              fd, policy, backend, workload,
+              WORKLOAD_SZ, NULL, ZN_IO_ENGINE_PSYNC);
 
     return 0;
 }
 
+struct fingerprint {
+    uint32_t fingerprint;
+    uint32_t n;
+};
+
+static int
+compare_fingerprints(const void *a, const void *b) {
+    const struct fingerprint *x = a, *y = b;
+    return (x->fingerprint > y->fingerprint) - (x->fingerprint < y->fingerprint);
+}
+
+/**
+ * @brief Two string keys sharing a fingerprint each get their own data, and are both cached
+ * @return Number of failures
+ */
+static int
+test_collision(struct zn_cache *cfg) {
+    // A 32-bit fingerprint repeats after about 2^16 keys
+    uint32_t nr_keys = 1 << 20;
+    struct fingerprint *fps = malloc(nr_keys * sizeof(*fps));
+    char buf[2][32];
+    for (uint32_t n = 0; n < nr_keys; n++) {
+        struct zn_key key;
+        int len = snprintf(buf[0], sizeof(buf[0]), "https://example.com/%u", n);
+        zn_key_init(&key, buf[0], (size_t) len);
+        fps[n] = (struct fingerprint) {.fingerprint = zn_key_fingerprint(&key), .n = n};
+    }
+    qsort(fps, nr_keys, sizeof(*fps), compare_fingerprints);
+    struct zn_key keys[2];
+    bool found = false;
+    for (uint32_t i = 1; i < nr_keys && !found; i++) {
+        if (fps[i].fingerprint == fps[i - 1].fingerprint) {
+            for (int k = 0; k < 2; k++) {
+                int len = snprintf(buf[k], sizeof(buf[k]), "https://example.com/%u", fps[i - k].n);
+                zn_key_init(&keys[k], buf[k], (size_t) len);
+            }
+            found = true;
+        }
+    }
+    free(fps);
+    if (!found) {
+        printf("TEST FAILED: No fingerprint collision among %u keys\n", nr_keys);
+        return 1;
+    }
+
+    // The first key holds the fingerprint, the second is cached under its next one
+    int failures = 0;
+    uint64_t collisions = cfg->ratio.collisions;
+    uint64_t hits = cfg->ratio.hits;
+    for (int round = 0; round < 2; round++) {
+        for (int k = 0; k < 2; k++) {
+            unsigned char *data = zn_cache_get(cfg, &keys[k], RANDOM_DATA);
+            if (data == NULL || zn_validate_read(cfg, data, &keys[k], RANDOM_DATA) != 0) {
+                printf("TEST FAILED: Wrong data for colliding key %d\n", k);
+                failures++;
+            }
+            zn_buffer_put(&cfg->buffers, data);
+        }
+    }
+    // Keys whose objects differ in size may go to different engines
+    if (!zn_small_cache_enabled(&cfg->small) && cfg->ratio.collisions - collisions != 2) {
+        printf("TEST FAILED: %" PRIu64 " collisions, expected 2\n",
+               cfg->ratio.collisions - collisions);
+        failures++;
+    }
+    if (cfg->ratio.hits - hits != 2) {
+        printf("TEST FAILED: %" PRIu64 " hits, expected 2\n", cfg->ratio.hits - hits);
+        failures++;
+    }
+    return failures;
+}
+
 int
 test_evict(struct zn_cache *cfg) {
     int failures = 0;
     for (uint32_t wi = 0; wi < WORKLOAD_SZ; wi++) {
         uint32_t data_id = workload[wi];
-        unsigned char *data = zn_cache_get(cfg, data_id, RANDOM_DATA);
-        if (data == NULL || zn_validate_read(cfg, data, data_id, RANDOM_DATA) != 0) {
+        struct zn_key key;
+        zn_key_init(&key, &data_id, sizeof(data_id));
+        unsigned char *data = zn_cache_get(cfg, &key, RANDOM_DATA);
+        if (data == NULL || zn_validate_read(cfg, data, &key, RANDOM_DATA) != 0) {
             printf("TEST FAILED: Wrong data returned for workload[%u]=%u\n", wi, workload[wi]);
             return 1;
         }
@@ -114,8 +191,10 @@ test_evict(struct zn_cache *cfg) {
 
     // First GC
     uint32_t data_id = 29;
-    unsigned char *data = zn_cache_get(cfg, data_id, RANDOM_DATA);
-    if (data == NULL || zn_validate_read(cfg, data, data_id, RANDOM_DATA) != 0) {
+    struct zn_key key;
+    zn_key_init(&key, &data_id, sizeof(data_id));
+    unsigned char *data = zn_cache_get(cfg, &key, RANDOM_DATA);
+    if (data == NULL || zn_validate_read(cfg, data, &key, RANDOM_DATA) != 0) {
         printf("TEST FAILED: Wrong data returned for id=%u\n", data_id);
         failures++;
     }
@@ -148,7 +227,33 @@ test_evict(struct zn_cache *cfg) {
 
     // Check correct data remains, should have evicted first
 
+    // The zero-copy variants return the same data
+    unsigned char *own;
+    if (posix_memalign((void **) &own, ZN_DIRECT_ALIGNMENT, cfg->max_object_sz) != 0) {
+        return failures + 1;
+    }
+    data_id = workload[WORKLOAD_SZ - 1];
+    zn_key_init(&key, &data_id, sizeof(data_id));
+    size_t object_sz = zn_cache_object_size(cfg, &key);
+    if (zn_cache_get_into(cfg, &key, RANDOM_DATA, own, object_sz) != 0 ||
+        zn_validate_read(cfg, own, &key, RANDOM_DATA) != 0) {
+        printf("TEST FAILED: Wrong data read into caller buffer for id=%u\n", data_id);
+        failures++;
+    }
+    if (zn_cache_get_into(cfg, &key, RANDOM_DATA, own, object_sz - 1) != -1) {
+        printf("TEST FAILED: Read into a buffer smaller than the object\n");
+        failures++;
+    }
+    free(own);
 
+    struct zn_cache_handle *handle = zn_cache_get_handle(cfg, &key, RANDOM_DATA);
+    if (handle == NULL || zn_validate_read(cfg, handle->data, &key, RANDOM_DATA) != 0) {
+        printf("TEST FAILED: Wrong data in handle for id=%u\n", data_id);
+        failures++;
+    }
+    zn_cache_handle_unref(handle);
+
+    failures += test_collision(cfg);
     return failures;
 }
 
@@ -156,27 +261,36 @@ test_evict(struct zn_cache *cfg) {
 int main(void) {
     int failures = 0;
 
-    RANDOM_DATA = generate_random_buffer(CHUNK_SIZE);
-    if (RANDOM_DATA == NULL) {
-        return 1;
-    }
+    // Without hits, CLOCK evicts in write order like LRU
+    enum zn_evict_policy_type policies[] = {ZN_EVICT_CHUNK, ZN_EVICT_CHUNK_CLOCK};
+    const char *policy_names[] = {"ZN_EVICT_CHUNK", "ZN_EVICT_CHUNK_CLOCK"};
 
-    struct zn_cache cfg[NUM_DEV];
-    for (int i = 0; i < NUM_DEV; i++) {
-        if (setup_dev(devices[i], &cfg[i]) != 0) {
-            fprintf(stderr, "Error: Couldn't setup device %s\n", devices[i]);
-            return 1;
+    for (size_t p = 0; p < sizeof(policies) / sizeof(policies[0]); p++) {
+        struct zn_cache cfg[NUM_DEV];
+        for (int i = 0; i < NUM_DEV; i++) {
+            if (setup_dev(devices[i], &cfg[i], policies[p]) != 0) {
+                fprintf(stderr, "Error: Couldn't setup device %s\n", devices[i]);
+                return 1;
+            }
+        }
+
+        if (RANDOM_DATA == NULL) {
+            RANDOM_DATA = generate_random_buffer(cfg[0].max_object_sz);
+            if (RANDOM_DATA == NULL) {
+                return 1;
+            }
         }
-    }
 
-    for (int i = 0; i < NUM_DEV; i++) {
-        int f = test_evict(&cfg[i]);
-        if (f == 0) {
-            printf("TESTs PASSED for %s\n", devices[i]);
-        } else {
-            printf("TESTs FAILED (%u) for %s\n", f, devices[i]);
+        for (int i = 0; i < NUM_DEV; i++) {
+            int f = test_evict(&cfg[i]);
+            if (f == 0) {
+                printf("TESTs PASSED for %s with %s\n", devices[i], policy_names[p]);
+            } else {
+                printf("TESTs FAILED (%u) for %s with %s\n", f, devices[i], policy_names[p]);
+            }
+            failures += f;
+            zn_destroy_cache(&cfg[i]);
         }
-        failures += f;
     }
 
     return failures;
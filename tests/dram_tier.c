@@ -0,0 +1,404 @@
+#include <assert.h>
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dramtier.h"
+#include "znbuf.h"
+
+/*
+ * Tests for the S3-FIFO DRAM tier. Entries hit while new have to outlive entries that were
+ * never hit, IDs that left recently have to come back into the main FIFO, and victims have
+ * to stay readable until they are released.
+ */
+
+#define CHUNK_SIZE 4096
+#define NR_ENTRIES 20 // One shard, with a small FIFO of 2 entries
+#define NR_THREADS 8
+#define ROUNDS 20000
+
+static void
+fill(unsigned char *data, uint32_t id) {
+    memset(data, (int) (id & 0xff), CHUNK_SIZE);
+    memcpy(data, &id, sizeof(id));
+}
+
+static bool
+check(const unsigned char *data, uint32_t id) {
+    uint32_t stored;
+    memcpy(&stored, data, sizeof(stored));
+    return stored == id && data[CHUNK_SIZE - 1] == (unsigned char) (id & 0xff);
+}
+
+/**
+ * @brief Insert `id`, releasing the victim right away
+ * @return The ID of the victim, or UINT32_MAX if nothing left
+ */
+static uint32_t
+insert(struct zn_dram_tier *tier, uint32_t id) {
+    unsigned char data[CHUNK_SIZE];
+    fill(data, id);
+
+    struct zn_dram_victim victim;
+    if (!zn_dram_tier_insert(tier, id, data, CHUNK_SIZE, &victim)) {
+        return UINT32_MAX;
+    }
+    uint32_t victim_id = victim.id;
+    zn_dram_tier_release(tier, &victim);
+    return victim_id;
+}
+
+static bool
+contains(struct zn_dram_tier *tier, uint32_t id) {
+    unsigned char data[CHUNK_SIZE];
+    size_t len;
+    return zn_dram_tier_get(tier, id, data, CHUNK_SIZE, &len) && len == CHUNK_SIZE &&
+           check(data, id);
+}
+
+/**
+ * @brief Hits return the inserted data, nothing leaves before the tier is full
+ * @return 0 on success, non-zero on failure.
+ */
+int test_hit() {
+    struct zn_buffer_pool pool;
+    zn_buffer_pool_init(&pool, CHUNK_SIZE, false);
+    struct zn_dram_tier tier;
+    zn_dram_tier_init(&tier, NR_ENTRIES * CHUNK_SIZE, CHUNK_SIZE, &pool);
+
+    int ret = 0;
+    if (tier.nr_shards != 1) {
+        ret = 1;
+    }
+    for (uint32_t id = 0; id < NR_ENTRIES && ret == 0; id++) {
+        if (insert(&tier, id) != UINT32_MAX) {
+            ret = 2;
+        }
+    }
+    // Inserting an ID that is held changes nothing
+    if (ret == 0 && insert(&tier, 3) != UINT32_MAX) {
+        ret = 3;
+    }
+    for (uint32_t id = 0; id < NR_ENTRIES && ret == 0; id++) {
+        if (!contains(&tier, id)) {
+            ret = 4;
+        }
+    }
+    if (ret == 0 && contains(&tier, NR_ENTRIES)) {
+        ret = 5;
+    }
+
+    struct zn_dram_tier_stats stats;
+    zn_dram_tier_get_stats(&tier, &stats);
+    if (ret == 0 && (stats.nr_entries != NR_ENTRIES || stats.hits != NR_ENTRIES ||
+                     stats.lookups != NR_ENTRIES + 1 || stats.evictions != 0)) {
+        ret = 6;
+    }
+
+    zn_dram_tier_destroy(&tier);
+    zn_buffer_pool_destroy(&pool);
+    return ret;
+}
+
+/**
+ * @brief Entries hit while in the small FIFO outlive a scan of one-hit IDs
+ * @return 0 on success, non-zero on failure.
+ */
+int test_scan_resistance() {
+    struct zn_buffer_pool pool;
+    zn_buffer_pool_init(&pool, CHUNK_SIZE, false);
+    struct zn_dram_tier tier;
+    zn_dram_tier_init(&tier, NR_ENTRIES * CHUNK_SIZE, CHUNK_SIZE, &pool);
+
+    for (uint32_t id = 0; id < NR_ENTRIES; id++) {
+        insert(&tier, id);
+    }
+    contains(&tier, 5);
+    contains(&tier, 6);
+
+    int ret = 0;
+    uint32_t expected = 0;
+    for (uint32_t id = NR_ENTRIES; id < NR_ENTRIES * 10 && ret == 0; id++) {
+        uint32_t victim = insert(&tier, id);
+        if (victim == 5 || victim == 6 || victim == UINT32_MAX) {
+            ret = 1;
+        }
+        // The rest of the first fill leaves in insertion order
+        if (expected < NR_ENTRIES && victim < NR_ENTRIES) {
+            if (expected == 5) {
+                expected = 7;
+            }
+            if (victim != expected++) {
+                ret = 2;
+            }
+        }
+    }
+    if (ret == 0 && (!contains(&tier, 5) || !contains(&tier, 6))) {
+        ret = 3;
+    }
+
+    zn_dram_tier_destroy(&tier);
+    zn_buffer_pool_destroy(&pool);
+    return ret;
+}
+
+/**
+ * @brief An ID inserted again soon after it left goes to the main FIFO
+ * @return 0 on success, non-zero on failure.
+ */
+int test_ghost() {
+    struct zn_buffer_pool pool;
+    zn_buffer_pool_init(&pool, CHUNK_SIZE, false);
+    struct zn_dram_tier tier;
+    zn_dram_tier_init(&tier, NR_ENTRIES * CHUNK_SIZE, CHUNK_SIZE, &pool);
+
+    int ret = 0;
+    for (uint32_t id = 0; id <= NR_ENTRIES; id++) {
+        insert(&tier, id);
+    }
+    if (contains(&tier, 0)) {
+        ret = 1;
+    }
+
+    // 0 is a ghost, 1000 was never seen
+    insert(&tier, 0);
+    insert(&tier, 1000);
+    for (uint32_t id = NR_ENTRIES + 1; id < NR_ENTRIES * 10 && ret == 0; id++) {
+        if (insert(&tier, id) == 0) {
+            ret = 2;
+        }
+    }
+    if (ret == 0 && !contains(&tier, 0)) {
+        ret = 3;
+    }
+    if (ret == 0 && contains(&tier, 1000)) {
+        ret = 4;
+    }
+
+    zn_dram_tier_destroy(&tier);
+    zn_buffer_pool_destroy(&pool);
+    return ret;
+}
+
+/**
+ * @brief A victim is served until it is released
+ * @return 0 on success, non-zero on failure.
+ */
+int test_victim() {
+    struct zn_buffer_pool pool;
+    zn_buffer_pool_init(&pool, CHUNK_SIZE, false);
+    struct zn_dram_tier tier;
+    zn_dram_tier_init(&tier, NR_ENTRIES * CHUNK_SIZE, CHUNK_SIZE, &pool);
+
+    for (uint32_t id = 0; id < NR_ENTRIES; id++) {
+        insert(&tier, id);
+    }
+
+    int ret = 0;
+    unsigned char data[CHUNK_SIZE];
+    fill(data, NR_ENTRIES);
+    struct zn_dram_victim victim;
+    if (!zn_dram_tier_insert(&tier, NR_ENTRIES, data, CHUNK_SIZE, &victim) || victim.id != 0 ||
+        victim.len != CHUNK_SIZE || !check(victim.data, 0)) {
+        ret = 1;
+    }
+    if (ret == 0 && !contains(&tier, 0)) {
+        ret = 2;
+    }
+    if (ret == 0) {
+        zn_dram_tier_release(&tier, &victim);
+        if (contains(&tier, 0)) {
+            ret = 3;
+        }
+    }
+
+    zn_dram_tier_destroy(&tier);
+    zn_buffer_pool_destroy(&pool);
+    return ret;
+}
+
+/**
+ * @brief Entries take the size class of their object, and a large one makes room by evicting
+ * several small ones, all handed out as victims of its insert
+ * @return 0 on success, non-zero on failure.
+ */
+int test_sizes() {
+    struct zn_buffer_pool pool;
+    zn_buffer_pool_init(&pool, 4 * CHUNK_SIZE, false);
+    struct zn_dram_tier tier;
+    zn_dram_tier_init(&tier, NR_ENTRIES * CHUNK_SIZE, CHUNK_SIZE, &pool);
+
+    for (uint32_t id = 0; id < NR_ENTRIES; id++) {
+        insert(&tier, id);
+    }
+
+    // Three chunks and a byte take a buffer of four chunks
+    int ret = 0;
+    size_t big_len = (3 * CHUNK_SIZE) + 1;
+    unsigned char *big = g_malloc(4 * CHUNK_SIZE);
+    memset(big, 0x5a, big_len);
+    struct zn_dram_victim victim;
+    uint32_t expected = 0;
+    if (zn_dram_tier_insert(&tier, NR_ENTRIES, big, big_len, &victim)) {
+        do {
+            if (victim.id != expected++ || !check(victim.data, victim.id)) {
+                ret = 1;
+            }
+        } while (zn_dram_tier_release(&tier, &victim));
+    }
+    if (ret == 0 && expected != 4) {
+        ret = 2;
+    }
+
+    // A destination that is too short only learns the length
+    size_t len = 0;
+    unsigned char *data = g_malloc0(4 * CHUNK_SIZE);
+    if (ret == 0 && (!zn_dram_tier_get(&tier, NR_ENTRIES, data, CHUNK_SIZE, &len) ||
+                     len != big_len || data[0] != 0)) {
+        ret = 3;
+    }
+    if (ret == 0 && (!zn_dram_tier_get(&tier, NR_ENTRIES, data, 4 * CHUNK_SIZE, &len) ||
+                     memcmp(data, big, big_len) != 0)) {
+        ret = 4;
+    }
+
+    struct zn_dram_tier_stats stats;
+    zn_dram_tier_get_stats(&tier, &stats);
+    if (ret == 0 && stats.nr_entries != NR_ENTRIES - 3) {
+        ret = 5;
+    }
+
+    g_free(big);
+    g_free(data);
+    zn_dram_tier_destroy(&tier);
+    zn_buffer_pool_destroy(&pool);
+    return ret;
+}
+
+struct concurrent_state {
+    struct zn_dram_tier *tier;
+    gint failures;
+    gint next_seed;
+};
+
+static uint32_t
+xorshift(uint32_t *state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+static gpointer
+concurrent_worker(gpointer user_data) {
+    struct concurrent_state *state = user_data;
+    uint32_t seed = (uint32_t) g_atomic_int_add(&state->next_seed, 1) * 2654435761u + 1;
+    unsigned char data[CHUNK_SIZE];
+
+    for (uint32_t i = 0; i < ROUNDS; i++) {
+        // A hot set that fits, and a cold tail that does not
+        uint32_t r = xorshift(&seed);
+        uint32_t id = (r & 1) == 0 ? (r >> 1) % 64 : (r >> 1) % 4096;
+        size_t len;
+        if (zn_dram_tier_get(state->tier, id, data, CHUNK_SIZE, &len)) {
+            if (len != CHUNK_SIZE || !check(data, id)) {
+                g_atomic_int_inc(&state->failures);
+            }
+            continue;
+        }
+
+        fill(data, id);
+        struct zn_dram_victim victim;
+        if (zn_dram_tier_insert(state->tier, id, data, CHUNK_SIZE, &victim)) {
+            if (!check(victim.data, victim.id)) {
+                g_atomic_int_inc(&state->failures);
+            }
+            zn_dram_tier_release(state->tier, &victim);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Threads getting and inserting overlapping IDs always read their own data
+ * @return 0 on success, non-zero on failure.
+ */
+int test_concurrent() {
+    struct zn_buffer_pool pool;
+    zn_buffer_pool_init(&pool, CHUNK_SIZE, false);
+    struct zn_dram_tier tier;
+    zn_dram_tier_init(&tier, 1024 * CHUNK_SIZE, CHUNK_SIZE, &pool);
+
+    struct concurrent_state state = {.tier = &tier, .failures = 0, .next_seed = 0};
+    GThread *threads[NR_THREADS];
+    for (int i = 0; i < NR_THREADS; i++) {
+        threads[i] = g_thread_new("dram_tier", concurrent_worker, &state);
+    }
+    for (int i = 0; i < NR_THREADS; i++) {
+        g_thread_join(threads[i]);
+    }
+
+    int ret = state.failures != 0;
+    struct zn_dram_tier_stats stats;
+    zn_dram_tier_get_stats(&tier, &stats);
+    if (ret == 0 && (stats.nr_entries > 1024 || stats.hits == 0 || stats.evictions == 0)) {
+        ret = 2;
+    }
+
+    zn_dram_tier_destroy(&tier);
+    zn_buffer_pool_destroy(&pool);
+    return ret;
+}
+
+/**
+ * @brief Runs all test cases and prints the results.
+ */
+int main() {
+    int failures = 0;
+
+    if (test_hit() != 0) {
+        printf("Test FAILED: test_hit()\n");
+        failures++;
+    } else {
+        printf("Test PASSED: test_hit()\n");
+    }
+
+    if (test_scan_resistance() != 0) {
+        printf("Test FAILED: test_scan_resistance()\n");
+        failures++;
+    } else {
+        printf("Test PASSED: test_scan_resistance()\n");
+    }
+
+    if (test_ghost() != 0) {
+        printf("Test FAILED: test_ghost()\n");
+        failures++;
+    } else {
+        printf("Test PASSED: test_ghost()\n");
+    }
+
+    if (test_victim() != 0) {
+        printf("Test FAILED: test_victim()\n");
+        failures++;
+    } else {
+        printf("Test PASSED: test_victim()\n");
+    }
+
+    if (test_sizes() != 0) {
+        printf("Test FAILED: test_sizes()\n");
+        failures++;
+    } else {
+        printf("Test PASSED: test_sizes()\n");
+    }
+
+    if (test_concurrent() != 0) {
+        printf("Test FAILED: test_concurrent()\n");
+        failures++;
+    } else {
+        printf("Test PASSED: test_concurrent()\n");
+    }
+
+    return failures;
+}
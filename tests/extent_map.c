@@ -0,0 +1,201 @@
+#include <assert.h>
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cachemap.h"
+#include "extentmap.h"
+
+/*
+ * Tests for the extent map of objects spanning several zones. Readers have to hold every zone
+ * of an object, any extent has to find its list, and evicting a zone has to take the object's
+ * head out of the cache map with it.
+ */
+
+#define NR_ZONES 8
+#define EXTENT_CHUNKS 4
+
+/**
+ * @brief A list of `nr_extents` extents of `id`, extent `i` in zone `zone + i`
+ */
+static struct zn_extent_list
+make_list(uint32_t id, uint32_t zone, uint32_t nr_extents) {
+    struct zn_extent_list list = {.nr_extents = nr_extents};
+    for (uint32_t i = 0; i < nr_extents; i++) {
+        list.extents[i] = (struct zn_pair) {.zone = zone + i,
+                                            .chunk_offset = id * EXTENT_CHUNKS,
+                                            .nr_chunks = i + 1 < nr_extents ? EXTENT_CHUNKS : 1,
+                                            .id = id,
+                                            .in_use = true};
+    }
+    return list;
+}
+
+/**
+ * @brief Acquire takes a reader on every zone after the head, release drops them
+ * @return 0 on success, non-zero on failure.
+ */
+int test_acquire() {
+    gint readers[NR_ZONES] = {0};
+    struct zn_extent_map map;
+    zn_extent_map_init(&map, NR_ZONES, readers);
+
+    struct zn_extent_list list = make_list(1, 2, 3);
+    zn_extent_map_insert(&map, &list);
+
+    int ret = 0;
+    struct zn_extent_list found;
+    if (!zn_extent_map_acquire(&map, &list.extents[0], &found)) {
+        ret = 1;
+    } else if (found.nr_extents != 3 || zn_extent_list_chunks(&found) != 2 * EXTENT_CHUNKS + 1) {
+        ret = 2;
+    } else if (readers[2] != 0 || readers[3] != 1 || readers[4] != 1) {
+        ret = 3;
+    }
+    if (ret == 0) {
+        zn_extent_map_release(&map, &found);
+        for (uint32_t i = 0; i < NR_ZONES; i++) {
+            ret = readers[i] != 0 ? 4 : ret;
+        }
+    }
+
+    // A head elsewhere is an older or a single-extent object of the ID
+    struct zn_pair other = list.extents[0];
+    other.zone = 6;
+    if (ret == 0 && zn_extent_map_acquire(&map, &other, &found)) {
+        ret = 5;
+    }
+    struct zn_pair unknown = list.extents[0];
+    unknown.id = 2;
+    if (ret == 0 && zn_extent_map_acquire(&map, &unknown, &found)) {
+        ret = 6;
+    }
+
+    zn_extent_map_destroy(&map);
+    return ret;
+}
+
+/**
+ * @brief Any extent finds the list, removing it forgets the object
+ * @return 0 on success, non-zero on failure.
+ */
+int test_remove() {
+    gint readers[NR_ZONES] = {0};
+    struct zn_extent_map map;
+    zn_extent_map_init(&map, NR_ZONES, readers);
+
+    struct zn_extent_list list = make_list(5, 0, 4);
+    zn_extent_map_insert(&map, &list);
+
+    int ret = 0;
+    struct zn_extent_list found;
+    if (!zn_extent_map_get(&map, &list.extents[3], &found) || found.extents[0].zone != 0) {
+        ret = 1;
+    } else if (!zn_extent_map_remove(&map, &list.extents[2], &found) || found.nr_extents != 4) {
+        ret = 2;
+    } else if (zn_extent_map_get(&map, &list.extents[0], &found) || zn_extent_map_size(&map) != 0) {
+        ret = 3;
+    }
+
+    // Writing the ID again replaces its list
+    zn_extent_map_insert(&map, &list);
+    struct zn_extent_list moved = make_list(5, 4, 2);
+    zn_extent_map_insert(&map, &moved);
+    if (ret == 0 && (zn_extent_map_get(&map, &list.extents[0], &found) ||
+                     !zn_extent_map_get(&map, &moved.extents[1], &found) ||
+                     zn_extent_map_size(&map) != 1)) {
+        ret = 4;
+    }
+
+    zn_extent_map_destroy(&map);
+    return ret;
+}
+
+/**
+ * @brief Evicting the zone of any extent drops the list and makes the head a miss
+ * @return 0 on success, non-zero on failure.
+ */
+int test_clear_zone() {
+    gint readers[NR_ZONES] = {0};
+    struct zn_cachemap cache_map;
+    zn_cachemap_init(&cache_map, NR_ZONES, readers, 1);
+    struct zn_extent_map map;
+    zn_extent_map_init(&map, NR_ZONES, readers);
+
+    // Objects 1 and 2 share zone 3 with different extents, object 3 has no extent there
+    struct zn_extent_list lists[3] = {make_list(1, 1, 3), make_list(2, 3, 2), make_list(3, 5, 2)};
+    int ret = 0;
+    for (uint32_t i = 0; i < 3; i++) {
+        struct zone_map_result res = zn_cachemap_find(&cache_map, lists[i].extents[0].id);
+        if (res.type != RESULT_COND) {
+            ret = 1;
+        }
+        zn_extent_map_insert(&map, &lists[i]);
+        zn_cachemap_insert(&cache_map, lists[i].extents[0].id, lists[i].extents[0]);
+    }
+
+    if (ret == 0 && zn_extent_map_clear_zone(&map, &cache_map, 3) != 2) {
+        ret = 2;
+    }
+    struct zn_extent_list found;
+    if (ret == 0 && (zn_extent_map_get(&map, &lists[0].extents[0], &found) ||
+                     zn_extent_map_get(&map, &lists[1].extents[0], &found) ||
+                     !zn_extent_map_get(&map, &lists[2].extents[0], &found))) {
+        ret = 3;
+    }
+
+    // The heads of the dropped objects are misses, the other object is still a hit
+    for (uint32_t i = 0; i < 3 && ret == 0; i++) {
+        uint32_t id = lists[i].extents[0].id;
+        struct zone_map_result res = zn_cachemap_find(&cache_map, id);
+        if (res.type == RESULT_LOC) {
+            g_atomic_int_dec_and_test(&readers[res.location.zone]);
+            ret = i < 2 ? 4 : ret;
+        } else if (res.type == RESULT_COND) {
+            zn_cachemap_fail(&cache_map, id);
+            ret = i == 2 ? 5 : ret;
+        } else {
+            ret = 6;
+        }
+    }
+
+    // The zone has no lists left
+    if (ret == 0 && zn_extent_map_clear_zone(&map, &cache_map, 3) != 0) {
+        ret = 7;
+    }
+
+    zn_extent_map_destroy(&map);
+    zn_cachemap_destroy(&cache_map);
+    return ret;
+}
+
+/**
+ * @brief Runs all test cases and prints the results.
+ */
+int main() {
+    int failures = 0;
+
+    if (test_acquire() != 0) {
+        printf("Test FAILED: test_acquire()\n");
+        failures++;
+    } else {
+        printf("Test PASSED: test_acquire()\n");
+    }
+
+    if (test_remove() != 0) {
+        printf("Test FAILED: test_remove()\n");
+        failures++;
+    } else {
+        printf("Test PASSED: test_remove()\n");
+    }
+
+    if (test_clear_zone() != 0) {
+        printf("Test FAILED: test_clear_zone()\n");
+        failures++;
+    } else {
+        printf("Test PASSED: test_clear_zone()\n");
+    }
+
+    return failures;
+}
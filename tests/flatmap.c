@@ -0,0 +1,265 @@
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "flatmap.h"
+
+/**
+ * @brief Test inserting and finding a single key.
+ * @return 0 on success, non-zero on failure.
+ */
+int test_single_insert_find() {
+    struct zn_flatmap map;
+    zn_flatmap_init(&map, 16);
+
+    bool inserted = false;
+    uint64_t *value = zn_flatmap_insert(&map, 42, 7, &inserted);
+    if (!inserted || *value != 7) {
+        return 1;
+    }
+    *value = 1234;
+
+    // The value only applies to a new key
+    value = zn_flatmap_insert(&map, 42, 7, &inserted);
+    if (inserted || *value != 1234) {
+        return 2;
+    }
+
+    value = zn_flatmap_find(&map, 42);
+    if (!value || *value != 1234 || map.size != 1) {
+        return 3;
+    }
+
+    if (zn_flatmap_find(&map, 43) != NULL) {
+        return 4;
+    }
+
+    zn_flatmap_destroy(&map);
+    return 0;
+}
+
+/**
+ * @brief Test growing the table well past its initial capacity.
+ * @return 0 on success, non-zero on failure.
+ */
+int test_growth() {
+    struct zn_flatmap map;
+    zn_flatmap_init(&map, 16);
+
+    uint32_t entries = 100000;
+    for (uint32_t i = 0; i < entries; i++) {
+        bool inserted = false;
+        uint64_t *value = zn_flatmap_insert(&map, i * 3, 0, &inserted);
+        if (!inserted) {
+            return 1;
+        }
+        *value = (uint64_t) i << 32 | i;
+    }
+
+    if (map.size != entries) {
+        return 2;
+    }
+
+    for (uint32_t i = 0; i < entries; i++) {
+        uint64_t *value = zn_flatmap_find(&map, i * 3);
+        if (!value || *value != ((uint64_t) i << 32 | i)) {
+            return 3;
+        }
+        if (zn_flatmap_find(&map, (i * 3) + 1) != NULL) {
+            return 4;
+        }
+    }
+
+    zn_flatmap_destroy(&map);
+    return 0;
+}
+
+/**
+ * @brief Test erasing keys, reinserting them, and that tombstones do not break lookups.
+ * @return 0 on success, non-zero on failure.
+ */
+int test_erase() {
+    struct zn_flatmap map;
+    zn_flatmap_init(&map, 16);
+
+    bool inserted = false;
+    uint32_t entries = 10000;
+    for (uint32_t i = 0; i < entries; i++) {
+        *zn_flatmap_insert(&map, i, i, &inserted) = i;
+    }
+
+    // Erase every even key
+    for (uint32_t i = 0; i < entries; i += 2) {
+        if (!zn_flatmap_erase(&map, i)) {
+            return 1;
+        }
+    }
+    if (zn_flatmap_erase(&map, 0)) {
+        return 2;
+    }
+    if (map.size != entries / 2) {
+        return 3;
+    }
+
+    for (uint32_t i = 0; i < entries; i++) {
+        uint64_t *value = zn_flatmap_find(&map, i);
+        if ((i % 2 == 0 && value != NULL) || (i % 2 == 1 && (!value || *value != i))) {
+            return 4;
+        }
+    }
+
+    // Churn the table so tombstones have to be cleaned up without the table growing unboundedly
+    uint32_t capacity = map.capacity;
+    for (uint32_t round = 0; round < 50; round++) {
+        for (uint32_t i = 0; i < entries; i += 2) {
+            *zn_flatmap_insert(&map, entries + (round * entries) + i, i, &inserted) = i;
+        }
+        for (uint32_t i = 0; i < entries; i += 2) {
+            if (!zn_flatmap_erase(&map, entries + (round * entries) + i)) {
+                return 5;
+            }
+        }
+    }
+    if (map.capacity > capacity * 2 || map.size != entries / 2) {
+        return 6;
+    }
+
+    for (uint32_t i = 1; i < entries; i += 2) {
+        uint64_t *value = zn_flatmap_find(&map, i);
+        if (!value || *value != i) {
+            return 7;
+        }
+    }
+
+    zn_flatmap_destroy(&map);
+    return 0;
+}
+
+static bool
+keep_odd_values(uint32_t key, uint64_t value, void *user_data) {
+    (void) key;
+    (*(uint32_t *) user_data)++;
+    return value % 2 == 1;
+}
+
+/**
+ * @brief Test erasing keys by predicate.
+ * @return 0 on success, non-zero on failure.
+ */
+int test_retain() {
+    struct zn_flatmap map;
+    zn_flatmap_init(&map, 16);
+
+    bool inserted = false;
+    uint32_t entries = 10000;
+    for (uint32_t i = 0; i < entries; i++) {
+        *zn_flatmap_insert(&map, i, i, &inserted) = i;
+    }
+
+    uint32_t visited = 0;
+    if (zn_flatmap_retain(&map, keep_odd_values, &visited) != entries / 2) {
+        return 1;
+    }
+    if (visited != entries || map.size != entries / 2) {
+        return 2;
+    }
+
+    for (uint32_t i = 0; i < entries; i++) {
+        uint64_t *value = zn_flatmap_find(&map, i);
+        if ((i % 2 == 0) != (value == NULL)) {
+            return 3;
+        }
+    }
+
+    zn_flatmap_destroy(&map);
+    return 0;
+}
+
+/**
+ * @brief Randomized comparison against a GHashTable.
+ * @return 0 on success, non-zero on failure.
+ */
+int test_random_against_ghashtable() {
+    struct zn_flatmap map;
+    zn_flatmap_init(&map, 64);
+    GHashTable *reference = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+    srand(42);
+    for (uint32_t op = 0; op < 500000; op++) {
+        uint32_t key = rand() % 20000;
+        bool inserted = false;
+        switch (rand() % 3) {
+            case 0:
+                *zn_flatmap_insert(&map, key, key + 1, &inserted) = key + 1;
+                g_hash_table_replace(reference, GUINT_TO_POINTER(key), GUINT_TO_POINTER(key + 1));
+                break;
+            case 1:
+                if (zn_flatmap_erase(&map, key) != g_hash_table_remove(reference, GUINT_TO_POINTER(key))) {
+                    return 1;
+                }
+                break;
+            default: {
+                uint64_t *value = zn_flatmap_find(&map, key);
+                gpointer expect = g_hash_table_lookup(reference, GUINT_TO_POINTER(key));
+                if ((value == NULL) != (expect == NULL)) {
+                    return 2;
+                }
+                if (value && *value != GPOINTER_TO_UINT(expect)) {
+                    return 3;
+                }
+            }
+        }
+    }
+
+    if (map.size != g_hash_table_size(reference)) {
+        return 4;
+    }
+
+    g_hash_table_destroy(reference);
+    zn_flatmap_destroy(&map);
+    return 0;
+}
+
+/**
+ * @brief Runs all test cases and prints the results.
+ */
+int main() {
+    int failures = 0;
+
+    if (test_single_insert_find() != 0) {
+        printf("Test FAILED: test_single_insert_find()\n");
+        failures++;
+    } else {
+        printf("Test PASSED: test_single_insert_find()\n");
+    }
+
+    if (test_growth() != 0) {
+        printf("Test FAILED: test_growth()\n");
+        failures++;
+    } else {
+        printf("Test PASSED: test_growth()\n");
+    }
+
+    if (test_erase() != 0) {
+        printf("Test FAILED: test_erase()\n");
+        failures++;
+    } else {
+        printf("Test PASSED: test_erase()\n");
+    }
+
+    if (test_retain() != 0) {
+        printf("Test FAILED: test_retain()\n");
+        failures++;
+    } else {
+        printf("Test PASSED: test_retain()\n");
+    }
+
+    if (test_random_against_ghashtable() != 0) {
+        printf("Test FAILED: test_random_against_ghashtable()\n");
+        failures++;
+    } else {
+        printf("Test PASSED: test_random_against_ghashtable()\n");
+    }
+
+    return failures;
+}
@@ -0,0 +1,210 @@
+#include <assert.h>
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "readbuffer.h"
+
+/*
+ * Tests for the lossy read buffers of the eviction policies. Readers record hits while a
+ * drainer applies them under a lock, and every hit must be applied at most once, in the order
+ * it was recorded by its thread, or be counted as dropped.
+ */
+
+#define NR_READERS 4
+#define HITS_PER_READER 200000
+#define CAPACITY 64
+
+/** Shared state of one test run */
+struct drain_state {
+    struct zn_read_buffer buffer;
+    GMutex lock;                      /**< Stands in for the policy lock */
+    uint32_t last_seen[NR_READERS];   /**< Last hit applied per reader, + 1 */
+    uint64_t nr_applied[NR_READERS];
+    gint stop;
+    uint32_t failures;
+};
+
+struct reader_args {
+    struct drain_state *state;
+    uint32_t reader;
+};
+
+static void
+apply_hit(void *policy, struct zn_pair location) {
+    struct drain_state *state = policy;
+    uint32_t reader = location.zone;
+    if (reader >= NR_READERS || location.chunk_offset < state->last_seen[reader]) {
+        state->failures++;
+        return;
+    }
+    // Hits of a reader come in the order it recorded them, possibly with dropped ones between
+    state->last_seen[reader] = location.chunk_offset + 1;
+    state->nr_applied[reader]++;
+}
+
+static gpointer
+reader_thread(gpointer user_data) {
+    struct reader_args *args = user_data;
+    struct drain_state *state = args->state;
+
+    for (uint32_t i = 0; i < HITS_PER_READER; i++) {
+        struct zn_pair location = {
+            .zone = args->reader, .chunk_offset = i, .nr_chunks = 1, .id = i, .in_use = true};
+        if (zn_read_buffer_record(&state->buffer, location) && g_mutex_trylock(&state->lock)) {
+            zn_read_buffer_drain(&state->buffer, apply_hit, state);
+            g_mutex_unlock(&state->lock);
+        }
+    }
+    return NULL;
+}
+
+static gpointer
+drain_thread(gpointer user_data) {
+    struct drain_state *state = user_data;
+
+    while (!g_atomic_int_get(&state->stop)) {
+        g_mutex_lock(&state->lock);
+        zn_read_buffer_drain(&state->buffer, apply_hit, state);
+        g_mutex_unlock(&state->lock);
+        g_thread_yield();
+    }
+    return NULL;
+}
+
+/**
+ * @brief A disabled buffer reports so, and hits then go straight to the policy
+ * @return 0 on success, non-zero on failure.
+ */
+static int
+test_disabled(void) {
+    struct zn_read_buffer buffer;
+    zn_read_buffer_init(&buffer, 0);
+    int ret = zn_read_buffer_enabled(&buffer) ? 1 : 0;
+    zn_read_buffer_destroy(&buffer);
+    return ret;
+}
+
+/**
+ * @brief A single thread fills its ring, drops hits past it, and gets them all applied in order
+ * @return 0 on success, non-zero on failure.
+ */
+static int
+test_full_ring(void) {
+    struct drain_state state = {0};
+    // Rounded up to a power of two
+    zn_read_buffer_init(&state.buffer, CAPACITY - 1);
+    if (state.buffer.capacity != CAPACITY) {
+        return 1;
+    }
+
+    bool drain_asked = false;
+    for (uint32_t i = 0; i < CAPACITY + 10; i++) {
+        struct zn_pair location = {.zone = 0, .chunk_offset = i, .nr_chunks = 1, .id = i};
+        drain_asked = zn_read_buffer_record(&state.buffer, location) || drain_asked;
+    }
+
+    int ret = 0;
+    uint32_t applied = zn_read_buffer_drain(&state.buffer, apply_hit, &state);
+    struct zn_read_buffer_stats stats;
+    zn_read_buffer_get_stats(&state.buffer, &stats);
+    if (!drain_asked) {
+        ret = 2;
+    } else if (applied != CAPACITY || stats.nr_applied != CAPACITY || stats.nr_dropped != 10) {
+        ret = 3;
+    } else if (state.failures != 0 || state.last_seen[0] != CAPACITY) {
+        ret = 4;
+    } else if (zn_read_buffer_drain(&state.buffer, apply_hit, &state) != 0) {
+        ret = 5;
+    }
+
+    // The ring takes hits again once drained
+    struct zn_pair location = {.zone = 0, .chunk_offset = CAPACITY + 10, .nr_chunks = 1};
+    zn_read_buffer_record(&state.buffer, location);
+    if (ret == 0 && zn_read_buffer_drain(&state.buffer, apply_hit, &state) != 1) {
+        ret = 6;
+    }
+
+    zn_read_buffer_destroy(&state.buffer);
+    return ret;
+}
+
+/**
+ * @brief Readers record hits while they and a drainer apply them. Every hit is applied at
+ * most once and in order, and is counted as applied or dropped once the rings are drained.
+ * @return 0 on success, non-zero on failure.
+ */
+static int
+test_concurrent_drain(void) {
+    struct drain_state *state = g_new0(struct drain_state, 1);
+    zn_read_buffer_init(&state->buffer, CAPACITY);
+    g_mutex_init(&state->lock);
+
+    GThread *drainer = g_thread_new("drainer", drain_thread, state);
+    GThread *readers[NR_READERS];
+    struct reader_args args[NR_READERS];
+    for (uint32_t t = 0; t < NR_READERS; t++) {
+        args[t] = (struct reader_args) {.state = state, .reader = t};
+        readers[t] = g_thread_new("reader", reader_thread, &args[t]);
+    }
+    for (uint32_t t = 0; t < NR_READERS; t++) {
+        g_thread_join(readers[t]);
+    }
+    g_atomic_int_set(&state->stop, 1);
+    g_thread_join(drainer);
+
+    // Apply what is left
+    zn_read_buffer_drain(&state->buffer, apply_hit, state);
+
+    int ret = 0;
+    struct zn_read_buffer_stats stats;
+    zn_read_buffer_get_stats(&state->buffer, &stats);
+    uint64_t applied = 0;
+    for (uint32_t t = 0; t < NR_READERS; t++) {
+        applied += state->nr_applied[t];
+    }
+    if (state->failures != 0) {
+        printf("  %u hits applied twice or out of order\n", state->failures);
+        ret = 1;
+    } else if (applied != stats.nr_applied ||
+               stats.nr_applied + stats.nr_dropped != (uint64_t) NR_READERS * HITS_PER_READER) {
+        printf("  %" G_GUINT64_FORMAT " applied, %" G_GUINT64_FORMAT " dropped\n",
+               stats.nr_applied, stats.nr_dropped);
+        ret = 2;
+    } else if (stats.nr_applied == 0) {
+        ret = 3;
+    }
+
+    zn_read_buffer_destroy(&state->buffer);
+    g_mutex_clear(&state->lock);
+    g_free(state);
+    return ret;
+}
+
+int
+main(void) {
+    int failures = 0;
+
+    if (test_disabled() != 0) {
+        printf("Test FAILED: test_disabled\n");
+        failures++;
+    } else {
+        printf("Test PASSED: test_disabled\n");
+    }
+
+    if (test_full_ring() != 0) {
+        printf("Test FAILED: test_full_ring\n");
+        failures++;
+    } else {
+        printf("Test PASSED: test_full_ring\n");
+    }
+
+    if (test_concurrent_drain() != 0) {
+        printf("Test FAILED: test_concurrent_drain\n");
+        failures++;
+    } else {
+        printf("Test PASSED: test_concurrent_drain\n");
+    }
+
+    return failures;
+}
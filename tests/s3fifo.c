@@ -0,0 +1,375 @@
+#include <assert.h>
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "eviction_policy_s3fifo.h"
+#include "zncache.h"
+
+/*
+ * Tests for the zone granular S3-FIFO eviction policy. Objects are written through the zone
+ * state manager like the cache does, one active zone at a time, so zones fill up in order.
+ * Zones that were not hit on probation have to be evicted from the small FIFO and leave their
+ * objects behind as ghosts, zones that were hit have to move to the main FIFO, zones rewritten
+ * with ghosts have to skip probation, and the ghost ring has to forget the oldest IDs only.
+ */
+
+#define NR_ZONES 20 // A small FIFO of 2 zones
+#define ZONE_CHUNKS 8
+#define CHUNK_SIZE 4096
+#define MAX_IDS 4096
+#define NOT_PUSHED UINT64_MAX
+
+/** Shared state of one test run */
+struct policy_state {
+    struct zn_cache cache;                 /**< Only what the policy and zones use is set */
+    struct zn_evict_policy policy;
+    struct zn_policy_s3fifo *s3;
+    struct zn_pair locations[MAX_IDS];     /**< Where each ID was written last */
+    uint32_t zone_ids[NR_ZONES][ZONE_CHUNKS];
+    uint32_t next_id;                      /**< Next ID that was never written */
+};
+
+static struct policy_state *
+init_state(void) {
+    struct policy_state *state = g_new0(struct policy_state, 1);
+    state->cache.nr_zones = NR_ZONES;
+    state->cache.max_zone_chunks = ZONE_CHUNKS;
+    state->cache.chunk_sz = CHUNK_SIZE;
+    state->cache.zone_cap = ZONE_CHUNKS * CHUNK_SIZE;
+    zsm_init(&state->cache.zone_state, NR_ZONES, -1, ZONE_CHUNKS * CHUNK_SIZE,
+             ZONE_CHUNKS * CHUNK_SIZE, CHUNK_SIZE, 1, ZE_BACKEND_BLOCK);
+    zn_evict_policy_init(&state->policy, ZN_EVICT_S3FIFO_ZONE, &state->cache);
+    state->s3 = state->policy.data;
+    assert(state->s3->small_zones == 2);
+    return state;
+}
+
+/**
+ * @brief Writes `id` to the next chunk of the active zone, reporting it to the policy before
+ * returning the chunk like zn_cache_write_miss() does
+ * @return The zone written to
+ */
+static uint32_t
+write_object(struct policy_state *state, uint32_t id) {
+    assert(id < MAX_IDS);
+    struct zn_pair pair;
+    enum zsm_get_active_zone_error ret = zsm_get_active_zone(&state->cache.zone_state, &pair);
+    assert(ret == ZSM_GET_ACTIVE_ZONE_SUCCESS);
+    (void) ret;
+    pair.id = id;
+    pair.in_use = true;
+
+    zsm_wait_write_turn(&state->cache.zone_state, &pair);
+    zsm_pass_write_turn(&state->cache.zone_state, &pair);
+    state->policy.update_policy(state->policy.data, pair, ZN_WRITE);
+    zsm_return_active_zone(&state->cache.zone_state, &pair);
+
+    state->locations[id] = pair;
+    state->zone_ids[pair.zone][pair.chunk_offset] = id;
+    return pair.zone;
+}
+
+/** @brief Fills the next zone with IDs that were never written */
+static uint32_t
+fill_zone(struct policy_state *state) {
+    uint32_t zone = 0;
+    for (uint32_t i = 0; i < ZONE_CHUNKS; i++) {
+        zone = write_object(state, state->next_id++);
+    }
+    return zone;
+}
+
+static void
+hit(struct policy_state *state, uint32_t id) {
+    state->policy.update_policy(state->policy.data, state->locations[id], ZN_READ);
+}
+
+/** @brief Evicts a zone like zn_fg_evict() does, -1 if the policy had none */
+static int
+evict(struct policy_state *state) {
+    int zone = state->policy.do_evict(state->policy.data);
+    if (zone != -1) {
+        int ret = zsm_evict(&state->cache.zone_state, zone);
+        assert(ret == 0);
+        (void) ret;
+    }
+    return zone;
+}
+
+static bool
+is_ghost(struct policy_state *state, uint32_t id) {
+    return zn_flatmap_find(&state->s3->ghosts, id) != NULL;
+}
+
+static bool
+in_queue(GQueue *queue, uint32_t zone) {
+    for (GList *node = queue->head; node != NULL; node = node->next) {
+        if (GPOINTER_TO_UINT(node->data) == zone) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/** @brief Whether every object written to `zone` is a ghost, or none is */
+static bool
+zone_ghosts(struct policy_state *state, uint32_t zone, bool ghost) {
+    for (uint32_t i = 0; i < ZONE_CHUNKS; i++) {
+        if (is_ghost(state, state->zone_ids[zone][i]) != ghost) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Zones that were never hit leave the small FIFO oldest first, and their objects
+ * become ghosts
+ * @return 0 on success, non-zero on failure.
+ */
+static int
+test_small_eviction(void) {
+    struct policy_state *state = init_state();
+    int failures = 0;
+
+    for (uint32_t z = 0; z < NR_ZONES; z++) {
+        if (fill_zone(state) != z) {
+            failures++;
+        }
+    }
+    if (evict(state) != 0 || !zone_ghosts(state, 0, true) || state->s3->ghosts.size != ZONE_CHUNKS) {
+        failures++;
+    }
+    if (g_queue_get_length(&state->s3->small) != NR_ZONES - 1 ||
+        !g_queue_is_empty(&state->s3->main) || state->s3->nr_promoted != 0) {
+        failures++;
+    }
+
+    // The freed zone is written again and waits behind the others
+    if (fill_zone(state) != 0 || evict(state) != 1 || !zone_ghosts(state, 1, true) ||
+        !in_queue(&state->s3->small, 0)) {
+        failures++;
+    }
+    return failures;
+}
+
+/**
+ * @brief A zone hit on probation moves to the main FIFO instead of being evicted. Main zones
+ * are only evicted from once the small FIFO runs low, get another pass while they are hit, and
+ * leave no ghosts.
+ * @return 0 on success, non-zero on failure.
+ */
+static int
+test_promotion(void) {
+    struct policy_state *state = init_state();
+    int failures = 0;
+
+    for (uint32_t z = 0; z < NR_ZONES; z++) {
+        fill_zone(state);
+    }
+    // One object of eight is enough
+    hit(state, state->zone_ids[0][3]);
+    if (evict(state) != 1 || state->s3->nr_promoted != 1 || !in_queue(&state->s3->main, 0) ||
+        !zone_ghosts(state, 0, false) || !zone_ghosts(state, 1, true)) {
+        failures++;
+    }
+
+    // Drain the small FIFO down to its size, main is left alone meanwhile
+    hit(state, state->zone_ids[0][5]);
+    for (uint32_t z = 2; z < NR_ZONES - 1; z++) {
+        if (evict(state) != (int) z) {
+            failures++;
+        }
+    }
+    if (g_queue_get_length(&state->s3->small) != 1 || state->s3->nr_reinserted != 0) {
+        failures++;
+    }
+
+    // Zone 0 was hit since its promotion, so it gets a pass, then is evicted for good
+    if (evict(state) != 0 || state->s3->nr_reinserted != 1 || !zone_ghosts(state, 0, false)) {
+        failures++;
+    }
+    if (evict(state) != NR_ZONES - 1 || evict(state) != -1) {
+        failures++;
+    }
+    return failures;
+}
+
+/**
+ * @brief A zone written mostly with ghosts goes straight to the main FIFO, one written with
+ * fewer goes on probation. Ghosts are forgotten once they are written again.
+ * @return 0 on success, non-zero on failure.
+ */
+static int
+test_ghost_admission(void) {
+    struct policy_state *state = init_state();
+    int failures = 0;
+
+    for (uint32_t z = 0; z < NR_ZONES; z++) {
+        fill_zone(state);
+    }
+    if (evict(state) != 0) {
+        failures++;
+    }
+
+    // Every object of zone 0 comes back into zone 0
+    uint32_t ghosts[ZONE_CHUNKS];
+    for (uint32_t i = 0; i < ZONE_CHUNKS; i++) {
+        ghosts[i] = state->zone_ids[0][i];
+    }
+    for (uint32_t i = 0; i < ZONE_CHUNKS; i++) {
+        write_object(state, ghosts[i]);
+    }
+    if (state->s3->ghosts.size != 0 || state->s3->zones[0].nr_ghosts != ZONE_CHUNKS) {
+        failures++;
+    }
+    if (evict(state) != 1 || state->s3->nr_ghost_admitted != 1 ||
+        !in_queue(&state->s3->main, 0) || in_queue(&state->s3->small, 0)) {
+        failures++;
+    }
+
+    // Three ghosts of zone 1 are not enough
+    for (uint32_t i = 0; i < ZONE_CHUNKS; i++) {
+        ghosts[i] = state->zone_ids[1][i];
+    }
+    for (uint32_t i = 0; i < 3; i++) {
+        write_object(state, ghosts[i]);
+    }
+    while (state->s3->zones[1].objects->len < ZONE_CHUNKS) {
+        write_object(state, state->next_id++);
+    }
+    if (evict(state) != 2 || state->s3->nr_ghost_admitted != 1 ||
+        !in_queue(&state->s3->small, 1) || state->s3->ghosts.size != 2 * ZONE_CHUNKS - 3) {
+        failures++;
+    }
+    return failures;
+}
+
+/**
+ * @brief The ghost ring holds the IDs of the last `ghost_capacity` objects evicted from the
+ * small FIFO. IDs pushed again before their old slot is reused have to survive that slot being
+ * overwritten.
+ *
+ * Most zones are promoted to main first, so the few zones left on probation are evicted soon
+ * after they are written. Each rewrites three ghosts of the zone evicted before it, which are
+ * therefore pushed again well within the capacity of the ring, and are then left to age out.
+ * The ghosts are checked after every eviction against a model of the ring.
+ *
+ * @return 0 on success, non-zero on failure.
+ */
+static int
+test_ghost_wraparound(void) {
+    struct policy_state *state = init_state();
+    struct zn_policy_s3fifo *s3 = state->s3;
+    int failures = 0;
+    const uint32_t nr_main = NR_ZONES - 4;
+
+    uint64_t *pushed_at = g_new(uint64_t, MAX_IDS);
+    for (uint32_t id = 0; id < MAX_IDS; id++) {
+        pushed_at[id] = NOT_PUSHED;
+    }
+    uint64_t next = 0;
+    if (s3->ghost_capacity != (NR_ZONES - s3->small_zones) * ZONE_CHUNKS) {
+        failures++;
+    }
+
+    for (uint32_t z = 0; z < NR_ZONES; z++) {
+        fill_zone(state);
+    }
+    for (uint32_t z = 0; z < nr_main; z++) {
+        hit(state, state->zone_ids[z][0]);
+    }
+
+    GQueue expected;
+    g_queue_init(&expected);
+    for (uint32_t z = nr_main; z < NR_ZONES; z++) {
+        g_queue_push_tail(&expected, GUINT_TO_POINTER(z));
+    }
+
+    for (uint32_t round = 0; round < 8 * s3->ghost_capacity / ZONE_CHUNKS; round++) {
+        int zone = evict(state);
+        if (zone < 0 || (uint32_t) zone != GPOINTER_TO_UINT(g_queue_pop_head(&expected))) {
+            failures++;
+            break;
+        }
+        for (uint32_t i = 0; i < ZONE_CHUNKS; i++) {
+            pushed_at[state->zone_ids[zone][i]] = next++;
+        }
+
+        uint32_t nr_live = 0;
+        for (uint32_t id = 0; id < state->next_id; id++) {
+            bool live = pushed_at[id] != NOT_PUSHED && pushed_at[id] + s3->ghost_capacity >= next;
+            if (is_ghost(state, id) != live) {
+                failures++;
+            }
+            nr_live += live;
+        }
+        if (s3->ghosts.size != nr_live || s3->ghost_next != next) {
+            failures++;
+        }
+
+        // The zone just freed is written next, starting with three of its own ghosts that were
+        // written for the first time
+        uint32_t rewritten[3];
+        for (uint32_t i = 0; i < 3; i++) {
+            rewritten[i] = state->zone_ids[zone][ZONE_CHUNKS - 3 + i];
+        }
+        for (uint32_t i = 0; i < 3; i++) {
+            write_object(state, rewritten[i]);
+            pushed_at[rewritten[i]] = NOT_PUSHED;
+        }
+        while (s3->zones[zone].objects->len < ZONE_CHUNKS) {
+            write_object(state, state->next_id++);
+        }
+        if (s3->zones[zone].nr_ghosts != 3) {
+            failures++;
+        }
+        g_queue_push_tail(&expected, GUINT_TO_POINTER((uint32_t) zone));
+    }
+
+    if (s3->nr_promoted != nr_main || s3->nr_ghost_admitted != 0 || s3->nr_reinserted != 0 ||
+        next <= 2 * s3->ghost_capacity) {
+        failures++;
+    }
+    g_queue_clear(&expected);
+    g_free(pushed_at);
+    return failures;
+}
+
+/**
+ * @brief Runs all test cases and prints the results.
+ */
+int main() {
+    int failures = 0;
+
+    if (test_small_eviction() != 0) {
+        printf("Test FAILED: test_small_eviction()\n");
+        failures++;
+    } else {
+        printf("Test PASSED: test_small_eviction()\n");
+    }
+
+    if (test_promotion() != 0) {
+        printf("Test FAILED: test_promotion()\n");
+        failures++;
+    } else {
+        printf("Test PASSED: test_promotion()\n");
+    }
+
+    if (test_ghost_admission() != 0) {
+        printf("Test FAILED: test_ghost_admission()\n");
+        failures++;
+    } else {
+        printf("Test PASSED: test_ghost_admission()\n");
+    }
+
+    if (test_ghost_wraparound() != 0) {
+        printf("Test FAILED: test_ghost_wraparound()\n");
+        failures++;
+    } else {
+        printf("Test PASSED: test_ghost_wraparound()\n");
+    }
+
+    return failures;
+}
@@ -0,0 +1,333 @@
+#include <assert.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "smallcache.h"
+#include "znbuf.h"
+#include "znio.h"
+
+/*
+ * Tests for the set-associative small object engine, on a file standing in for a block
+ * device. Objects have to be served from the DRAM log and from set pages, overflowing sets
+ * have to keep the objects that were hit, and reclaiming zones has to drop the sets still in
+ * them without ever returning the wrong data.
+ */
+
+#define NR_THREADS 8
+#define ROUNDS 20000
+
+/** Shared state of one test run */
+struct fixture {
+    char path[64];
+    int fd;
+    struct zn_io io;
+    struct zn_buffer_pool pool;
+    struct zn_small_cache sc;
+};
+
+static void
+setup(struct fixture *f, uint32_t nr_zones, uint32_t pages_per_zone) {
+    snprintf(f->path, sizeof(f->path), "/tmp/zn_small_cache_%d", (int) getpid());
+    f->fd = open(f->path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    assert(f->fd >= 0);
+    unlink(f->path);
+
+    uint64_t zone_size = (uint64_t) pages_per_zone * ZN_SMALL_SET_SIZE;
+    zn_io_init(&f->io, ZN_IO_ENGINE_PSYNC, f->fd, ZN_SMALL_SET_SIZE, false);
+    zn_buffer_pool_init(&f->pool, ZN_SMALL_SET_SIZE, false);
+    // The smallest log, a partition rewrites a set once it logs more than a page
+    zn_small_cache_init(&f->sc, &f->io, &f->pool, f->fd, ZE_BACKEND_BLOCK, 0, nr_zones,
+                        zone_size, zone_size, 0);
+}
+
+static void
+teardown(struct fixture *f) {
+    zn_small_cache_destroy(&f->sc);
+    zn_buffer_pool_destroy(&f->pool);
+    zn_io_destroy(&f->io);
+    close(f->fd);
+}
+
+/** @brief Size of an object, between 4 and 1000 bytes */
+static size_t
+len_of(uint32_t id) {
+    return 4 + ((id * 2654435761u) >> 16) % 997;
+}
+
+static void
+fill(unsigned char *data, uint32_t id, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        data[i] = (unsigned char) (id + i);
+    }
+    memcpy(data, &id, sizeof(id));
+}
+
+static bool
+check(const unsigned char *data, uint32_t id, size_t len) {
+    unsigned char expected[ZN_SMALL_OBJECT_MAX];
+    fill(expected, id, len);
+    return memcmp(data, expected, len) == 0;
+}
+
+static void
+insert(struct zn_small_cache *sc, uint32_t id, size_t len) {
+    unsigned char data[ZN_SMALL_OBJECT_MAX];
+    fill(data, id, len);
+    zn_small_cache_insert(sc, id, data, len);
+}
+
+/**
+ * @return 1 on a hit with the right data, 0 on a miss, -1 on a hit with the wrong data
+ */
+static int
+lookup(struct zn_small_cache *sc, uint32_t id, size_t len) {
+    unsigned char data[ZN_SMALL_OBJECT_MAX];
+    size_t got;
+    if (!zn_small_cache_get(sc, id, data, &got)) {
+        return 0;
+    }
+    return got == len && check(data, id, len) ? 1 : -1;
+}
+
+/**
+ * @brief Objects are served from the log before any set is written
+ * @return 0 on success, non-zero on failure.
+ */
+int test_log_hit() {
+    struct fixture f;
+    setup(&f, 4, 4);
+
+    int ret = 0;
+    for (uint32_t id = 0; id < 3; id++) {
+        insert(&f.sc, id, 100);
+    }
+    // Inserting an ID that is logged changes nothing
+    insert(&f.sc, 1, 100);
+    for (uint32_t id = 0; id < 3 && ret == 0; id++) {
+        if (lookup(&f.sc, id, 100) != 1) {
+            ret = 1;
+        }
+    }
+    if (ret == 0 && lookup(&f.sc, 3, 100) != 0) {
+        ret = 2;
+    }
+
+    struct zn_small_cache_stats stats;
+    zn_small_cache_get_stats(&f.sc, &stats);
+    if (ret == 0 && (stats.nr_sets != 8 || stats.nr_logged != 3 || stats.hits != 3 ||
+                     stats.lookups != 4 || stats.set_writes != 0)) {
+        ret = 3;
+    }
+
+    teardown(&f);
+    return ret;
+}
+
+/**
+ * @brief An overflowing set keeps the objects that were hit, then the newest logged ones
+ * @return 0 on success, non-zero on failure.
+ */
+int test_set_overflow() {
+    // Two zones of one page hold a single set, so every object shares it
+    struct fixture f;
+    setup(&f, 2, 1);
+
+    // Four objects fit a page, the fifth logged one triggers the write
+    int ret = 0;
+    for (uint32_t id = 0; id < 5; id++) {
+        insert(&f.sc, id, 1000);
+    }
+    struct zn_small_cache_stats stats;
+    zn_small_cache_get_stats(&f.sc, &stats);
+    if (stats.nr_sets != 1 || stats.set_writes != 1 || stats.objects_flushed != 4 ||
+        stats.nr_logged != 0) {
+        ret = 1;
+    }
+    if (ret == 0 && (lookup(&f.sc, 1, 1000) != 1 || lookup(&f.sc, 0, 1000) != 0)) {
+        ret = 2;
+    }
+
+    // 1 was hit, so it stays ahead of the new objects, which push out the rest
+    for (uint32_t id = 5; id < 10 && ret == 0; id++) {
+        insert(&f.sc, id, 1000);
+    }
+    uint32_t kept[] = {1, 7, 8, 9};
+    uint32_t evicted[] = {2, 3, 4, 5, 6};
+    for (size_t i = 0; i < G_N_ELEMENTS(kept) && ret == 0; i++) {
+        if (lookup(&f.sc, kept[i], 1000) != 1) {
+            ret = 3;
+        }
+    }
+    for (size_t i = 0; i < G_N_ELEMENTS(evicted) && ret == 0; i++) {
+        if (lookup(&f.sc, evicted[i], 1000) != 0) {
+            ret = 4;
+        }
+    }
+
+    // Every object of the page was hit, so none of the new ones get in
+    for (uint32_t id = 10; id < 15 && ret == 0; id++) {
+        insert(&f.sc, id, 1000);
+    }
+    zn_small_cache_get_stats(&f.sc, &stats);
+    if (ret == 0 && (stats.set_writes != 3 || stats.objects_flushed != 7)) {
+        ret = 5;
+    }
+
+    // The hits only count for one rewrite
+    for (uint32_t id = 15; id < 20 && ret == 0; id++) {
+        insert(&f.sc, id, 1000);
+    }
+    zn_small_cache_get_stats(&f.sc, &stats);
+    if (ret == 0 && (stats.set_writes != 4 || stats.objects_flushed != 11)) {
+        ret = 6;
+    }
+    if (ret == 0 && (lookup(&f.sc, 19, 1000) != 1 || lookup(&f.sc, 1, 1000) != 0)) {
+        ret = 7;
+    }
+
+    // The zones were reclaimed once the set had moved on, so nothing was dropped
+    zn_small_cache_get_stats(&f.sc, &stats);
+    if (ret == 0 && (stats.zones_reclaimed != 2 || stats.sets_dropped != 0)) {
+        ret = 8;
+    }
+
+    teardown(&f);
+    return ret;
+}
+
+/**
+ * @brief Zones are reclaimed as sets are rewritten, sets still in them are dropped, and no
+ * lookup ever returns the wrong data
+ * @return 0 on success, non-zero on failure.
+ */
+int test_reclaim() {
+    struct fixture f;
+    setup(&f, 4, 4);
+
+    int ret = 0;
+    for (uint32_t id = 0; id < 3000 && ret == 0; id++) {
+        insert(&f.sc, id, len_of(id));
+        // The newest object is always logged or in its set's newest page
+        if (lookup(&f.sc, id, len_of(id)) != 1) {
+            ret = 1;
+        }
+    }
+    for (uint32_t id = 0; id < 3000 && ret == 0; id++) {
+        if (lookup(&f.sc, id, len_of(id)) == -1) {
+            ret = 2;
+        }
+    }
+
+    struct zn_small_cache_stats stats;
+    zn_small_cache_get_stats(&f.sc, &stats);
+    if (ret == 0 && (stats.zones_reclaimed == 0 || stats.sets_dropped == 0 ||
+                     stats.metadata_bytes == 0)) {
+        ret = 3;
+    }
+
+    teardown(&f);
+    return ret;
+}
+
+struct concurrent_state {
+    struct zn_small_cache *sc;
+    gint failures;
+    gint next_seed;
+};
+
+static uint32_t
+xorshift(uint32_t *state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+static gpointer
+concurrent_worker(gpointer user_data) {
+    struct concurrent_state *state = user_data;
+    uint32_t seed = (uint32_t) g_atomic_int_add(&state->next_seed, 1) * 2654435761u + 1;
+
+    for (uint32_t i = 0; i < ROUNDS; i++) {
+        // A hot set that fits, and a cold tail that does not
+        uint32_t r = xorshift(&seed);
+        uint32_t id = (r & 1) == 0 ? (r >> 1) % 64 : (r >> 1) % 4096;
+        int found = lookup(state->sc, id, len_of(id));
+        if (found == -1) {
+            g_atomic_int_inc(&state->failures);
+        } else if (found == 0) {
+            insert(state->sc, id, len_of(id));
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Threads getting and inserting overlapping IDs always read their own data
+ * @return 0 on success, non-zero on failure.
+ */
+int test_concurrent() {
+    struct fixture f;
+    setup(&f, 8, 16);
+
+    struct concurrent_state state = {.sc = &f.sc, .failures = 0, .next_seed = 0};
+    GThread *threads[NR_THREADS];
+    for (int i = 0; i < NR_THREADS; i++) {
+        threads[i] = g_thread_new("small_cache", concurrent_worker, &state);
+    }
+    for (int i = 0; i < NR_THREADS; i++) {
+        g_thread_join(threads[i]);
+    }
+
+    int ret = state.failures != 0;
+    struct zn_small_cache_stats stats;
+    zn_small_cache_get_stats(&f.sc, &stats);
+    if (ret == 0 && (stats.hits == 0 || stats.set_writes == 0 || stats.zones_reclaimed == 0)) {
+        ret = 2;
+    }
+
+    teardown(&f);
+    return ret;
+}
+
+/**
+ * @brief Runs all test cases and prints the results.
+ */
+int main() {
+    int failures = 0;
+
+    if (test_log_hit() != 0) {
+        printf("Test FAILED: test_log_hit()\n");
+        failures++;
+    } else {
+        printf("Test PASSED: test_log_hit()\n");
+    }
+
+    if (test_set_overflow() != 0) {
+        printf("Test FAILED: test_set_overflow()\n");
+        failures++;
+    } else {
+        printf("Test PASSED: test_set_overflow()\n");
+    }
+
+    if (test_reclaim() != 0) {
+        printf("Test FAILED: test_reclaim()\n");
+        failures++;
+    } else {
+        printf("Test PASSED: test_reclaim()\n");
+    }
+
+    if (test_concurrent() != 0) {
+        printf("Test FAILED: test_concurrent()\n");
+        failures++;
+    } else {
+        printf("Test PASSED: test_concurrent()\n");
+    }
+
+    return failures;
+}
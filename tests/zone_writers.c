@@ -0,0 +1,554 @@
+#include <assert.h>
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "zone_state_manager.h"
+
+/*
+ * Tests for reserving several chunks of one active zone at a time. Writer threads fill every
+ * zone and record the order their chunks reach the "device" in, which has to follow the
+ * zone's write pointer no matter how many writers share the zone, whether each writer waits
+ * for its turn or queues its write to be submitted with the others. In zone append mode the
+ * emulated device picks the offsets, and the appends of a zone overlap. Batch reservations, used by the write buffer, take
+ * a run of chunks for a single writer, and extents of objects spanning several chunks seal
+ * zones without enough room left.
+ */
+
+#define NR_ZONES 4
+#define ZONE_CHUNKS 64
+#define CHUNK_SIZE 4096
+#define MAX_ACTIVE_ZONES 2
+#define NR_WRITERS 8
+
+/** How writers get their chunks to the device */
+enum write_mode {
+    WRITE_TURN = 0,   /**< zsm_wait_write_turn() and zsm_pass_write_turn() */
+    WRITE_QUEUED = 1, /**< zsm_write_ordered() */
+    WRITE_APPEND = 2, /**< Zone append mode */
+};
+
+/** Shared state of one test run */
+struct writer_state {
+    struct zone_state_manager zsm;
+    enum write_mode mode;
+    GMutex device_lock;
+    uint32_t device_wp[NR_ZONES];       /**< Next chunk the emulated device accepts per zone */
+    uint32_t written[NR_ZONES][ZONE_CHUNKS];
+    gint in_flight[NR_ZONES];           /**< Writers holding a chunk per zone */
+    gint max_in_flight;
+    gint device_writing[NR_ZONES];      /**< Writes the device is doing per zone */
+    gint max_device_writing;
+    gint max_run;                       /**< Most writes submitted together */
+    gint failures;
+};
+
+static void
+init_state(struct writer_state *state, uint32_t max_zone_writers, uint32_t max_active_zones,
+           enum write_mode mode) {
+    *state = (struct writer_state) {0};
+    zsm_init(&state->zsm, NR_ZONES, -1, ZONE_CHUNKS * CHUNK_SIZE, ZONE_CHUNKS * CHUNK_SIZE,
+             CHUNK_SIZE, max_active_zones, ZE_BACKEND_BLOCK);
+    state->zsm.max_zone_writers = max_zone_writers;
+    state->zsm.zone_append = mode == WRITE_APPEND;
+    state->mode = mode;
+    g_mutex_init(&state->device_lock);
+}
+
+static void
+record_max(gint *max, gint value) {
+    gint seen = g_atomic_int_get(max);
+    while (value > seen && !g_atomic_int_compare_and_exchange(max, seen, value)) {
+        seen = g_atomic_int_get(max);
+    }
+}
+
+/**
+ * @brief Emulates a sequential write zone, which rejects writes that are not at its write
+ * pointer and puts appends at it
+ */
+static void
+device_write(struct writer_state *state, struct zn_pair *pair) {
+    record_max(&state->max_device_writing,
+               g_atomic_int_add(&state->device_writing[pair->zone], 1) + 1);
+
+    g_mutex_lock(&state->device_lock);
+    if (pair->chunk_offset == ZSM_APPEND_OFFSET) {
+        pair->chunk_offset = state->device_wp[pair->zone];
+    } else if (state->device_wp[pair->zone] != pair->chunk_offset) {
+        g_atomic_int_inc(&state->failures);
+    }
+    state->device_wp[pair->zone]++;
+    state->written[pair->zone][pair->chunk_offset]++;
+    g_mutex_unlock(&state->device_lock);
+
+    // The write completes a little later
+    g_usleep(20);
+    g_atomic_int_add(&state->device_writing[pair->zone], -1);
+}
+
+/** @brief Submits a run of queued writes to the emulated device, see zsm_submit_fn */
+static void
+device_submit(void *user_data, struct zsm_write **writes, uint32_t nr_writes) {
+    struct writer_state *state = user_data;
+    record_max(&state->max_run, (gint) nr_writes);
+    for (uint32_t i = 0; i < nr_writes; i++) {
+        device_write(state, &writes[i]->pair);
+        writes[i]->result = 0;
+    }
+}
+
+static gpointer
+writer_thread(gpointer user_data) {
+    struct writer_state *state = user_data;
+    uint32_t seed = (uint32_t) GPOINTER_TO_UINT(g_thread_self());
+
+    while (true) {
+        struct zn_pair pair;
+        enum zsm_get_active_zone_error ret = zsm_get_active_zone(&state->zsm, &pair);
+        if (ret == ZSM_GET_ACTIVE_ZONE_EVICT) {
+            break;
+        } else if (ret == ZSM_GET_ACTIVE_ZONE_RETRY) {
+            g_thread_yield();
+            continue;
+        } else if (ret != ZSM_GET_ACTIVE_ZONE_SUCCESS) {
+            g_atomic_int_inc(&state->failures);
+            break;
+        }
+
+        record_max(&state->max_in_flight, g_atomic_int_add(&state->in_flight[pair.zone], 1) + 1);
+
+        // Stagger the writers so later chunks are often ready before earlier ones
+        seed = seed * 1103515245 + 12345;
+        g_usleep((seed >> 16) % 200);
+
+        if (state->mode == WRITE_QUEUED) {
+            struct zsm_write write = {.pair = pair};
+            if (zsm_write_ordered(&state->zsm, &write, device_submit, state) != 0) {
+                g_atomic_int_inc(&state->failures);
+            }
+        } else {
+            zsm_wait_write_turn(&state->zsm, &pair);
+            device_write(state, &pair);
+            zsm_pass_write_turn(&state->zsm, &pair);
+        }
+
+        g_usleep(50);
+        g_atomic_int_dec_and_test(&state->in_flight[pair.zone]);
+        if (zsm_return_active_zone(&state->zsm, &pair) != 0) {
+            g_atomic_int_inc(&state->failures);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Writers sharing zones fill all of them, and every zone is written in order.
+ * @return 0 on success, non-zero on failure.
+ */
+int test_ordered_writes(uint32_t max_zone_writers, enum write_mode mode) {
+    struct writer_state state;
+    init_state(&state, max_zone_writers, MAX_ACTIVE_ZONES, mode);
+
+    GThread *threads[NR_WRITERS];
+    for (uint32_t t = 0; t < NR_WRITERS; t++) {
+        threads[t] = g_thread_new("writer", writer_thread, &state);
+    }
+    for (uint32_t t = 0; t < NR_WRITERS; t++) {
+        g_thread_join(threads[t]);
+    }
+
+    if (state.failures != 0) {
+        return 1;
+    }
+    if (zsm_get_num_full_zones(&state.zsm) != NR_ZONES || zsm_get_num_active_zones(&state.zsm) != 0) {
+        return 2;
+    }
+    for (uint32_t z = 0; z < NR_ZONES; z++) {
+        if (zsm_pop_full_zone(&state.zsm) < 0) {
+            return 2;
+        }
+    }
+    if (zsm_pop_full_zone(&state.zsm) != -1) {
+        return 2;
+    }
+    for (uint32_t z = 0; z < NR_ZONES; z++) {
+        for (uint32_t c = 0; c < ZONE_CHUNKS; c++) {
+            if (state.written[z][c] != 1) {
+                return 3;
+            }
+        }
+    }
+    if ((uint32_t) state.max_in_flight > max_zone_writers) {
+        return 4;
+    }
+    if (max_zone_writers > 1 && state.max_in_flight < 2) {
+        return 5;
+    }
+    if (mode == WRITE_APPEND && max_zone_writers > 1 && state.max_device_writing < 2) {
+        return 6;
+    }
+    if (mode == WRITE_QUEUED && max_zone_writers > 1 && state.max_run < 2) {
+        return 7;
+    }
+    return 0;
+}
+
+/**
+ * @brief A failed write is retried at the same chunk unless a later chunk was already
+ * reserved, in which case it is skipped and marked invalid.
+ * @return 0 on success, non-zero on failure.
+ */
+int test_failed_write() {
+    struct writer_state state;
+    init_state(&state, 4, 1, WRITE_TURN);
+
+    struct zn_pair pairs[3];
+    for (uint32_t i = 0; i < 3; i++) {
+        if (zsm_get_active_zone(&state.zsm, &pairs[i]) != ZSM_GET_ACTIVE_ZONE_SUCCESS ||
+            pairs[i].zone != pairs[0].zone || pairs[i].chunk_offset != i) {
+            return 1;
+        }
+    }
+
+    zsm_wait_write_turn(&state.zsm, &pairs[0]);
+    zsm_pass_write_turn(&state.zsm, &pairs[0]);
+    zsm_return_active_zone(&state.zsm, &pairs[0]);
+
+    // Chunk 2 is reserved, so chunk 1 cannot be handed out again
+    zsm_wait_write_turn(&state.zsm, &pairs[1]);
+    zsm_failed_to_write(&state.zsm, pairs[1]);
+    if (zsm_get_num_invalid_chunks(&state.zsm, pairs[0].zone) != 1) {
+        return 2;
+    }
+
+    // Chunk 2 is the newest reservation, so the next writer gets it again
+    zsm_wait_write_turn(&state.zsm, &pairs[2]);
+    zsm_failed_to_write(&state.zsm, pairs[2]);
+
+    struct zn_pair retry;
+    if (zsm_get_active_zone(&state.zsm, &retry) != ZSM_GET_ACTIVE_ZONE_SUCCESS ||
+        retry.zone != pairs[0].zone || retry.chunk_offset != 2) {
+        return 3;
+    }
+    zsm_wait_write_turn(&state.zsm, &retry);
+    zsm_pass_write_turn(&state.zsm, &retry);
+    zsm_return_active_zone(&state.zsm, &retry);
+
+    if (zsm_get_num_invalid_chunks(&state.zsm, pairs[0].zone) != 1) {
+        return 4;
+    }
+    return 0;
+}
+
+/**
+ * @brief In zone append mode writers append without waiting for each other, the device picks
+ * their offsets, and a failed append gives the space back.
+ * @return 0 on success, non-zero on failure.
+ */
+int test_append_order() {
+    struct writer_state state;
+    init_state(&state, 4, 1, WRITE_APPEND);
+
+    struct zn_pair pairs[3];
+    for (uint32_t i = 0; i < 3; i++) {
+        if (zsm_get_active_zone(&state.zsm, &pairs[i]) != ZSM_GET_ACTIVE_ZONE_SUCCESS ||
+            pairs[i].zone != pairs[0].zone || pairs[i].chunk_offset != ZSM_APPEND_OFFSET) {
+            return 1;
+        }
+    }
+
+    // Nobody waits, and the device takes the appends in another order than they reserved
+    for (uint32_t i = 0; i < 3; i++) {
+        zsm_wait_write_turn(&state.zsm, &pairs[i]);
+    }
+    pairs[2].chunk_offset = 0;
+    pairs[0].chunk_offset = 1;
+    zsm_failed_to_write(&state.zsm, pairs[1]);
+
+    // Completes before the append the device put ahead of it
+    zsm_pass_write_turn(&state.zsm, &pairs[0]);
+    zsm_return_active_zone(&state.zsm, &pairs[0]);
+    zsm_pass_write_turn(&state.zsm, &pairs[2]);
+    zsm_return_active_zone(&state.zsm, &pairs[2]);
+
+    if (zsm_get_num_invalid_chunks(&state.zsm, pairs[0].zone) != 0) {
+        return 2;
+    }
+
+    // The failed append's chunk is free again, so the rest of the zone can be reserved
+    struct zn_pair rest;
+    if (zsm_get_active_zone_extent(&state.zsm, ZONE_CHUNKS - 2, &rest) != ZSM_GET_ACTIVE_ZONE_SUCCESS ||
+        rest.zone != pairs[0].zone) {
+        return 3;
+    }
+    zsm_wait_write_turn(&state.zsm, &rest);
+    rest.chunk_offset = 2;
+    zsm_pass_write_turn(&state.zsm, &rest);
+    zsm_return_active_zone(&state.zsm, &rest);
+    if (zsm_pop_full_zone(&state.zsm) != (int) pairs[0].zone) {
+        return 4;
+    }
+    return 0;
+}
+
+/** A queued write and the thread writing it */
+struct queued_writer {
+    struct writer_state *state;
+    struct zsm_write write;
+    gint submissions;      /**< Times the write was submitted */
+};
+
+static struct queued_writer *failing_writer;
+
+/** @brief Fails the write of `failing_writer` the first time it is submitted */
+static void
+failing_submit(void *user_data, struct zsm_write **writes, uint32_t nr_writes) {
+    struct writer_state *state = user_data;
+    record_max(&state->max_run, (gint) nr_writes);
+    bool failed = false;
+    for (uint32_t i = 0; i < nr_writes; i++) {
+        struct queued_writer *writer = writes[i]->data;
+        failed = failed || (writer == failing_writer && writer->submissions == 0);
+        writer->submissions++;
+        writes[i]->result = failed ? -1 : 0;
+    }
+}
+
+static gpointer
+queued_writer_thread(gpointer user_data) {
+    struct queued_writer *writer = user_data;
+    struct zone_state_manager *zsm = &writer->state->zsm;
+    if (zsm_write_ordered(zsm, &writer->write, failing_submit, writer->state) != 0) {
+        zsm_failed_to_write(zsm, writer->write.pair);
+    } else {
+        zsm_return_active_zone(zsm, &writer->write.pair);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Queued writes are submitted together by the writer at the write pointer, and when
+ * one fails the writes behind it are submitted again after its chunk is skipped.
+ * @return 0 on success, non-zero on failure.
+ */
+int test_queued_failure() {
+    struct writer_state state;
+    init_state(&state, 4, 1, WRITE_QUEUED);
+
+    struct queued_writer writers[3];
+    for (uint32_t i = 0; i < 3; i++) {
+        writers[i] = (struct queued_writer) {.state = &state};
+        writers[i].write.data = &writers[i];
+        if (zsm_get_active_zone(&state.zsm, &writers[i].write.pair) != ZSM_GET_ACTIVE_ZONE_SUCCESS ||
+            writers[i].write.pair.chunk_offset != i) {
+            return 1;
+        }
+    }
+    failing_writer = &writers[1];
+
+    // The later writes are queued before the first one arrives, which submits all three
+    GThread *threads[3];
+    threads[2] = g_thread_new("writer", queued_writer_thread, &writers[2]);
+    threads[1] = g_thread_new("writer", queued_writer_thread, &writers[1]);
+    while (true) {
+        g_mutex_lock(&state.zsm.state_mutex);
+        guint queued = g_queue_get_length(state.zsm.state[0].queued);
+        g_mutex_unlock(&state.zsm.state_mutex);
+        if (queued == 2) {
+            break;
+        }
+        g_usleep(100);
+    }
+    threads[0] = g_thread_new("writer", queued_writer_thread, &writers[0]);
+    for (uint32_t i = 0; i < 3; i++) {
+        g_thread_join(threads[i]);
+    }
+
+    if (state.max_run != 3) {
+        return 2;
+    }
+    if (writers[0].write.result != 0 || writers[1].write.result == 0 ||
+        writers[2].write.result != 0 || writers[2].submissions != 2) {
+        return 3;
+    }
+    if (zsm_get_num_invalid_chunks(&state.zsm, 0) != 1 ||
+        state.zsm.state[0].write_pointer != 3) {
+        return 4;
+    }
+    return 0;
+}
+
+/**
+ * @brief A batch reservation holds its zone until returned, an unused tail can be given back,
+ * and a failed batch is handed out again.
+ * @return 0 on success, non-zero on failure.
+ */
+int test_batch() {
+    struct writer_state state;
+    init_state(&state, 4, 1, WRITE_TURN);
+
+    struct zn_pair batch, single;
+    uint32_t nr_chunks;
+    if (zsm_get_active_zone_batch(&state.zsm, 1, 16, &batch, &nr_chunks) != ZSM_GET_ACTIVE_ZONE_SUCCESS ||
+        batch.chunk_offset != 0 || nr_chunks != 16) {
+        return 1;
+    }
+    if (zsm_get_active_zone(&state.zsm, &single) != ZSM_GET_ACTIVE_ZONE_RETRY) {
+        return 2;
+    }
+
+    // Only 10 chunks were used, the next reservation starts right after them
+    zsm_trim_batch(&state.zsm, &batch, nr_chunks, 10);
+    zsm_wait_write_turn(&state.zsm, &batch);
+    zsm_pass_write_turn_batch(&state.zsm, &batch, 10);
+    zsm_return_active_zone_batch(&state.zsm, &batch, 10);
+    if (zsm_get_active_zone(&state.zsm, &single) != ZSM_GET_ACTIVE_ZONE_SUCCESS ||
+        single.zone != batch.zone || single.chunk_offset != 10) {
+        return 3;
+    }
+    zsm_wait_write_turn(&state.zsm, &single);
+    zsm_pass_write_turn(&state.zsm, &single);
+    zsm_return_active_zone(&state.zsm, &single);
+
+    // Capped at the end of the zone
+    if (zsm_get_active_zone_batch(&state.zsm, 1, ZONE_CHUNKS, &batch, &nr_chunks) !=
+            ZSM_GET_ACTIVE_ZONE_SUCCESS ||
+        batch.chunk_offset != 11 || nr_chunks != ZONE_CHUNKS - 11) {
+        return 4;
+    }
+    zsm_wait_write_turn(&state.zsm, &batch);
+    zsm_failed_to_write_batch(&state.zsm, batch, nr_chunks);
+
+    struct zn_pair retry;
+    if (zsm_get_active_zone_batch(&state.zsm, 1, ZONE_CHUNKS, &retry, &nr_chunks) !=
+            ZSM_GET_ACTIVE_ZONE_SUCCESS ||
+        retry.zone != batch.zone || retry.chunk_offset != 11 || nr_chunks != ZONE_CHUNKS - 11) {
+        return 5;
+    }
+    zsm_wait_write_turn(&state.zsm, &retry);
+    zsm_pass_write_turn_batch(&state.zsm, &retry, nr_chunks);
+    zsm_return_active_zone_batch(&state.zsm, &retry, nr_chunks);
+
+    if (zsm_get_num_full_zones(&state.zsm) != 1 ||
+        zsm_get_num_invalid_chunks(&state.zsm, batch.zone) != 0) {
+        return 6;
+    }
+    return 0;
+}
+
+/**
+ * @brief Extents are reserved back to back, a zone with too little room left is sealed and
+ * closes once its writers return, and a failed newest extent is handed out again.
+ * @return 0 on success, non-zero on failure.
+ */
+int test_extent() {
+    struct writer_state state;
+    init_state(&state, 4, 1, WRITE_TURN);
+
+    struct zn_pair first, second, third;
+    if (zsm_get_active_zone_extent(&state.zsm, 40, &first) != ZSM_GET_ACTIVE_ZONE_SUCCESS ||
+        first.chunk_offset != 0 || first.nr_chunks != 40) {
+        return 1;
+    }
+    if (zsm_get_active_zone_extent(&state.zsm, 20, &second) != ZSM_GET_ACTIVE_ZONE_SUCCESS ||
+        second.zone != first.zone || second.chunk_offset != 40) {
+        return 2;
+    }
+
+    // 4 chunks are left, the zone is sealed and no other zone can be opened while it is written
+    if (zsm_get_active_zone_extent(&state.zsm, 8, &third) != ZSM_GET_ACTIVE_ZONE_RETRY) {
+        return 3;
+    }
+    zsm_wait_write_turn(&state.zsm, &first);
+    zsm_pass_write_turn(&state.zsm, &first);
+    zsm_return_active_zone(&state.zsm, &first);
+    if (zsm_pop_full_zone(&state.zsm) != -1) {
+        return 4;
+    }
+    zsm_wait_write_turn(&state.zsm, &second);
+    zsm_pass_write_turn(&state.zsm, &second);
+    zsm_return_active_zone(&state.zsm, &second);
+    if (zsm_pop_full_zone(&state.zsm) != (int) first.zone || zsm_pop_full_zone(&state.zsm) != -1 ||
+        zsm_get_num_full_zones(&state.zsm) != 1) {
+        return 5;
+    }
+
+    if (zsm_get_active_zone_extent(&state.zsm, 8, &third) != ZSM_GET_ACTIVE_ZONE_SUCCESS ||
+        third.zone == first.zone || third.chunk_offset != 0) {
+        return 6;
+    }
+    zsm_wait_write_turn(&state.zsm, &third);
+    zsm_failed_to_write(&state.zsm, third);
+
+    struct zn_pair retry;
+    if (zsm_get_active_zone_extent(&state.zsm, ZONE_CHUNKS, &retry) !=
+            ZSM_GET_ACTIVE_ZONE_SUCCESS ||
+        retry.zone != third.zone || retry.chunk_offset != 0) {
+        return 7;
+    }
+    zsm_wait_write_turn(&state.zsm, &retry);
+    zsm_pass_write_turn(&state.zsm, &retry);
+    zsm_return_active_zone(&state.zsm, &retry);
+    if (zsm_pop_full_zone(&state.zsm) != (int) retry.zone ||
+        zsm_get_num_invalid_chunks(&state.zsm, retry.zone) != 0) {
+        return 8;
+    }
+    return 0;
+}
+
+/**
+ * @brief Runs all test cases and prints the results.
+ */
+int main() {
+    int failures = 0;
+    uint32_t writer_configs[] = {1, 4, NR_WRITERS};
+
+    for (uint32_t c = 0; c < G_N_ELEMENTS(writer_configs); c++) {
+        for (int mode = WRITE_TURN; mode <= WRITE_APPEND; mode++) {
+            if (test_ordered_writes(writer_configs[c], mode) != 0) {
+                printf("Test FAILED: test_ordered_writes(%u, %d)\n", writer_configs[c], mode);
+                failures++;
+            } else {
+                printf("Test PASSED: test_ordered_writes(%u, %d)\n", writer_configs[c], mode);
+            }
+        }
+    }
+
+    if (test_failed_write() != 0) {
+        printf("Test FAILED: test_failed_write()\n");
+        failures++;
+    } else {
+        printf("Test PASSED: test_failed_write()\n");
+    }
+
+    if (test_append_order() != 0) {
+        printf("Test FAILED: test_append_order()\n");
+        failures++;
+    } else {
+        printf("Test PASSED: test_append_order()\n");
+    }
+
+    if (test_queued_failure() != 0) {
+        printf("Test FAILED: test_queued_failure()\n");
+        failures++;
+    } else {
+        printf("Test PASSED: test_queued_failure()\n");
+    }
+
+    if (test_batch() != 0) {
+        printf("Test FAILED: test_batch()\n");
+        failures++;
+    } else {
+        printf("Test PASSED: test_batch()\n");
+    }
+
+    if (test_extent() != 0) {
+        printf("Test FAILED: test_extent()\n");
+        failures++;
+    } else {
+        printf("Test PASSED: test_extent()\n");
+    }
+
+    return failures;
+}